@@ -0,0 +1,148 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <array>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "bench_common.h"
+
+// the baseline binary is built from the same source without the hooks.
+#ifndef MEMISPECT_BENCH_BASELINE
+  #include <meminspect/memory_tracker.h>
+#endif
+
+
+namespace {
+
+#ifdef MEMISPECT_BENCH_BASELINE
+struct Tracker {};
+#else
+using Tracker = meminspect::MemoryTracker;
+#endif
+
+/// @brief Registers the trackers of a benchmark from its first thread.
+/// The threads of a benchmark wait for each other before and after the timed loop, so the trackers exist while
+/// every thread is timed.
+std::vector<std::unique_ptr<Tracker>> trackers (const benchmark::State &state, int64_t count) {
+  std::vector<std::unique_ptr<Tracker>> out;
+  if (state.thread_index() == 0) {
+    for (int64_t i = 0; i < count; ++i)
+      out.push_back (std::make_unique<Tracker>());
+  }
+
+  return out;
+}
+
+/// @brief Allocates and frees batches of blocks with malloc/free.
+void mallocFree (benchmark::State &state, const std::vector<size_t> &table) {
+  std::array<void *, bench::Batch> blocks {};
+  size_t next { 0 };
+
+  for (auto _ : state) {
+    for (auto &b : blocks) {
+      b = std::malloc (table[next++ & (bench::SizeCount - 1)]);
+      benchmark::DoNotOptimize (b);
+    }
+
+    for (auto b : blocks)
+      std::free (b);
+  }
+
+  state.SetItemsProcessed (state.iterations() * bench::Batch * 2);
+}
+
+}
+
+
+// ----------------------------------------------------------------------------
+// malloc/free
+// ----------------------------------------------------------------------------
+static void BM_malloc_free (benchmark::State &state) {
+  mallocFree (state, bench::sizes (state.range (0)));
+}
+BENCHMARK (BM_malloc_free)->ArgName ("dist")->DenseRange (bench::Small, bench::Mixed)->ThreadRange (1, bench::maxThreads())->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// calloc/free
+// ----------------------------------------------------------------------------
+static void BM_calloc_free (benchmark::State &state) {
+  const auto table { bench::sizes (state.range (0)) };
+  std::array<void *, bench::Batch> blocks {};
+  size_t next { 0 };
+
+  for (auto _ : state) {
+    for (auto &b : blocks) {
+      b = std::calloc (1, table[next++ & (bench::SizeCount - 1)]);
+      benchmark::DoNotOptimize (b);
+    }
+
+    for (auto b : blocks)
+      std::free (b);
+  }
+
+  state.SetItemsProcessed (state.iterations() * bench::Batch * 2);
+}
+BENCHMARK (BM_calloc_free)->ArgName ("dist")->DenseRange (bench::Small, bench::Mixed)->ThreadRange (1, bench::maxThreads())->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// aligned_alloc/free
+// ----------------------------------------------------------------------------
+static void BM_aligned_alloc_free (benchmark::State &state) {
+  const auto table { bench::sizes (state.range (0)) };
+  const auto alignment { static_cast<size_t> (state.range (1)) };
+  std::array<void *, bench::Batch> blocks {};
+  size_t next { 0 };
+
+  for (auto _ : state) {
+    for (auto &b : blocks) {
+      const auto size { (table[next++ & (bench::SizeCount - 1)] + alignment - 1) & ~(alignment - 1) };
+      b = std::aligned_alloc (alignment, size);
+      benchmark::DoNotOptimize (b);
+    }
+
+    for (auto b : blocks)
+      std::free (b);
+  }
+
+  state.SetItemsProcessed (state.iterations() * bench::Batch * 2);
+}
+BENCHMARK (BM_aligned_alloc_free)->ArgNames ({ "dist", "align" })->ArgsProduct ({ { bench::Small, bench::Mixed }, { 16, 64, 4096 } })->ThreadRange (1, bench::maxThreads())->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// realloc
+// ----------------------------------------------------------------------------
+static void BM_realloc (benchmark::State &state) {
+  const auto table { bench::sizes (state.range (0)) };
+  size_t next { 0 };
+
+  // each block grows three times before it is freed.
+  for (auto _ : state) {
+    const auto size { table[next++ & (bench::SizeCount - 1)] };
+
+    auto p { std::malloc (size) };
+    for (size_t i = 2; i <= 4; ++i) {
+      p = std::realloc (p, size * i);
+      benchmark::DoNotOptimize (p);
+    }
+
+    std::free (p);
+  }
+
+  state.SetItemsProcessed (state.iterations() * 5);
+}
+BENCHMARK (BM_realloc)->ArgName ("dist")->DenseRange (bench::Small, bench::Mixed)->ThreadRange (1, bench::maxThreads())->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// malloc/free with live trackers
+// ----------------------------------------------------------------------------
+static void BM_malloc_free_trackers (benchmark::State &state) {
+  const auto live { trackers (state, state.range (1)) };
+  mallocFree (state, bench::sizes (state.range (0)));
+}
+BENCHMARK (BM_malloc_free_trackers)->ArgNames ({ "dist", "trackers" })->ArgsProduct ({ { bench::Small, bench::Mixed }, { 0, 1, 100 } })->ThreadRange (1, bench::maxThreads())->UseRealTime();
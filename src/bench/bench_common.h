@@ -0,0 +1,57 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_BENCH_COMMON_H__
+#define __MEM_INSPECT_BENCH_COMMON_H__
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <vector>
+
+
+namespace bench {
+
+constexpr size_t Batch { 64 };      ///< The blocks allocated before they are freed, per iteration.
+constexpr size_t SizeCount { 1024 }; ///< The sizes drawn for each distribution (a power of two).
+
+/// @brief The size distributions of the allocations.
+enum Distribution : int64_t {
+  Small,  ///< 16 to 128 bytes.
+  Medium, ///< 256 to 4096 bytes.
+  Large,  ///< 16 KiB to 256 KiB.
+  Mixed   ///< 90% small, 9% medium and 1% large.
+};
+
+/// @brief Draws the sizes of a distribution, always the same for a given distribution.
+inline std::vector<size_t> sizes (int64_t distribution) {
+  std::mt19937_64 rng { static_cast<uint64_t> (distribution) + 1 };
+  const auto draw { [ &rng ] (size_t lo, size_t hi) { return std::uniform_int_distribution<size_t> { lo, hi } (rng); } };
+
+  std::vector<size_t> out (SizeCount);
+  for (auto &s : out) {
+    switch (distribution) {
+      case Small: s = draw (16, 128); break;
+      case Medium: s = draw (256, 4096); break;
+      case Large: s = draw (16 * 1024, 256 * 1024); break;
+      default: {
+        const auto p { draw (0, 99) };
+        s = p < 90 ? draw (16, 128) : (p < 99 ? draw (256, 4096) : draw (16 * 1024, 256 * 1024));
+      }
+    }
+  }
+
+  return out;
+}
+
+/// @brief Gets the highest number of threads of the multi-threaded benchmarks.
+inline int maxThreads() {
+  return std::clamp (static_cast<int> (std::thread::hardware_concurrency()), 1, 16);
+}
+
+}
+
+#endif
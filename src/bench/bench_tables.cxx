@@ -0,0 +1,98 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <array>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <meminspect/default_allocator.h>
+#include <meminspect/memory_inspector.h>
+
+#include "bench_common.h"
+
+
+namespace {
+
+/// @brief An inspector whose table starts with S buckets per shard (what MEMISPECT_HASHMAP_SIZE sets for the hooks).
+template<size_t S>
+using TableInspector = meminspect::MemoryInspector<meminspect::DefaultAllocator, meminspect::ShardedHashMapPtr<void, size_t, meminspect::DefaultAllocator, MEMISPECT_HASHMAP_SHARDS, S>>;
+
+/// @brief An inspector with the lock-free open-addressing table.
+using OpenInspector = meminspect::MemoryInspector<meminspect::DefaultAllocator, meminspect::OpenHashMapPtr<void, size_t, meminspect::DefaultAllocator>>;
+
+/// @brief Keeps live blocks in the table of an inspector while a benchmark runs, to measure a loaded table.
+template<size_t S>
+class LiveBlocks {
+  public:
+    LiveBlocks (const benchmark::State &state, size_t count) {
+      if (state.thread_index() == 0) {
+        for (size_t i = 0; i < count; ++i)
+          _blocks.push_back (TableInspector<S>::alloc (32));
+      }
+    }
+
+    ~LiveBlocks() {
+      for (auto p : _blocks)
+        TableInspector<S>::dealloc (p);
+    }
+
+  private:
+    std::vector<void *> _blocks;
+};
+
+}
+
+
+// ----------------------------------------------------------------------------
+// table size
+// ----------------------------------------------------------------------------
+template<size_t S>
+static void BM_table_size (benchmark::State &state) {
+  const auto table { bench::sizes (bench::Small) };
+  const LiveBlocks<S> live { state, static_cast<size_t> (state.range (0)) };
+  std::array<void *, bench::Batch> blocks {};
+  size_t next { 0 };
+
+  for (auto _ : state) {
+    for (auto &b : blocks) {
+      b = TableInspector<S>::alloc (table[next++ & (bench::SizeCount - 1)]);
+      benchmark::DoNotOptimize (b);
+    }
+
+    for (auto b : blocks)
+      TableInspector<S>::dealloc (b);
+  }
+
+  state.SetItemsProcessed (state.iterations() * bench::Batch * 2);
+}
+BENCHMARK_TEMPLATE (BM_table_size, 64)->ArgName ("live")->Arg (0)->Arg (100000)->ThreadRange (1, bench::maxThreads())->UseRealTime();
+BENCHMARK_TEMPLATE (BM_table_size, 1024)->ArgName ("live")->Arg (0)->Arg (100000)->ThreadRange (1, bench::maxThreads())->UseRealTime();
+BENCHMARK_TEMPLATE (BM_table_size, 16384)->ArgName ("live")->Arg (0)->Arg (100000)->ThreadRange (1, bench::maxThreads())->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// table scalability
+// ----------------------------------------------------------------------------
+template<typename I>
+static void BM_table_scalability (benchmark::State &state) {
+  const auto table { bench::sizes (bench::Small) };
+  std::array<void *, bench::Batch> blocks {};
+  size_t next { 0 };
+
+  // compare the items per second of each thread count: a single lock stays flat (or drops) when threads are added.
+  for (auto _ : state) {
+    for (auto &b : blocks) {
+      b = I::alloc (table[next++ & (bench::SizeCount - 1)]);
+      benchmark::DoNotOptimize (b);
+    }
+
+    for (auto b : blocks)
+      I::dealloc (b);
+  }
+
+  state.SetItemsProcessed (state.iterations() * bench::Batch * 2);
+}
+BENCHMARK_TEMPLATE (BM_table_scalability, TableInspector<MEMISPECT_HASHMAP_SIZE>)->ThreadRange (1, bench::maxThreads())->UseRealTime();
+BENCHMARK_TEMPLATE (BM_table_scalability, OpenInspector)->ThreadRange (1, bench::maxThreads())->UseRealTime();
@@ -0,0 +1,21 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <benchmark/benchmark.h>
+
+
+// ----------------------------------------------------------------------------
+// main
+// ----------------------------------------------------------------------------
+int main (int argc, char* argv[]) {
+  benchmark::Initialize (&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments (argc, argv))
+    return 1;
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  return 0;
+}
@@ -0,0 +1,270 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_DEFAULT_ALLOCATOR_H__
+#define __MEM_INSPECT_DEFAULT_ALLOCATOR_H__
+#include <dlfcn.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <meminspect/types.h>
+
+#ifndef MEMISPECT_BOOTSTRAP_SIZE
+  #define MEMISPECT_BOOTSTRAP_SIZE (64 * 1024)
+#endif
+
+
+namespace meminspect {
+
+/// @brief Static arena that serves the allocations made before the real allocator is resolved.
+/// `dlsym` may allocate while it looks the allocator up, which comes back to the hooks, so those allocations are
+/// carved from this arena instead. Blocks are never reused: freeing them does nothing, and reallocating them moves
+/// them to the real allocator. The arena lives in `.bss`, so it only takes memory once it is used.
+class BootstrapArena {
+  public:
+    static constexpr size_t HeaderSize { 16 }; ///< The bytes in front of each block, which keep its size.
+
+    /// @brief Allocates a block from the arena.
+    /// @param alignment The alignment of the block (a power of two).
+    /// @param size The size of the block.
+    /// @return The block (zero-filled), or nullptr if the arena is exhausted.
+    static void * alloc (size_t alignment, size_t size) {
+      if (alignment < HeaderSize)
+        alignment = HeaderSize;
+
+      const auto base { reinterpret_cast<uintptr_t> (_arena) };
+      auto used { _used.load (std::memory_order_relaxed) };
+      size_t offset { 0 };
+
+      do {
+        offset = ((base + used + HeaderSize + alignment - 1) & ~(alignment - 1)) - base;
+        if ((offset > Size) || (size > Size - offset))
+          return nullptr;
+      } while (!_used.compare_exchange_weak (used, offset + size, std::memory_order_relaxed));
+
+      std::memcpy (_arena + offset - HeaderSize, &size, sizeof (size));
+
+      return _arena + offset;
+    }
+
+    /// @brief Checks whether a block comes from the arena.
+    static inline bool owns (const void *ptr) {
+      const auto p { static_cast<const char *> (ptr) };
+      return (p >= _arena) && (p < _arena + Size);
+    }
+
+    /// @brief Gets the size of a block of the arena.
+    static inline size_t size (const void *ptr) {
+      // only called for blocks of the arena, but the compiler cannot tell: hide the origin of the pointer so it
+      // does not flag the read in front of it as out of bounds.
+      asm ("" : "+r" (ptr));
+
+      size_t size { 0 };
+      std::memcpy (&size, static_cast<const char *> (ptr) - HeaderSize, sizeof (size));
+
+      return size;
+    }
+
+    /// @brief Gets the bytes of the arena in use.
+    static inline size_t usedBytes() {
+      return _used.load (std::memory_order_relaxed);
+    }
+
+  private:
+    static constexpr size_t Size { MEMISPECT_BOOTSTRAP_SIZE }; ///< The size of the arena.
+
+    alignas (MEMISPECT_CACHE_LINE_SIZE) static inline char _arena[Size] {}; ///< The arena.
+    static inline std::atomic<size_t> _used { 0 };                          ///< The bytes in use.
+};
+
+/// @brief The real allocator, behind the hooks.
+/// The entry points are resolved with `dlsym (RTLD_NEXT, ...)` once, by `resolve()`, which the hooks run from a
+/// high-priority constructor. Until then they point to bootstrap functions that resolve the allocator on their
+/// first call and serve the allocations made while `dlsym` runs from the BootstrapArena. Afterwards every call
+/// is a direct indirect call; only the entry points that receive a block check whether it belongs to the arena.
+class DefaultAllocator {
+  public:
+    /// @brief Allocates memory (`malloc`).
+    static inline void * malloc (size_t size) {
+      return _malloc (size);
+    }
+
+    /// @brief Reallocates memory (`realloc`).
+    static inline void * realloc (void *ptr, size_t size) {
+      if (BootstrapArena::owns (ptr))
+        return move (ptr, size);
+
+      return _realloc (ptr, size);
+    }
+
+    /// @brief Allocates zero-filled memory (`calloc`).
+    static inline void * calloc (size_t num, size_t size) {
+      return _calloc (num, size);
+    }
+
+    /// @brief Allocates aligned memory (`aligned_alloc`).
+    static inline void * aligned_alloc (size_t alignment, size_t size) {
+      return _aligned_alloc (alignment, size);
+    }
+
+    /// @brief Deallocates memory (`free`). Blocks of the BootstrapArena are ignored.
+    static inline void free (void *ptr) {
+      if (BootstrapArena::owns (ptr))
+        return;
+
+      _free (ptr);
+    }
+
+    /// @brief Deallocates memory whose size is known (`free_sized`), so the allocator can skip looking it up.
+    /// Falls back to `free` when the real allocator does not provide it.
+    static inline void free_sized (void *ptr, size_t size) {
+      if (BootstrapArena::owns (ptr))
+        return;
+
+      if (_free_sized != nullptr)
+        _free_sized (ptr, size);
+      else
+        _free (ptr);
+    }
+
+    /// @brief Deallocates aligned memory whose size is known (`free_aligned_sized`).
+    /// Falls back to `free` when the real allocator does not provide it.
+    static inline void free_aligned_sized (void *ptr, size_t alignment, size_t size) {
+      if (BootstrapArena::owns (ptr))
+        return;
+
+      if (_free_aligned_sized != nullptr)
+        _free_aligned_sized (ptr, alignment, size);
+      else
+        _free (ptr);
+    }
+
+    /// @brief Gets the number of usable bytes of a block (`malloc_usable_size`).
+    static inline size_t malloc_usable_size (void *ptr) {
+      if (BootstrapArena::owns (ptr))
+        return BootstrapArena::size (ptr);
+
+      return _malloc_usable_size (ptr);
+    }
+
+    /// @brief Resolves the entry points of the real allocator.
+    /// Calls made while another call resolves them return false, and must use the BootstrapArena.
+    /// @return true once the entry points are resolved.
+    static bool resolve() {
+      auto state { _state.load (std::memory_order_acquire) };
+      if (state == Resolved)
+        return true;
+
+      if ((state != Unresolved) || !_state.compare_exchange_strong (state, Resolving, std::memory_order_acquire))
+        return _state.load (std::memory_order_acquire) == Resolved;
+
+      const auto realMalloc { reinterpret_cast<malloc_t> (lookup ("malloc")) };
+      const auto realRealloc { reinterpret_cast<realloc_t> (lookup ("realloc")) };
+      const auto realCalloc { reinterpret_cast<calloc_t> (lookup ("calloc")) };
+      const auto realAlignedAlloc { reinterpret_cast<aligned_alloc_t> (lookup ("aligned_alloc")) };
+      const auto realFree { reinterpret_cast<free_t> (lookup ("free")) };
+      const auto realUsableSize { reinterpret_cast<malloc_usable_size_t> (lookup ("malloc_usable_size")) };
+      // the sized entry points are optional (C23): glibc does not provide them, jemalloc and tcmalloc do.
+      const auto realFreeSized { reinterpret_cast<free_sized_t> (dlsym (RTLD_NEXT, "free_sized")) };
+      const auto realFreeAlignedSized { reinterpret_cast<free_aligned_sized_t> (dlsym (RTLD_NEXT, "free_aligned_sized")) };
+
+      _malloc = realMalloc;
+      _realloc = realRealloc;
+      _calloc = realCalloc;
+      _aligned_alloc = realAlignedAlloc;
+      _free = realFree;
+      _malloc_usable_size = realUsableSize;
+      _free_sized = realFreeSized;
+      _free_aligned_sized = realFreeAlignedSized;
+
+      _state.store (Resolved, std::memory_order_release);
+
+      return true;
+    }
+
+  private:
+    static constexpr int Unresolved { 0 }; ///< Nobody resolved the entry points yet.
+    static constexpr int Resolving { 1 };  ///< A thread is resolving them.
+    static constexpr int Resolved { 2 };   ///< The entry points are resolved.
+
+    /// @brief Looks up an entry point of the real allocator.
+    static void * lookup (const char *name) {
+      const auto f { dlsym (RTLD_NEXT, name) };
+      if (f == nullptr)
+        std::abort();
+
+      return f;
+    }
+
+    /// @brief Moves a block of the BootstrapArena to a new block.
+    static void * move (void *ptr, size_t size) {
+      if (size == 0)
+        return nullptr;
+
+      const auto addr { malloc (size) };
+      if (addr != nullptr) {
+        const auto old { BootstrapArena::size (ptr) };
+        std::memcpy (addr, ptr, old < size ? old : size);
+      }
+
+      return addr;
+    }
+
+    // the initial entry points: they resolve the allocator, and fall back to the arena while it is being resolved.
+
+    static void * bootstrapMalloc (size_t size) {
+      return resolve() ? _malloc (size) : BootstrapArena::alloc (BootstrapArena::HeaderSize, size);
+    }
+
+    static void * bootstrapRealloc (void *ptr, size_t size) {
+      if (resolve())
+        return _realloc (ptr, size);
+
+      // the arena blocks never reach here: ptr is null, or it comes from the real allocator, which is resolved.
+      return BootstrapArena::alloc (BootstrapArena::HeaderSize, size);
+    }
+
+    static void * bootstrapCalloc (size_t num, size_t size) {
+      if (resolve())
+        return _calloc (num, size);
+
+      size_t bytes { 0 };
+      if (__builtin_mul_overflow (num, size, &bytes))
+        return nullptr;
+
+      // the arena is never reused, so its blocks are already zero-filled.
+      return BootstrapArena::alloc (BootstrapArena::HeaderSize, bytes);
+    }
+
+    static void * bootstrapAlignedAlloc (size_t alignment, size_t size) {
+      return resolve() ? _aligned_alloc (alignment, size) : BootstrapArena::alloc (alignment, size);
+    }
+
+    static void bootstrapFree (void *ptr) {
+      if (resolve())
+        _free (ptr);
+    }
+
+    static size_t bootstrapUsableSize (void *ptr) {
+      return resolve() ? _malloc_usable_size (ptr) : 0;
+    }
+
+    static inline malloc_t _malloc { &bootstrapMalloc };                                 ///< The real `malloc`.
+    static inline realloc_t _realloc { &bootstrapRealloc };                              ///< The real `realloc`.
+    static inline calloc_t _calloc { &bootstrapCalloc };                                 ///< The real `calloc`.
+    static inline aligned_alloc_t _aligned_alloc { &bootstrapAlignedAlloc };             ///< The real `aligned_alloc`.
+    static inline free_t _free { &bootstrapFree };                                       ///< The real `free`.
+    static inline malloc_usable_size_t _malloc_usable_size { &bootstrapUsableSize };     ///< The real `malloc_usable_size`.
+    static inline free_sized_t _free_sized { nullptr };                                  ///< The real `free_sized`, if any.
+    static inline free_aligned_sized_t _free_aligned_sized { nullptr };                  ///< The real `free_aligned_sized`, if any.
+    static inline std::atomic<int> _state { Unresolved };                                ///< Unresolved, Resolving or Resolved.
+};
+
+}
+
+#endif
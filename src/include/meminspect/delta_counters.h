@@ -0,0 +1,320 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_DELTA_COUNTERS_H__
+#define __MEM_INSPECT_DELTA_COUNTERS_H__
+#include <pthread.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include <meminspect/mutex.h>
+#include <meminspect/node_pool.h>
+
+#ifndef MEMISPECT_DELTA_THRESHOLD
+  #define MEMISPECT_DELTA_THRESHOLD (64 * 1024)
+#endif
+
+
+namespace meminspect {
+
+/// @brief A snapshot of monotonic allocation counters.
+/// Trackers keep the snapshot taken when they are created, and compute their bytes as the difference with the
+/// current counters, so updating the counters costs the same whatever the number of live trackers.
+struct Snapshot {
+  size_t allocated { 0 };     ///< The bytes allocated so far.
+  size_t freed { 0 };         ///< The bytes freed so far.
+  size_t allocations { 0 };   ///< The number of allocations so far.
+  size_t frees { 0 };         ///< The number of frees so far.
+  size_t reallocations { 0 }; ///< The number of reallocations so far (each one is also counted as a free and an allocation).
+
+  /// @brief Gets the net bytes allocated since a baseline.
+  /// @param baseline The older snapshot.
+  /// @return The bytes allocated minus the bytes freed between both snapshots.
+  inline size_t since (const Snapshot &baseline) const {
+    return (allocated - baseline.allocated) - (freed - baseline.freed);
+  }
+};
+
+/// @brief The high-water marks of a count of net bytes, for any number of trackers that start at different times.
+/// Time is split into epochs, one per tracker, opened when the tracker starts (or resets its peak). Each epoch keeps
+/// the highest value seen while it was the newest one, so an update only raises the mark of the newest epoch and
+/// costs the same whatever the number of trackers. The peak of a tracker is the highest mark of its epoch and of the
+/// newer ones. When a tracker leaves, the mark of its epoch is folded into the previous one.
+/// The epochs come from a NodePool. The class is not thread-safe: its owner serializes the calls.
+class HighWaterMarks {
+  public:
+    /// @brief An epoch.
+    struct Epoch {
+      int64_t mark;  ///< The highest value seen while the epoch was the newest one.
+      Epoch *prev;   ///< The previous (older) epoch.
+      Epoch *next;   ///< The next (newer) epoch.
+    };
+
+    /// @brief Raises the mark of the newest epoch.
+    /// @param value The current value.
+    inline void update (int64_t value) {
+      if ((_newest != nullptr) && (value > _newest->mark))
+        _newest->mark = value;
+    }
+
+    /// @brief Opens a new epoch.
+    /// @param value The current value.
+    /// @return The epoch, or nullptr if it cannot be allocated.
+    Epoch * open (int64_t value) {
+      const auto e { static_cast<Epoch *> (Pool::alloc()) };
+      if (e == nullptr)
+        return nullptr;
+
+      *e = Epoch { value, _newest, nullptr };
+      if (_newest != nullptr)
+        _newest->next = e;
+      _newest = e;
+
+      return e;
+    }
+
+    /// @brief Closes an epoch, folding its mark into the previous one.
+    /// @param e The epoch, or nullptr.
+    void close (Epoch *e) {
+      if (e == nullptr)
+        return;
+
+      if (e->prev != nullptr) {
+        if (e->mark > e->prev->mark)
+          e->prev->mark = e->mark;
+        e->prev->next = e->next;
+      }
+
+      if (e->next != nullptr)
+        e->next->prev = e->prev;
+      else
+        _newest = e->prev;
+
+      Pool::free (e);
+    }
+
+    /// @brief Gets the highest value seen since an epoch was opened.
+    /// @param e The epoch.
+    inline int64_t peak (const Epoch &e) const {
+      auto p { e.mark };
+      for (auto *it = e.next; it != nullptr; it = it->next)
+        p = it->mark > p ? it->mark : p;
+
+      return p;
+    }
+
+  private:
+    using Pool = NodePool<sizeof (Epoch), alignof (Epoch)>; ///< The pool of epochs.
+
+    Epoch *_newest { nullptr }; ///< The newest epoch.
+};
+
+/// @brief Monotonic allocation counters shared by all threads, updated through per-thread delta buffers.
+/// Each thread accumulates its deltas in a thread-local buffer, so an update is a few stores to a cache line that
+/// no other thread writes. The buffer is flushed to the shared totals when it holds MEMISPECT_DELTA_THRESHOLD bytes
+/// and when its thread exits. Reads reconcile the shared totals with the buffers of every thread, so they are exact.
+/// The high-water marks of the net bytes are raised with the reconciled counters on every flush and read, so a peak
+/// misses at most what the threads allocated and freed between two of them (less than MEMISPECT_DELTA_THRESHOLD bytes
+/// each), and a free still buffered by another thread never makes it look higher than it was.
+/// @tparam Tag Distinguishes independent sets of counters (e.g. one per MemoryInspector).
+template<typename Tag>
+class DeltaCounters {
+  public:
+    /// @brief Counts an allocation.
+    /// @param size The size of the block.
+    static inline void allocated (size_t size) {
+      auto &b { buffer() };
+
+      b.allocated.store (b.allocated.load (std::memory_order_relaxed) + size, std::memory_order_relaxed);
+      b.allocations.store (b.allocations.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+      if (b.allocated.load (std::memory_order_relaxed) + b.freed.load (std::memory_order_relaxed) >= MEMISPECT_DELTA_THRESHOLD)
+        flush (b);
+    }
+
+    /// @brief Counts a free.
+    /// @param size The size of the block.
+    static inline void freed (size_t size) {
+      auto &b { buffer() };
+
+      b.freed.store (b.freed.load (std::memory_order_relaxed) + size, std::memory_order_relaxed);
+      b.frees.store (b.frees.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+      if (b.allocated.load (std::memory_order_relaxed) + b.freed.load (std::memory_order_relaxed) >= MEMISPECT_DELTA_THRESHOLD)
+        flush (b);
+    }
+
+    /// @brief Counts a reallocation (its free and its allocation are counted on their own).
+    static inline void reallocated() {
+      auto &b { buffer() };
+
+      b.reallocations.store (b.reallocations.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /// @brief Reads the counters, including the deltas not yet flushed by every thread.
+    /// Flushes are blocked while the buffers are summed, so no delta is counted twice or missed.
+    static Snapshot read() {
+      std::lock_guard<Mutex> guard { _mutex };
+      return reconcile();
+    }
+
+    /// @brief Starts recording the peak of the net bytes (see HighWaterMarks).
+    /// @return The epoch of the peak, or nullptr if it cannot be allocated.
+    static HighWaterMarks::Epoch * mark() {
+      Snapshot now {};
+      return mark (now);
+    }
+
+    /// @brief Starts recording the peak of the net bytes and reads the counters it starts from.
+    /// @param now Set to the counters, read under the same lock, so the peak is never below them.
+    /// @return The epoch of the peak, or nullptr if it cannot be allocated.
+    static HighWaterMarks::Epoch * mark (Snapshot &now) {
+      std::lock_guard<Mutex> guard { _mutex };
+      now = reconcile();
+
+      return _marks.open (net (now));
+    }
+
+    /// @brief Stops recording a peak.
+    /// @param epoch The epoch returned by mark(), or nullptr.
+    static void unmark (HighWaterMarks::Epoch *epoch) {
+      std::lock_guard<Mutex> guard { _mutex };
+      _marks.close (epoch);
+    }
+
+    /// @brief Gets the highest net bytes (`allocated - freed`) since an epoch was opened, including the current ones.
+    /// @param epoch The epoch returned by mark().
+    static int64_t peak (const HighWaterMarks::Epoch &epoch) {
+      std::lock_guard<Mutex> guard { _mutex };
+      reconcile();
+      return _marks.peak (epoch);
+    }
+
+  private:
+    /// @brief The deltas of a thread.
+    /// Only the owner thread writes them; readers load them under the mutex.
+    struct Buffer {
+      std::atomic<size_t> allocated;     ///< The bytes allocated since the last flush.
+      std::atomic<size_t> freed;         ///< The bytes freed since the last flush.
+      std::atomic<size_t> allocations;   ///< The allocations since the last flush.
+      std::atomic<size_t> frees;         ///< The frees since the last flush.
+      std::atomic<size_t> reallocations; ///< The reallocations since the last flush.
+      Buffer *next;                    ///< The next buffer of the registry.
+      bool registered;                 ///< Whether the buffer is in the registry.
+    };
+
+    /// @brief Gets the buffer of the current thread, adding it to the registry on first use.
+    static inline Buffer & buffer() {
+      auto &b { _buffer };
+      if (!b.registered)
+        enroll (b);
+
+      return b;
+    }
+
+    /// @brief Adds a buffer to the registry and arms its thread-exit flush.
+    static void enroll (Buffer &b) {
+      // set first: pthread_setspecific may allocate, which comes back here.
+      b.registered = true;
+
+      {
+        std::lock_guard<Mutex> guard { _mutex };
+        b.next = _buffers;
+        _buffers = &b;
+      }
+
+      pthread_setspecific (key(), &b);
+    }
+
+    /// @brief Moves the deltas of a buffer to the shared totals.
+    static void flush (Buffer &b) {
+      std::lock_guard<Mutex> guard { _mutex };
+      drain (b);
+    }
+
+    /// @brief Moves the deltas of a buffer to the shared totals, and raises the high-water marks (the mutex must be held).
+    /// The marks are raised with the buffers of the other threads as well: their frees may be of blocks counted in the totals.
+    static inline void drain (Buffer &b) {
+      _totals.allocated += b.allocated.exchange (0, std::memory_order_relaxed);
+      _totals.freed += b.freed.exchange (0, std::memory_order_relaxed);
+      _totals.allocations += b.allocations.exchange (0, std::memory_order_relaxed);
+      _totals.frees += b.frees.exchange (0, std::memory_order_relaxed);
+      _totals.reallocations += b.reallocations.exchange (0, std::memory_order_relaxed);
+
+      reconcile();
+    }
+
+    /// @brief Sums the shared totals and the buffers of every thread, and raises the high-water marks (the mutex must be held).
+    static Snapshot reconcile() {
+      auto s { _totals };
+      for (auto *b = _buffers; b != nullptr; b = b->next) {
+        s.allocated += b->allocated.load (std::memory_order_relaxed);
+        s.freed += b->freed.load (std::memory_order_relaxed);
+        s.allocations += b->allocations.load (std::memory_order_relaxed);
+        s.frees += b->frees.load (std::memory_order_relaxed);
+        s.reallocations += b->reallocations.load (std::memory_order_relaxed);
+      }
+
+      _marks.update (net (s));
+
+      return s;
+    }
+
+    /// @brief Gets the net bytes of a snapshot.
+    static inline int64_t net (const Snapshot &s) {
+      return static_cast<int64_t> (s.allocated - s.freed);
+    }
+
+    /// @brief Thread-exit callback that flushes the buffer of the thread and removes it from the registry.
+    static void release (void *p) {
+      const auto b { static_cast<Buffer *> (p) };
+
+      std::lock_guard<Mutex> guard { _mutex };
+      drain (*b);
+
+      for (auto **it = &_buffers; *it != nullptr; it = &(*it)->next) {
+        if (*it == b) {
+          *it = b->next;
+          break;
+        }
+      }
+
+      // enrolled again if other thread-exit callbacks still allocate.
+      b->registered = false;
+    }
+
+    /// @brief Gets the key used to be notified of thread exits.
+    static pthread_key_t key() {
+      static const pthread_key_t k { [] () { pthread_key_t k {}; pthread_key_create (&k, &release); return k; } () };
+      return k;
+    }
+
+    static thread_local Buffer _buffer; ///< The buffer of the current thread.
+    static Mutex _mutex;                ///< Protects the totals and the registry.
+    static Snapshot _totals;            ///< The flushed totals.
+    static Buffer *_buffers;            ///< The registry of buffers.
+    static HighWaterMarks _marks;       ///< The high-water marks of the net bytes.
+};
+
+template<typename Tag>
+thread_local typename DeltaCounters<Tag>::Buffer DeltaCounters<Tag>::_buffer {};
+
+template<typename Tag>
+Mutex DeltaCounters<Tag>::_mutex {};
+
+template<typename Tag>
+Snapshot DeltaCounters<Tag>::_totals {};
+
+template<typename Tag>
+typename DeltaCounters<Tag>::Buffer * DeltaCounters<Tag>::_buffers { nullptr };
+
+template<typename Tag>
+HighWaterMarks DeltaCounters<Tag>::_marks {};
+
+}
+
+#endif
@@ -0,0 +1,427 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_EVENT_PIPELINE_H__
+#define __MEM_INSPECT_EVENT_PIPELINE_H__
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <cpuid.h>
+  #include <x86intrin.h>
+#endif
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+#include <meminspect/metadata_arena.h>
+#include <meminspect/mutex.h>
+#include <meminspect/sampler.h>
+#include <meminspect/types.h>
+
+#ifndef MEMISPECT_RING_SIZE
+  #define MEMISPECT_RING_SIZE 1024
+#endif
+
+#ifndef MEMISPECT_CONSUMER_INTERVAL_US
+  #define MEMISPECT_CONSUMER_INTERVAL_US 100
+#endif
+
+// orders the deferred events with a shared sequence number instead of the time-stamp counter (e.g. on hosts whose
+// sockets or virtual CPUs have counters that are not synchronized).
+#ifndef MEMISPECT_PIPELINE_SEQUENCE
+  #define MEMISPECT_PIPELINE_SEQUENCE 0
+#endif
+
+
+namespace meminspect {
+
+/// @brief A deferred allocation event.
+struct Event {
+  static constexpr uint16_t Alloc { 0 };    ///< A block was allocated.
+  static constexpr uint16_t Free { 1 };     ///< A block is about to be freed.
+  static constexpr uint16_t Threaded { 1 }; ///< Flag: the thread had thread-scoped trackers.
+
+  uint64_t time;   ///< When the event took place (see EventPipeline::now).
+  uintptr_t addr;  ///< The address of the block.
+  size_t size;     ///< The size of the block (Alloc only).
+  uint32_t stack;  ///< The allocation call stack (Alloc only).
+  uint16_t op;     ///< Alloc or Free.
+  uint16_t flags;  ///< Threaded, or 0.
+};
+
+/// @brief Moves allocation events from the threads that produce them to a single consumer.
+/// Each thread pushes its events into its own single-producer/single-consumer ring. The events are stamped with a
+/// clock that is consistent between CPUs (see now) and the rings are merged in that order, so a free and a later
+/// reuse of the same address by another thread are never swapped. A thread announces a bound on the stamps it may
+/// still push (its in-flight bound) before reading the clock, and the consumer only applies the events older than
+/// every bound (the watermark). With the time-stamp counter, nothing is shared between the producers but the
+/// registry of rings.
+///
+/// The events are applied by whoever holds the drain lock: the background consumer started with `start()`, a
+/// producer whose ring is full, or a reader that needs exact results (`barrier()`). Nobody waits while holding it.
+/// @tparam Consumer Provides `Context` (per-thread data kept in the ring) and `static void apply (const Event &, Context &)`.
+template<typename Consumer>
+class EventPipeline {
+  static_assert ((MEMISPECT_RING_SIZE & (MEMISPECT_RING_SIZE - 1)) == 0, "the size of the rings must be a power of two");
+
+  public:
+    using Context = typename Consumer::Context; ///< The per-thread data of the consumer.
+
+    /// @brief Gets the context of the current thread.
+    static inline Context & context() {
+      return ring().context;
+    }
+
+    /// @brief Starts an operation and stamps its first event.
+    /// Every reserve() must be followed by commit(), and the events of the operation are pushed in between.
+    static inline uint64_t reserve() {
+      auto &r { ring() };
+
+      // the previous stamp of the thread bounds the next ones; it must be visible before the clock is read.
+      r.inflight.store (r.last, std::memory_order_seq_cst);
+      r.last = now();
+
+      return r.last;
+    }
+
+    /// @brief Pushes an event of the operation in progress.
+    /// When the ring is full the thread drains the pipeline itself.
+    static inline void push (const Event &e) {
+      auto &r { *_ring };
+      const auto tail { r.tail.load (std::memory_order_relaxed) };
+
+      while (tail - r.head.load (std::memory_order_acquire) == MEMISPECT_RING_SIZE) {
+        if (!drain())
+          pause();
+      }
+
+      r.events[tail & (MEMISPECT_RING_SIZE - 1)] = e;
+      r.tail.store (tail + 1, std::memory_order_release);
+    }
+
+    /// @brief Ends the operation in progress.
+    static inline void commit() {
+      _ring->inflight.store (Idle, std::memory_order_release);
+    }
+
+    /// @brief Applies the pending events below the watermark, unless another thread is already draining.
+    /// @return false if the drain lock was busy.
+    static bool drain() {
+      if (!_drainMutex.try_lock())
+        return false;
+
+      drainLocked();
+      _drainMutex.unlock();
+
+      return true;
+    }
+
+    /// @brief Applies every event of the operations started before the call.
+    static void barrier() {
+      const auto target { now() };
+
+      for (;;) {
+        uint64_t watermark { 0 };
+        {
+          std::lock_guard<Mutex> guard { _drainMutex };
+          watermark = drainLocked();
+        }
+
+        if (watermark >= target)
+          return;
+
+        pause();
+      }
+    }
+
+    /// @brief Starts the background consumer thread.
+    /// @return false if it is already running or cannot be created.
+    static bool start() {
+      std::lock_guard<Mutex> guard { _consumerMutex };
+      if (_running)
+        return false;
+
+      _stop.store (false, std::memory_order_relaxed);
+      if (pthread_create (&_consumer, nullptr, &run, nullptr) != 0)
+        return false;
+
+      _running = true;
+
+      // registered after the tables were constructed, so the consumer stops before they are destroyed.
+      static const bool stopAtExit { std::atexit (&stop) == 0 };
+      (void) stopAtExit;
+
+      return true;
+    }
+
+    /// @brief Stops the background consumer thread and applies the remaining events.
+    static void stop() {
+      std::lock_guard<Mutex> guard { _consumerMutex };
+      if (!_running)
+        return;
+
+      _stop.store (true, std::memory_order_release);
+      pthread_join (_consumer, nullptr);
+      _running = false;
+
+      barrier();
+    }
+
+  private:
+    static constexpr uint64_t Idle { UINT64_MAX }; ///< In-flight bound of a thread without an operation in progress.
+
+    /// @brief The ring of a thread.
+    struct Ring {
+      std::atomic<uint64_t> inflight { Idle };   ///< The lowest stamp the thread may still push.
+      uint64_t last { 0 };                       ///< The last stamp taken by the thread.
+      alignas (MEMISPECT_CACHE_LINE_SIZE) std::atomic<size_t> head { 0 }; ///< The next event to apply.
+      alignas (MEMISPECT_CACHE_LINE_SIZE) std::atomic<size_t> tail { 0 }; ///< The next free slot.
+      std::atomic<Ring *> next { nullptr };      ///< The next ring of the registry.
+      Context context {};                        ///< The per-thread data of the consumer.
+      Event events[MEMISPECT_RING_SIZE];         ///< The events.
+    };
+
+    /// @brief Gets the ring of the current thread, creating it on first use.
+    static inline Ring & ring() {
+      if (_ring == nullptr)
+        create();
+
+      return *_ring;
+    }
+
+    /// @brief Maps the ring of the current thread and adds it to the registry.
+    static void create() {
+      static_assert (alignof (Ring) <= MetadataArena::MinSize, "the blocks of the arena are only aligned to MetadataArena::MinSize");
+
+      const auto m { MetadataArena::alloc (sizeof (Ring)) };
+      if (m == nullptr)
+        std::abort();
+
+      const auto r { new (m) Ring {} };
+
+      auto head { _rings.load (std::memory_order_seq_cst) };
+      do {
+        r->next.store (head, std::memory_order_relaxed);
+      } while (!_rings.compare_exchange_weak (head, r, std::memory_order_seq_cst));
+
+      // set first: pthread_setspecific may allocate, which pushes events to this ring.
+      _ring = r;
+      pthread_setspecific (key(), r);
+    }
+
+    /// @brief Applies the pending events below the watermark (the drain lock must be held).
+    /// @return The watermark.
+    static uint64_t drainLocked() {
+      // the clock is read before the bounds: a thread that announces its bound later reads a later time.
+      auto watermark { now() };
+      for (auto *r = _rings.load (std::memory_order_seq_cst); r != nullptr; r = r->next.load (std::memory_order_acquire)) {
+        const auto bound { r->inflight.load (std::memory_order_seq_cst) };
+        if (bound < watermark)
+          watermark = bound;
+      }
+
+      for (;;) {
+        // merge the rings: apply the run of the ring with the oldest event, up to the oldest event of the others.
+        Ring *best { nullptr };
+        uint64_t first { watermark };
+        uint64_t second { watermark };
+
+        for (auto *r = _rings.load (std::memory_order_acquire); r != nullptr; r = r->next.load (std::memory_order_acquire)) {
+          const auto head { r->head.load (std::memory_order_relaxed) };
+          if (head == r->tail.load (std::memory_order_acquire))
+            continue;
+
+          const auto time { r->events[head & (MEMISPECT_RING_SIZE - 1)].time };
+          if (time < first) {
+            second = first;
+            first = time;
+            best = r;
+          }
+          else if (time < second) {
+            second = time;
+          }
+        }
+
+        if (best == nullptr)
+          return watermark;
+
+        auto head { best->head.load (std::memory_order_relaxed) };
+        const auto tail { best->tail.load (std::memory_order_acquire) };
+
+        // the oldest event goes first even if another ring has one with the same stamp.
+        do {
+          Consumer::apply (best->events[head & (MEMISPECT_RING_SIZE - 1)], best->context);
+          best->head.store (++head, std::memory_order_release);
+        } while ((head != tail) && (best->events[head & (MEMISPECT_RING_SIZE - 1)].time < second));
+      }
+    }
+
+    /// @brief Thread-exit callback that waits until the ring of the thread is drained and unmaps it.
+    static void release (void *p) {
+      const auto r { static_cast<Ring *> (p) };
+
+      for (;;) {
+        {
+          std::lock_guard<Mutex> guard { _drainMutex };
+          drainLocked();
+
+          if (r->head.load (std::memory_order_relaxed) == r->tail.load (std::memory_order_relaxed)) {
+            unlink (r);
+            break;
+          }
+        }
+
+        pause();
+      }
+
+      r->~Ring();
+      MetadataArena::free (r, sizeof (Ring));
+
+      // created again if other thread-exit callbacks still allocate.
+      _ring = nullptr;
+    }
+
+    /// @brief Removes a ring from the registry (the drain lock must be held).
+    /// New rings are only pushed at the head, so the head is unlinked with a CAS; once another ring was pushed in
+    /// front of it, its predecessor can only change under the drain lock.
+    static void unlink (Ring *r) {
+      const auto next { r->next.load (std::memory_order_relaxed) };
+
+      auto head { r };
+      if (_rings.compare_exchange_strong (head, next, std::memory_order_seq_cst))
+        return;
+
+      auto *prev { head };
+      while (prev->next.load (std::memory_order_relaxed) != r)
+        prev = prev->next.load (std::memory_order_relaxed);
+
+      prev->next.store (next, std::memory_order_release);
+    }
+
+    /// @brief Body of the background consumer.
+    static void * run (void *) {
+      const timespec interval { 0, MEMISPECT_CONSUMER_INTERVAL_US * 1000 };
+
+      while (!_stop.load (std::memory_order_acquire)) {
+        drain();
+        nanosleep (&interval, nullptr);
+      }
+
+      return nullptr;
+    }
+
+    /// @brief Reads the clock that orders the events.
+    /// The order is only exact if a block freed by a thread and reused by another is stamped later the second time,
+    /// so the clock must be consistent between CPUs. On x86 it is the time-stamp counter, read once the previous
+    /// instructions are done and before the next ones start, if the CPU reports it invariant (CPUID 0x80000007, EDX
+    /// bit 8): Linux keeps such counters synchronized between cores. Otherwise, or with MEMISPECT_PIPELINE_SEQUENCE,
+    /// it is a shared sequence number, which is always consistent but bounces between the cores. Elsewhere it is the
+    /// monotonic clock, which the kernel keeps consistent between CPUs.
+    static inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+      static const bool tsc { (MEMISPECT_PIPELINE_SEQUENCE == 0) && invariantTsc() };
+      if (!tsc)
+        return _seq.fetch_add (1, std::memory_order_seq_cst);
+
+      unsigned int aux { 0 };
+      const auto t { __rdtscp (&aux) };
+      _mm_lfence();
+
+      return t;
+#elif MEMISPECT_PIPELINE_SEQUENCE
+      return _seq.fetch_add (1, std::memory_order_seq_cst);
+#else
+      timespec ts {};
+      clock_gettime (CLOCK_MONOTONIC, &ts);
+
+      return (static_cast<uint64_t> (ts.tv_sec) * 1000000000) + static_cast<uint64_t> (ts.tv_nsec);
+#endif
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    /// @brief Checks whether the time-stamp counter is invariant and can be read with RDTSCP.
+    static bool invariantTsc() {
+      unsigned int eax { 0 }, ebx { 0 }, ecx { 0 }, edx { 0 };
+      if ((__get_cpuid (0x80000001, &eax, &ebx, &ecx, &edx) == 0) || ((edx & (1u << 27)) == 0))
+        return false;
+
+      return (__get_cpuid (0x80000007, &eax, &ebx, &ecx, &edx) != 0) && ((edx & (1u << 8)) != 0);
+    }
+#endif
+
+    /// @brief Waits a little before trying again.
+    static inline void pause() {
+      sched_yield();
+    }
+
+    /// @brief Gets the key used to be notified of thread exits.
+    static pthread_key_t key() {
+      static const pthread_key_t k { [] () { pthread_key_t k {}; pthread_key_create (&k, &release); return k; } () };
+      return k;
+    }
+
+    static thread_local Ring *_ring;          ///< The ring of the current thread.
+    static std::atomic<Ring *> _rings;        ///< The registry of rings.
+    static std::atomic<uint64_t> _seq;        ///< The next sequence number, when it orders the events (see now).
+    static Mutex _drainMutex;                 ///< Held while the events are applied.
+    static Mutex _consumerMutex;              ///< Serializes start() and stop().
+    static std::atomic<bool> _stop;           ///< Asks the consumer thread to exit.
+    static pthread_t _consumer;               ///< The consumer thread.
+    static bool _running;                     ///< Whether the consumer thread is running.
+};
+
+template<typename Consumer>
+thread_local typename EventPipeline<Consumer>::Ring * EventPipeline<Consumer>::_ring { nullptr };
+
+template<typename Consumer>
+std::atomic<typename EventPipeline<Consumer>::Ring *> EventPipeline<Consumer>::_rings { nullptr };
+
+template<typename Consumer>
+std::atomic<uint64_t> EventPipeline<Consumer>::_seq { 0 };
+
+template<typename Consumer>
+Mutex EventPipeline<Consumer>::_drainMutex {};
+
+template<typename Consumer>
+Mutex EventPipeline<Consumer>::_consumerMutex {};
+
+template<typename Consumer>
+std::atomic<bool> EventPipeline<Consumer>::_stop { false };
+
+template<typename Consumer>
+pthread_t EventPipeline<Consumer>::_consumer {};
+
+template<typename Consumer>
+bool EventPipeline<Consumer>::_running { false };
+
+/// @brief Storage policy of MemoryInspector that leaves the table to a consumer.
+/// The hooks only push events into the EventPipeline of the inspector; the table and the counters are updated
+/// when the events are applied (see `MemoryInspector::startConsumer`). Queries apply the pending events first, so
+/// their results stay exact. It can wrap a Sampled table.
+/// @tparam Table The table of live allocations.
+template<typename Table>
+class Deferred : public Table {
+  public:
+    using Table::Table;
+};
+
+/// @brief Checks whether a storage policy is Deferred.
+template<typename T>
+struct IsDeferred : std::false_type {};
+
+template<typename Table>
+struct IsDeferred<Deferred<Table>> : std::true_type {};
+
+/// @brief A Deferred table is sampled if the table it wraps is.
+template<typename Table>
+struct IsSampled<Deferred<Table>> : IsSampled<Table> {};
+
+}
+
+#endif
@@ -0,0 +1,113 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_HASH_H__
+#define __MEM_INSPECT_HASH_H__
+#include <cstddef>
+#include <cstdint>
+
+#include <meminspect/mutex.h>
+
+
+namespace meminspect {
+
+/// @brief Maps a well mixed 64-bit hash to [0, n) using its high bits (Lemire's fast range reduction).
+/// @param h The hash.
+/// @param n The number of buckets.
+/// @return The bucket index.
+inline size_t fastRange (uint64_t h, size_t n) {
+  return static_cast<size_t> ((static_cast<__uint128_t> (h) * n) >> 64);
+}
+
+/// @brief Hash policy that takes the pointer modulo the number of buckets.
+/// It is the cheapest one, but allocators return aligned pointers, so most buckets are never used.
+struct ModuloHash {
+  /// @brief Gets the bucket of a key.
+  /// @param key The pointer value.
+  /// @param n The number of buckets.
+  /// @return The bucket index, in [0, n).
+  static inline size_t index (uintptr_t key, size_t n) {
+    return key % n;
+  }
+};
+
+/// @brief Hash policy that discards the alignment bits of the pointer before taking the modulo.
+/// @tparam Shift The number of low bits to discard (4 matches the 16-byte alignment of glibc).
+template<unsigned Shift=4>
+struct AlignedModuloHash {
+  /// @brief Gets the bucket of a key.
+  /// @param key The pointer value.
+  /// @param n The number of buckets.
+  /// @return The bucket index, in [0, n).
+  static inline size_t index (uintptr_t key, size_t n) {
+    return (key >> Shift) % n;
+  }
+};
+
+/// @brief Hash policy based on Fibonacci (multiplicative) hashing.
+/// One multiplication by 2^64/phi spreads aligned pointers over the whole table.
+struct FibonacciHash {
+  /// @brief Gets the bucket of a key.
+  /// @param key The pointer value.
+  /// @param n The number of buckets.
+  /// @return The bucket index, in [0, n).
+  static inline size_t index (uintptr_t key, size_t n) {
+    return fastRange (static_cast<uint64_t> (key) * UINT64_C (0x9E3779B97F4A7C15), n);
+  }
+};
+
+/// @brief Hash policy based on the xor-shift mixer of MurmurHash3 (fmix64).
+/// It is slower than FibonacciHash, but every bit of the pointer affects every bit of the hash.
+struct XorShiftHash {
+  /// @brief Gets the bucket of a key.
+  /// @param key The pointer value.
+  /// @param n The number of buckets.
+  /// @return The bucket index, in [0, n).
+  static inline size_t index (uintptr_t key, size_t n) {
+    auto h { static_cast<uint64_t> (key) };
+    h ^= h >> 33;
+    h *= UINT64_C (0xFF51AFD7ED558CCD);
+    h ^= h >> 33;
+    h *= UINT64_C (0xC4CEB9FE1A85EC53);
+    h ^= h >> 33;
+
+    return fastRange (h, n);
+  }
+};
+
+/// @brief Occupancy statistics of a HashMap.
+/// They are computed on demand by walking the table, so collecting them costs nothing on the hot path.
+struct HashMapStats {
+  size_t size { 0 };           ///< The number of elements.
+  size_t buckets { 0 };        ///< The number of buckets (slots for open addressing).
+  size_t usedBuckets { 0 };    ///< The number of buckets holding at least one element.
+  size_t maxChainLength { 0 }; ///< The longest chain (longest probe sequence for open addressing).
+  size_t tombstones { 0 };     ///< The number of deleted slots (open addressing only).
+  double averageProbes { 0 };  ///< The average number of probes needed to find an element.
+  MutexStats locks {};         ///< The statistics of the locks of the table (sharded tables only).
+
+  /// @brief Merges the statistics of another table (e.g. another shard).
+  /// @param other The statistics to merge.
+  /// @return Reference to the modified statistics.
+  inline HashMapStats & operator+= (const HashMapStats &other) {
+    const auto total { size + other.size };
+    if (total > 0)
+      averageProbes = ((averageProbes * size) + (other.averageProbes * other.size)) / total;
+
+    size = total;
+    buckets += other.buckets;
+    usedBuckets += other.usedBuckets;
+    tombstones += other.tombstones;
+    if (other.maxChainLength > maxChainLength)
+      maxChainLength = other.maxChainLength;
+    locks += other.locks;
+
+    return *this;
+  }
+};
+
+}
+
+#endif
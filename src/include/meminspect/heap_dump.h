@@ -0,0 +1,233 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_HEAP_DUMP_H__
+#define __MEM_INSPECT_HEAP_DUMP_H__
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include <meminspect/mapped_file.h>
+#include <meminspect/stack_depot.h>
+
+#ifndef MEMISPECT_HEAP_DUMP_BUFFER
+  #define MEMISPECT_HEAP_DUMP_BUFFER (16 * 1024)
+#endif
+
+
+namespace meminspect {
+
+/// @brief The header of a heap dump, followed by its sections: the live blocks, the stacks and the memory map.
+struct HeapDumpHeader {
+  static constexpr char Magic[8] { 'M', 'E', 'M', 'H', 'D', 'U', 'M', 'P' };
+  static constexpr uint32_t Version { 1 };
+
+  char magic[8];         ///< Magic.
+  uint32_t version;      ///< Version.
+  uint32_t blockSize;    ///< The size of a block record.
+  uint64_t time;         ///< The wall-clock time of the dump, in nanoseconds since the epoch.
+  uint64_t liveBytes;    ///< The bytes of the blocks.
+  uint64_t blocks;       ///< The number of blocks.
+  uint64_t blocksOffset; ///< The offset of the blocks.
+  uint64_t stacks;       ///< The number of stacks.
+  uint64_t stacksOffset; ///< The offset of the stacks.
+  uint64_t stacksSize;   ///< The size of the stacks.
+  uint64_t mapsOffset;   ///< The offset of the memory map (the text of `/proc/self/maps`).
+  uint64_t mapsSize;     ///< The size of the memory map.
+};
+
+/// @brief A live block of a heap dump.
+struct HeapDumpBlock {
+  uint64_t ptr;   ///< The address of the block.
+  uint64_t size;  ///< The size of the block (its weight, with the Sampled policy).
+  uint32_t stack; ///< The id of its allocation stack, or StackDepot::NoStack.
+  uint32_t reserved;
+};
+
+/// @brief A stack of a heap dump, followed by its frames (`uint64_t`, innermost first).
+struct HeapDumpStack {
+  uint32_t id;         ///< The id of the stack.
+  uint32_t depth;      ///< The number of frames.
+  uint64_t liveBytes;  ///< The live bytes allocated from the stack.
+  uint64_t liveBlocks; ///< The live blocks allocated from the stack.
+};
+
+/// @brief Writes the live blocks of an inspector, their allocation stacks and the memory map of the process to a
+/// file, to be analyzed offline (e.g. by `meminspect-analyze`).
+/// The blocks are written through a small buffer on the stack, so writing a dump does not allocate. The shards of
+/// the table are locked while they are written: the threads that free or allocate blocks of a shard wait for it.
+class HeapDump {
+  public:
+    /// @brief Writes a heap dump.
+    /// @tparam Inspector The MemoryInspector whose blocks are written (e.g. DefaultInspector).
+    /// @param path The file to write (truncated).
+    /// @return false if the file cannot be written.
+    template<typename Inspector>
+    static bool write (const char *path) {
+      Writer w { ::open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) };
+      if (w.fd < 0)
+        return false;
+
+      HeapDumpHeader h {};
+      std::memcpy (h.magic, HeapDumpHeader::Magic, sizeof (h.magic));
+      h.version = HeapDumpHeader::Version;
+      h.blockSize = sizeof (HeapDumpBlock);
+
+      timespec ts {};
+      clock_gettime (CLOCK_REALTIME, &ts);
+      h.time = (static_cast<uint64_t> (ts.tv_sec) * 1000000000) + static_cast<uint64_t> (ts.tv_nsec);
+
+      // the header is written again at the end, with the sections.
+      w.put (&h, sizeof (h));
+
+      h.blocksOffset = w.offset;
+      Inspector::forEach ([&] (void *addr, size_t size, uint32_t stack) {
+        const HeapDumpBlock b { reinterpret_cast<uintptr_t> (addr), size, stack, 0 };
+        w.put (&b, sizeof (b));
+        h.liveBytes += size;
+        ++h.blocks;
+      });
+
+      h.stacksOffset = w.offset;
+      StackDepot::forEach ([&] (const StackDepot::Stack &s) {
+        if (s.liveBlocks() == 0)
+          return;
+
+        const HeapDumpStack d { s.id(), static_cast<uint32_t> (s.depth()), s.liveBytes(), s.liveBlocks() };
+        w.put (&d, sizeof (d));
+        for (size_t i = 0; i < s.depth(); ++i) {
+          const uint64_t frame { s.frames()[i] };
+          w.put (&frame, sizeof (frame));
+        }
+
+        ++h.stacks;
+      });
+      h.stacksSize = w.offset - h.stacksOffset;
+
+      h.mapsOffset = w.offset;
+      const auto maps { ::open ("/proc/self/maps", O_RDONLY | O_CLOEXEC) };
+      if (maps >= 0) {
+        char buffer[4096];
+        for (auto n = ::read (maps, buffer, sizeof (buffer)); n > 0; n = ::read (maps, buffer, sizeof (buffer)))
+          w.put (buffer, static_cast<size_t> (n));
+
+        ::close (maps);
+      }
+      h.mapsSize = w.offset - h.mapsOffset;
+
+      const auto ok { w.flush() && (::pwrite (w.fd, &h, sizeof (h), 0) == sizeof (h)) };
+      ::close (w.fd);
+
+      return ok;
+    }
+
+  private:
+    /// @brief Buffers the writes to the file.
+    struct Writer {
+      explicit Writer (int file) : fd { file } {
+        // empty
+      }
+
+      int fd;                                   ///< The file.
+      uint64_t offset { 0 };                    ///< The bytes written (or buffered).
+      size_t used { 0 };                        ///< The bytes of the buffer in use.
+      bool failed { false };                    ///< Whether a write failed.
+      char buffer[MEMISPECT_HEAP_DUMP_BUFFER];  ///< The buffer.
+
+      /// @brief Appends bytes to the file.
+      void put (const void *data, size_t size) {
+        offset += size;
+        while (size > 0) {
+          if (used == sizeof (buffer))
+            flush();
+
+          const auto n { size < sizeof (buffer) - used ? size : sizeof (buffer) - used };
+          std::memcpy (buffer + used, data, n);
+          used += n;
+          data = static_cast<const char *> (data) + n;
+          size -= n;
+        }
+      }
+
+      /// @brief Writes the buffer.
+      /// @return false if a write failed.
+      bool flush() {
+        for (size_t done = 0; (done < used) && !failed; ) {
+          const auto n { ::write (fd, buffer + done, used - done) };
+          failed = n <= 0;
+          done += n > 0 ? static_cast<size_t> (n) : 0;
+        }
+
+        used = 0;
+
+        return !failed;
+      }
+    };
+};
+
+/// @brief A heap dump mapped into memory, to read its sections in place.
+class HeapDumpFile {
+  public:
+    /// @brief Maps a heap dump.
+    /// @param path The file.
+    /// @return false if the file cannot be read or is not a heap dump.
+    bool open (const char *path) {
+      if (!_file.open (path))
+        return false;
+
+      const auto h { _file.at<HeapDumpHeader> (0) };
+      const auto fits { [&] (uint64_t offset, uint64_t size) { return (offset <= _file.size()) && (size <= _file.size() - offset); } };
+
+      if ((h == nullptr) || (std::memcmp (h->magic, HeapDumpHeader::Magic, sizeof (h->magic)) != 0) ||
+          (h->version != HeapDumpHeader::Version) || (h->blockSize != sizeof (HeapDumpBlock)) ||
+          (h->blocks > _file.size() / sizeof (HeapDumpBlock)) || !fits (h->blocksOffset, h->blocks * sizeof (HeapDumpBlock)) ||
+          !fits (h->stacksOffset, h->stacksSize) || !fits (h->mapsOffset, h->mapsSize)) {
+        _file.close();
+        return false;
+      }
+
+      return true;
+    }
+
+    /// @brief Gets the header of the dump.
+    inline const HeapDumpHeader & header() const { return *_file.at<HeapDumpHeader> (0); }
+
+    /// @brief Gets the live blocks (`header().blocks` of them).
+    inline const HeapDumpBlock * blocks() const {
+      return reinterpret_cast<const HeapDumpBlock *> (_file.data() + header().blocksOffset);
+    }
+
+    /// @brief Calls a function for every stack of the dump.
+    /// @param f The function, called with a `const HeapDumpStack &` and its frames (`const uint64_t *`).
+    template<typename F>
+    void forEachStack (F &&f) const {
+      const auto &h { header() };
+      for (uint64_t at = h.stacksOffset, end = h.stacksOffset + h.stacksSize; at + sizeof (HeapDumpStack) <= end; ) {
+        const auto s { reinterpret_cast<const HeapDumpStack *> (_file.data() + at) };
+        const auto size { sizeof (HeapDumpStack) + (s->depth * sizeof (uint64_t)) };
+        if (at + size > end)
+          break;
+
+        f (*s, reinterpret_cast<const uint64_t *> (s + 1));
+        at += size;
+      }
+    }
+
+    /// @brief Gets the memory map of the process (the text of `/proc/self/maps`), to symbolize the frames.
+    inline std::string_view maps() const {
+      return { _file.data() + header().mapsOffset, header().mapsSize };
+    }
+
+  private:
+    MappedFile _file; ///< The file.
+};
+
+}
+
+#endif
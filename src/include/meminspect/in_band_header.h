@@ -0,0 +1,175 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_IN_BAND_HEADER_H__
+#define __MEM_INSPECT_IN_BAND_HEADER_H__
+#include <sys/mman.h>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace meminspect {
+
+/// @brief Storage policy of MemoryInspector that keeps the size of each block in a header placed just
+/// before the pointer returned to the application, instead of in a table of live allocations.
+/// `free` and `realloc` read the size back in O(1), without any lookup or shared state.
+///
+/// The block returned by the real allocator (the raw block) is laid out as:
+///
+///     raw                              raw + offset
+///     |  padding (aligned blocks only)  | Header |  user data ...
+///
+/// `offset` is `Size` for regular blocks and the requested alignment for over-aligned blocks, so the user
+/// pointer keeps the alignment of the raw block.
+///
+/// The memory in front of a block that this policy did not allocate (e.g. before the hooks were installed) is the
+/// chunk header of the allocator, and can hold anything. So the ownership of a pointer is never guessed from it:
+/// the user pointers this policy returned are recorded in a bitmap, one bit per 16-byte granule, and the blocks
+/// without their bit are passed through untouched. The bitmap is a two-level radix over the low 48 bits of the
+/// addresses: each leaf covers 1 GiB with 8 MiB of bits, mapped on first use, so only the pages of the bitmap that
+/// cover the heap are committed (1/128 of it at most).
+class InBandHeader {
+  public:
+    /// @brief The header stored before each user pointer.
+    struct Header {
+      size_t size;     ///< The size requested by the application.
+      uint32_t offset; ///< Distance from the raw block to the user pointer; the low 4 bits hold the flags.
+      uint32_t check;  ///< Check word, derived from the other fields (to catch a corrupted header in debug builds).
+    };
+
+    static_assert (sizeof (Header) == 16, "the header must keep 16-byte alignment");
+
+    static constexpr size_t Size { sizeof (Header) }; ///< The bytes added in front of a regular block.
+    static constexpr uint32_t FlagsMask { 0xF };      ///< The bits of `offset` used as flags.
+
+    /// @brief Writes the header of a raw block.
+    /// @param raw The raw block returned by the allocator.
+    /// @param offset The distance from the raw block to the user pointer (a multiple of 16).
+    /// @param size The size requested by the application.
+    /// @param flags Optional flags (4 bits).
+    /// @return The user pointer, or nullptr if it cannot be recorded as a block of this policy (its address is beyond
+    /// 48 bits, or the bitmap cannot be mapped). The raw block is left untouched then.
+    static inline void * attach (void *raw, size_t offset, size_t size, uint32_t flags=0) {
+      const auto user { static_cast<char *> (raw) + offset };
+      const auto h { reinterpret_cast<Header *> (user - Size) };
+
+      uint64_t mask { 0 };
+      const auto w { word (reinterpret_cast<uintptr_t> (user), true, mask) };
+      if (w == nullptr)
+        return nullptr;
+
+      w->fetch_or (mask, std::memory_order_relaxed);
+
+      h->size = size;
+      h->offset = static_cast<uint32_t> (offset) | (flags & FlagsMask);
+      h->check = checksum (*h);
+
+      return user;
+    }
+
+    /// @brief Gets the header of a user pointer.
+    /// @param ptr The user pointer.
+    /// @return The header, or nullptr if the block was not allocated with a header.
+    static inline Header * header (void *ptr) {
+      const auto addr { reinterpret_cast<uintptr_t> (ptr) };
+      if ((addr & (Size - 1)) != 0)
+        return nullptr;
+
+      uint64_t mask { 0 };
+      const auto w { word (addr, false, mask) };
+      if ((w == nullptr) || ((w->load (std::memory_order_relaxed) & mask) == 0))
+        return nullptr;
+
+      const auto h { reinterpret_cast<Header *> (static_cast<char *> (ptr) - Size) };
+      assert (h->check == checksum (*h));
+
+      return h;
+    }
+
+    /// @brief Gets the raw block of a user pointer and invalidates its header.
+    /// @param ptr The user pointer.
+    /// @param h The header of the pointer.
+    /// @return The raw block, to be given back to the allocator.
+    static inline void * detach (void *ptr, Header *h) {
+      const auto raw { static_cast<char *> (ptr) - offset (*h) };
+      h->check = ~checksum (*h);
+
+      uint64_t mask { 0 };
+      word (reinterpret_cast<uintptr_t> (ptr), false, mask)->fetch_and (~mask, std::memory_order_relaxed);
+
+      return raw;
+    }
+
+    /// @brief Gets the distance from the raw block to the user pointer.
+    static inline size_t offset (const Header &h) { return h.offset & ~FlagsMask; }
+
+    /// @brief Gets the flags of a block.
+    static inline uint32_t flags (const Header &h) { return h.offset & FlagsMask; }
+
+  private:
+    using Leaf = std::atomic<uint64_t>; ///< A word of a leaf of the bitmap.
+
+    static constexpr uint32_t Magic { 0x4D454D49 };                                  ///< "MEMI"
+    static constexpr size_t AddressBits { 48 };                                      ///< The bits of the addresses covered.
+    static constexpr size_t LeafBits { 30 };                                         ///< The bits of the addresses covered by a leaf.
+    static constexpr size_t LeafBytes { (size_t { 1 } << (LeafBits - 4)) / 8 };      ///< The size of a leaf.
+    static constexpr size_t Leaves { size_t { 1 } << (AddressBits - LeafBits) };     ///< The number of leaves.
+
+    /// @brief Finds the word of the bitmap that holds the bit of a user pointer.
+    /// @param addr The user pointer (a multiple of 16).
+    /// @param create Whether the leaf is mapped if it does not exist yet.
+    /// @param mask The bit of the pointer in the word.
+    /// @return The word, or nullptr if the address is beyond the bitmap or its leaf does not exist.
+    static inline Leaf * word (uintptr_t addr, bool create, uint64_t &mask) {
+      if ((addr >> AddressBits) != 0)
+        return nullptr;
+
+      auto &slot { _leaves[addr >> LeafBits] };
+      auto leaf { slot.load (std::memory_order_acquire) };
+      if (leaf == nullptr) {
+        if (!create)
+          return nullptr;
+
+        leaf = map (slot);
+        if (leaf == nullptr)
+          return nullptr;
+      }
+
+      const auto granule { (addr & ((uintptr_t { 1 } << LeafBits) - 1)) >> 4 };
+      mask = uint64_t { 1 } << (granule % 64);
+
+      return &leaf[granule / 64];
+    }
+
+    /// @brief Maps a leaf of the bitmap (zero-filled, and only committed where it is written).
+    /// The leaves are mapped on their own instead of coming from the MetadataArena, which would back them with huge pages.
+    /// @return The leaf of the slot, which another thread may have mapped first, or nullptr if it cannot be mapped.
+    static Leaf * map (std::atomic<Leaf *> &slot) {
+      const auto m { ::mmap (nullptr, LeafBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0) };
+      if (m == MAP_FAILED)
+        return nullptr;
+
+      Leaf *expected { nullptr };
+      if (slot.compare_exchange_strong (expected, static_cast<Leaf *> (m), std::memory_order_acq_rel, std::memory_order_acquire))
+        return static_cast<Leaf *> (m);
+
+      ::munmap (m, LeafBytes);
+
+      return expected;
+    }
+
+    /// @brief Computes the check word of a header.
+    static inline uint32_t checksum (const Header &h) {
+      return Magic ^ static_cast<uint32_t> (h.size) ^ static_cast<uint32_t> (h.size >> 32) ^ (h.offset * 0x9E3779B9u);
+    }
+
+    static inline std::atomic<Leaf *> _leaves[Leaves] {}; ///< The leaves of the bitmap (2 MiB of zero pages until they are used).
+};
+
+}
+
+#endif
@@ -0,0 +1,87 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_MAPPED_FILE_H__
+#define __MEM_INSPECT_MAPPED_FILE_H__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstddef>
+#include <utility>
+
+
+namespace meminspect {
+
+/// @brief A file mapped read-only into memory, so large traces and dumps are read without copying them.
+class MappedFile {
+  public:
+    MappedFile() = default;
+
+    MappedFile (const MappedFile &) = delete;
+    MappedFile & operator= (const MappedFile &) = delete;
+
+    /// @brief Destructor: unmaps the file.
+    ~MappedFile() {
+      close();
+    }
+
+    /// @brief Maps a file (and unmaps the previous one).
+    /// @param path The file.
+    /// @return false if the file cannot be opened or mapped.
+    bool open (const char *path) {
+      close();
+
+      const auto fd { ::open (path, O_RDONLY | O_CLOEXEC) };
+      if (fd < 0)
+        return false;
+
+      struct stat st {};
+      auto ok { ::fstat (fd, &st) == 0 };
+      if (ok && (st.st_size > 0)) {
+        const auto m { ::mmap (nullptr, static_cast<size_t> (st.st_size), PROT_READ, MAP_PRIVATE, fd, 0) };
+        ok = m != MAP_FAILED;
+        if (ok) {
+          _data = static_cast<const char *> (m);
+          _size = static_cast<size_t> (st.st_size);
+        }
+      }
+
+      ::close (fd);
+
+      return ok;
+    }
+
+    /// @brief Unmaps the file.
+    void close() {
+      if (_data != nullptr)
+        ::munmap (const_cast<char *> (_data), _size);
+
+      _data = nullptr;
+      _size = 0;
+    }
+
+    /// @brief Gets the contents of the file.
+    inline const char * data() const { return _data; }
+
+    /// @brief Gets the size of the file.
+    inline size_t size() const { return _size; }
+
+    /// @brief Gets an object stored in the file.
+    /// @param offset The offset of the object.
+    /// @return The object, or nullptr if it does not fit in the file.
+    template<typename T>
+    inline const T * at (size_t offset) const {
+      return (offset <= _size) && (sizeof (T) <= _size - offset) ? reinterpret_cast<const T *> (_data + offset) : nullptr;
+    }
+
+  private:
+    const char *_data { nullptr }; ///< The mapping.
+    size_t _size { 0 };            ///< The size of the file.
+};
+
+}
+
+#endif
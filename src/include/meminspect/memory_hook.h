@@ -5,144 +5,405 @@
 // ----------------------------------------------------------------------------
 #ifndef __MEM_INSPECT_MEMORY_HOOK_H__
 #define __MEM_INSPECT_MEMORY_HOOK_H__
-#include <dlfcn.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <bit>
+#include <cerrno>
 #include <cstdlib>
 #include <stdexcept>
+#include <type_traits>
 #include <new>
 
+#include <meminspect/default_allocator.h>
 #include <meminspect/memory_inspector.h>
+#include <meminspect/stack_depot.h>
+#include <meminspect/trace.h>
 #include <meminspect/types.h>
 
+// storage policy of the block sizes, see MemoryInspector (e.g. meminspect::InBandHeader).
+// MEMISPECT_CAPTURE_STACKS records the allocation call stack of each block as well.
+// MEMISPECT_TRACE lets the hooks record their calls with meminspect::TraceRecorder (see MEMISPECT_TRACE_FILE).
+#ifndef MEMISPECT_STORAGE
+  #ifdef MEMISPECT_CAPTURE_STACKS
+    #define MEMISPECT_STORAGE meminspect::ShardedHashMapPtr<void, meminspect::Block, meminspect::DefaultAllocator>
+  #else
+    #define MEMISPECT_STORAGE meminspect::ShardedHashMapPtr<void, size_t, meminspect::DefaultAllocator>
+  #endif
+#endif
+
+// the inspector behind the hooks: any class with the static interface of MemoryInspector (e.g. the one of the
+// preload library, which picks its storage policy at run time).
+#ifndef MEMISPECT_INSPECTOR
+  #define MEMISPECT_INSPECTOR meminspect::MemoryInspector<meminspect::DefaultAllocator, MEMISPECT_STORAGE>
+#endif
+
+// the hooks keep the default visibility, so they interpose the allocator even from a shared library built with
+// hidden symbols (see libmeminspect_preload).
+#define MEMISPECT_HOOK __attribute__ ((visibility ("default")))
+
 
 namespace meminspect {
 
-struct DefaultAllocator {
-  static meminspect::malloc_t malloc;
-  static meminspect::realloc_t realloc;
-  static meminspect::calloc_t calloc;
-  static meminspect::aligned_alloc_t aligned_alloc;
-  static meminspect::free_t free;
-};
+/// @brief The inspector behind the hooks.
+using DefaultInspector = MEMISPECT_INSPECTOR;
+
+/// @brief The recorder of the calls of the hooks.
+#ifdef MEMISPECT_TRACE
+using HookTrace = TraceRecorder;
+#else
+using HookTrace = NoTrace;
+#endif
+
+/// @brief The scope that makes the captured stacks start at the caller of the hooks.
+using HookCaller = std::conditional_t<DefaultInspector::CapturesStacks, StackDepot::Caller, NoCaller>;
+
+/// @brief Resolves the real allocator before the static constructors of the program run.
+/// Allocations made even earlier (e.g. by the constructors of shared libraries) resolve it on their first call.
+__attribute__ ((constructor (101))) static void resolveDefaultAllocator() {
+  DefaultAllocator::resolve();
+}
+
+#ifdef MEMISPECT_TRACE
+/// @brief Records the calls of the hooks into the file named by the MEMISPECT_TRACE_FILE environment variable, if set.
+/// The recording stops when the program exits.
+__attribute__ ((constructor (102))) static void startHookTrace() {
+  const auto path { std::getenv ("MEMISPECT_TRACE_FILE") };
+  if ((path != nullptr) && TraceRecorder::start (path))
+    std::atexit (&TraceRecorder::stop);
+}
+#endif
+
+/// @brief Allocates the block of an `operator new`.
+/// As the standard requires, the new handler is called until the allocation succeeds, and std::bad_alloc is thrown
+/// when there is none.
+/// @param size The size of the block (0 allocates 1 byte, so every block is unique).
+/// @param alignment The alignment of the block, or 0 for the default alignment.
+inline void * newBlock (size_t size, size_t alignment) {
+  if (size == 0)
+    size = 1;
+
+  while (true) {
+    const auto addr { alignment != 0 ? std::aligned_alloc (alignment, size) : std::malloc (size) };
+    if (addr != nullptr)
+      return addr;
+
+    const auto handler { std::get_new_handler() };
+    if (handler == nullptr)
+      throw std::bad_alloc {};
+
+    handler();
+  }
+}
+
+/// @brief Allocates the block of a nothrow `operator new`.
+/// @return The block, or nullptr instead of throwing std::bad_alloc.
+inline void * newBlockNoThrow (size_t size, size_t alignment) noexcept {
+  try {
+    return newBlock (size, alignment);
+  }
+  catch (...) {
+    return nullptr;
+  }
+}
 
-malloc_t DefaultAllocator::malloc { nullptr };
-realloc_t DefaultAllocator::realloc { nullptr };
-calloc_t DefaultAllocator::calloc { nullptr };
-calloc_t DefaultAllocator::aligned_alloc { nullptr };
-free_t DefaultAllocator::free { nullptr };
+/// @brief Gets the size of a page, for `valloc` and `pvalloc`.
+inline size_t pageSize() {
+  static const auto size { static_cast<size_t> (sysconf (_SC_PAGESIZE)) };
+  return size;
+}
 
 }
 
 // ----------------------------------------------------------------------------
 // malloc
 // ----------------------------------------------------------------------------
-extern void * malloc (size_t size) {
-  if (!meminspect::DefaultAllocator::malloc) {
-    meminspect::DefaultAllocator::malloc = reinterpret_cast<meminspect::malloc_t> (dlsym (RTLD_NEXT, "malloc"));
-    if (dlerror() != nullptr)
-      std::abort();
-
-  }
+MEMISPECT_HOOK extern void * malloc (size_t size) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  const auto start { meminspect::HookTrace::now() };
+  const auto addr { meminspect::DefaultInspector::alloc (size) };
+  meminspect::HookTrace::record (meminspect::TraceOp::Malloc, start, nullptr, addr, size);
 
-  return meminspect::MemoryInspector<meminspect::DefaultAllocator>::alloc (size);
+  return addr;
 }
 
 // ----------------------------------------------------------------------------
 // realloc
 // ----------------------------------------------------------------------------
-extern void * realloc (void *ptr, size_t size) {
-  if (!meminspect::DefaultAllocator::realloc) {
-     meminspect::DefaultAllocator::realloc = reinterpret_cast<meminspect::realloc_t> (dlsym (RTLD_NEXT, "realloc"));
-    if (dlerror() != nullptr)
-      std::abort();
-  }
+MEMISPECT_HOOK extern void * realloc (void *ptr, size_t size) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  const auto start { meminspect::HookTrace::now() };
+  const auto addr { meminspect::DefaultInspector::realloc (ptr, size) };
+  meminspect::HookTrace::record (meminspect::TraceOp::Realloc, start, ptr, addr, size);
 
-  if (!meminspect::DefaultAllocator::free) {
-     meminspect::DefaultAllocator::free = reinterpret_cast<meminspect::free_t> (dlsym (RTLD_NEXT, "free"));
-    if (dlerror() != nullptr)
-      std::abort();
-  }
-
-  return meminspect::MemoryInspector<meminspect::DefaultAllocator>::realloc (ptr, size);
+  return addr;
 }
 
 // ----------------------------------------------------------------------------
 // calloc
 // ----------------------------------------------------------------------------
-extern void * calloc (size_t num, size_t size) {
-  if (!meminspect::DefaultAllocator::calloc) {
-    meminspect::DefaultAllocator::calloc = reinterpret_cast<meminspect::calloc_t> (dlsym (RTLD_NEXT, "calloc"));
-    if (dlerror() != nullptr)
-      std::abort();
-  }
+MEMISPECT_HOOK extern void * calloc (size_t num, size_t size) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  const auto start { meminspect::HookTrace::now() };
+  const auto addr { meminspect::DefaultInspector::calloc (num, size) };
+  meminspect::HookTrace::record (meminspect::TraceOp::Calloc, start, nullptr, addr, num * size);
 
-  return meminspect::MemoryInspector<meminspect::DefaultAllocator>::calloc (num, size);
+  return addr;
 }
 
 // ----------------------------------------------------------------------------
 // aligned_alloc
 // ----------------------------------------------------------------------------
-extern void * aligned_alloc (size_t alignment, size_t size) {
-  if (!meminspect::DefaultAllocator::aligned_alloc) {
-    meminspect::DefaultAllocator::aligned_alloc = reinterpret_cast<meminspect::aligned_alloc_t> (dlsym (RTLD_NEXT, "aligned_alloc"));
-    if (dlerror() != nullptr)
-      std::abort();
-  }
+MEMISPECT_HOOK extern void * aligned_alloc (size_t alignment, size_t size) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  const auto start { meminspect::HookTrace::now() };
+  const auto addr { meminspect::DefaultInspector::aligned_alloc (alignment, size) };
+  meminspect::HookTrace::record (meminspect::TraceOp::AlignedAlloc, start, nullptr, addr, size, alignment);
 
-  return meminspect::MemoryInspector<meminspect::DefaultAllocator>::aligned_alloc (alignment, size);
+  return addr;
 }
 
 // ----------------------------------------------------------------------------
 // free
 // ----------------------------------------------------------------------------
-extern void free (void *ptr) {
-  if (!meminspect::DefaultAllocator::free) {
-     meminspect::DefaultAllocator::free = reinterpret_cast<meminspect::free_t> (dlsym (RTLD_NEXT, "free"));
-    if (dlerror() != nullptr)
-      std::abort();
+MEMISPECT_HOOK extern void free (void *ptr) {
+  const auto start { meminspect::HookTrace::now() };
+  meminspect::DefaultInspector::dealloc (ptr);
+  meminspect::HookTrace::record (meminspect::TraceOp::Free, start, ptr, nullptr, 0);
+}
+
+// ----------------------------------------------------------------------------
+// malloc_usable_size
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK extern size_t malloc_usable_size (void *ptr) {
+  return meminspect::DefaultInspector::usable_size (ptr);
+}
+
+// ----------------------------------------------------------------------------
+// posix_memalign
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK extern int posix_memalign (void **memptr, size_t alignment, size_t size) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  if (((alignment % sizeof (void *)) != 0) || !std::has_single_bit (alignment))
+    return EINVAL;
+
+  const auto addr { aligned_alloc (alignment, size) };
+  if ((addr == nullptr) && (size != 0))
+    return ENOMEM;
+
+  *memptr = addr;
+
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// memalign
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK extern void * memalign (size_t alignment, size_t size) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  // like glibc, an alignment that is not a power of two is rounded up to the next one.
+  return aligned_alloc (std::bit_ceil (alignment), size);
+}
+
+// ----------------------------------------------------------------------------
+// valloc
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK extern void * valloc (size_t size) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  return aligned_alloc (meminspect::pageSize(), size);
+}
+
+// ----------------------------------------------------------------------------
+// pvalloc
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK extern void * pvalloc (size_t size) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  const auto page { meminspect::pageSize() };
+  if (size > SIZE_MAX - page) {
+    errno = ENOMEM;
+    return nullptr;
   }
 
-  meminspect::MemoryInspector<meminspect::DefaultAllocator>::dealloc (ptr);
+  return aligned_alloc (page, size != 0 ? (size + page - 1) & ~(page - 1) : page);
+}
+
+// ----------------------------------------------------------------------------
+// reallocarray
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK extern void * reallocarray (void *ptr, size_t num, size_t size) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  size_t bytes { 0 };
+  if (__builtin_mul_overflow (num, size, &bytes)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+
+  return realloc (ptr, bytes);
+}
+
+// ----------------------------------------------------------------------------
+// free_sized
+// ----------------------------------------------------------------------------
+extern "C" MEMISPECT_HOOK void free_sized (void *ptr, size_t size) {
+  const auto start { meminspect::HookTrace::now() };
+  meminspect::DefaultInspector::dealloc (ptr, size);
+  meminspect::HookTrace::record (meminspect::TraceOp::Free, start, ptr, nullptr, 0);
+}
+
+// ----------------------------------------------------------------------------
+// free_aligned_sized
+// ----------------------------------------------------------------------------
+extern "C" MEMISPECT_HOOK void free_aligned_sized (void *ptr, size_t alignment, size_t size) {
+  const auto start { meminspect::HookTrace::now() };
+  meminspect::DefaultInspector::dealloc (ptr, size, alignment);
+  meminspect::HookTrace::record (meminspect::TraceOp::Free, start, ptr, nullptr, 0);
+}
+
+// ----------------------------------------------------------------------------
+// new
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void * operator new (std::size_t sz) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  return meminspect::newBlock (sz, 0);
+}
+
+// ----------------------------------------------------------------------------
+// new[]
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void * operator new[] (std::size_t sz) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  return meminspect::newBlock (sz, 0);
+}
+
+// ----------------------------------------------------------------------------
+// new
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void * operator new (std::size_t sz, std::align_val_t al) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  return meminspect::newBlock (sz, static_cast<size_t> (al));
+}
+
+// ----------------------------------------------------------------------------
+// new[]
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void * operator new[] (std::size_t sz, std::align_val_t al) {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  return meminspect::newBlock (sz, static_cast<size_t> (al));
+}
+
+// ----------------------------------------------------------------------------
+// new
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void * operator new (std::size_t sz, const std::nothrow_t &) noexcept {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  return meminspect::newBlockNoThrow (sz, 0);
+}
+
+// ----------------------------------------------------------------------------
+// new[]
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void * operator new[] (std::size_t sz, const std::nothrow_t &) noexcept {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  return meminspect::newBlockNoThrow (sz, 0);
 }
 
 // ----------------------------------------------------------------------------
 // new
 // ----------------------------------------------------------------------------
-void * operator new (std::size_t sz) {
-  return std::malloc (sz);
+MEMISPECT_HOOK void * operator new (std::size_t sz, std::align_val_t al, const std::nothrow_t &) noexcept {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  return meminspect::newBlockNoThrow (sz, static_cast<size_t> (al));
 }
 
 // ----------------------------------------------------------------------------
 // new[]
 // ----------------------------------------------------------------------------
-void * operator new[] (std::size_t sz) {
-  return std::malloc (sz);
+MEMISPECT_HOOK void * operator new[] (std::size_t sz, std::align_val_t al, const std::nothrow_t &) noexcept {
+  const meminspect::HookCaller caller { __builtin_frame_address (0) };
+  return meminspect::newBlockNoThrow (sz, static_cast<size_t> (al));
 }
 
 // ----------------------------------------------------------------------------
 // delete
 // ----------------------------------------------------------------------------
-void operator delete (void *ptr) noexcept {
+MEMISPECT_HOOK void operator delete (void *ptr) noexcept {
   std::free (ptr);
 }
 
 // ----------------------------------------------------------------------------
 // delete
 // ----------------------------------------------------------------------------
-void operator delete (void *ptr, std::size_t) noexcept {
+MEMISPECT_HOOK void operator delete (void *ptr, std::size_t sz) noexcept {
+  // operator new allocates 1 byte for 0.
+  free_sized (ptr, sz != 0 ? sz : 1);
+}
+
+// ----------------------------------------------------------------------------
+// delete
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void operator delete (void *ptr, std::align_val_t) noexcept {
   std::free (ptr);
 }
 
+// ----------------------------------------------------------------------------
+// delete
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void operator delete (void *ptr, std::size_t sz, std::align_val_t al) noexcept {
+  free_aligned_sized (ptr, static_cast<size_t> (al), sz != 0 ? sz : 1);
+}
+
+// ----------------------------------------------------------------------------
+// delete
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void operator delete (void *ptr, const std::nothrow_t &) noexcept {
+  std::free (ptr);
+}
+
+// ----------------------------------------------------------------------------
+// delete
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void operator delete (void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+  std::free (ptr);
+}
+
+// ----------------------------------------------------------------------------
+// delete[]
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void operator delete[] (void *ptr) noexcept {
+  std::free (ptr);
+}
+
+// ----------------------------------------------------------------------------
+// delete[]
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void operator delete[] (void *ptr, std::size_t sz) noexcept {
+  free_sized (ptr, sz != 0 ? sz : 1);
+}
+
+// ----------------------------------------------------------------------------
+// delete[]
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void operator delete[] (void *ptr, std::align_val_t) noexcept {
+  std::free (ptr);
+}
+
+// ----------------------------------------------------------------------------
+// delete[]
+// ----------------------------------------------------------------------------
+MEMISPECT_HOOK void operator delete[] (void *ptr, std::size_t sz, std::align_val_t al) noexcept {
+  free_aligned_sized (ptr, static_cast<size_t> (al), sz != 0 ? sz : 1);
+}
+
 // ----------------------------------------------------------------------------
 // delete[]
 // ----------------------------------------------------------------------------
-void operator delete[] (void *ptr) noexcept {
+MEMISPECT_HOOK void operator delete[] (void *ptr, const std::nothrow_t &) noexcept {
   std::free (ptr);
 }
 
 // ----------------------------------------------------------------------------
 // delete[]
 // ----------------------------------------------------------------------------
-void operator delete[] (void *ptr, std::size_t) noexcept {
+MEMISPECT_HOOK void operator delete[] (void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
   std::free (ptr);
 }
 
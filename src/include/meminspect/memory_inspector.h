@@ -6,27 +6,95 @@
 #ifndef __MEM_INSPECT_MEMORY_INSPECTOR_H__
 #define __MEM_INSPECT_MEMORY_INSPECTOR_H__
 #include <cinttypes>
+#include <cstring>
+#include <type_traits>
+
+#include <meminspect/delta_counters.h>
+#include <meminspect/event_pipeline.h>
+#include <meminspect/in_band_header.h>
+#include <meminspect/sampler.h>
+#include <meminspect/size_histogram.h>
+#include <meminspect/stack_depot.h>
 #include <meminspect/types.h>
 
 
 namespace meminspect {
 
+/// @brief Storage policy of MemoryInspector that keeps no per-block metadata.
+/// The counters are updated with `malloc_usable_size` on allocation and deallocation, so they report the usable
+/// size of the blocks (which may be greater than the requested size). The allocator must provide `malloc_usable_size`.
+struct CountersOnly {};
+
+/// @brief Gets the type of the values of a storage policy (the size of a block, for the policies without a table).
+template<typename Storage, typename=void>
+struct StorageValue {
+  using type = size_t;
+};
+
+template<typename Storage>
+struct StorageValue<Storage, std::void_t<typename Storage::value_type>> {
+  using type = typename Storage::value_type;
+};
+
 /// @brief A class for tracking memory allocations and deallocations.
 /// This class provides static methods for tracking memory allocations, reallocations, and deallocations.
+/// The size of each live block is recovered at `free`/`realloc` time from its storage policy:
+/// - a table of live allocations (pointer to size), sharded by default so threads only serialize when their
+///   pointers fall in the same shard. The table must provide `add` (which returns false when the block cannot be
+///   stored, so it is not counted either), `remove`, `find` and `stats`, and be thread-safe.
+/// - InBandHeader, which stores the size in a header in front of each block and needs no shared table.
+/// - CountersOnly, which keeps no per-block metadata and counts the usable size reported by the allocator.
+/// - Sampled, which only records sampled blocks (with their weight) in a table, so the counters are estimates.
+/// - Deferred, which leaves the table and the counters to a consumer: the hooks only push events into per-thread
+///   rings, and queries apply the pending events first.
+///
+/// When the values of the table are Block, the call stack of each recorded allocation is captured and stored in
+/// the StackDepot, which keeps the live bytes and blocks of every stack.
+///
+/// While there are trackers, the allocations and frees are also counted per size class (see histogram()).
 /// @tparam Allocator The custom allocator type to use for memory management.
-template<typename Allocator>
+/// @tparam Storage The storage policy of the block sizes.
+template<typename Allocator, typename Storage=ShardedHashMapPtr<void, size_t, Allocator>>
 class MemoryInspector {
+  static constexpr bool UsesHeader { std::is_same_v<Storage, InBandHeader> }; ///< Whether sizes live in block headers.
+  static constexpr bool CountsOnly { std::is_same_v<Storage, CountersOnly> };  ///< Whether only the counters are kept.
+  static constexpr bool Sampling { IsSampled<Storage>::value };                ///< Whether only sampled blocks are kept.
+  static constexpr bool Defers { IsDeferred<Storage>::value };                 ///< Whether the table is left to a consumer.
+
+  using Value = typename StorageValue<Storage>::type;                          ///< The value stored for each block.
+
   public:
+    using PeakEpoch = HighWaterMarks::Epoch; ///< The epoch of the peak of a tracker (see addPeak).
+
+    static constexpr bool CapturesStacks { std::is_same_v<Value, Block> }; ///< Whether the call stacks are captured.
+
     /// @brief Allocates memory of a specified size and tracks the allocation.
     /// @param size The size of memory to allocate.
     /// @return A pointer to the allocated memory.
     static inline void * alloc (size_t size) {
-      std::lock_guard<Mutex> guard { _mutex };
+      if constexpr (CountsOnly) {
+        const auto addr { Allocator::malloc (size) };
+        if (addr != nullptr)
+          increase (Allocator::malloc_usable_size (addr));
+
+        return addr;
+      }
+      else if constexpr (UsesHeader) {
+        const auto raw { Allocator::malloc (size + InBandHeader::Size) };
+        if (raw == nullptr)
+          return nullptr;
 
-      const auto addr { Allocator::malloc (size) };
-      _allocatedBytes += size;
+        return attach (raw, InBandHeader::Size, size);
+      }
+      else {
+        const auto addr { Allocator::malloc (size) };
+        if (addr == nullptr)
+          return nullptr;
 
-      return _mem.add (addr, std::move (size))->key;
+        track (addr, size);
+
+        return addr;
+      }
     }
 
     /// @brief Reallocates memory to a new size and tracks the reallocation.
@@ -34,17 +102,114 @@ class MemoryInspector {
     /// @param size The new size of memory to allocate.
     /// @return A pointer to the reallocated memory.
     static inline void * realloc (void *ptr, size_t size) {
-      std::lock_guard<Mutex> guard { _mutex };
+      if constexpr (CountsOnly) {
+        const auto oldSize { ptr != nullptr ? Allocator::malloc_usable_size (ptr) : 0 };
+
+        const auto addr { Allocator::realloc (ptr, size) };
+        if ((addr == nullptr) && (size != 0))
+          return nullptr;
+
+        decrease (oldSize);
+        if (addr != nullptr)
+          increase (Allocator::malloc_usable_size (addr));
+
+        if ((ptr != nullptr) && (addr != nullptr))
+          resized();
+
+        return addr;
+      }
+      else if constexpr (UsesHeader) {
+        if (ptr == nullptr)
+          return alloc (size);
+
+        const auto h { InBandHeader::header (ptr) };
+        if (h == nullptr)
+          return Allocator::realloc (ptr, size);
 
-      const auto addr { Allocator::realloc (ptr, size) };
+        if (size == 0) {
+          dealloc (ptr);
+          return nullptr;
+        }
 
-      _allocatedBytes += size;
+        const auto oldSize { h->size };
 
-      const auto oldSize { _mem.remove (ptr) };
-      if (oldSize)
-        _allocatedBytes -= *oldSize;
+        if (InBandHeader::offset (*h) != InBandHeader::Size) {
+          // over-aligned blocks cannot be resized in place, since realloc does not keep the alignment.
+          const auto addr { alloc (size) };
+          if (addr == nullptr)
+            return nullptr;
 
-      return _mem.add (addr, std::move (size))->key;
+          std::memcpy (addr, ptr, oldSize < size ? oldSize : size);
+          dealloc (ptr);
+          resized();
+
+          return addr;
+        }
+
+        const auto raw { Allocator::realloc (InBandHeader::detach (ptr, h), size + InBandHeader::Size) };
+        if (raw == nullptr) {
+          // the old block is still valid (its bit was recorded before, so this cannot fail).
+          InBandHeader::attach (static_cast<char *> (ptr) - InBandHeader::Size, InBandHeader::Size, oldSize);
+          return nullptr;
+        }
+
+        decrease (oldSize);
+        resized();
+
+        return attach (raw, InBandHeader::Size, size);
+      }
+      else if constexpr (Defers) {
+        if (ptr == nullptr)
+          return alloc (size);
+
+        // the free is stamped before the old block can be reused by another thread, and pushed once realloc succeeds.
+        // only the address is kept, since the pointer cannot be used once realloc succeeds.
+        const auto time { Pipeline::reserve() };
+        const auto old { reinterpret_cast<uintptr_t> (ptr) };
+        const auto flags { threadFlags() };
+
+        const auto addr { Allocator::realloc (ptr, size) };
+        if ((addr == nullptr) && (size != 0)) {
+          // the old block is still valid.
+          Pipeline::commit();
+          return nullptr;
+        }
+
+        Pipeline::push (Event { time, old, 0, StackDepot::NoStack, Event::Free, flags });
+        Pipeline::commit();
+
+        if (addr != nullptr) {
+          track (addr, size);
+          resized();
+        }
+
+        return addr;
+      }
+      else {
+        // the old block is untracked before calling the allocator, since it cannot be used once realloc succeeds.
+        auto old { ptr != nullptr ? _mem.remove (ptr) : std::nullopt };
+
+        const auto addr { Allocator::realloc (ptr, size) };
+        if ((addr == nullptr) && (size != 0)) {
+          // the old block is still valid; it is no longer counted if it no longer fits in the table.
+          if (old && !_mem.add (ptr, Value { *old }))
+            untrack (*old);
+
+          return nullptr;
+        }
+
+        if (old)
+          untrack (*old);
+
+        if (addr == nullptr)
+          return nullptr;
+
+        track (addr, size);
+        if (ptr != nullptr)
+          resized();
+
+        return addr;
+      }
     }
 
     /// @brief Allocates memory for an array of num objects of size size.
@@ -52,10 +217,33 @@ class MemoryInspector {
     /// @param size The size of each object.
     /// @return A pointer to the allocated memory.
     static inline void * calloc (size_t num, size_t size) {
-      const auto addr { Allocator::calloc (num, size) };
-      _allocatedBytes += size * num;
+      if constexpr (CountsOnly) {
+        const auto addr { Allocator::calloc (num, size) };
+        if (addr != nullptr)
+          increase (Allocator::malloc_usable_size (addr));
+
+        return addr;
+      }
+      else if constexpr (UsesHeader) {
+        size_t bytes { 0 };
+        if (__builtin_mul_overflow (num, size, &bytes) || (bytes > SIZE_MAX - InBandHeader::Size))
+          return nullptr;
+
+        const auto raw { Allocator::calloc (1, bytes + InBandHeader::Size) };
+        if (raw == nullptr)
+          return nullptr;
 
-      return _mem.add (addr, std::move (size * num))->key;
+        return attach (raw, InBandHeader::Size, bytes);
+      }
+      else {
+        const auto addr { Allocator::calloc (num, size) };
+        if (addr == nullptr)
+          return nullptr;
+
+        track (addr, size * num);
+
+        return addr;
+      }
     }
 
     /// @brief Allocate size bytes of uninitialized storage whose alignment is specified by alignment.
@@ -63,56 +251,506 @@ class MemoryInspector {
     /// @param size The number of bytes to allocate.
     /// @return A pointer to the allocated memory.
     static inline void * aligned_alloc (size_t alignment, size_t size) {
-      std::lock_guard<Mutex> guard { _mutex };
+      if constexpr (CountsOnly) {
+        const auto addr { Allocator::aligned_alloc (alignment, size) };
+        if (addr != nullptr)
+          increase (Allocator::malloc_usable_size (addr));
+
+        return addr;
+      }
+      else if constexpr (UsesHeader) {
+        if ((alignment & (alignment - 1)) != 0)
+          return nullptr;
+
+        // the header keeps the 16-byte alignment of regular blocks.
+        if (alignment <= InBandHeader::Size)
+          return alloc (size);
+
+        // the header goes at the end of a full alignment unit, so the user pointer keeps the alignment.
+        const auto rounded { (size + alignment - 1) & ~(alignment - 1) };
+        const auto raw { Allocator::aligned_alloc (alignment, rounded + alignment) };
+        if (raw == nullptr)
+          return nullptr;
 
-      const auto addr { Allocator::aligned_alloc (alignment, size) };
-      _allocatedBytes += size;
+        return attach (raw, alignment, size);
+      }
+      else {
+        const auto addr { Allocator::aligned_alloc (alignment, size) };
+        if (addr == nullptr)
+          return nullptr;
 
-      return _mem.add (addr, std::move (size))->key;
+        track (addr, size);
+
+        return addr;
+      }
     }
 
     /// @brief Deallocates memory and tracks the deallocation.
+    /// When the caller knows the size of the block (sized `delete`, `free_sized`), it is passed on to the sized
+    /// entry points of the allocator, if it has them, so the allocator does not have to look it up. The InBandHeader
+    /// policy always knows the size of its blocks, so it uses them for every block.
     /// @param ptr A pointer to the memory to deallocate.
-    static inline void dealloc (void *ptr) {
-      std::lock_guard<Mutex> guard { _mutex };
+    /// @param size The requested size of the block, or 0 if unknown.
+    /// @param alignment The requested alignment of the block, or 0 if it was not allocated with an alignment.
+    static inline void dealloc (void *ptr, size_t size = 0, size_t alignment = 0) {
+      if (ptr == nullptr)
+        return;
+
+      if constexpr (CountsOnly) {
+        decrease (Allocator::malloc_usable_size (ptr));
+        release (ptr, size, alignment);
+      }
+      else if constexpr (UsesHeader) {
+        const auto h { InBandHeader::header (ptr) };
+        if (h == nullptr) {
+          release (ptr, size, alignment);
+          return;
+        }
 
-      const auto size { _mem.remove (ptr) };
-      if (size)
-        _allocatedBytes -= *size;
+        decrease (h->size);
 
-      Allocator::free (ptr);
+        // the raw block of an over-aligned block is a multiple of its alignment, plus the unit of the header.
+        const auto offset { InBandHeader::offset (*h) };
+        if (offset == InBandHeader::Size)
+          release (InBandHeader::detach (ptr, h), h->size + offset, 0);
+        else
+          release (InBandHeader::detach (ptr, h), ((h->size + offset - 1) & ~(offset - 1)) + offset, offset);
+      }
+      else if constexpr (Defers) {
+        // pushed before the block can be reused by another thread.
+        defer (Event::Free, ptr, 0, StackDepot::NoStack);
+        release (ptr, size, alignment);
+      }
+      else {
+        const auto old { _mem.remove (ptr) };
+        if (old)
+          untrack (*old);
+
+        release (ptr, size, alignment);
+      }
     }
 
-    /// @brief Tracks the addition of memory size.
-    /// @param size A pointer to the size of memory to add.
-    static inline void add (size_t *size) {
-      std::lock_guard<Mutex> guard { _mutex };
+    /// @brief Gets the number of usable bytes of a block (`malloc_usable_size`).
+    /// @param ptr A pointer to the memory.
+    /// @return The number of bytes that can be used, which may be greater than the requested size.
+    static inline size_t usable_size (void *ptr) {
+      if (ptr == nullptr)
+        return 0;
+
+      if constexpr (UsesHeader) {
+        const auto h { InBandHeader::header (ptr) };
+        if (h != nullptr) {
+          const auto offset { InBandHeader::offset (*h) };
+          return Allocator::malloc_usable_size (static_cast<char *> (ptr) - offset) - offset;
+        }
+      }
 
-      _allocatedBytes.add (size);
+      return Allocator::malloc_usable_size (ptr);
     }
 
-    /// @brief Tracks the removal of memory size.
-    /// @param size A pointer to the size of memory to remove.
-    static inline void remove (size_t *size) {
-      std::lock_guard<Mutex> guard { _mutex };
+    /// @brief Registers a tracker.
+    /// The global counters are only updated while at least one tracker is registered. Registration is lock-free,
+    /// but taking the baseline reconciles the buffers of all threads.
+    /// @return The baseline of the tracker.
+    static inline Snapshot add() {
+      _trackers.fetch_add (1, std::memory_order_acq_rel);
 
-      _allocatedBytes.remove (size);
+      return snapshot();
+    }
+
+    /// @brief Registers a tracker and starts recording its peak (see addPeak).
+    /// The baseline and the epoch are taken together, so the peak is never below the baseline.
+    /// @param epoch Set to the epoch of the peak, or nullptr if it cannot be allocated.
+    /// @return The baseline of the tracker.
+    static inline Snapshot add (PeakEpoch *&epoch) {
+      _trackers.fetch_add (1, std::memory_order_acq_rel);
+
+      if constexpr (Defers)
+        Pipeline::barrier();
+
+      Snapshot baseline {};
+      epoch = Counters::mark (baseline);
+
+      return baseline;
+    }
+
+    /// @brief Unregisters a tracker.
+    static inline void remove() {
+      _trackers.fetch_sub (1, std::memory_order_acq_rel);
+    }
+
+    /// @brief Gets the global counters.
+    /// The deltas buffered by every thread are included, so the result is exact.
+    static inline Snapshot snapshot() {
+      if constexpr (Defers)
+        Pipeline::barrier();
+
+      return Counters::read();
+    }
+
+    /// @brief Gets the net bytes allocated by all threads since a baseline.
+    /// @param baseline The baseline returned by add().
+    static inline size_t bytesSince (const Snapshot &baseline) {
+      return snapshot().since (baseline);
+    }
+
+    /// @brief Starts recording the peak of the global net bytes for a tracker registered with add().
+    /// Only the newest tracker is updated by the allocations (see HighWaterMarks), so the cost does not depend on
+    /// the number of trackers. The global counters are flushed in batches, so the peak misses at most the deltas
+    /// buffered by the other threads (see MEMISPECT_DELTA_THRESHOLD).
+    /// @return The epoch of the peak, for peakSince() and removePeak(), or nullptr if it cannot be allocated.
+    static inline PeakEpoch * addPeak() {
+      if constexpr (Defers)
+        Pipeline::barrier();
+
+      return Counters::mark();
+    }
+
+    /// @brief Stops recording a peak.
+    /// @param epoch The epoch returned by addPeak(), or nullptr.
+    static inline void removePeak (PeakEpoch *epoch) {
+      Counters::unmark (epoch);
+    }
+
+    /// @brief Gets the peak of the net bytes allocated by all threads since a baseline.
+    /// @param baseline The baseline returned by add().
+    /// @param epoch The epoch returned by add() with the baseline, or by addPeak() after it; nullptr returns the
+    ///   current net bytes.
+    /// @return The highest net bytes since the epoch was opened, relative to the baseline (0 if they stayed below).
+    static inline size_t peakSince (const Snapshot &baseline, const PeakEpoch *epoch) {
+      if (epoch == nullptr)
+        return bytesSince (baseline);
+
+      if constexpr (Defers)
+        Pipeline::barrier();
+
+      const auto peak { Counters::peak (*epoch) - static_cast<int64_t> (baseline.allocated - baseline.freed) };
+
+      return peak > 0 ? static_cast<size_t> (peak) : 0;
+    }
+
+    /// @brief Gets the allocations and frees of all threads per size class, since the first tracker was registered.
+    /// Like the global counters, the classes are only counted while there are trackers, so the histogram of a
+    /// tracker is the difference with the one taken when it was registered (see SizeHistogram::since). The sizes
+    /// are the requested ones, or the usable ones with the CountersOnly policy. The Sampled policy keeps no histogram,
+    /// since it only knows the weights of its samples.
+    static inline SizeHistogram histogram() {
+      if constexpr (Defers)
+        Pipeline::barrier();
+
+      return Sizes::read();
+    }
+
+    /// @brief Registers a tracker of the allocations made by the current thread.
+    /// The counters of the thread live in thread-local storage, so no lock or shared cache line is touched.
+    /// With the Deferred policy they live in the ring of the thread, and the pending events are applied first.
+    /// @return The baseline of the tracker. The tracker must be removed from the same thread.
+    static inline Snapshot addThread() {
+      auto &t { threadCounters() };
+      ++t.trackers;
+
+      if constexpr (Defers)
+        Pipeline::barrier();
+
+      return t.counters;
+    }
+
+    /// @brief Unregisters a tracker of the current thread.
+    static inline void removeThread() {
+      --threadCounters().trackers;
+    }
+
+    /// @brief Gets the net bytes allocated by the current thread since a baseline.
+    /// @param baseline The baseline returned by addThread() on this thread.
+    static inline size_t threadBytesSince (const Snapshot &baseline) {
+      if constexpr (Defers)
+        Pipeline::barrier();
+
+      return threadCounters().counters.since (baseline);
+    }
+
+    /// @brief Gets the occupancy statistics of the table of live allocations.
+    /// The table is walked on demand, so it is meant for tuning and diagnostics rather than for the hot path.
+    /// @return The statistics of the table (empty when the storage policy has no table).
+    static inline HashMapStats stats() {
+      if constexpr (UsesHeader || CountsOnly) {
+        return {};
+      }
+      else {
+        if constexpr (Defers)
+          Pipeline::barrier();
+
+        return _mem.stats();
+      }
+    }
+
+    /// @brief Calls a function for every block of the table of live allocations (e.g. to write a HeapDump).
+    /// The shards of the table are locked while they are walked, so the function must not allocate. With the
+    /// Sampled policy only the sampled blocks are walked, with their weights as sizes.
+    /// @param f The function, called with the address, the size and the stack id (StackDepot::NoStack when the
+    /// stacks are not captured) of each block. It is never called when the storage policy has no table.
+    template<typename F>
+    static void forEach (F &&f) {
+      if constexpr (!UsesHeader && !CountsOnly) {
+        if constexpr (Defers)
+          Pipeline::barrier();
+
+        _mem.forEach ([&f] (void *addr, const Value &v) {
+          if constexpr (CapturesStacks)
+            f (addr, v.size, v.stack);
+          else
+            f (addr, v, StackDepot::NoStack);
+        });
+      }
+    }
+
+    /// @brief Starts the background thread that applies the events of the Deferred policy.
+    /// Without it the events are still applied, by the threads whose ring is full and by the queries.
+    /// @return false if it is already running or cannot be created.
+    static inline bool startConsumer() {
+      static_assert (Defers, "only the Deferred policy has a consumer");
+      return Pipeline::start();
+    }
+
+    /// @brief Stops the background thread of the Deferred policy and applies the pending events.
+    static inline void stopConsumer() {
+      static_assert (Defers, "only the Deferred policy has a consumer");
+      Pipeline::stop();
+    }
+
+    /// @brief Applies the pending events of the Deferred policy (does nothing for the other policies).
+    static inline void flush() {
+      if constexpr (Defers)
+        Pipeline::barrier();
+    }
+
+    /// @brief Sets the mean number of bytes between samples of the Sampled storage policy.
+    /// @param bytes The mean number of bytes between samples (0 records every allocation).
+    static inline void setSamplingInterval (size_t bytes) {
+      Sampler::setInterval (bytes);
     }
 
   private:
-    static HashMapPtr<void, size_t, Allocator> _mem;   ///< A HashMap for tracking allocated memory.
-    static ListPtr<size_t, Allocator> _allocatedBytes; ///< A List for counting allocated bytes.
-    static Mutex _mutex;                               ///< A mutex to make code thread-safe.
+    /// @brief Returns a block to the allocator, through its sized entry points when it has them and the size is known.
+    static inline void release (void *raw, size_t size, size_t alignment) {
+      if constexpr (requires { Allocator::free_sized (raw, size); Allocator::free_aligned_sized (raw, alignment, size); }) {
+        if (size != 0) {
+          if (alignment != 0)
+            Allocator::free_aligned_sized (raw, alignment, size);
+          else
+            Allocator::free_sized (raw, size);
+
+          return;
+        }
+      }
+
+      Allocator::free (raw);
+    }
+
+    /// @brief Writes the header of a new raw block and adds its size to the counters.
+    /// A block whose header cannot be recorded (see InBandHeader::attach) is returned as is, without a header: it
+    /// is large enough, it is freed straight to the allocator, and it is not counted.
+    static inline void * attach (void *raw, size_t offset, size_t size) {
+      const auto user { InBandHeader::attach (raw, offset, size) };
+      if (user == nullptr)
+        return raw;
+
+      increase (size);
+
+      return user;
+    }
+
+    /// @brief Records a new block in the table and adds its size to the counters.
+    /// With the Sampled policy only sampled blocks are recorded, with their weight instead of their size.
+    /// With Block values the call stack is captured as well.
+    static inline void track (void *addr, size_t size) {
+      if constexpr (Sampling) {
+        size = Sampler::sample (size);
+        if (size == 0)
+          return;
+      }
+
+      if constexpr (Defers) {
+        defer (Event::Alloc, addr, size, CapturesStacks ? StackDepot::capture (size) : StackDepot::NoStack);
+        return;
+      }
+      else if constexpr (CapturesStacks) {
+        const auto stack { StackDepot::capture (size) };
+        if (!_mem.add (addr, Block { size, stack })) {
+          StackDepot::release (stack, size);
+          return;
+        }
+      }
+      else {
+        if (!_mem.add (addr, size_t { size }))
+          return;
+      }
+
+      // only the blocks in the table are counted, since the others are not found when they are freed.
+      increase (size);
+    }
+
+    /// @brief Counts a reallocation (its free and its allocation are counted on their own).
+    static inline void resized() {
+      auto &t { threadCounters() };
+      if (t.trackers != 0)
+        ++t.counters.reallocations;
+
+      if (_trackers.load (std::memory_order_relaxed) != 0)
+        Counters::reallocated();
+    }
+
+    /// @brief Subtracts the size of a block that is no longer in the table from the counters.
+    static inline void untrack (const Value &v) {
+      if constexpr (CapturesStacks) {
+        StackDepot::release (v.stack, v.size);
+        decrease (v.size);
+      }
+      else {
+        decrease (v);
+      }
+    }
+
+    using Counters = DeltaCounters<MemoryInspector>;  ///< The global counters, buffered per thread.
+    using Sizes = HistogramCounters<MemoryInspector>; ///< The global counters per size class, sharded per thread.
+
+    /// @brief The counters of a thread.
+    struct ThreadCounters {
+      size_t trackers;   ///< The number of trackers registered by the thread.
+      Snapshot counters; ///< The counters of the thread while it had trackers.
+    };
+
+    /// @brief Applies the events of the Deferred policy; the counters of each thread live in its ring.
+    struct Consumer {
+      using Context = ThreadCounters;
+
+      static inline void apply (const Event &e, ThreadCounters &owner) {
+        MemoryInspector::apply (e, owner);
+      }
+    };
+
+    using Pipeline = EventPipeline<Consumer>; ///< The events of the Deferred policy.
+
+    /// @brief Gets the counters of the current thread.
+    static inline ThreadCounters & threadCounters() {
+      if constexpr (Defers)
+        return Pipeline::context();
+      else
+        return _thread;
+    }
+
+    /// @brief Gets the flags of the events pushed by the current thread.
+    static inline uint16_t threadFlags() {
+      return Pipeline::context().trackers != 0 ? Event::Threaded : 0;
+    }
+
+    /// @brief Pushes the event of a single-step operation.
+    static inline void defer (uint16_t op, void *addr, size_t size, uint32_t stack) {
+      const auto time { Pipeline::reserve() };
+      Pipeline::push (Event { time, reinterpret_cast<uintptr_t> (addr), size, stack, op, threadFlags() });
+      Pipeline::commit();
+    }
+
+    /// @brief Applies an event to the table and the counters.
+    /// It runs on the thread that drains the pipeline, so the counters of the thread that pushed the event are
+    /// updated through its ring, if it had trackers when the event was pushed.
+    static void apply (const Event &e, ThreadCounters &owner) {
+      const auto ptr { reinterpret_cast<void *> (e.addr) };
+      size_t size { e.size };
+
+      if (e.op == Event::Alloc) {
+        if constexpr (CapturesStacks) {
+          if (!_mem.add (ptr, Block { size, e.stack })) {
+            StackDepot::release (e.stack, size);
+            return;
+          }
+        }
+        else {
+          if (!_mem.add (ptr, size_t { size }))
+            return;
+        }
+
+        if ((e.flags & Event::Threaded) != 0) {
+          owner.counters.allocated += size;
+          ++owner.counters.allocations;
+        }
+
+        if (_trackers.load (std::memory_order_relaxed) != 0) {
+          Counters::allocated (size);
+          if constexpr (!Sampling)
+            Sizes::allocated (size);
+        }
+      }
+      else {
+        const auto old { _mem.remove (ptr) };
+        if (!old)
+          return;
+
+        if constexpr (CapturesStacks) {
+          StackDepot::release (old->stack, old->size);
+          size = old->size;
+        }
+        else {
+          size = *old;
+        }
+
+        if ((e.flags & Event::Threaded) != 0) {
+          owner.counters.freed += size;
+          ++owner.counters.frees;
+        }
+
+        if (_trackers.load (std::memory_order_relaxed) != 0) {
+          Counters::freed (size);
+          if constexpr (!Sampling)
+            Sizes::freed (size);
+        }
+      }
+    }
+
+    /// @brief Counts an allocation.
+    /// Each counter is only updated while it has trackers, so the hooks cost nothing more when nobody tracks.
+    static inline void increase (size_t size) {
+      auto &t { _thread };
+      if (t.trackers != 0) {
+        t.counters.allocated += size;
+        ++t.counters.allocations;
+      }
+
+      if (_trackers.load (std::memory_order_relaxed) != 0) {
+        Counters::allocated (size);
+        if constexpr (!Sampling)
+          Sizes::allocated (size);
+      }
+    }
+
+    /// @brief Counts a free.
+    static inline void decrease (size_t size) {
+      auto &t { _thread };
+      if (t.trackers != 0) {
+        t.counters.freed += size;
+        ++t.counters.frees;
+      }
+
+      if (_trackers.load (std::memory_order_relaxed) != 0) {
+        Counters::freed (size);
+        if constexpr (!Sampling)
+          Sizes::freed (size);
+      }
+    }
+
+    alignas (MEMISPECT_CACHE_LINE_SIZE) static Storage _mem; ///< The table of live allocations (empty for InBandHeader and CountersOnly).
+    alignas (MEMISPECT_CACHE_LINE_SIZE) static std::atomic<size_t> _trackers; ///< The number of registered trackers.
+    static thread_local ThreadCounters _thread; ///< The counters of the current thread.
 };
 
-template<typename Allocator>
-HashMapPtr<void, size_t, Allocator> MemoryInspector<Allocator>::_mem {};
+template<typename Allocator, typename Storage>
+alignas (MEMISPECT_CACHE_LINE_SIZE) Storage MemoryInspector<Allocator, Storage>::_mem {};
 
-template<typename Allocator>
-ListPtr<size_t, Allocator> MemoryInspector<Allocator>::_allocatedBytes {};
+template<typename Allocator, typename Storage>
+alignas (MEMISPECT_CACHE_LINE_SIZE) std::atomic<size_t> MemoryInspector<Allocator, Storage>::_trackers { 0 };
 
-template<typename Allocator>
-Mutex MemoryInspector<Allocator>::_mutex {};
+template<typename Allocator, typename Storage>
+thread_local typename MemoryInspector<Allocator, Storage>::ThreadCounters MemoryInspector<Allocator, Storage>::_thread {};
 
 }
 
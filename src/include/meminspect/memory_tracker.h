@@ -5,33 +5,144 @@
 // ----------------------------------------------------------------------------
 #ifndef __MEM_INSPECT_MEMORY_TRACKER_H__
 #define __MEM_INSPECT_MEMORY_TRACKER_H__
+#include <utility>
+
 #include <meminspect/memory_hook.h>
 #include <meminspect/memory_inspector.h>
+#include <meminspect/stats_segment.h>
 
 
 namespace meminspect {
 
+/// @brief The counters of a MemoryTracker, since it was created.
+struct TrackerStats {
+  size_t liveBytes;      ///< The net bytes allocated (see MemoryTracker::getAllocatedBytes).
+  size_t peakBytes;      ///< The peak of the net bytes (see MemoryTracker::getPeakBytes).
+  size_t allocatedBytes; ///< The bytes allocated.
+  size_t freedBytes;     ///< The bytes freed.
+  size_t allocations;    ///< The number of allocations.
+  size_t frees;          ///< The number of frees.
+  size_t reallocations;  ///< The number of reallocations (each one is also counted as a free and an allocation).
+};
+
 /// @brief This class is a part of the meminspect C++ library, designed for measuring memory usage in your C++ applications.
+/// The tracker keeps a snapshot of the global byte counters taken when it is created, so any number of trackers
+/// can be alive without slowing down the allocations. Its peak is kept in an epoch of the high-water marks of the
+/// global counters, and only the newest epoch is raised by the allocations (see MemoryInspector::addPeak).
+/// A HistogramTracker also counts the allocations per size class.
 class MemoryTracker {
   public:
     /// @brief Constructor for MemoryTracker.
     /// Initializes the memory tracker and registers the memory usage with the MemoryInspector.
-    inline MemoryTracker() noexcept {
-      MemoryInspector<DefaultAllocator>::add (&_bytes);
+    inline MemoryTracker() noexcept : _baseline { DefaultInspector::add (_peak) } {
+      // empty
+    }
+
+    /// @brief Constructor for a named MemoryTracker.
+    /// The counters of the tracker are published under its name in the stats segment (see StatsPublisher).
+    /// @param name The name of the tracker.
+    inline explicit MemoryTracker (const char *name) noexcept : MemoryTracker() {
+      _slot = StatsPublisher<DefaultInspector>::attach (name, _baseline, _peak);
     }
 
     /// @brief Destructor for MemoryTracker.
     /// Unregisters the memory usage from the MemoryInspector.
     inline ~MemoryTracker() noexcept {
-      MemoryInspector<DefaultAllocator>::remove (&_bytes);
+      StatsPublisher<DefaultInspector>::detach (_slot);
+      DefaultInspector::removePeak (_peak);
+      DefaultInspector::remove();
     }
 
+    MemoryTracker (const MemoryTracker &) = delete;
+    MemoryTracker & operator= (const MemoryTracker &) = delete;
+
     /// @brief Get the number of allocated bytes (heap).
     /// @return The total number of allocated bytes.
-    inline size_t getAllocatedBytes() { return _bytes; }
+    inline size_t getAllocatedBytes() { return DefaultInspector::bytesSince (_baseline); }
+
+    /// @brief Get the peak of the number of allocated bytes since the tracker was created, or since resetPeak().
+    /// It catches the memory allocated and freed between two reads, e.g. the temporary buffers of a function.
+    /// @return The highest number of allocated bytes (relative to the creation of the tracker).
+    inline size_t getPeakBytes() { return DefaultInspector::peakSince (_baseline, _peak); }
+
+    /// @brief Restarts the peak from the current number of allocated bytes, e.g. at the start of each stage of a pipeline.
+    inline void resetPeak() {
+      const auto peak { DefaultInspector::addPeak() };
+      StatsPublisher<DefaultInspector>::resetPeak (_slot, peak);
+      DefaultInspector::removePeak (std::exchange (_peak, peak));
+    }
+
+    /// @brief Get every counter of the tracker.
+    inline TrackerStats getStats() {
+      const auto now { DefaultInspector::snapshot() };
+
+      return TrackerStats {
+        now.since (_baseline),
+        DefaultInspector::peakSince (_baseline, _peak),
+        now.allocated - _baseline.allocated,
+        now.freed - _baseline.freed,
+        now.allocations - _baseline.allocations,
+        now.frees - _baseline.frees,
+        now.reallocations - _baseline.reallocations
+      };
+    }
+
+  private:
+    DefaultInspector::PeakEpoch *_peak { nullptr }; //< The epoch of the peak of the tracker (set with the baseline).
+    Snapshot _baseline;                             //< The global counters when the tracker was created.
+    int _slot { -1 };                               //< The slot of the tracker in the stats segment, or -1 if it is not named.
+};
+
+/// @brief A MemoryTracker that also counts the allocations and frees per size class.
+/// It keeps the size histogram taken when it is created (about 8 KiB), and taking it sums the shards of every thread,
+/// so only the trackers that need getHistogram() pay for it.
+class HistogramTracker : public MemoryTracker {
+  public:
+    /// @brief Constructor for HistogramTracker.
+    inline HistogramTracker() noexcept : _sizes { DefaultInspector::histogram() } {
+      // empty
+    }
+
+    /// @brief Constructor for a named HistogramTracker (see MemoryTracker).
+    /// @param name The name of the tracker.
+    inline explicit HistogramTracker (const char *name) noexcept : MemoryTracker { name }, _sizes { DefaultInspector::histogram() } {
+      // empty
+    }
+
+    /// @brief Get the allocations and frees per size class since the tracker was created (see SizeHistogram).
+    inline SizeHistogram getHistogram() { return DefaultInspector::histogram().since (_sizes); }
+
+  private:
+    SizeHistogram _sizes; //< The size histogram when the tracker was created.
+};
+
+/// @brief A MemoryTracker that only counts the allocations made by the thread that created it.
+/// Blocks freed by the thread are subtracted even if another thread allocated them, so the count is the net
+/// allocation of the thread while the tracker is alive. Updates take no lock and cost nothing to other threads.
+/// The tracker must be read and destroyed on the thread that created it.
+class ThreadMemoryTracker {
+  public:
+    /// @brief Constructor for ThreadMemoryTracker.
+    /// Registers the tracker with the counters of the current thread.
+    inline ThreadMemoryTracker() noexcept : _baseline { DefaultInspector::addThread() } {
+      // empty
+    }
+
+    /// @brief Destructor for ThreadMemoryTracker.
+    /// Unregisters the tracker from the counters of the current thread.
+    inline ~ThreadMemoryTracker() noexcept {
+      DefaultInspector::removeThread();
+    }
+
+    ThreadMemoryTracker (const ThreadMemoryTracker &) = delete;
+    ThreadMemoryTracker & operator= (const ThreadMemoryTracker &) = delete;
+
+    /// @brief Get the number of bytes allocated by the thread (heap).
+    /// @return The number of allocated bytes.
+    inline size_t getAllocatedBytes() { return DefaultInspector::threadBytesSince (_baseline); }
 
   private:
-    size_t _bytes { 0 }; //< The number of allocated bytes.
+    Snapshot _baseline; //< The counters of the thread when the tracker was created.
 };
 
 }
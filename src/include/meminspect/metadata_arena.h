@@ -0,0 +1,250 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_METADATA_ARENA_H__
+#define __MEM_INSPECT_METADATA_ARENA_H__
+#include <sys/mman.h>
+#include <unistd.h>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include <meminspect/mutex.h>
+
+// the size of the regions of the arena (a multiple of the huge page size, 2 MiB on x86-64 and most aarch64 kernels).
+#ifndef MEMISPECT_ARENA_REGION_SIZE
+  #define MEMISPECT_ARENA_REGION_SIZE (2 * 1024 * 1024)
+#endif
+
+// 1 backs the regions with transparent huge pages (`madvise (MADV_HUGEPAGE)`), 2 tries explicit huge pages
+// (`MAP_HUGETLB`, which need pages reserved in /proc/sys/vm/nr_hugepages) first, 0 uses regular pages.
+#ifndef MEMISPECT_ARENA_HUGE_PAGES
+  #define MEMISPECT_ARENA_HUGE_PAGES 1
+#endif
+
+
+namespace meminspect {
+
+/// @brief The footprint of the MetadataArena, i.e. the memory that meminspect uses for itself.
+struct ArenaFootprint {
+  size_t mappedBytes { 0 };   ///< The bytes mapped by the arena (regions and large blocks).
+  size_t usedBytes { 0 };     ///< The bytes of the live blocks (rounded up to their size class, or to pages).
+  size_t freeBytes { 0 };     ///< The bytes of the free blocks kept for reuse.
+  size_t hugePageBytes { 0 }; ///< The bytes mapped with, or advised to use, huge pages (see MEMISPECT_ARENA_HUGE_PAGES).
+  size_t regions { 0 };       ///< The number of regions.
+  size_t largeBlocks { 0 };   ///< The number of live blocks mapped on their own.
+};
+
+/// @brief Arena of the internal storage of meminspect: the buckets of the tables, the slabs of the NodePool and the
+/// rings of the EventPipeline and the TraceRecorder.
+/// It maps its memory with `mmap`, so the metadata never fragments the heap being measured nor takes the locks of
+/// its allocator, and footprint() tells how much memory the tracking itself uses.
+/// Blocks are carved from regions of MEMISPECT_ARENA_REGION_SIZE bytes, aligned to their size so they can be backed
+/// by huge pages (see MEMISPECT_ARENA_HUGE_PAGES): the tables are probed at random, so fewer TLB misses pay off.
+/// Sizes are rounded up to a power of two (64 bytes at least, so blocks are cache-line aligned), and freed blocks are
+/// kept in a free list per size for reuse. Blocks larger than an eighth of a region are mapped on their own, and
+/// unmapped when they are freed. Allocations are rare (a slab or a table resize), so a lock is enough.
+class MetadataArena {
+  static_assert ((MEMISPECT_ARENA_REGION_SIZE & (MEMISPECT_ARENA_REGION_SIZE - 1)) == 0, "the size of the regions must be a power of two");
+
+  public:
+    static constexpr size_t MinSize { 64 };                                ///< The smallest block (and its alignment).
+    static constexpr size_t RegionSize { MEMISPECT_ARENA_REGION_SIZE };    ///< The size of a region.
+    static constexpr size_t MaxSize { RegionSize / 8 };                    ///< The largest block carved from a region.
+
+    /// @brief Allocates a block. The block is not zero-filled, unless it is a new large block.
+    /// @param size The size of the block.
+    /// @return The block (aligned to 64 bytes), or nullptr if no memory can be mapped.
+    static void * alloc (size_t size) {
+      if (size > MaxSize)
+        return allocLarge (size);
+
+      const auto c { sizeClass (size) };
+      const auto bytes { MinSize << c };
+
+      std::lock_guard<Mutex> guard { _mutex };
+
+      auto block { _free[c] };
+      if (block != nullptr) {
+        _free[c] = block->next;
+        _footprint.freeBytes -= bytes;
+      }
+      else {
+        if (static_cast<size_t> (_end - _bump) < bytes) {
+          if (!mapRegion())
+            return nullptr;
+        }
+
+        block = reinterpret_cast<FreeBlock *> (_bump);
+        _bump += bytes;
+      }
+
+      _footprint.usedBytes += bytes;
+
+      return block;
+    }
+
+    /// @brief Returns a block to the arena.
+    /// @param p The block, or nullptr.
+    /// @param size The size it was allocated with.
+    static void free (void *p, size_t size) {
+      if (p == nullptr)
+        return;
+
+      if (size > MaxSize) {
+        freeLarge (p, size);
+        return;
+      }
+
+      const auto c { sizeClass (size) };
+      const auto bytes { MinSize << c };
+
+      std::lock_guard<Mutex> guard { _mutex };
+
+      const auto block { static_cast<FreeBlock *> (p) };
+      block->next = _free[c];
+      _free[c] = block;
+
+      _footprint.usedBytes -= bytes;
+      _footprint.freeBytes += bytes;
+    }
+
+    /// @brief Gets the footprint of the arena, to subtract the overhead of the tracking from what is measured.
+    static ArenaFootprint footprint() {
+      std::lock_guard<Mutex> guard { _mutex };
+
+      auto f { _footprint };
+      // the rest of the current region is free as well.
+      f.freeBytes += static_cast<size_t> (_end - _bump);
+
+      return f;
+    }
+
+  private:
+    static constexpr size_t Classes { std::countr_zero (MaxSize / MinSize) + 1 }; ///< The number of size classes.
+
+    /// @brief A free block of a free list.
+    struct FreeBlock {
+      FreeBlock *next; ///< The next free block.
+    };
+
+    /// @brief Gets the size class of a block: its size is `MinSize << class`.
+    static inline size_t sizeClass (size_t size) {
+      return size <= MinSize ? 0 : static_cast<size_t> (std::bit_width ((size - 1) / MinSize));
+    }
+
+    /// @brief Gets the size of a page.
+    static inline size_t pageSize() {
+      static const auto size { static_cast<size_t> (sysconf (_SC_PAGESIZE)) };
+      return size;
+    }
+
+    /// @brief Maps a region aligned to its size, and makes it the current one.
+    /// The rest of the previous region is split into blocks for the free lists. Called with the lock held.
+    /// @return false if the region cannot be mapped.
+    static bool mapRegion() {
+      void *region { MAP_FAILED };
+      bool huge { false };
+
+      if constexpr (MEMISPECT_ARENA_HUGE_PAGES == 2) {
+        // explicit huge pages are aligned to their size.
+        region = ::mmap (nullptr, RegionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge = region != MAP_FAILED;
+      }
+
+      if (region == MAP_FAILED) {
+        // mapped with room to spare, and trimmed to an aligned region.
+        const auto m { ::mmap (nullptr, RegionSize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) };
+        if (m == MAP_FAILED)
+          return false;
+
+        const auto base { reinterpret_cast<uintptr_t> (m) };
+        const auto aligned { (base + RegionSize - 1) & ~(RegionSize - 1) };
+        if (aligned > base)
+          ::munmap (m, aligned - base);
+        if (aligned + RegionSize < base + (RegionSize * 2))
+          ::munmap (reinterpret_cast<void *> (aligned + RegionSize), base + (RegionSize * 2) - aligned - RegionSize);
+
+        region = reinterpret_cast<void *> (aligned);
+
+        if constexpr (MEMISPECT_ARENA_HUGE_PAGES != 0) {
+          ::madvise (region, RegionSize, MADV_HUGEPAGE);
+          huge = true;
+        }
+      }
+
+      // the rest of the current region goes to the free lists, largest blocks first.
+      while (static_cast<size_t> (_end - _bump) >= MinSize) {
+        const auto rest { static_cast<size_t> (_end - _bump) };
+        // smaller than the block that did not fit, so within the classes.
+        const auto c { static_cast<size_t> (std::bit_width (rest / MinSize)) - 1 };
+        const auto bytes { MinSize << c };
+
+        const auto block { reinterpret_cast<FreeBlock *> (_bump) };
+        block->next = _free[c];
+        _free[c] = block;
+
+        _footprint.freeBytes += bytes;
+        _bump += bytes;
+      }
+
+      _bump = static_cast<char *> (region);
+      _end = _bump + RegionSize;
+
+      _footprint.mappedBytes += RegionSize;
+      _footprint.hugePageBytes += huge ? RegionSize : 0;
+      ++_footprint.regions;
+
+      return true;
+    }
+
+    /// @brief Maps a large block on its own.
+    static void * allocLarge (size_t size) {
+      const auto bytes { (size + pageSize() - 1) & ~(pageSize() - 1) };
+
+      const auto m { ::mmap (nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) };
+      if (m == MAP_FAILED)
+        return nullptr;
+
+      const auto huge { (MEMISPECT_ARENA_HUGE_PAGES != 0) && (bytes >= RegionSize) };
+      if (huge)
+        ::madvise (m, bytes, MADV_HUGEPAGE);
+
+      std::lock_guard<Mutex> guard { _mutex };
+
+      _footprint.mappedBytes += bytes;
+      _footprint.usedBytes += bytes;
+      _footprint.hugePageBytes += huge ? bytes : 0;
+      ++_footprint.largeBlocks;
+
+      return m;
+    }
+
+    /// @brief Unmaps a large block.
+    static void freeLarge (void *p, size_t size) {
+      const auto bytes { (size + pageSize() - 1) & ~(pageSize() - 1) };
+
+      ::munmap (p, bytes);
+
+      std::lock_guard<Mutex> guard { _mutex };
+
+      _footprint.mappedBytes -= bytes;
+      _footprint.usedBytes -= bytes;
+      if ((MEMISPECT_ARENA_HUGE_PAGES != 0) && (bytes >= RegionSize))
+        _footprint.hugePageBytes -= bytes;
+      --_footprint.largeBlocks;
+    }
+
+    static inline Mutex _mutex {};                    ///< Protects the arena.
+    static inline char *_bump { nullptr };            ///< The next free byte of the current region.
+    static inline char *_end { nullptr };             ///< The end of the current region.
+    static inline FreeBlock *_free[Classes] {};       ///< The free blocks of each size class.
+    static inline ArenaFootprint _footprint {};       ///< The footprint (without the rest of the current region).
+};
+
+}
+
+#endif
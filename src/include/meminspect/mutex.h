@@ -0,0 +1,171 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_MUTEX_H__
+#define __MEM_INSPECT_MUTEX_H__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef MEMISPECT_MUTEX_SPIN
+  #define MEMISPECT_MUTEX_SPIN 100
+#endif
+
+#ifndef MEMISPECT_MUTEX_MAX_BACKOFF
+  #define MEMISPECT_MUTEX_MAX_BACKOFF 64
+#endif
+
+
+namespace meminspect {
+
+/// @brief Tells the CPU the thread is spinning (lowers the power and the cost of leaving the loop).
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile ("yield" ::: "memory");
+#else
+  std::atomic_signal_fence (std::memory_order_seq_cst);
+#endif
+}
+
+/// @brief Acquisition and contention statistics of a Mutex.
+struct MutexStats {
+  size_t acquisitions { 0 }; ///< The number of times the mutex was locked.
+  size_t contentions { 0 };  ///< The acquisitions that found the mutex locked.
+  size_t spins { 0 };        ///< The pause iterations spent waiting.
+  size_t sleeps { 0 };       ///< The times a thread slept in the kernel waiting for the mutex.
+
+  /// @brief Merges the statistics of another mutex (e.g. another shard).
+  /// @param other The statistics to merge.
+  /// @return Reference to the modified statistics.
+  inline MutexStats & operator+= (const MutexStats &other) {
+    acquisitions += other.acquisitions;
+    contentions += other.contentions;
+    spins += other.spins;
+    sleeps += other.sleeps;
+
+    return *this;
+  }
+};
+
+/// @brief This class is a synchronization primitive that can be used to protect shared data from being simultaneously accessed by multiple threads.
+/// An uncontended lock is a single CAS. A contended one spins with test-and-test-and-set and exponential backoff
+/// for up to MEMISPECT_MUTEX_SPIN attempts, and then sleeps on a futex, so a preempted owner does not make the
+/// waiters burn their time slices. The statistics are updated by the owner while it holds the lock, so they cost
+/// no atomic read-modify-write.
+class Mutex {
+  public:
+    /// @brief Locks the mutex.
+    inline void lock() {
+      uint32_t expected { Unlocked };
+      if (!_state.compare_exchange_strong (expected, Locked, std::memory_order_acquire, std::memory_order_relaxed)) {
+        lockSlow();
+        return;
+      }
+
+      count (_acquisitions, 1);
+    }
+
+    /// @brief Tries to lock the mutex without waiting.
+    /// @return true if the mutex was locked.
+    inline bool try_lock() {
+      uint32_t expected { Unlocked };
+      if (!_state.compare_exchange_strong (expected, Locked, std::memory_order_acquire, std::memory_order_relaxed))
+        return false;
+
+      count (_acquisitions, 1);
+
+      return true;
+    }
+
+    /// @brief Unlocks the mutex.
+    inline void unlock() {
+      if (_state.exchange (Unlocked, std::memory_order_release) == Sleeping)
+        futex (FUTEX_WAKE_PRIVATE, 1);
+    }
+
+    /// @brief Gets the statistics of the mutex.
+    /// They are read without locking, so they may lag behind the current owner.
+    inline MutexStats stats() const {
+      return {
+        _acquisitions.load (std::memory_order_relaxed),
+        _contentions.load (std::memory_order_relaxed),
+        _spins.load (std::memory_order_relaxed),
+        _sleeps.load (std::memory_order_relaxed)
+      };
+    }
+
+  private:
+    static constexpr uint32_t Unlocked { 0 }; ///< Nobody holds the mutex.
+    static constexpr uint32_t Locked { 1 };   ///< Held, and nobody sleeps on it.
+    static constexpr uint32_t Sleeping { 2 }; ///< Held, and waiters may sleep on it (unlock must wake one).
+
+    /// @brief Waits for the mutex: spins first, then sleeps.
+    void lockSlow() {
+      size_t spins { 0 };
+      size_t sleeps { 0 };
+      uint32_t backoff { 1 };
+
+      for (size_t attempt = 0; attempt < MEMISPECT_MUTEX_SPIN; ++attempt) {
+        // test before test-and-set, so the waiters read a shared line instead of bouncing it.
+        if (_state.load (std::memory_order_relaxed) == Unlocked) {
+          uint32_t expected { Unlocked };
+          if (_state.compare_exchange_weak (expected, Locked, std::memory_order_acquire, std::memory_order_relaxed)) {
+            acquired (spins, sleeps);
+            return;
+          }
+        }
+
+        for (uint32_t i = 0; i < backoff; ++i)
+          cpuRelax();
+
+        spins += backoff;
+        if (backoff < MEMISPECT_MUTEX_MAX_BACKOFF)
+          backoff <<= 1;
+      }
+
+      // from now on the mutex is marked as having sleepers, so the owner wakes one of them on unlock.
+      while (_state.exchange (Sleeping, std::memory_order_acquire) != Unlocked) {
+        futex (FUTEX_WAIT_PRIVATE, Sleeping);
+        ++sleeps;
+      }
+
+      acquired (spins, sleeps);
+    }
+
+    /// @brief Updates the statistics of a contended acquisition (the mutex must be held).
+    inline void acquired (size_t spins, size_t sleeps) {
+      count (_acquisitions, 1);
+      count (_contentions, 1);
+      count (_spins, spins);
+      count (_sleeps, sleeps);
+    }
+
+    /// @brief Adds to a statistic (the mutex must be held).
+    static inline void count (std::atomic<size_t> &counter, size_t n) {
+      counter.store (counter.load (std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    /// @brief Calls futex on the state of the mutex.
+    inline void futex (int op, uint32_t value) {
+      syscall (SYS_futex, reinterpret_cast<uint32_t *> (&_state), op, value, nullptr, nullptr, 0);
+    }
+
+    static_assert (sizeof (std::atomic<uint32_t>) == sizeof (uint32_t), "the futex must be the state itself");
+
+    std::atomic<uint32_t> _state { Unlocked };    ///< Unlocked, Locked or Sleeping.
+    std::atomic<size_t> _acquisitions { 0 };      ///< The number of acquisitions.
+    std::atomic<size_t> _contentions { 0 };       ///< The contended acquisitions.
+    std::atomic<size_t> _spins { 0 };             ///< The pause iterations spent waiting.
+    std::atomic<size_t> _sleeps { 0 };            ///< The sleeps in the kernel.
+};
+
+}
+
+#endif
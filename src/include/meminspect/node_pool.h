@@ -0,0 +1,172 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_NODE_POOL_H__
+#define __MEM_INSPECT_NODE_POOL_H__
+#include <pthread.h>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+
+#include <meminspect/metadata_arena.h>
+#include <meminspect/mutex.h>
+
+#ifndef MEMISPECT_POOL_SLAB_SIZE
+  #define MEMISPECT_POOL_SLAB_SIZE (64 * 1024)
+#endif
+
+#ifndef MEMISPECT_POOL_MAGAZINE_SIZE
+  #define MEMISPECT_POOL_MAGAZINE_SIZE 64
+#endif
+
+
+namespace meminspect {
+
+/// @brief Pool of fixed-size blocks used for the nodes of the internal containers.
+/// Blocks are carved from slabs of the MetadataArena, so they never go through the allocator being tracked.
+/// Each thread keeps a magazine of free blocks, and only touches the shared free list (under a lock)
+/// to refill or drain half of its magazine. Magazines are returned to the shared list when their thread exits.
+/// Slabs are never returned to the arena: freed blocks are kept for reuse.
+/// @tparam Size The size of a block.
+/// @tparam Align The alignment of a block.
+template<size_t Size, size_t Align=alignof (std::max_align_t)>
+class NodePool {
+  static_assert ((Align & (Align - 1)) == 0, "the alignment must be a power of two");
+  static_assert (Align <= MetadataArena::MinSize, "the slabs are only aligned to MetadataArena::MinSize");
+
+  public:
+    /// @brief Allocates a block.
+    /// @return A pointer to the block, or nullptr if a new slab cannot be mapped.
+    static inline void * alloc() {
+      auto &m { _magazine };
+
+      if (m.count == 0)
+        refill (m);
+
+      return m.count > 0 ? m.items[--m.count] : nullptr;
+    }
+
+    /// @brief Returns a block to the pool.
+    /// @param p A pointer returned by alloc(), or nullptr.
+    static inline void free (void *p) {
+      if (p == nullptr)
+        return;
+
+      auto &m { _magazine };
+
+      if (m.count == MEMISPECT_POOL_MAGAZINE_SIZE)
+        drain (m, MEMISPECT_POOL_MAGAZINE_SIZE / 2);
+
+      m.items[m.count++] = p;
+    }
+
+    /// @brief Gets the number of bytes of the slabs of the pool.
+    static inline size_t mappedBytes() {
+      return _mappedBytes.load (std::memory_order_relaxed);
+    }
+
+  private:
+    static constexpr size_t BlockSize { ((Size < sizeof (void *) ? sizeof (void *) : Size) + Align - 1) & ~(Align - 1) };
+
+    /// @brief A free block of the shared free list.
+    struct FreeBlock {
+      FreeBlock *next; ///< The next free block.
+    };
+
+    /// @brief The per-thread cache of free blocks.
+    struct Magazine {
+      void *items[MEMISPECT_POOL_MAGAZINE_SIZE]; ///< The cached blocks.
+      size_t count;                              ///< The number of cached blocks.
+      bool registered;                           ///< Whether the thread-exit callback is armed.
+    };
+
+    /// @brief Fills half of a magazine from the shared free list, carving a new slab when it is empty.
+    static void refill (Magazine &m) {
+      if (!m.registered) {
+        // set first: pthread_setspecific may allocate, which comes back here (with the lock of a table held).
+        m.registered = true;
+        // a non-null value makes pthread call `release` when the thread exits.
+        pthread_setspecific (key(), &m);
+      }
+
+      std::lock_guard<Mutex> guard { _mutex };
+
+      while (m.count < MEMISPECT_POOL_MAGAZINE_SIZE / 2) {
+        if (_free != nullptr) {
+          m.items[m.count++] = std::exchange (_free, _free->next);
+          continue;
+        }
+
+        if (_bump == _end) {
+          const auto slab { MetadataArena::alloc (MEMISPECT_POOL_SLAB_SIZE) };
+          if (slab == nullptr)
+            return;
+
+          _mappedBytes.fetch_add (MEMISPECT_POOL_SLAB_SIZE, std::memory_order_relaxed);
+          _bump = static_cast<char *> (slab);
+          _end = _bump + ((MEMISPECT_POOL_SLAB_SIZE / BlockSize) * BlockSize);
+        }
+
+        m.items[m.count++] = std::exchange (_bump, _bump + BlockSize);
+      }
+    }
+
+    /// @brief Moves blocks from a magazine to the shared free list.
+    static void drain (Magazine &m, size_t count) {
+      std::lock_guard<Mutex> guard { _mutex };
+
+      for (size_t i = 0; (i < count) && (m.count > 0); ++i) {
+        const auto b { static_cast<FreeBlock *> (m.items[--m.count]) };
+        b->next = _free;
+        _free = b;
+      }
+    }
+
+    /// @brief Thread-exit callback that gives the magazine of the thread back to the shared free list.
+    static void release (void *m) {
+      const auto magazine { static_cast<Magazine *> (m) };
+
+      drain (*magazine, MEMISPECT_POOL_MAGAZINE_SIZE);
+
+      // re-armed if other thread-exit callbacks still allocate nodes.
+      magazine->registered = false;
+    }
+
+    /// @brief Gets the key used to be notified of thread exits.
+    static pthread_key_t key() {
+      static const pthread_key_t k { [] () { pthread_key_t k {}; pthread_key_create (&k, &release); return k; } () };
+      return k;
+    }
+
+    static thread_local Magazine _magazine;  ///< The magazine of the current thread.
+    static Mutex _mutex;                     ///< Protects the shared free list and the current slab.
+    static FreeBlock *_free;                 ///< The shared free list.
+    static char *_bump;                      ///< The next unused block of the current slab.
+    static char *_end;                       ///< The end of the current slab.
+    static std::atomic<size_t> _mappedBytes; ///< The number of bytes mapped by the pool.
+};
+
+template<size_t Size, size_t Align>
+thread_local typename NodePool<Size, Align>::Magazine NodePool<Size, Align>::_magazine {};
+
+template<size_t Size, size_t Align>
+Mutex NodePool<Size, Align>::_mutex {};
+
+template<size_t Size, size_t Align>
+typename NodePool<Size, Align>::FreeBlock * NodePool<Size, Align>::_free { nullptr };
+
+template<size_t Size, size_t Align>
+char * NodePool<Size, Align>::_bump { nullptr };
+
+template<size_t Size, size_t Align>
+char * NodePool<Size, Align>::_end { nullptr };
+
+template<size_t Size, size_t Align>
+std::atomic<size_t> NodePool<Size, Align>::_mappedBytes { 0 };
+
+}
+
+#endif
@@ -0,0 +1,138 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_SAMPLER_H__
+#define __MEM_INSPECT_SAMPLER_H__
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#ifndef MEMISPECT_SAMPLING_INTERVAL
+  #define MEMISPECT_SAMPLING_INTERVAL (512 * 1024)
+#endif
+
+
+namespace meminspect {
+
+/// @brief Poisson sampler of allocated bytes.
+/// Each thread counts down the bytes left until its next sample. The distance between samples is drawn from an
+/// exponential distribution with a mean of `interval()` bytes, so every allocated byte has the same probability of
+/// being sampled and a block of `size` bytes is sampled with probability `1 - exp(-size / interval)`.
+/// A sampled block is given the weight `size / (1 - exp(-size / interval))`, which keeps the estimated totals unbiased.
+class Sampler {
+  public:
+    /// @brief Decides whether an allocation is sampled.
+    /// The fast path is a single decrement and branch on thread-local state.
+    /// @param size The size of the allocation.
+    /// @return The weight of the allocation if it is sampled, or 0 otherwise.
+    static inline size_t sample (size_t size) {
+      auto &s { _state };
+
+      s.left -= static_cast<int64_t> (size);
+      if (s.left > 0)
+        return 0;
+
+      return next (s, size);
+    }
+
+    /// @brief Sets the mean number of bytes between samples.
+    /// The calling thread uses the new interval at once, other threads after their next sample.
+    /// An interval of 0 samples every allocation.
+    /// @param bytes The mean number of bytes between samples.
+    static inline void setInterval (size_t bytes) {
+      _interval.store (bytes, std::memory_order_relaxed);
+
+      // the countdown is drawn again on the next allocation, from a new seed.
+      _state = {};
+    }
+
+    /// @brief Gets the mean number of bytes between samples.
+    static inline size_t interval() {
+      return _interval.load (std::memory_order_relaxed);
+    }
+
+  private:
+    /// @brief The sampling state of a thread.
+    struct State {
+      int64_t left;  ///< The bytes left until the next sample.
+      uint64_t rng;  ///< The state of the random generator (0 until the first allocation of the thread).
+    };
+
+    /// @brief Slow path: takes the sample and draws the distance to the next one.
+    static size_t next (State &s, size_t size) {
+      const auto mean { static_cast<double> (interval()) };
+
+      if (s.rng == 0) {
+        // first allocation of the thread, or after setInterval: the countdown has not been drawn yet.
+        s.rng = seed (reinterpret_cast<uintptr_t> (&s)) | 1;
+        s.left = draw (s, mean) - static_cast<int64_t> (size);
+        if (s.left > 0)
+          return 0;
+      }
+
+      // the exponential distribution is memoryless, so the overshoot of the previous countdown is dropped.
+      s.left = draw (s, mean);
+
+      if ((size == 0) || (mean <= 0))
+        return size;
+
+      const auto weight { static_cast<double> (size) / -std::expm1 (-static_cast<double> (size) / mean) };
+      return static_cast<size_t> (weight + 0.5);
+    }
+
+    /// @brief Makes the seed of a thread.
+    /// The address of its state tells the threads apart, and a global counter makes each seed of a thread differ
+    /// from the previous ones, so resetting the state does not repeat the same samples.
+    static uint64_t seed (uint64_t address) {
+      // splitmix64
+      auto z { address + ((_seeds.fetch_add (1, std::memory_order_relaxed) + 1) * UINT64_C (0x9E3779B97F4A7C15)) };
+      z = (z ^ (z >> 30)) * UINT64_C (0xBF58476D1CE4E5B9);
+      z = (z ^ (z >> 27)) * UINT64_C (0x94D049BB133111EB);
+
+      return z ^ (z >> 31);
+    }
+
+    /// @brief Draws the number of bytes until the next sample.
+    static int64_t draw (State &s, double mean) {
+      // xorshift64*
+      s.rng ^= s.rng >> 12;
+      s.rng ^= s.rng << 25;
+      s.rng ^= s.rng >> 27;
+
+      // uniform in (0, 1], from the high 53 bits.
+      const auto u { static_cast<double> (((s.rng * UINT64_C (0x2545F4914F6CDD1D)) >> 11) + 1) * 0x1.0p-53 };
+
+      return static_cast<int64_t> (-std::log (u) * mean) + 1;
+    }
+
+    static inline thread_local State _state {};                                ///< The sampling state of the current thread.
+    static inline std::atomic<size_t> _interval { MEMISPECT_SAMPLING_INTERVAL }; ///< The mean number of bytes between samples.
+    static inline std::atomic<uint64_t> _seeds { 0 };                            ///< The number of seeds made.
+};
+
+/// @brief Storage policy of MemoryInspector that only records sampled allocations in a table.
+/// Allocations are sampled with Sampler, and each sampled block is stored with its weight instead of its size, so
+/// the tracker counters hold an unbiased estimate of the live bytes. Frees of unsampled blocks only cost a miss in
+/// the table, so a table with lock-free lookups (OpenHashMapPtr) is a good fit: it stays sparse, since only a small
+/// fraction of the live blocks are sampled.
+/// @tparam Table The table of sampled blocks (pointer to weight).
+template<typename Table>
+class Sampled : public Table {
+  public:
+    using Table::Table;
+};
+
+/// @brief Checks whether a storage policy is Sampled.
+template<typename T>
+struct IsSampled : std::false_type {};
+
+template<typename Table>
+struct IsSampled<Sampled<Table>> : std::true_type {};
+
+}
+
+#endif
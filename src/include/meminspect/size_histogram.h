@@ -0,0 +1,247 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_SIZE_HISTOGRAM_H__
+#define __MEM_INSPECT_SIZE_HISTOGRAM_H__
+#include <pthread.h>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+#include <meminspect/metadata_arena.h>
+#include <meminspect/mutex.h>
+
+// the number of sub-buckets of each power of two (a power of two): 4 splits [1 KiB, 2 KiB) in steps of 256 bytes.
+#ifndef MEMISPECT_HISTOGRAM_SUB_BUCKETS
+  #define MEMISPECT_HISTOGRAM_SUB_BUCKETS 4
+#endif
+
+
+namespace meminspect {
+
+/// @brief The allocations and frees per size class.
+/// The classes are log-linear: each power of two is split into MEMISPECT_HISTOGRAM_SUB_BUCKETS sub-buckets of the
+/// same width, and the sizes below `2 * SubBuckets` have a class of their own. With 4 sub-buckets the classes of
+/// [64, 128) are [64, 80), [80, 96), [96, 112) and [112, 128), close to the size classes of jemalloc and tcmalloc.
+/// A histogram holds monotonic counters, so the histogram of a tracker is the difference with the one taken when
+/// it was created (see since()).
+struct SizeHistogram {
+  static_assert (std::has_single_bit (static_cast<size_t> (MEMISPECT_HISTOGRAM_SUB_BUCKETS)), "the sub-buckets must be a power of two");
+
+  static constexpr size_t SubBuckets { MEMISPECT_HISTOGRAM_SUB_BUCKETS };               ///< The classes of a power of two.
+  static constexpr size_t SubBits { std::countr_zero (SubBuckets) };                    ///< The bits of a sub-bucket.
+  static constexpr size_t Buckets { (64 - SubBits + 1) * SubBuckets };                  ///< The number of classes.
+
+  /// @brief The counters of a size class.
+  struct Bucket {
+    uint64_t allocations;    ///< The number of allocations.
+    uint64_t frees;          ///< The number of frees.
+    uint64_t allocatedBytes; ///< The bytes allocated.
+    uint64_t freedBytes;     ///< The bytes freed.
+
+    /// @brief Gets the blocks still allocated (negative when a tracker frees more than it allocates).
+    inline int64_t liveBlocks() const { return static_cast<int64_t> (allocations - frees); }
+
+    /// @brief Gets the bytes still allocated (negative when a tracker frees more than it allocates).
+    inline int64_t liveBytes() const { return static_cast<int64_t> (allocatedBytes - freedBytes); }
+  };
+
+  std::array<Bucket, Buckets> buckets {}; ///< The counters of each class.
+
+  /// @brief Gets the class of a size.
+  static constexpr size_t bucket (size_t size) {
+    if (size < 2 * SubBuckets)
+      return size;
+
+    const auto shift { static_cast<size_t> (std::bit_width (size)) - 1 - SubBits };
+    return ((shift + 1) * SubBuckets) + ((size >> shift) - SubBuckets);
+  }
+
+  /// @brief Gets the smallest size of a class.
+  static constexpr size_t lowerBound (size_t bucket) {
+    if (bucket < 2 * SubBuckets)
+      return bucket;
+
+    const auto shift { (bucket / SubBuckets) - 1 };
+    return ((bucket % SubBuckets) + SubBuckets) << shift;
+  }
+
+  /// @brief Gets the largest size of a class.
+  static constexpr size_t upperBound (size_t bucket) {
+    return bucket + 1 < Buckets ? lowerBound (bucket + 1) - 1 : SIZE_MAX;
+  }
+
+  /// @brief Gets the counters since a baseline (e.g. the histogram of a tracker).
+  /// @param baseline The older histogram.
+  SizeHistogram since (const SizeHistogram &baseline) const {
+    SizeHistogram h;
+    for (size_t i = 0; i < Buckets; ++i) {
+      const auto &b { buckets[i] };
+      const auto &o { baseline.buckets[i] };
+      h.buckets[i] = { b.allocations - o.allocations, b.frees - o.frees, b.allocatedBytes - o.allocatedBytes, b.freedBytes - o.freedBytes };
+    }
+
+    return h;
+  }
+
+  /// @brief Calls a function for every class with allocations or frees.
+  /// @param f The function, called with the smallest and largest sizes of the class and its counters.
+  template<typename F>
+  void forEach (F &&f) const {
+    for (size_t i = 0; i < Buckets; ++i) {
+      const auto &b { buckets[i] };
+      if ((b.allocations != 0) || (b.frees != 0))
+        f (lowerBound (i), upperBound (i), b);
+    }
+  }
+};
+
+/// @brief Counters of a SizeHistogram shared by all threads, kept in per-thread shards.
+/// Each thread counts in a shard of its own, with relaxed loads and stores that no other thread writes, so an
+/// update never takes a lock nor bounces a cache line between cores. The shards come from the MetadataArena, so they
+/// are not counted in the heap being measured. Reads sum the shards of every thread, and the shard of a thread is
+/// merged into the retired counters when the thread exits.
+/// @tparam Tag Distinguishes independent histograms (e.g. one per MemoryInspector).
+template<typename Tag>
+class HistogramCounters {
+  public:
+    /// @brief Counts an allocation.
+    /// @param size The size of the block.
+    static inline void allocated (size_t size) {
+      const auto s { shard() };
+      if (s == nullptr)
+        return;
+
+      auto &b { s->buckets[SizeHistogram::bucket (size)] };
+      add (b.allocations, 1);
+      add (b.allocatedBytes, size);
+    }
+
+    /// @brief Counts a free.
+    /// @param size The size of the block.
+    static inline void freed (size_t size) {
+      const auto s { shard() };
+      if (s == nullptr)
+        return;
+
+      auto &b { s->buckets[SizeHistogram::bucket (size)] };
+      add (b.frees, 1);
+      add (b.freedBytes, size);
+    }
+
+    /// @brief Reads the histogram, including the shards of the live threads.
+    static SizeHistogram read() {
+      std::lock_guard<Mutex> guard { _mutex };
+
+      auto h { _retired };
+      for (auto *s = _shards; s != nullptr; s = s->next)
+        merge (h, *s);
+
+      return h;
+    }
+
+  private:
+    /// @brief A counter of a shard (only its thread writes it).
+    using Counter = std::atomic<uint64_t>;
+
+    /// @brief The counters of a class in a shard.
+    struct Bucket {
+      Counter allocations;    ///< The number of allocations.
+      Counter frees;          ///< The number of frees.
+      Counter allocatedBytes; ///< The bytes allocated.
+      Counter freedBytes;     ///< The bytes freed.
+    };
+
+    /// @brief The counters of a thread.
+    struct Shard {
+      Bucket buckets[SizeHistogram::Buckets]; ///< The counters of each class.
+      Shard *next;                            ///< The next shard of the registry.
+    };
+
+    /// @brief Adds to a counter of the shard of the current thread.
+    static inline void add (Counter &c, uint64_t n) {
+      c.store (c.load (std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    /// @brief Gets the shard of the current thread, creating it on first use.
+    /// @return The shard, or nullptr if it cannot be allocated (the update is dropped).
+    static inline Shard * shard() {
+      const auto s { _shard };
+      return s != nullptr ? s : enroll();
+    }
+
+    /// @brief Creates the shard of the current thread, adds it to the registry and arms its thread-exit merge.
+    static Shard * enroll() {
+      const auto m { MetadataArena::alloc (sizeof (Shard)) };
+      if (m == nullptr)
+        return nullptr;
+
+      const auto s { new (m) Shard {} };
+
+      {
+        std::lock_guard<Mutex> guard { _mutex };
+        s->next = _shards;
+        _shards = s;
+      }
+
+      // set first: pthread_setspecific may allocate, which comes back here.
+      _shard = s;
+      pthread_setspecific (key(), s);
+
+      return s;
+    }
+
+    /// @brief Adds the counters of a shard to a histogram.
+    static inline void merge (SizeHistogram &h, const Shard &s) {
+      for (size_t i = 0; i < SizeHistogram::Buckets; ++i) {
+        auto &b { h.buckets[i] };
+        const auto &o { s.buckets[i] };
+        b.allocations += o.allocations.load (std::memory_order_relaxed);
+        b.frees += o.frees.load (std::memory_order_relaxed);
+        b.allocatedBytes += o.allocatedBytes.load (std::memory_order_relaxed);
+        b.freedBytes += o.freedBytes.load (std::memory_order_relaxed);
+      }
+    }
+
+    /// @brief Thread-exit callback that merges the shard of the thread into the retired counters and frees it.
+    static void release (void *p) {
+      const auto s { static_cast<Shard *> (p) };
+
+      {
+        std::lock_guard<Mutex> guard { _mutex };
+        merge (_retired, *s);
+
+        for (auto **it = &_shards; *it != nullptr; it = &(*it)->next) {
+          if (*it == s) {
+            *it = s->next;
+            break;
+          }
+        }
+      }
+
+      // created again if other thread-exit callbacks still allocate.
+      _shard = nullptr;
+      MetadataArena::free (s, sizeof (Shard));
+    }
+
+    /// @brief Gets the key used to be notified of thread exits.
+    static pthread_key_t key() {
+      static const pthread_key_t k { [] () { pthread_key_t k {}; pthread_key_create (&k, &release); return k; } () };
+      return k;
+    }
+
+    static inline thread_local Shard *_shard { nullptr }; ///< The shard of the current thread.
+    static inline Mutex _mutex {};                        ///< Protects the registry and the retired counters.
+    static inline Shard *_shards { nullptr };             ///< The registry of shards.
+    static inline SizeHistogram _retired {};              ///< The counters of the threads that exited.
+};
+
+}
+
+#endif
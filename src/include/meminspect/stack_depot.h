@@ -0,0 +1,320 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_STACK_DEPOT_H__
+#define __MEM_INSPECT_STACK_DEPOT_H__
+#include <pthread.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include <meminspect/mutex.h>
+
+#ifndef MEMISPECT_STACK_DEPTH
+  #define MEMISPECT_STACK_DEPTH 16
+#endif
+
+#ifndef MEMISPECT_STACK_DEPOT_SIZE
+  #define MEMISPECT_STACK_DEPOT_SIZE (64 * 1024 * 1024)
+#endif
+
+#ifndef MEMISPECT_STACK_DEPOT_BUCKETS
+  #define MEMISPECT_STACK_DEPOT_BUCKETS 65536
+#endif
+
+
+namespace meminspect {
+
+/// @brief The value stored for each live block when the allocation call stacks are captured.
+/// Use it as the value of the table of live allocations (e.g. `ShardedHashMapPtr<void, Block, Allocator>`).
+struct Block {
+  size_t size;    ///< The size of the block (its weight, with the Sampled policy).
+  uint32_t stack; ///< The id of the allocation call stack in the StackDepot, or StackDepot::NoStack.
+};
+
+/// @brief Deduplicated store of allocation call stacks.
+/// Stacks are captured by walking the frame-pointer chain, so they are only complete when the code is built with
+/// `-fno-omit-frame-pointer`. Each distinct stack is stored once (hash-consed) in an arena mapped with `mmap`, and
+/// is identified by a 32-bit id. Every stack keeps the bytes and blocks that are still live, so memory can be
+/// attributed to the code that allocated it. Lookups are lock-free; only the insertion of a new stack takes a lock.
+/// Stacks are never removed.
+class StackDepot {
+  static_assert ((MEMISPECT_STACK_DEPOT_BUCKETS & (MEMISPECT_STACK_DEPOT_BUCKETS - 1)) == 0, "the number of buckets must be a power of two");
+  static_assert (MEMISPECT_STACK_DEPOT_SIZE / 8 <= UINT32_MAX, "the ids of the stacks must fit in 32 bits");
+
+  public:
+    static constexpr uint32_t NoStack { 0 }; ///< The id of an unknown stack.
+
+    /// @brief A stack stored in the depot, followed by its frames.
+    class Stack {
+      public:
+        /// @brief Gets the id of the stack.
+        inline uint32_t id() const { return _id; }
+
+        /// @brief Gets the number of frames.
+        inline size_t depth() const { return _depth; }
+
+        /// @brief Gets the return addresses, innermost first.
+        inline const uintptr_t * frames() const { return reinterpret_cast<const uintptr_t *> (this + 1); }
+
+        /// @brief Gets the bytes allocated from this stack that are still live.
+        inline size_t liveBytes() const { return _liveBytes.load (std::memory_order_relaxed); }
+
+        /// @brief Gets the number of blocks allocated from this stack that are still live.
+        inline size_t liveBlocks() const { return _liveBlocks.load (std::memory_order_relaxed); }
+
+      private:
+        friend class StackDepot;
+
+        std::atomic<uint32_t> _next { NoStack };  ///< The next stack of the bucket.
+        uint32_t _hash { 0 };                     ///< The hash of the frames.
+        uint32_t _depth { 0 };                    ///< The number of frames.
+        uint32_t _id { NoStack };                 ///< The id of the stack.
+        std::atomic<size_t> _liveBytes { 0 };     ///< The live bytes.
+        std::atomic<size_t> _liveBlocks { 0 };    ///< The live blocks.
+    };
+
+    /// @brief Marks the frame of an entry point of the hooks, so the stacks captured below it start at its caller
+    /// instead of spending frames on the hooks and the inspector.
+    /// Only the outermost scope of a thread counts: the stack of the `malloc` called by `operator new` starts at
+    /// the caller of `operator new`.
+    class Caller {
+      public:
+        /// @brief Marks a frame.
+        /// @param frame The frame of the entry point (`__builtin_frame_address (0)`).
+        explicit Caller (void *frame) : _outermost { _thread.caller == nullptr } {
+          if (_outermost)
+            _thread.caller = static_cast<uintptr_t *> (frame);
+        }
+
+        ~Caller() {
+          if (_outermost)
+            _thread.caller = nullptr;
+        }
+
+        Caller (const Caller &) = delete;
+        Caller & operator= (const Caller &) = delete;
+
+      private:
+        bool _outermost; ///< Whether this scope marked the frame.
+    };
+
+    /// @brief Captures the call stack of the caller and accounts a new block to it.
+    /// Under a Caller scope the stack starts at the caller of the marked frame, otherwise at the caller of this
+    /// function. Allocations made while a stack is being captured (e.g. by pthread) get NoStack instead of
+    /// recursing.
+    /// @param size The size of the block.
+    /// @return The id of the stack, or NoStack if it cannot be captured or stored.
+    static __attribute__ ((noinline)) uint32_t capture (size_t size) {
+      auto &t { _thread };
+      if (t.busy)
+        return NoStack;
+
+      t.busy = true;
+
+      uintptr_t frames[MEMISPECT_STACK_DEPTH];
+      const auto fp { t.caller != nullptr ? t.caller : static_cast<uintptr_t *> (__builtin_frame_address (0)) };
+      const auto depth { unwind (t, fp, frames) };
+
+      const auto s { intern (frames, depth) };
+      if (s != nullptr) {
+        s->_liveBytes.fetch_add (size, std::memory_order_relaxed);
+        s->_liveBlocks.fetch_add (1, std::memory_order_relaxed);
+      }
+
+      t.busy = false;
+
+      return s != nullptr ? s->_id : NoStack;
+    }
+
+    /// @brief Accounts the release of a block.
+    /// @param id The id of the stack of the block.
+    /// @param size The size of the block.
+    static inline void release (uint32_t id, size_t size) {
+      if (id == NoStack)
+        return;
+
+      auto s { at (id) };
+      s->_liveBytes.fetch_sub (size, std::memory_order_relaxed);
+      s->_liveBlocks.fetch_sub (1, std::memory_order_relaxed);
+    }
+
+    /// @brief Gets a stack.
+    /// @param id The id of the stack.
+    /// @return The stack, or nullptr for NoStack.
+    static inline const Stack * get (uint32_t id) {
+      return id != NoStack ? at (id) : nullptr;
+    }
+
+    /// @brief Calls a function for every stack of the depot, in insertion order.
+    /// Stacks added while the depot is walked may be skipped.
+    /// @param f The function, called with a `const Stack &`.
+    template<typename F>
+    static void forEach (F &&f) {
+      const auto used { _used.load (std::memory_order_acquire) };
+      const auto arena { _arena.load (std::memory_order_relaxed) };
+
+      for (size_t offset = First; offset < used; ) {
+        const auto s { reinterpret_cast<const Stack *> (arena + offset) };
+        f (*s);
+
+        offset += bytes (s->_depth);
+      }
+    }
+
+    /// @brief Gets the number of bytes of the arena used by the stacks.
+    static inline size_t usedBytes() {
+      const auto used { _used.load (std::memory_order_relaxed) };
+      return used > First ? used - First : 0;
+    }
+
+  private:
+    static constexpr size_t Granularity { 8 };        ///< The ids are offsets in the arena, in units of 8 bytes.
+    static constexpr size_t First { sizeof (Stack) }; ///< The offset of the first stack (offset 0 is NoStack).
+
+    static_assert (sizeof (Stack) % Granularity == 0, "stacks must keep the alignment of the arena");
+
+    /// @brief The capture state of a thread.
+    struct ThreadState {
+      bool busy;          ///< Whether the thread is capturing a stack.
+      uintptr_t stackTop; ///< The highest address of the stack of the thread (0 until the first capture).
+      uintptr_t *caller;  ///< The frame marked by the outermost Caller scope, or nullptr.
+    };
+
+    /// @brief Gets the bytes taken by a stack in the arena.
+    static inline size_t bytes (size_t depth) {
+      return sizeof (Stack) + (depth * sizeof (uintptr_t));
+    }
+
+    /// @brief Gets the stack at an id.
+    static inline Stack * at (uint32_t id) {
+      return reinterpret_cast<Stack *> (_arena.load (std::memory_order_relaxed) + (static_cast<size_t> (id) * Granularity));
+    }
+
+    /// @brief Walks the frame-pointer chain from a frame, whose return address is the first one stored.
+    /// The walk stops at the first frame pointer that does not move towards the base of the stack, leaves it, or
+    /// is misaligned, so code built without frame pointers yields a short stack instead of a crash.
+    static size_t unwind (ThreadState &t, uintptr_t *fp, uintptr_t *frames) {
+      if (t.stackTop == 0)
+        t.stackTop = stackTop();
+
+      size_t depth { 0 };
+
+      while (depth < MEMISPECT_STACK_DEPTH) {
+        const auto ret { fp[1] };
+        if (ret == 0)
+          break;
+
+        frames[depth++] = ret;
+
+        const auto next { reinterpret_cast<uintptr_t *> (fp[0]) };
+        if ((next <= fp) || (reinterpret_cast<uintptr_t> (next + 2) > t.stackTop) || ((reinterpret_cast<uintptr_t> (next) % alignof (uintptr_t)) != 0))
+          break;
+
+        fp = next;
+      }
+
+      return depth;
+    }
+
+    /// @brief Gets the highest address of the stack of the current thread.
+    static uintptr_t stackTop() {
+      pthread_attr_t attr;
+      if (pthread_getattr_np (pthread_self(), &attr) != 0)
+        return 0;
+
+      void *addr { nullptr };
+      size_t size { 0 };
+      pthread_attr_getstack (&attr, &addr, &size);
+      pthread_attr_destroy (&attr);
+
+      return reinterpret_cast<uintptr_t> (addr) + size;
+    }
+
+    /// @brief Computes the hash of a stack.
+    static inline uint32_t hash (const uintptr_t *frames, size_t depth) {
+      uint64_t h { depth };
+      for (size_t i = 0; i < depth; ++i)
+        h = (h ^ frames[i]) * UINT64_C (0x9E3779B97F4A7C15);
+
+      return static_cast<uint32_t> (h ^ (h >> 32));
+    }
+
+    /// @brief Finds a stack in the chain of a bucket.
+    static inline Stack * find (uint32_t id, uint32_t h, const uintptr_t *frames, size_t depth) {
+      while (id != NoStack) {
+        const auto s { at (id) };
+        if ((s->_hash == h) && (s->_depth == depth) && (std::memcmp (s->frames(), frames, depth * sizeof (uintptr_t)) == 0))
+          return s;
+
+        id = s->_next.load (std::memory_order_acquire);
+      }
+
+      return nullptr;
+    }
+
+    /// @brief Gets the stored copy of a stack, storing it if it is new.
+    static Stack * intern (const uintptr_t *frames, size_t depth) {
+      const auto h { hash (frames, depth) };
+      auto &bucket { _buckets[h & (MEMISPECT_STACK_DEPOT_BUCKETS - 1)] };
+
+      if (const auto s { find (bucket.load (std::memory_order_acquire), h, frames, depth) }; s != nullptr)
+        return s;
+
+      std::lock_guard<Mutex> guard { _mutex };
+
+      // another thread may have stored the stack in the meantime.
+      const auto head { bucket.load (std::memory_order_relaxed) };
+      if (const auto s { find (head, h, frames, depth) }; s != nullptr)
+        return s;
+
+      auto arena { _arena.load (std::memory_order_relaxed) };
+      if (arena == nullptr) {
+        // the pages are only backed by memory once they are written.
+        const auto m { ::mmap (nullptr, MEMISPECT_STACK_DEPOT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0) };
+        if (m == MAP_FAILED)
+          return nullptr;
+
+        arena = static_cast<char *> (m);
+        _arena.store (arena, std::memory_order_relaxed);
+        _used.store (First, std::memory_order_release);
+      }
+
+      const auto offset { _used.load (std::memory_order_relaxed) };
+      if (offset + bytes (depth) > MEMISPECT_STACK_DEPOT_SIZE)
+        return nullptr;
+
+      const auto s { new (arena + offset) Stack {} };
+      s->_next.store (head, std::memory_order_relaxed);
+      s->_hash = h;
+      s->_depth = static_cast<uint32_t> (depth);
+      s->_id = static_cast<uint32_t> (offset / Granularity);
+      std::memcpy (reinterpret_cast<uintptr_t *> (s + 1), frames, depth * sizeof (uintptr_t));
+
+      _used.store (offset + bytes (depth), std::memory_order_release);
+      bucket.store (s->_id, std::memory_order_release);
+
+      return s;
+    }
+
+    static inline thread_local ThreadState _thread {};                                ///< The capture state of the current thread.
+    static inline std::atomic<uint32_t> _buckets[MEMISPECT_STACK_DEPOT_BUCKETS] {};   ///< The first stack of each bucket.
+    static inline std::atomic<char *> _arena { nullptr };                            ///< The arena of the stacks.
+    static inline std::atomic<size_t> _used { 0 };                                   ///< The bytes of the arena in use.
+    static inline Mutex _mutex {};                                                   ///< Serializes the insertion of stacks.
+};
+
+/// @brief A Caller scope that marks nothing, for the hooks of inspectors that do not capture stacks.
+struct NoCaller {
+  explicit constexpr NoCaller (void *) {}
+};
+
+}
+
+#endif
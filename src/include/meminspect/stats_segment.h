@@ -0,0 +1,565 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_STATS_SEGMENT_H__
+#define __MEM_INSPECT_STATS_SEGMENT_H__
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <meminspect/delta_counters.h>
+#include <meminspect/mutex.h>
+#include <meminspect/size_histogram.h>
+
+// the directory of the segments (a tmpfs, so they are never written to disk).
+#ifndef MEMISPECT_STATS_DIR
+  #define MEMISPECT_STATS_DIR "/dev/shm"
+#endif
+
+// the number of named trackers a segment can publish.
+#ifndef MEMISPECT_STATS_TRACKERS
+  #define MEMISPECT_STATS_TRACKERS 64
+#endif
+
+// the microseconds between two updates of a segment.
+#ifndef MEMISPECT_STATS_INTERVAL_US
+  #define MEMISPECT_STATS_INTERVAL_US 10000
+#endif
+
+// the attempts of a reader to copy a segment while it is being updated.
+#ifndef MEMISPECT_STATS_READ_RETRIES
+  #define MEMISPECT_STATS_READ_RETRIES 10000
+#endif
+
+
+namespace meminspect {
+
+/// @brief The counters published for the whole process or for a tracker.
+struct StatsCounters {
+  uint64_t allocated;     ///< The bytes allocated.
+  uint64_t freed;         ///< The bytes freed.
+  uint64_t allocations;   ///< The number of allocations.
+  uint64_t frees;         ///< The number of frees.
+  uint64_t reallocations; ///< The number of reallocations (each one is also counted as a free and an allocation).
+  uint64_t liveBytes;     ///< The net bytes allocated.
+  uint64_t peakBytes;     ///< The peak of the net bytes.
+};
+
+/// @brief The header of a stats segment, followed by its sections: the named trackers and the size histogram.
+/// Every field after `sequence` is written under a seqlock: `sequence` is odd while the segment is updated, and a
+/// reader that sees the same even value before and after copying the fields has a consistent copy.
+struct StatsSegmentHeader {
+  static constexpr char Magic[8] { 'M', 'E', 'M', 'S', 'T', 'A', 'T', 'S' };
+  static constexpr uint32_t Version { 2 };
+
+  char magic[8];             ///< Magic.
+  uint32_t version;          ///< Version.
+  uint32_t pid;              ///< The process that publishes the segment.
+  uint32_t trackers;         ///< The number of tracker slots.
+  uint32_t trackerSize;      ///< The size of a tracker slot.
+  uint64_t trackersOffset;   ///< The offset of the tracker slots.
+  uint32_t histogramBuckets; ///< The number of buckets of the size histogram (0 when the inspector keeps none).
+  uint32_t reserved;
+  uint64_t histogramOffset;  ///< The offset of the size histogram.
+  uint64_t sequence;         ///< The seqlock.
+  uint64_t time;             ///< The wall-clock time of the last update, in nanoseconds since the epoch.
+  uint64_t updates;          ///< The number of updates.
+  StatsCounters global;      ///< The counters of the process.
+};
+
+/// @brief A tracker slot of a stats segment.
+struct StatsSegmentTracker {
+  char name[48];          ///< The name of the tracker (empty when the slot is free).
+  StatsCounters counters; ///< The counters of the tracker.
+};
+
+/// @brief A size class of the histogram of a stats segment (see SizeHistogram).
+struct StatsHistogramBucket {
+  uint64_t lowerBound;     ///< The smallest size of the class (written once, when the segment is created).
+  uint64_t upperBound;     ///< The largest size of the class (written once, when the segment is created).
+  uint64_t allocations;    ///< The number of allocations.
+  uint64_t frees;          ///< The number of frees.
+  uint64_t allocatedBytes; ///< The bytes allocated.
+  uint64_t freedBytes;     ///< The bytes freed.
+};
+
+/// @brief A consistent copy of a stats segment.
+struct StatsSample {
+  /// @brief A named tracker.
+  struct Tracker {
+    std::string name;       ///< The name of the tracker.
+    StatsCounters counters; ///< The counters of the tracker.
+  };
+
+  uint32_t pid { 0 };             ///< The process that publishes the segment.
+  uint64_t time { 0 };            ///< The wall-clock time of the update, in nanoseconds since the epoch.
+  uint64_t updates { 0 };         ///< The number of updates.
+  StatsCounters global {};        ///< The counters of the process.
+  std::vector<Tracker> trackers;  ///< The named trackers.
+  std::vector<StatsHistogramBucket> histogram; ///< The size classes of the process with allocations or frees.
+};
+
+/// @brief Gets the path of a stats segment.
+/// @param name The name of the segment, or nullptr for the default one of the current process (`meminspect.<pid>`).
+inline std::string statsSegmentPath (const char *name) {
+  if (name != nullptr)
+    return std::string { MEMISPECT_STATS_DIR } + "/" + name;
+
+  return std::string { MEMISPECT_STATS_DIR } + "/meminspect." + std::to_string (::getpid());
+}
+
+/// @brief Checks whether the process that published a segment still runs.
+/// @param pid The pid of the publisher.
+inline bool statsPublisherAlive (uint32_t pid) {
+  return (::kill (static_cast<pid_t> (pid), 0) == 0) || (errno == EPERM);
+}
+
+/// @brief Publishes the counters of an inspector, and of its named trackers, into a shared-memory segment
+/// (a file of MEMISPECT_STATS_DIR), so other processes can poll them without calling into the process.
+/// A background thread refreshes the segment every MEMISPECT_STATS_INTERVAL_US microseconds: the hooks never
+/// touch it, and readers only map it read-only, so polling costs the process nothing. The counters only run while
+/// the inspector has trackers, so the publisher registers one and the global counters (and their peak) start with it.
+/// @tparam Inspector The MemoryInspector whose counters are published (e.g. DefaultInspector).
+template<typename Inspector>
+class StatsPublisher {
+  public:
+    /// @brief Creates the segment and starts the thread that updates it.
+    /// @param name The name of the segment, or nullptr for `meminspect.<pid>`.
+    /// @return false if it is already running, or the segment or the thread cannot be created.
+    static bool start (const char *name = nullptr) {
+      std::lock_guard<Mutex> guard { _mutex };
+      if (_segment != nullptr)
+        return false;
+
+      const auto path { statsSegmentPath (name) };
+      if (path.size() >= sizeof (_path))
+        return false;
+
+      const auto fd { create (path.c_str()) };
+      if (fd < 0)
+        return false;
+
+      const auto histogramOffset { sizeof (StatsSegmentHeader) + (MEMISPECT_STATS_TRACKERS * sizeof (StatsSegmentTracker)) };
+      const auto size { histogramOffset + (SizeHistogram::Buckets * sizeof (StatsHistogramBucket)) };
+      const auto m { ::ftruncate (fd, static_cast<off_t> (size)) == 0 ?
+        ::mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED };
+      ::close (fd);
+
+      if (m == MAP_FAILED) {
+        ::unlink (path.c_str());
+        return false;
+      }
+
+      // the file is zero-filled, so only the layout is written before the magic.
+      const auto h { static_cast<StatsSegmentHeader *> (m) };
+      h->version = StatsSegmentHeader::Version;
+      h->pid = static_cast<uint32_t> (::getpid());
+      h->trackers = MEMISPECT_STATS_TRACKERS;
+      h->trackerSize = sizeof (StatsSegmentTracker);
+      h->trackersOffset = sizeof (StatsSegmentHeader);
+      h->histogramBuckets = SizeHistogram::Buckets;
+      h->histogramOffset = histogramOffset;
+
+      const auto buckets { reinterpret_cast<StatsHistogramBucket *> (static_cast<char *> (m) + histogramOffset) };
+      for (size_t i = 0; i < SizeHistogram::Buckets; ++i) {
+        buckets[i].lowerBound = SizeHistogram::lowerBound (i);
+        buckets[i].upperBound = SizeHistogram::upperBound (i);
+      }
+
+      std::memcpy (h->magic, StatsSegmentHeader::Magic, sizeof (h->magic));
+
+      _segment = h;
+      _size = size;
+      std::memcpy (_path, path.c_str(), path.size() + 1);
+      _baseline = Inspector::add (_peak);
+      _sizes = Inspector::histogram();
+      update();
+
+      _stop.store (false, std::memory_order_relaxed);
+      if (pthread_create (&_thread, nullptr, &run, nullptr) != 0) {
+        close();
+        return false;
+      }
+
+      // registered after the tables were constructed, so the thread stops before they are destroyed.
+      static const bool stopAtExit { (std::atexit (&stop) == 0) && (pthread_atfork (nullptr, nullptr, &forked) == 0) };
+      (void) stopAtExit;
+
+      return true;
+    }
+
+    /// @brief Stops the thread and removes the segment.
+    static void stop() {
+      {
+        std::lock_guard<Mutex> guard { _mutex };
+        if ((_segment == nullptr) || _stop.exchange (true, std::memory_order_acq_rel))
+          return;
+      }
+
+      pthread_join (_thread, nullptr);
+
+      std::lock_guard<Mutex> guard { _mutex };
+      close();
+    }
+
+    /// @brief Updates the segment now (it does nothing when the publisher is not running).
+    static void publish() {
+      std::lock_guard<Mutex> guard { _mutex };
+      if (_segment != nullptr)
+        update();
+    }
+
+    /// @brief Publishes a named tracker (see MemoryTracker).
+    /// The name is copied, and truncated to fit its slot. Trackers are published while the publisher runs.
+    /// @param name The name of the tracker.
+    /// @param baseline The baseline of the tracker (returned by `Inspector::add()`).
+    /// @param peak The epoch of the peak of the tracker (returned by `Inspector::addPeak()`), or nullptr.
+    /// @return The slot of the tracker, or -1 if every slot is taken.
+    static int attach (const char *name, const Snapshot &baseline, typename Inspector::PeakEpoch *peak) {
+      std::lock_guard<Mutex> guard { _mutex };
+
+      for (int i = 0; i < MEMISPECT_STATS_TRACKERS; ++i) {
+        auto &t { _trackers[i] };
+        if (!t.used) {
+          std::strncpy (t.name, name, sizeof (t.name) - 1);
+          t.name[sizeof (t.name) - 1] = '\0';
+          t.baseline = baseline;
+          t.peak = peak;
+          t.used = true;
+          return i;
+        }
+      }
+
+      return -1;
+    }
+
+    /// @brief Stops publishing a named tracker.
+    /// @param slot The slot returned by attach(), or -1.
+    static void detach (int slot) {
+      if (slot < 0)
+        return;
+
+      std::lock_guard<Mutex> guard { _mutex };
+      _trackers[slot].used = false;
+    }
+
+    /// @brief Replaces the epoch of the peak of a named tracker (see MemoryTracker::resetPeak).
+    /// @param slot The slot returned by attach(), or -1.
+    /// @param peak The new epoch. The old one can be removed once the call returns.
+    static void resetPeak (int slot, typename Inspector::PeakEpoch *peak) {
+      if (slot < 0)
+        return;
+
+      std::lock_guard<Mutex> guard { _mutex };
+      _trackers[slot].peak = peak;
+    }
+
+  private:
+    /// @brief A named tracker.
+    struct Tracker {
+      char name[sizeof (StatsSegmentTracker::name)]; ///< The name.
+      Snapshot baseline;                             ///< The counters when the tracker was created.
+      typename Inspector::PeakEpoch *peak;           ///< The epoch of the peak of the tracker.
+      bool used;                                     ///< Whether the slot is taken.
+    };
+
+    /// @brief Fills the counters of a tracker from its baseline.
+    static inline void fill (StatsCounters &c, const Snapshot &now, const Snapshot &baseline, const typename Inspector::PeakEpoch *peak) {
+      c.allocated = now.allocated - baseline.allocated;
+      c.freed = now.freed - baseline.freed;
+      c.allocations = now.allocations - baseline.allocations;
+      c.frees = now.frees - baseline.frees;
+      c.reallocations = now.reallocations - baseline.reallocations;
+      c.liveBytes = now.since (baseline);
+      c.peakBytes = Inspector::peakSince (baseline, peak);
+    }
+
+    /// @brief Creates the file of a segment.
+    /// The segment left by a process that is gone (or by the program this process ran before an `exec`) is
+    /// replaced, but not the segment of another live process (e.g. of the parent of a process that inherited its name).
+    /// @return The file, or -1 if it cannot be created.
+    static int create (const char *path) {
+      for (int attempt = 0; attempt < 2; ++attempt) {
+        const auto fd { ::open (path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644) };
+        if ((fd >= 0) || (errno != EEXIST))
+          return fd;
+
+        StatsSegmentHeader h {};
+        const auto old { ::open (path, O_RDONLY | O_CLOEXEC) };
+        const auto read { (old >= 0) && (::pread (old, &h, sizeof (h), 0) == sizeof (h)) };
+        if (old >= 0)
+          ::close (old);
+
+        if (read && (std::memcmp (h.magic, StatsSegmentHeader::Magic, sizeof (h.magic)) == 0) && (h.pid != static_cast<uint32_t> (::getpid())) &&
+            statsPublisherAlive (h.pid))
+          return -1;
+
+        ::unlink (path);
+      }
+
+      return -1;
+    }
+
+    /// @brief Writes the counters to the segment, under the seqlock (the mutex must be held).
+    static void update() {
+      const auto now { Inspector::snapshot() };
+      const auto sizes { Inspector::histogram().since (_sizes) };
+
+      timespec ts {};
+      clock_gettime (CLOCK_REALTIME, &ts);
+
+      StatsCounters global {};
+      fill (global, now, _baseline, _peak);
+
+      auto &h { *_segment };
+      const auto trackers { reinterpret_cast<StatsSegmentTracker *> (reinterpret_cast<char *> (_segment) + h.trackersOffset) };
+      const auto buckets { reinterpret_cast<StatsHistogramBucket *> (reinterpret_cast<char *> (_segment) + h.histogramOffset) };
+
+      std::atomic_ref<uint64_t> sequence { h.sequence };
+      const auto seq { sequence.load (std::memory_order_relaxed) };
+      sequence.store (seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence (std::memory_order_release);
+
+      store (h.time, (static_cast<uint64_t> (ts.tv_sec) * 1000000000) + static_cast<uint64_t> (ts.tv_nsec));
+      store (h.updates, h.updates + 1);
+      store (h.global, global);
+
+      for (int i = 0; i < MEMISPECT_STATS_TRACKERS; ++i) {
+        auto &t { _trackers[i] };
+        auto &s { trackers[i] };
+
+        StatsCounters c {};
+        if (t.used)
+          fill (c, now, t.baseline, t.peak);
+
+        for (size_t j = 0; j < sizeof (s.name); ++j)
+          std::atomic_ref<char> { s.name[j] }.store (t.used ? t.name[j] : '\0', std::memory_order_relaxed);
+        store (s.counters, c);
+      }
+
+      for (size_t i = 0; i < SizeHistogram::Buckets; ++i) {
+        const auto &b { sizes.buckets[i] };
+        store (buckets[i].allocations, b.allocations);
+        store (buckets[i].frees, b.frees);
+        store (buckets[i].allocatedBytes, b.allocatedBytes);
+        store (buckets[i].freedBytes, b.freedBytes);
+      }
+
+      sequence.store (seq + 2, std::memory_order_release);
+    }
+
+    /// @brief Stores a field of the segment.
+    static inline void store (uint64_t &field, uint64_t value) {
+      std::atomic_ref<uint64_t> { field }.store (value, std::memory_order_relaxed);
+    }
+
+    /// @brief Stores counters of the segment.
+    static inline void store (StatsCounters &field, const StatsCounters &value) {
+      store (field.allocated, value.allocated);
+      store (field.freed, value.freed);
+      store (field.allocations, value.allocations);
+      store (field.frees, value.frees);
+      store (field.reallocations, value.reallocations);
+      store (field.liveBytes, value.liveBytes);
+      store (field.peakBytes, value.peakBytes);
+    }
+
+    /// @brief Unmaps and removes the segment, and unregisters the tracker of the publisher (the mutex must be held).
+    static void close() {
+      ::munmap (_segment, _size);
+      ::unlink (_path);
+      Inspector::removePeak (_peak);
+      Inspector::remove();
+
+      _segment = nullptr;
+      _path[0] = '\0';
+    }
+
+    /// @brief Fork callback: the child has no thread to update the segment of its parent, so it lets it go.
+    /// The child can start a publisher of its own.
+    static void forked() {
+      new (&_mutex) Mutex {};
+
+      // the epoch of the peak is left behind: the counters may have been locked by another thread of the parent.
+      if (_segment != nullptr) {
+        ::munmap (_segment, _size);
+        Inspector::remove();
+      }
+
+      _segment = nullptr;
+      _path[0] = '\0';
+    }
+
+    /// @brief Body of the thread that updates the segment.
+    static void * run (void *) {
+      const timespec interval { MEMISPECT_STATS_INTERVAL_US / 1000000, (MEMISPECT_STATS_INTERVAL_US % 1000000) * 1000 };
+
+      while (!_stop.load (std::memory_order_acquire)) {
+        publish();
+        nanosleep (&interval, nullptr);
+      }
+
+      return nullptr;
+    }
+
+    static inline Mutex _mutex {};                                  ///< Protects the segment and the trackers.
+    static inline StatsSegmentHeader *_segment { nullptr };         ///< The segment.
+    static inline size_t _size { 0 };                               ///< The size of the segment.
+    static inline char _path[256] {};                               ///< The path of the segment (not a string: it outlives the static destructors).
+    static inline Snapshot _baseline {};                            ///< The counters when the publisher started.
+    static inline typename Inspector::PeakEpoch *_peak { nullptr }; ///< The epoch of the peak of the process.
+    static inline SizeHistogram _sizes {};                          ///< The size histogram when the publisher started.
+    static inline Tracker _trackers[MEMISPECT_STATS_TRACKERS] {};   ///< The named trackers.
+    static inline pthread_t _thread {};                             ///< The thread that updates the segment.
+    static inline std::atomic<bool> _stop { false };                ///< Asks the thread to exit.
+};
+
+/// @brief Reads the stats segment of another process (or of this one).
+/// The segment is mapped read-only, so polling it, at any rate, never slows down the process that publishes it.
+class StatsReader {
+  public:
+    StatsReader() = default;
+
+    StatsReader (const StatsReader &) = delete;
+    StatsReader & operator= (const StatsReader &) = delete;
+
+    /// @brief Destructor: unmaps the segment.
+    ~StatsReader() {
+      close();
+    }
+
+    /// @brief Maps a segment (and unmaps the previous one).
+    /// @param name The name of the segment (see StatsPublisher::start).
+    /// @return false if the segment cannot be mapped or is not a stats segment.
+    bool open (const char *name) {
+      close();
+
+      const auto fd { ::open (statsSegmentPath (name).c_str(), O_RDONLY | O_CLOEXEC) };
+      if (fd < 0)
+        return false;
+
+      struct stat st {};
+      const auto m { (::fstat (fd, &st) == 0) && (static_cast<size_t> (st.st_size) >= sizeof (StatsSegmentHeader)) ?
+        ::mmap (nullptr, static_cast<size_t> (st.st_size), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED };
+      ::close (fd);
+
+      if (m == MAP_FAILED)
+        return false;
+
+      _segment = static_cast<const StatsSegmentHeader *> (m);
+      _size = static_cast<size_t> (st.st_size);
+
+      const auto &h { *_segment };
+      if ((std::memcmp (h.magic, StatsSegmentHeader::Magic, sizeof (h.magic)) != 0) || (h.version != StatsSegmentHeader::Version) ||
+          (h.trackerSize != sizeof (StatsSegmentTracker)) || (h.trackersOffset > _size) ||
+          (h.trackers > (_size - h.trackersOffset) / sizeof (StatsSegmentTracker)) || (h.histogramOffset > _size) ||
+          (h.histogramBuckets > (_size - h.histogramOffset) / sizeof (StatsHistogramBucket))) {
+        close();
+        return false;
+      }
+
+      return true;
+    }
+
+    /// @brief Unmaps the segment.
+    void close() {
+      if (_segment != nullptr)
+        ::munmap (const_cast<StatsSegmentHeader *> (_segment), _size);
+
+      _segment = nullptr;
+      _size = 0;
+    }
+
+    /// @brief Checks whether the process that publishes the segment still runs.
+    /// @return false if no segment is mapped, or if its publisher exited (the segment is stale).
+    bool alive() const {
+      return (_segment != nullptr) && statsPublisherAlive (_segment->pid);
+    }
+
+    /// @brief Copies the segment, retrying while it is being updated (up to MEMISPECT_STATS_READ_RETRIES times).
+    /// A publisher that died in the middle of an update leaves the segment torn for good: see alive().
+    /// @param sample The copy. Only the trackers in use, and the size classes with allocations or frees, are copied.
+    /// @return false if no segment is mapped, or if no consistent copy could be taken.
+    bool read (StatsSample &sample) const {
+      if (_segment == nullptr)
+        return false;
+
+      auto &h { const_cast<StatsSegmentHeader &> (*_segment) };
+      const auto trackers { reinterpret_cast<StatsSegmentTracker *> (reinterpret_cast<char *> (&h) + h.trackersOffset) };
+      const auto buckets { reinterpret_cast<StatsHistogramBucket *> (reinterpret_cast<char *> (&h) + h.histogramOffset) };
+
+      std::atomic_ref<uint64_t> sequence { h.sequence };
+      for (size_t attempt = 0; attempt < MEMISPECT_STATS_READ_RETRIES; ++attempt) {
+        const auto seq { sequence.load (std::memory_order_acquire) };
+        if ((seq & 1) != 0) {
+          sched_yield();
+          continue;
+        }
+
+        sample.pid = h.pid;
+        sample.time = load (h.time);
+        sample.updates = load (h.updates);
+        sample.global = load (h.global);
+
+        sample.trackers.clear();
+        for (size_t i = 0; i < h.trackers; ++i) {
+          char name[sizeof (StatsSegmentTracker::name)];
+          for (size_t j = 0; j < sizeof (name); ++j)
+            name[j] = std::atomic_ref<char> { trackers[i].name[j] }.load (std::memory_order_relaxed);
+
+          if (name[0] != '\0')
+            sample.trackers.push_back ({ std::string { name, strnlen (name, sizeof (name)) }, load (trackers[i].counters) });
+        }
+
+        sample.histogram.clear();
+        for (size_t i = 0; i < h.histogramBuckets; ++i) {
+          auto &b { buckets[i] };
+          const StatsHistogramBucket copy { b.lowerBound, b.upperBound, load (b.allocations), load (b.frees), load (b.allocatedBytes), load (b.freedBytes) };
+          if ((copy.allocations != 0) || (copy.frees != 0))
+            sample.histogram.push_back (copy);
+        }
+
+        std::atomic_thread_fence (std::memory_order_acquire);
+        if (sequence.load (std::memory_order_relaxed) == seq)
+          return true;
+      }
+
+      return false;
+    }
+
+  private:
+    /// @brief Loads a field of the segment.
+    static inline uint64_t load (uint64_t &field) {
+      return std::atomic_ref<uint64_t> { field }.load (std::memory_order_relaxed);
+    }
+
+    /// @brief Loads counters of the segment.
+    static inline StatsCounters load (StatsCounters &field) {
+      return { load (field.allocated), load (field.freed), load (field.allocations), load (field.frees),
+        load (field.reallocations), load (field.liveBytes), load (field.peakBytes) };
+    }
+
+    const StatsSegmentHeader *_segment { nullptr }; ///< The segment.
+    size_t _size { 0 };                             ///< The size of the mapping.
+};
+
+}
+
+#endif
@@ -0,0 +1,553 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#ifndef __MEM_INSPECT_TRACE_H__
+#define __MEM_INSPECT_TRACE_H__
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <meminspect/mapped_file.h>
+#include <meminspect/metadata_arena.h>
+#include <meminspect/mutex.h>
+#include <meminspect/types.h>
+
+#ifndef MEMISPECT_TRACE_RING
+  #define MEMISPECT_TRACE_RING 8192
+#endif
+
+#ifndef MEMISPECT_TRACE_CHUNK
+  #define MEMISPECT_TRACE_CHUNK 512
+#endif
+
+#ifndef MEMISPECT_TRACE_INTERVAL_US
+  #define MEMISPECT_TRACE_INTERVAL_US 1000
+#endif
+
+
+namespace meminspect {
+
+/// @brief The operations of an allocation trace.
+enum class TraceOp : uint8_t {
+  Malloc,       ///< `malloc` (and `new`).
+  Calloc,       ///< `calloc`; the size is the total size.
+  AlignedAlloc, ///< `aligned_alloc`; the alignment is kept as its base-2 logarithm.
+  Realloc,      ///< `realloc`; ptr is the old block and result the new one.
+  Free          ///< `free` (and `delete`).
+};
+
+/// @brief A recorded call.
+/// The call started at `time` and returned `duration` later, so a block passed to the call is released at `time`
+/// (before the real allocator could reuse it) and a block returned by it exists from `time + duration`. The file
+/// keeps both in time-stamp counter ticks; `TraceRecorder::load` converts them to nanoseconds.
+struct TraceRecord {
+  uint64_t time;      ///< When the call started (nanoseconds since the recording started, once loaded).
+  uint64_t ptr;       ///< The block passed to the call (Realloc and Free).
+  uint64_t result;    ///< The block returned by the call (all but Free).
+  uint64_t size;      ///< The requested size.
+  uint32_t duration;  ///< How long the call took (saturated).
+  uint32_t thread;    ///< The id of the calling thread, numbered from 0 in order of first call.
+  TraceOp op;         ///< The operation.
+  uint8_t alignment;  ///< The base-2 logarithm of the alignment (AlignedAlloc only).
+  uint8_t reserved[6];
+};
+
+static_assert (sizeof (TraceRecord) == 48, "the records are written as is");
+
+/// @brief The header of a trace file, followed by its chunks.
+/// The writer updates the chunk count and the clock calibration as it goes, so the file of a process that crashed
+/// can still be read up to its last complete chunk.
+struct TraceHeader {
+  static constexpr char Magic[8] { 'M', 'E', 'M', 'T', 'R', 'A', 'C', 'E' };
+  static constexpr uint32_t Version { 2 };
+
+  char magic[8];          ///< Magic.
+  uint32_t version;       ///< Version.
+  uint32_t recordSize;    ///< The size of a record.
+  uint32_t chunkRecords;  ///< The records a chunk can hold.
+  uint32_t chunkSize;     ///< The size of a chunk, with its header.
+  uint64_t chunks;        ///< The chunks written (the index: chunk `i` is at `sizeof (TraceHeader) + i * chunkSize`).
+  uint64_t dropped;       ///< The records dropped because a ring was full.
+  uint64_t baseTicks;     ///< The time-stamp counter when the recording started.
+  uint64_t baseNanos;     ///< The monotonic clock when the recording started.
+  uint64_t lastTicks;     ///< The time-stamp counter at the last update of the header.
+  uint64_t lastNanos;     ///< The monotonic clock at the last update of the header.
+};
+
+/// @brief The header of a chunk, followed by its records.
+/// The records of a chunk come from one ring, in call order; the chunks of the rings are interleaved.
+struct TraceChunk {
+  static constexpr uint32_t Magic { 0x4b4e4843 }; ///< "CHNK", written last so a torn chunk is never read.
+
+  uint32_t magic;      ///< Magic.
+  uint32_t count;      ///< The number of records.
+  uint32_t ring;       ///< The ring the records come from.
+  uint32_t reserved;
+  uint64_t firstTicks; ///< The time of the first record.
+  uint64_t lastTicks;  ///< The time of the last record.
+};
+
+/// @brief A trace file mapped into memory, to read its chunks in place (e.g. from several threads).
+/// The file may come from a process that crashed: the chunks are read up to the last complete one.
+class TraceFile {
+  public:
+    /// @brief Maps a trace file.
+    /// @param path The file.
+    /// @return false if the file cannot be read or is not a trace.
+    bool open (const char *path) {
+      _chunks = 0;
+      if (!_file.open (path))
+        return false;
+
+      const auto h { _file.at<TraceHeader> (0) };
+      if ((h == nullptr) || (std::memcmp (h->magic, TraceHeader::Magic, sizeof (h->magic)) != 0) ||
+          (h->version != TraceHeader::Version) || (h->recordSize != sizeof (TraceRecord)) || (h->chunkRecords == 0) ||
+          (h->chunkSize != sizeof (TraceChunk) + (h->chunkRecords * sizeof (TraceRecord)))) {
+        _file.close();
+        return false;
+      }
+
+      // the chunk count of the header may lag behind a crash: the chunks count while their magic is valid.
+      for (size_t at = sizeof (TraceHeader); at + h->chunkSize <= _file.size(); at += h->chunkSize, ++_chunks) {
+        const auto c { _file.at<TraceChunk> (at) };
+        if ((c->magic != TraceChunk::Magic) || (c->count > h->chunkRecords))
+          break;
+      }
+
+      // ticks to nanoseconds, with the calibration of the last update of the header.
+      _scale = (h->lastTicks > h->baseTicks) && (h->lastNanos > h->baseNanos) ?
+               static_cast<double> (h->lastNanos - h->baseNanos) / static_cast<double> (h->lastTicks - h->baseTicks) : 1.0;
+
+      return true;
+    }
+
+    /// @brief Gets the header of the file.
+    inline const TraceHeader & header() const { return *_file.at<TraceHeader> (0); }
+
+    /// @brief Gets the number of complete chunks.
+    inline size_t chunks() const { return _chunks; }
+
+    /// @brief Gets the header of a chunk.
+    inline const TraceChunk & chunk (size_t i) const {
+      return *reinterpret_cast<const TraceChunk *> (_file.data() + sizeof (TraceHeader) + (i * header().chunkSize));
+    }
+
+    /// @brief Gets the records of a chunk, as written (in ticks).
+    inline const TraceRecord * records (size_t i) const {
+      return reinterpret_cast<const TraceRecord *> (&chunk (i) + 1);
+    }
+
+    /// @brief Converts the times of a record to nanoseconds since the recording started.
+    inline TraceRecord decode (const TraceRecord &r) const {
+      const auto base { header().baseTicks };
+      const auto duration { r.duration * _scale };
+
+      auto out { r };
+      out.time = r.time > base ? static_cast<uint64_t> ((r.time - base) * _scale) : 0;
+      out.duration = duration < UINT32_MAX ? static_cast<uint32_t> (duration) : UINT32_MAX;
+
+      return out;
+    }
+
+  private:
+    MappedFile _file;      ///< The file.
+    size_t _chunks { 0 };  ///< The complete chunks.
+    double _scale { 1.0 }; ///< Nanoseconds per tick.
+};
+
+/// @brief Records the allocation calls of every thread into a binary trace file.
+/// Each thread appends fixed-size records, stamped with the time-stamp counter, to its own single-producer/
+/// single-consumer ring (MEMISPECT_TRACE_RING records, taken from the MetadataArena so recording never calls the allocator).
+/// A background writer copies them in chunks of MEMISPECT_TRACE_CHUNK records into the file, which is mapped and
+/// grown by the writer alone, so recording takes no lock and never waits for I/O: when a ring is full, the record
+/// is dropped and counted instead. The rings of the threads that exit are reused by new threads.
+/// Recording is enabled in the hooks with MEMISPECT_TRACE, and runs between `start()` and `stop()`.
+class TraceRecorder {
+  static_assert ((MEMISPECT_TRACE_RING & (MEMISPECT_TRACE_RING - 1)) == 0, "the size of the rings must be a power of two");
+  static_assert (MEMISPECT_TRACE_CHUNK <= MEMISPECT_TRACE_RING, "a chunk cannot be larger than a ring");
+
+  public:
+    /// @brief Starts recording.
+    /// @param path The file to write (truncated).
+    /// @return false if it is already recording or the file cannot be created.
+    static bool start (const char *path) {
+      std::lock_guard<Mutex> guard { _controlMutex };
+      if (_fd >= 0)
+        return false;
+
+      const auto fd { ::open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) };
+      if (fd < 0)
+        return false;
+
+      _fd = fd;
+      _map = nullptr;
+      _mapSize = 0;
+      _capacity = 0;
+      _chunks = 0;
+
+      if (!grow()) {
+        close();
+        return false;
+      }
+
+      auto &h { header() };
+      std::memcpy (h.magic, TraceHeader::Magic, sizeof (h.magic));
+      h.version = TraceHeader::Version;
+      h.recordSize = sizeof (TraceRecord);
+      h.chunkRecords = MEMISPECT_TRACE_CHUNK;
+      h.chunkSize = ChunkSize;
+      h.baseTicks = h.lastTicks = ticks();
+      h.baseNanos = h.lastNanos = clock();
+
+      // the records left by calls that raced with the last stop() belong to that recording.
+      for (auto *r = _rings.load (std::memory_order_acquire); r != nullptr; r = r->next) {
+        r->tail.store (r->head.load (std::memory_order_acquire), std::memory_order_release);
+        r->dropped.store (0, std::memory_order_relaxed);
+      }
+
+      _stop.store (false, std::memory_order_relaxed);
+      if (pthread_create (&_writer, nullptr, &run, nullptr) != 0) {
+        close();
+        return false;
+      }
+
+      _active.store (true, std::memory_order_release);
+
+      return true;
+    }
+
+    /// @brief Stops recording and writes the records of every thread.
+    static void stop() {
+      std::lock_guard<Mutex> guard { _controlMutex };
+      if (_fd < 0)
+        return;
+
+      _active.store (false, std::memory_order_release);
+      _stop.store (true, std::memory_order_release);
+      pthread_join (_writer, nullptr);
+
+      write (true);
+      close();
+    }
+
+    /// @brief Checks whether it is recording.
+    static inline bool active() {
+      return _active.load (std::memory_order_relaxed);
+    }
+
+    /// @brief Gets the time a call starts, to pass to record().
+    static inline uint64_t now() {
+      return active() ? ticks() : 0;
+    }
+
+    /// @brief Records a call.
+    /// @param op The operation.
+    /// @param start The time the call started, from now().
+    /// @param ptr The block passed to the call.
+    /// @param result The block returned by the call.
+    /// @param size The requested size.
+    /// @param alignment The alignment (AlignedAlloc only).
+    static inline void record (TraceOp op, uint64_t start, const void *ptr, const void *result, size_t size, size_t alignment = 0) {
+      if (!active() || (start == 0))
+        return;
+
+      const auto end { ticks() };
+      const auto r { ring() };
+      if (r == nullptr)
+        return;
+
+      const auto head { r->head.load (std::memory_order_relaxed) };
+      if (head - r->tail.load (std::memory_order_acquire) >= MEMISPECT_TRACE_RING) {
+        r->dropped.store (r->dropped.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+      }
+
+      auto &e { r->records[head & (MEMISPECT_TRACE_RING - 1)] };
+      e.time = start;
+      e.ptr = reinterpret_cast<uintptr_t> (ptr);
+      e.result = reinterpret_cast<uintptr_t> (result);
+      e.size = size;
+      e.duration = end - start < UINT32_MAX ? static_cast<uint32_t> (end - start) : UINT32_MAX;
+      e.thread = r->thread;
+      e.op = op;
+      e.alignment = alignment != 0 ? static_cast<uint8_t> (__builtin_ctzll (alignment)) : 0;
+
+      r->head.store (head + 1, std::memory_order_release);
+    }
+
+    /// @brief Loads the records of a trace file, sorted by time.
+    /// The file may come from a process that crashed: the records are read up to the last complete chunk.
+    /// @param path The file.
+    /// @param records The records, with their times in nanoseconds since the recording started.
+    /// @return false if the file cannot be read or is not a trace.
+    static bool load (const char *path, std::vector<TraceRecord> &records) {
+      records.clear();
+
+      TraceFile file;
+      if (!file.open (path))
+        return false;
+
+      for (size_t i = 0; i < file.chunks(); ++i) {
+        const auto r { file.records (i) };
+        for (size_t j = 0; j < file.chunk (i).count; ++j)
+          records.push_back (file.decode (r[j]));
+      }
+
+      // stable, so the records of a thread with the same time keep their order.
+      std::stable_sort (records.begin(), records.end(), [] (const TraceRecord &a, const TraceRecord &b) { return a.time < b.time; });
+
+      return true;
+    }
+
+  private:
+    static constexpr uint32_t Owned { 0 }; ///< A thread records into the ring.
+    static constexpr uint32_t Free { 1 };  ///< The thread exited: the ring can be taken by another thread.
+
+    static constexpr size_t ChunkSize { sizeof (TraceChunk) + (MEMISPECT_TRACE_CHUNK * sizeof (TraceRecord)) }; ///< The size of a chunk.
+
+    /// @brief The records of a thread not yet written.
+    struct Ring {
+      alignas (MEMISPECT_CACHE_LINE_SIZE) std::atomic<uint64_t> head { 0 }; ///< The next free slot.
+      alignas (MEMISPECT_CACHE_LINE_SIZE) std::atomic<uint64_t> tail { 0 }; ///< The next record to write.
+      std::atomic<uint32_t> state { Owned };                                 ///< Owned or Free.
+      std::atomic<uint64_t> dropped { 0 };                                   ///< The records dropped while the ring was full.
+      Ring *next { nullptr };                                                ///< The next ring of the registry.
+      uint32_t index { 0 };                                                  ///< The number of the ring.
+      uint32_t thread { 0 };                                                 ///< The id of the thread that owns the ring.
+      TraceRecord records[MEMISPECT_TRACE_RING];                             ///< The records.
+    };
+
+    /// @brief Reads the time-stamp counter (the monotonic clock where there is none).
+    static inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#elif defined(__aarch64__)
+      uint64_t v { 0 };
+      asm volatile ("mrs %0, cntvct_el0" : "=r" (v));
+      return v;
+#else
+      return clock();
+#endif
+    }
+
+    /// @brief Reads the monotonic clock, in nanoseconds.
+    static inline uint64_t clock() {
+      timespec ts {};
+      clock_gettime (CLOCK_MONOTONIC, &ts);
+
+      return (static_cast<uint64_t> (ts.tv_sec) * 1000000000) + static_cast<uint64_t> (ts.tv_nsec);
+    }
+
+    /// @brief Gets the ring of the current thread, taking a free one or mapping a new one on first use.
+    static Ring * ring() {
+      if (_ring != nullptr)
+        return _ring;
+
+      Ring *r { nullptr };
+      for (auto *it = _rings.load (std::memory_order_acquire); (it != nullptr) && (r == nullptr); it = it->next) {
+        auto state { Free };
+        if (it->state.compare_exchange_strong (state, Owned, std::memory_order_acquire))
+          r = it;
+      }
+
+      if (r == nullptr) {
+        static_assert (alignof (Ring) <= MetadataArena::MinSize, "the blocks of the arena are only aligned to MetadataArena::MinSize");
+
+        const auto m { MetadataArena::alloc (sizeof (Ring)) };
+        if (m == nullptr)
+          return nullptr;
+
+        r = new (m) Ring {};
+        r->index = _ringCount.fetch_add (1, std::memory_order_relaxed);
+
+        auto head { _rings.load (std::memory_order_relaxed) };
+        do {
+          r->next = head;
+        } while (!_rings.compare_exchange_weak (head, r, std::memory_order_release, std::memory_order_relaxed));
+      }
+
+      r->thread = _threads.fetch_add (1, std::memory_order_relaxed);
+
+      // set first: pthread_setspecific may allocate, which records a call to this ring.
+      _ring = r;
+      pthread_setspecific (key(), r);
+
+      return r;
+    }
+
+    /// @brief Gets the header of the file (the file must be mapped).
+    static inline TraceHeader & header() {
+      return *static_cast<TraceHeader *> (_map);
+    }
+
+    /// @brief Gets the offset of a chunk in the file.
+    static inline size_t offset (uint64_t chunk) {
+      return sizeof (TraceHeader) + (chunk * ChunkSize);
+    }
+
+    /// @brief Doubles the chunks the file can hold, and maps it again.
+    /// @return false if the file cannot grow.
+    static bool grow() {
+      const auto capacity { _capacity > 0 ? _capacity * 2 : 16 };
+      const auto size { offset (capacity) };
+      if (::ftruncate (_fd, static_cast<off_t> (size)) != 0)
+        return false;
+
+      const auto m { _map == nullptr ? ::mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0) :
+                                       ::mremap (_map, _mapSize, size, MREMAP_MAYMOVE) };
+      if (m == MAP_FAILED)
+        return false;
+
+      _map = m;
+      _mapSize = size;
+      _capacity = capacity;
+
+      return true;
+    }
+
+    /// @brief Appends a chunk to the file.
+    /// @param r The ring.
+    /// @param tail The first record of the chunk.
+    /// @param count The number of records.
+    /// @return false if the file cannot grow.
+    static bool append (const Ring &r, uint64_t tail, uint32_t count) {
+      if ((_chunks == _capacity) && !grow())
+        return false;
+
+      const auto at { static_cast<char *> (_map) + offset (_chunks) };
+      const auto records { reinterpret_cast<TraceRecord *> (at + sizeof (TraceChunk)) };
+
+      // the records may wrap around the end of the ring.
+      const auto first { tail & (MEMISPECT_TRACE_RING - 1) };
+      const auto n { std::min<uint64_t> (count, MEMISPECT_TRACE_RING - first) };
+      std::memcpy (records, &r.records[first], n * sizeof (TraceRecord));
+      std::memcpy (records + n, &r.records[0], (count - n) * sizeof (TraceRecord));
+
+      TraceChunk c {};
+      c.count = count;
+      c.ring = r.index;
+      c.firstTicks = records[0].time;
+      c.lastTicks = records[count - 1].time;
+      std::memcpy (at, &c, sizeof (c));
+
+      // the magic goes last, so a chunk torn by a crash is never read.
+      std::atomic_signal_fence (std::memory_order_release);
+      c.magic = TraceChunk::Magic;
+      std::memcpy (at, &c.magic, sizeof (c.magic));
+      std::atomic_signal_fence (std::memory_order_release);
+
+      header().chunks = ++_chunks;
+
+      return true;
+    }
+
+    /// @brief Writes the records of the rings to the file (only the writer, or stop() once the writer exited).
+    /// @param all Whether to write the partial chunks of the threads still running.
+    static void write (bool all) {
+      uint64_t dropped { 0 };
+
+      for (auto *r = _rings.load (std::memory_order_acquire); r != nullptr; r = r->next) {
+        // the last records of an exited thread would wait for a new owner to fill their chunk.
+        const auto partial { all || (r->state.load (std::memory_order_acquire) == Free) };
+        const auto head { r->head.load (std::memory_order_acquire) };
+        auto tail { r->tail.load (std::memory_order_relaxed) };
+
+        while ((head - tail >= MEMISPECT_TRACE_CHUNK) || (partial && (head > tail))) {
+          const auto count { static_cast<uint32_t> (std::min<uint64_t> (head - tail, MEMISPECT_TRACE_CHUNK)) };
+          if (!append (*r, tail, count))
+            break;
+
+          tail += count;
+          r->tail.store (tail, std::memory_order_release);
+        }
+
+        dropped += r->dropped.load (std::memory_order_relaxed);
+      }
+
+      auto &h { header() };
+      h.dropped = dropped;
+      h.lastTicks = ticks();
+      h.lastNanos = clock();
+    }
+
+    /// @brief Unmaps and closes the file, trimming it to the chunks written.
+    static void close() {
+      if (_map != nullptr) {
+        ::munmap (_map, _mapSize);
+
+        // the file grows ahead of the chunks; if it cannot be trimmed, load() skips the zeroed ones.
+        const auto trimmed { ::ftruncate (_fd, static_cast<off_t> (offset (_chunks))) == 0 };
+        (void) trimmed;
+      }
+
+      ::close (_fd);
+      _fd = -1;
+      _map = nullptr;
+    }
+
+    /// @brief Body of the background writer.
+    static void * run (void *) {
+      const timespec interval { 0, MEMISPECT_TRACE_INTERVAL_US * 1000 };
+
+      while (!_stop.load (std::memory_order_acquire)) {
+        write (false);
+        nanosleep (&interval, nullptr);
+      }
+
+      return nullptr;
+    }
+
+    /// @brief Thread-exit callback that hands the ring of the thread over to the writer and to future threads.
+    static void release (void *p) {
+      static_cast<Ring *> (p)->state.store (Free, std::memory_order_release);
+
+      // taken again (with a new id) if other thread-exit callbacks still allocate.
+      _ring = nullptr;
+    }
+
+    /// @brief Gets the key used to be notified of thread exits.
+    static pthread_key_t key() {
+      static const pthread_key_t k { [] () { pthread_key_t k {}; pthread_key_create (&k, &release); return k; } () };
+      return k;
+    }
+
+    static inline thread_local Ring *_ring { nullptr };       ///< The ring of the current thread.
+    static inline std::atomic<Ring *> _rings { nullptr };     ///< The registry of rings.
+    static inline std::atomic<uint32_t> _ringCount { 0 };     ///< The number of rings.
+    static inline std::atomic<uint32_t> _threads { 0 };       ///< The next thread id.
+    static inline std::atomic<bool> _active { false };        ///< Whether it is recording.
+    static inline std::atomic<bool> _stop { false };          ///< Asks the writer to exit.
+    static inline Mutex _controlMutex {};                     ///< Serializes start() and stop().
+    static inline pthread_t _writer {};                       ///< The writer thread.
+    static inline int _fd { -1 };                             ///< The trace file.
+    static inline void *_map { nullptr };                     ///< The mapping of the file.
+    static inline size_t _mapSize { 0 };                      ///< The size of the mapping.
+    static inline uint64_t _capacity { 0 };                   ///< The chunks the mapping can hold.
+    static inline uint64_t _chunks { 0 };                     ///< The chunks written.
+};
+
+/// @brief Stand-in for TraceRecorder when the hooks do not record (compiled away).
+struct NoTrace {
+  static constexpr uint64_t now() { return 0; }
+  static constexpr void record (TraceOp, uint64_t, const void *, const void *, size_t, size_t = 0) {}
+};
+
+}
+
+#endif
@@ -7,16 +7,40 @@
 #define __MEM_INSPECT_TYPES_H__
 #include <array>
 #include <atomic>
+#include <cassert>
+#include <cstdint>
 #include <mutex>
+#include <new>
 #include <optional>
 #include <stdexcept>
 #include <type_traits>
 #include <utility>
 
+#include <meminspect/hash.h>
+#include <meminspect/metadata_arena.h>
+#include <meminspect/mutex.h>
+#include <meminspect/node_pool.h>
+
 #ifndef MEMISPECT_HASHMAP_SIZE
   #define MEMISPECT_HASHMAP_SIZE 1024
 #endif
 
+#ifndef MEMISPECT_HASHMAP_REHASH_STEP
+  #define MEMISPECT_HASHMAP_REHASH_STEP 4
+#endif
+
+#ifndef MEMISPECT_HASHMAP_SHARDS
+  #define MEMISPECT_HASHMAP_SHARDS 16
+#endif
+
+#ifndef MEMISPECT_OPEN_HASHMAP_SIZE
+  #define MEMISPECT_OPEN_HASHMAP_SIZE 65536
+#endif
+
+#ifndef MEMISPECT_CACHE_LINE_SIZE
+  #define MEMISPECT_CACHE_LINE_SIZE 64
+#endif
+
 
 namespace meminspect {
 
@@ -30,30 +54,18 @@ using calloc_t = std::add_pointer<void * (size_t, size_t)>::type;
 using aligned_alloc_t = std::add_pointer<void * (size_t, size_t)>::type;
 /// @brief Type alias for the `free` function pointer.
 using free_t = std::add_pointer<void (void *)>::type;
-
-/// @brief This class is a synchronization primitive that can be used to protect shared data from being simultaneously accessed by multiple threads.
-class Mutex {
-  public:
-    /// @brief Locks the mutex.
-    inline void lock() {
-      while (std::atomic_flag_test_and_set_explicit (&_lock, std::memory_order_acquire)) {
-        // empty
-      }
-    }
-
-    /// @brief Unlocks the mutex.
-    inline void unlock() {
-      std::atomic_flag_clear_explicit (&_lock, std::memory_order_release);
-    }
-
-  private:
-    std::atomic_flag _lock = ATOMIC_FLAG_INIT;
-};
+/// @brief Type alias for the `free_sized` function pointer (C23).
+using free_sized_t = std::add_pointer<void (void *, size_t)>::type;
+/// @brief Type alias for the `free_aligned_sized` function pointer (C23).
+using free_aligned_sized_t = std::add_pointer<void (void *, size_t, size_t)>::type;
+/// @brief Type alias for the `malloc_usable_size` function pointer.
+using malloc_usable_size_t = std::add_pointer<size_t (void *)>::type;
 
 /// @brief A templated linked list implementation with custom memory allocation.
+/// The nodes come from a NodePool, so adding a value does not call the allocator being tracked.
 ///
 /// @tparam T The type of the values stored in the list.
-/// @tparam Allocator The allocator class responsible for memory management.
+/// @tparam Allocator The allocator class of the owner. The nodes themselves come from the NodePool.
 template<typename T, typename Allocator>
 class ListPtr {
   public:
@@ -76,14 +88,17 @@ class ListPtr {
     /// @brief Destructor to free all allocated memory.
     ~ListPtr() {
       while (_head != nullptr)
-        Allocator::free (std::exchange (_head, _head->next));
+        Pool::free (std::exchange (_head, _head->next));
     }
 
     /// @brief Adds a new node with the given value to the end of the list.
     /// @param value Pointer to the value to be added.
-    /// @return Pointer to the newly added node.
+    /// @return Pointer to the newly added node, or nullptr if the node cannot be allocated.
     Node * add (T *value) {
-      const auto n { static_cast<Node *> (Allocator::malloc (sizeof (Node))) };
+      const auto n { static_cast<Node *> (Pool::alloc()) };
+      if (n == nullptr)
+        return nullptr;
+
       n->value = value;
       n->next = nullptr;
 
@@ -130,7 +145,7 @@ class ListPtr {
           if (it1 == _tail)
             _tail = it0;
 
-          Allocator::free (it1);
+          Pool::free (it1);
 
           return;
         }
@@ -169,11 +184,14 @@ class ListPtr {
     }
 
   private:
+    using Pool = NodePool<sizeof (Node), alignof (Node)>; ///< The pool of nodes.
+
     Node *_head { nullptr }; ///< Pointer to the head of the list.
     Node *_tail { nullptr }; ///< Pointer to the tail of the list.
 };
 
 /// @brief This class implements a single-linked sorted list.
+/// The nodes come from a NodePool, so adding an element does not call the allocator being tracked.
 template<typename K, typename V, typename Allocator>
 class SortedList {
   public:
@@ -187,17 +205,29 @@ class SortedList {
     /// @brief Destructor to free all allocated memory.
     ~SortedList() {
       while (_head != nullptr)
-        Allocator::free (std::exchange (_head, _head->next));
+        Pool::free (std::exchange (_head, _head->next));
     }
 
     /// @brief Inserts an element.
     /// @param key The key to insert.
     /// @param val The value to insert.
-    /// @return A pointer to the inserted node.
+    /// @return A pointer to the inserted node, or nullptr if the node cannot be allocated.
     Node * add (K key, V &&val) {
-      const auto n { static_cast<Node *> (Allocator::malloc (sizeof (Node))) };
+      const auto n { static_cast<Node *> (Pool::alloc()) };
+      if (n == nullptr)
+        return nullptr;
+
       n->key = key;
       n->value = std::forward<V> (val);
+
+      return link (n);
+    }
+
+    /// @brief Inserts an already allocated node, keeping the list sorted.
+    /// @param n The node to insert.
+    /// @return The inserted node.
+    Node * link (Node *n) {
+      const auto key { n->key };
       n->next = nullptr;
 
       // if head is nullptr, the list doesn’t yet exist, so we create one.
@@ -224,6 +254,19 @@ class SortedList {
       throw std::runtime_error { "repeated value" };
     }
 
+    /// @brief Detaches the first node of the list without freeing it.
+    /// @return The detached node, or nullptr if the list is empty.
+    Node * unlink() {
+      if (_head == nullptr)
+        return nullptr;
+
+      return std::exchange (_head, _head->next);
+    }
+
+    /// @brief Gets a pointer to the head of the list.
+    /// @return Pointer to the head node.
+    inline Node * head() const { return _head; }
+
     /// @brief Searches for an element by key.
     /// @param key The key to search for.
     /// @return A pointer to the found node or nullptr if not found.
@@ -244,7 +287,7 @@ class SortedList {
 
       if (_head->key == key) {
         const auto v { _head->value };
-        Allocator::free (std::exchange (_head, _head->next));
+        Pool::free (std::exchange (_head, _head->next));
         return { v };
       }
 
@@ -252,7 +295,7 @@ class SortedList {
         if (n->key == key) {
           const auto v { n->value };
           std::swap (p->next, n->next);
-          Allocator::free (n);
+          Pool::free (n);
 
           return { v };
         }
@@ -262,42 +305,552 @@ class SortedList {
     }
 
   private:
+    using Pool = NodePool<sizeof (Node), alignof (Node)>; ///< The pool of nodes.
+
     Node *_head { nullptr };
 };
 
-/// @brief Basic HashMap class.
-template<typename K, typename V, typename Allocator, size_t S=MEMISPECT_HASHMAP_SIZE>
+/// @brief Default load factor policy of HashMapPtr.
+struct DefaultLoadFactor {
+  static constexpr size_t grow { 2 };   ///< The table doubles when there are more than `grow` elements per bucket.
+  static constexpr size_t shrink { 8 }; ///< The table halves when there is less than one element every `shrink` buckets.
+};
+
+/// @brief HashMap class with separate chaining.
+/// The bucket array is taken from the MetadataArena and grows or shrinks with the number of elements.
+/// The rehash is incremental: each `add`/`remove` migrates at most MEMISPECT_HASHMAP_REHASH_STEP buckets
+/// from the old array to the new one, so no single operation pays for the whole rehash.
+/// @tparam S The initial (and minimum) number of buckets.
+/// @tparam Hash The policy that maps a pointer to a bucket (see hash.h).
+/// @tparam LoadFactor The policy that decides when the table grows or shrinks.
+template<typename K, typename V, typename Allocator, size_t S=MEMISPECT_HASHMAP_SIZE, typename Hash=FibonacciHash, typename LoadFactor=DefaultLoadFactor>
 class HashMapPtr {
+  static_assert (S > 0, "the number of buckets must be greater than zero");
+
   public:
+    using value_type = V;                       ///< The type of the values.
+    using List = SortedList<K *, V, Allocator>; ///< The type of the buckets.
+
+    /// @brief Destructor to free all allocated memory.
+    ~HashMapPtr() {
+      release (_tables[0]);
+      release (_tables[1]);
+    }
+
     /// @brief Inserts an element.
     /// @param p The key pointer to insert.
     /// @param v The value to insert.
-    /// @return A pointer to the inserted node in the sorted list.
-    inline typename SortedList<K *, V, Allocator>::Node * add (K *p, V &&v) {
-      const auto k { reinterpret_cast<uintptr_t> (p) % S };
-      return _map[k].add (p, std::forward<V> (v));
+    /// @return A pointer to the inserted node in the sorted list, or nullptr if the buckets cannot be allocated.
+    inline typename List::Node * add (K *p, V &&v) {
+      if ((_tables[0].buckets == nullptr) && !allocate (_tables[0], S))
+        return nullptr;
+
+      rehash();
+
+      const auto n { bucket (rehashing() ? _tables[1] : _tables[0], p).add (p, std::forward<V> (v)) };
+      if (n == nullptr)
+        return nullptr;
+
+      ++_size;
+
+      if (!rehashing() && (_size > _tables[0].count * LoadFactor::grow))
+        resize (_tables[0].count * 2);
+
+      return n;
     }
 
     /// @brief Deletes an element.
     /// @param p The key pointer to delete.
     /// @return An optional containing the value of the deleted element, or nullopt if not found.
     inline std::optional<V> remove (K *p) {
-      const auto k { reinterpret_cast<uintptr_t> (p) % S };
-      return _map[k].remove (p);
+      if (_tables[0].buckets == nullptr)
+        return std::nullopt;
+
+      rehash();
+
+      auto v { bucket (_tables[0], p).remove (p) };
+      if (!v && rehashing())
+        v = bucket (_tables[1], p).remove (p);
+
+      if (v) {
+        --_size;
+
+        if (!rehashing() && (_tables[0].count > S) && (_size * LoadFactor::shrink < _tables[0].count))
+          resize (_tables[0].count / 2);
+      }
+
+      return v;
     }
 
     /// @brief Finds an element.
     /// @param p The key pointer to search for.
     /// @return A pointer to the found node in the sorted list, or nullptr if not found.
-    inline typename SortedList<K *, V, Allocator>::Node * find (K *p) {
-      const auto k { reinterpret_cast<uintptr_t> (p) % S };
-      return _map[k].find (p);
+    inline typename List::Node * find (K *p) {
+      if (_tables[0].buckets == nullptr)
+        return nullptr;
+
+      const auto n { bucket (_tables[0], p).find (p) };
+      if ((n == nullptr) && rehashing())
+        return bucket (_tables[1], p).find (p);
+
+      return n;
+    }
+
+    /// @brief Gets the number of elements.
+    inline size_t size() const { return _size; }
+
+    /// @brief Gets the number of buckets (the new array's while a rehash is in progress).
+    inline size_t buckets() const { return rehashing() ? _tables[1].count : _tables[0].count; }
+
+    /// @brief Checks whether an incremental rehash is in progress.
+    inline bool rehashing() const { return _tables[1].buckets != nullptr; }
+
+    /// @brief Computes the occupancy statistics by walking every bucket.
+    /// @return The statistics of both bucket arrays while a rehash is in progress.
+    HashMapStats stats() const {
+      HashMapStats st {};
+      size_t probes { 0 };
+
+      for (const auto &t : _tables) {
+        st.buckets += t.count;
+
+        for (size_t i = 0; i < t.count; ++i) {
+          size_t length { 0 };
+          for (auto *n = t.buckets[i].head(); n != nullptr; n = n->next)
+            probes += ++length;
+
+          if (length > 0)
+            ++st.usedBuckets;
+          if (length > st.maxChainLength)
+            st.maxChainLength = length;
+        }
+      }
+
+      st.size = _size;
+      st.averageProbes = _size > 0 ? static_cast<double> (probes) / _size : 0;
+
+      return st;
+    }
+
+    /// @brief Calls a function for every element (of both bucket arrays while a rehash is in progress).
+    /// @param f The function, called with the key and the value of each element.
+    template<typename F>
+    void forEach (F &&f) const {
+      for (const auto &t : _tables) {
+        for (size_t i = 0; i < t.count; ++i) {
+          for (auto *n = t.buckets[i].head(); n != nullptr; n = n->next)
+            f (n->key, n->value);
+        }
+      }
+    }
+
+  private:
+    /// @brief A bucket array.
+    struct Table {
+      List *buckets { nullptr }; ///< The buckets.
+      size_t count { 0 };        ///< The number of buckets.
+    };
+
+    /// @brief Gets the bucket of a key.
+    static inline List & bucket (Table &t, K *p) {
+      return t.buckets[Hash::index (reinterpret_cast<uintptr_t> (p), t.count)];
+    }
+
+    /// @brief Allocates the buckets of a table.
+    static inline bool allocate (Table &t, size_t count) {
+      const auto buckets { static_cast<List *> (MetadataArena::alloc (count * sizeof (List))) };
+      if (buckets == nullptr)
+        return false;
+
+      for (size_t i = 0; i < count; ++i)
+        new (&buckets[i]) List {};
+
+      t.buckets = buckets;
+      t.count = count;
+
+      return true;
+    }
+
+    /// @brief Frees the buckets of a table and the nodes they still hold.
+    static inline void release (Table &t) {
+      if (t.buckets == nullptr)
+        return;
+
+      for (size_t i = 0; i < t.count; ++i)
+        t.buckets[i].~List();
+
+      MetadataArena::free (t.buckets, t.count * sizeof (List));
+      t = Table {};
+    }
+
+    /// @brief Starts an incremental rehash into a new array of buckets.
+    /// If the new array cannot be allocated, the table keeps its current size.
+    inline void resize (size_t count) {
+      if (allocate (_tables[1], count))
+        _rehashIndex = 0;
+    }
+
+    /// @brief Migrates a few buckets of the old array when a rehash is in progress.
+    inline void rehash() {
+      if (!rehashing())
+        return;
+
+      // empty buckets are cheap to skip, but still bounded.
+      size_t emptyVisits { MEMISPECT_HASHMAP_REHASH_STEP * 10 };
+
+      for (size_t steps = 0; (steps < MEMISPECT_HASHMAP_REHASH_STEP) && (_rehashIndex < _tables[0].count); ++_rehashIndex) {
+        auto &from { _tables[0].buckets[_rehashIndex] };
+
+        if (from.head() == nullptr) {
+          if (--emptyVisits == 0)
+            break;
+
+          continue;
+        }
+
+        while (auto n = from.unlink())
+          bucket (_tables[1], n->key).link (n);
+
+        ++steps;
+      }
+
+      if (_rehashIndex == _tables[0].count) {
+        release (_tables[0]);
+        _tables[0] = std::exchange (_tables[1], Table {});
+      }
+    }
+
+    Table _tables[2];          ///< The current buckets and, while rehashing, the new ones.
+    size_t _rehashIndex { 0 }; ///< The next bucket of the old array to migrate.
+    size_t _size { 0 };        ///< The number of elements.
+};
+
+/// @brief HashMap split into independently locked shards.
+/// A pointer is always routed to the same shard, so threads working on different shards never contend.
+/// @tparam N The number of shards.
+/// @tparam S The initial number of buckets of each shard.
+/// @tparam Hash The policy that maps a pointer to a bucket inside its shard.
+template<typename K, typename V, typename Allocator, size_t N=MEMISPECT_HASHMAP_SHARDS, size_t S=MEMISPECT_HASHMAP_SIZE, typename Hash=FibonacciHash>
+class ShardedHashMapPtr {
+  public:
+    using value_type = V; ///< The type of the values.
+
+    /// @brief Inserts an element.
+    /// @param p The key pointer to insert.
+    /// @param v The value to insert.
+    /// @return true if the element was inserted, false if its node or the buckets cannot be allocated.
+    inline bool add (K *p, V &&v) {
+      auto &s { shard (p) };
+      std::lock_guard<Mutex> guard { s.mutex };
+
+      return s.map.add (p, std::forward<V> (v)) != nullptr;
+    }
+
+    /// @brief Deletes an element.
+    /// @param p The key pointer to delete.
+    /// @return An optional containing the value of the deleted element, or nullopt if not found.
+    inline std::optional<V> remove (K *p) {
+      auto &s { shard (p) };
+      std::lock_guard<Mutex> guard { s.mutex };
+
+      return s.map.remove (p);
+    }
+
+    /// @brief Finds an element.
+    /// @param p The key pointer to search for.
+    /// @return An optional containing a copy of the value, or nullopt if not found.
+    inline std::optional<V> find (K *p) {
+      auto &s { shard (p) };
+      std::lock_guard<Mutex> guard { s.mutex };
+
+      const auto n { s.map.find (p) };
+      if (n == nullptr)
+        return std::nullopt;
+
+      return { n->value };
+    }
+
+    /// @brief Computes the occupancy statistics of all the shards.
+    /// Each shard is locked while it is walked.
+    HashMapStats stats() {
+      HashMapStats st {};
+
+      for (auto &s : _shards) {
+        // read first, so the statistics do not count the lock taken to walk the shard.
+        const auto locks { s.mutex.stats() };
+
+        std::lock_guard<Mutex> guard { s.mutex };
+        st += s.map.stats();
+        st.locks += locks;
+      }
+
+      return st;
+    }
+
+    /// @brief Calls a function for every element of all the shards.
+    /// Each shard is locked while it is walked, so the function must not allocate from the tracked allocator.
+    /// @param f The function, called with the key and the value of each element.
+    template<typename F>
+    void forEach (F &&f) {
+      for (auto &s : _shards) {
+        std::lock_guard<Mutex> guard { s.mutex };
+        s.map.forEach (f);
+      }
+    }
+
+  private:
+    /// @brief A HashMap and the mutex protecting it, padded to its own cache line.
+    struct alignas (MEMISPECT_CACHE_LINE_SIZE) Shard {
+      Mutex mutex;                              ///< Protects the map of this shard.
+      HashMapPtr<K, V, Allocator, S, Hash> map; ///< Elements routed to this shard.
+    };
+
+    /// @brief Gets the shard of a key.
+    /// The shard is picked from the middle bits of a multiplicative hash, so it stays independent of the
+    /// bucket chosen by the hash policy inside the shard.
+    inline Shard & shard (K *p) {
+      return _shards[((static_cast<uint64_t> (reinterpret_cast<uintptr_t> (p)) * UINT64_C (0x9E3779B97F4A7C15)) >> 32) % N];
+    }
+
+    std::array<Shard, N> _shards;
+};
+
+/// @brief Lock-free HashMap with open addressing.
+/// The elements are stored inline in a single array of slots, so a lookup touches one or two cache lines.
+/// Slots are claimed with an atomic CAS on the key and released by turning the key into a tombstone.
+/// `add` reuses the first tombstone on its probe path, and `remove` turns the tombstones at the end of a run of
+/// used slots back into empty slots, so churn does not leave the table full of tombstones that every miss has to
+/// walk past.
+/// A claimed slot holds a busy marker until its value is written, and only then is the key stored, so a lookup
+/// that finds the key also sees the value.
+/// The capacity is fixed: once every slot is taken, `add` fails.
+/// @note The keys `nullptr`, `1`, `2` and `3` are reserved to mark empty, deleted, busy and sweeping slots.
+/// @tparam S The number of slots. It must be a power of two.
+/// @tparam Hash The policy that maps a pointer to its home slot.
+template<typename K, typename V, typename Allocator, size_t S=MEMISPECT_OPEN_HASHMAP_SIZE, typename Hash=FibonacciHash>
+class OpenHashMapPtr {
+  static_assert ((S > 1) && ((S & (S - 1)) == 0), "the number of slots must be a power of two");
+
+  public:
+    using value_type = V; ///< The type of the values.
+
+    /// @brief Inserts an element.
+    /// @param p The key pointer to insert.
+    /// @param v The value to insert.
+    /// @return true if the element was inserted, false if the table is full.
+    inline bool add (K *p, V &&v) {
+      const auto key { reinterpret_cast<uintptr_t> (p) };
+      assert (key > Sweeping);
+
+      const auto home { index (key) };
+      for (;;) {
+        const auto probe { claim (home) };
+        if (probe == S)
+          return false;
+
+        auto &slot { _slots[(home + probe) & (S - 1)] };
+
+        // a tombstone on the probe path was emptied before the claim, so lookups would stop short of this slot.
+        if (!linked (home, probe)) {
+          release ((home + probe) & (S - 1));
+          continue;
+        }
+
+        slot.value = std::forward<V> (v);
+        slot.key.store (key, std::memory_order_release);
+
+        // lookups give up after the longest probe sequence ever used.
+        auto longest { _longestProbe.load (std::memory_order_relaxed) };
+        while ((longest < probe) && !_longestProbe.compare_exchange_weak (longest, probe, std::memory_order_relaxed)) {
+          // empty
+        }
+
+        return true;
+      }
+    }
+
+    /// @brief Deletes an element.
+    /// @param p The key pointer to delete.
+    /// @return An optional containing the value of the deleted element, or nullopt if not found.
+    inline std::optional<V> remove (K *p) {
+      const auto slot { lookup (reinterpret_cast<uintptr_t> (p)) };
+      if (slot == nullptr)
+        return std::nullopt;
+
+      const V v { slot->value };
+
+      auto key { reinterpret_cast<uintptr_t> (p) };
+      if (!slot->key.compare_exchange_strong (key, Tombstone, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return std::nullopt;
+
+      sweep (static_cast<size_t> (slot - _slots.data()));
+      return { v };
+    }
+
+    /// @brief Finds an element.
+    /// @param p The key pointer to search for.
+    /// @return An optional containing a copy of the value, or nullopt if not found.
+    inline std::optional<V> find (K *p) {
+      const auto slot { lookup (reinterpret_cast<uintptr_t> (p)) };
+      if (slot == nullptr)
+        return std::nullopt;
+
+      return { slot->value };
+    }
+
+    /// @brief Computes the occupancy statistics by walking every slot.
+    /// The walk does not stop concurrent writers, so the result is approximate while the table is being modified.
+    /// @return The statistics. The chain length of an element is its probe distance from its home slot plus one.
+    HashMapStats stats() const {
+      HashMapStats st {};
+      size_t probes { 0 };
+
+      st.buckets = S;
+
+      for (size_t i = 0; i < S; ++i) {
+        const auto key { _slots[i].key.load (std::memory_order_relaxed) };
+
+        if ((key == Tombstone) || (key == Sweeping)) {
+          ++st.tombstones;
+        }
+        else if (key > Sweeping) {
+          const auto length { ((i - index (key)) & (S - 1)) + 1 };
+
+          ++st.size;
+          probes += length;
+          if (length > st.maxChainLength)
+            st.maxChainLength = length;
+        }
+      }
+
+      st.usedBuckets = st.size;
+      st.averageProbes = st.size > 0 ? static_cast<double> (probes) / st.size : 0;
+
+      return st;
+    }
+
+    /// @brief Calls a function for every element.
+    /// The walk does not stop concurrent writers, so elements added or removed meanwhile may be missed or seen.
+    /// @param f The function, called with the key and the value of each element.
+    template<typename F>
+    void forEach (F &&f) const {
+      for (const auto &slot : _slots) {
+        const auto key { slot.key.load (std::memory_order_acquire) };
+        if (key > Sweeping)
+          f (reinterpret_cast<K *> (key), slot.value);
+      }
     }
 
   private:
-    std::array<SortedList<K *, V, Allocator>, S> _map;
+    static constexpr uintptr_t Empty { 0 };     ///< Key of a slot that was never used.
+    static constexpr uintptr_t Tombstone { 1 }; ///< Key of a slot whose element was deleted.
+    static constexpr uintptr_t Busy { 2 };      ///< Key of a slot claimed by `add` whose value is not written yet.
+    static constexpr uintptr_t Sweeping { 3 };  ///< Key of a tombstone that `remove` is turning back into Empty.
+
+    /// @brief An inlined key/value pair.
+    struct Slot {
+      std::atomic<uintptr_t> key { Empty }; ///< The key, Empty, Tombstone, Busy or Sweeping.
+      V value {};                           ///< The value, published by the release store of the key.
+    };
+
+    /// @brief Gets the home slot of a key.
+    static inline size_t index (uintptr_t key) {
+      return Hash::index (key, S);
+    }
+
+    /// @brief Claims the first empty slot or tombstone on the probe path of a home slot.
+    /// @return The probe distance of the claimed slot, now Busy, or S if the table is full.
+    inline size_t claim (size_t home) {
+      for (size_t probe = 0; probe < S; ++probe) {
+        auto &slot { _slots[(home + probe) & (S - 1)] };
+        auto current { slot.key.load (std::memory_order_relaxed) };
+
+        while ((current == Empty) || (current == Tombstone)) {
+          if (slot.key.compare_exchange_weak (current, Busy, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return probe;
+        }
+      }
+
+      return S;
+    }
+
+    /// @brief Checks that no slot before a claimed one on its probe path is empty or being swept.
+    /// `sweep` only empties a tombstone after seeing the slot that follows empty. Walking back from the claimed
+    /// slot, which stays Busy, every slot that passes the check is followed by one that cannot become empty anymore.
+    inline bool linked (size_t home, size_t probe) const {
+      for (size_t i = probe; i > 0; --i) {
+        const auto key { _slots[(home + i - 1) & (S - 1)].key.load (std::memory_order_seq_cst) };
+        if ((key == Empty) || (key == Sweeping))
+          return false;
+      }
+
+      return true;
+    }
+
+    /// @brief Gives back a claimed slot that `add` could not use.
+    inline void release (size_t i) {
+      _slots[i].key.store (Tombstone, std::memory_order_seq_cst);
+      sweep (i);
+    }
+
+    /// @brief Empties a tombstone, and the ones before it, when no probe path goes through it.
+    /// The tombstone is marked Sweeping before the check, so an `add` that claims a slot behind it meanwhile sees the
+    /// mark and retries.
+    inline void sweep (size_t i) {
+      for (size_t n = 0; n < S; ++n, i = (i - 1) & (S - 1)) {
+        auto &slot { _slots[i] };
+        auto expected { Tombstone };
+        if (!slot.key.compare_exchange_strong (expected, Sweeping, std::memory_order_seq_cst, std::memory_order_relaxed))
+          return;
+
+        if (!unreachable (i)) {
+          slot.key.store (Tombstone, std::memory_order_seq_cst);
+          return;
+        }
+
+        slot.key.store (Empty, std::memory_order_seq_cst);
+      }
+    }
+
+    /// @brief Checks that no element up to the next empty slot has its home at or before a slot.
+    /// A busy slot may be an element about to be published, so it fails the check.
+    inline bool unreachable (size_t i) const {
+      for (size_t distance = 1; distance < S; ++distance) {
+        const auto j { (i + distance) & (S - 1) };
+        const auto key { _slots[j].key.load (std::memory_order_seq_cst) };
+
+        if (key == Empty)
+          return true;
+        if ((key == Busy) || ((key > Sweeping) && (((j - index (key)) & (S - 1)) >= distance)))
+          return false;
+      }
+
+      return false;
+    }
+
+    /// @brief Finds the slot of a key.
+    /// The probe stops on an empty slot, since no probe path goes through an empty slot.
+    inline Slot * lookup (uintptr_t key) {
+      const auto longest { _longestProbe.load (std::memory_order_relaxed) };
+
+      auto i { index (key) };
+      for (size_t probe = 0; probe <= longest; ++probe, i = (i + 1) & (S - 1)) {
+        auto &slot { _slots[i] };
+        const auto current { slot.key.load (std::memory_order_acquire) };
+
+        if (current == key)
+          return &slot;
+        if (current == Empty)
+          return nullptr;
+      }
+
+      return nullptr;
+    }
+
+    alignas (MEMISPECT_CACHE_LINE_SIZE) std::array<Slot, S> _slots {};         ///< The slots.
+    alignas (MEMISPECT_CACHE_LINE_SIZE) std::atomic<size_t> _longestProbe { 0 }; ///< The longest probe sequence used by `add`.
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
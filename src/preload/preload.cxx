@@ -0,0 +1,258 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include <meminspect/default_allocator.h>
+#include <meminspect/memory_inspector.h>
+#include <meminspect/sampler.h>
+#include <meminspect/types.h>
+
+
+namespace {
+
+/// @brief A table that is never destroyed.
+/// The static destructors would empty it before the heap dump written at exit, and the blocks freed by the
+/// destructors of other libraries would no longer be found.
+template<typename Table>
+class Persistent {
+  public:
+    using value_type = typename Table::value_type;
+
+    constexpr Persistent() : _table {} {
+      // empty
+    }
+
+    ~Persistent() {
+      // empty: the table lives until the process ends.
+    }
+
+    template<typename V>
+    inline bool add (void *p, V &&v) { return _table.add (p, std::forward<V> (v)); }
+    inline std::optional<value_type> remove (void *p) { return _table.remove (p); }
+    inline meminspect::HashMapStats stats() { return _table.stats(); }
+
+    template<typename F>
+    inline void forEach (F &&f) { _table.forEach (std::forward<F> (f)); }
+
+  private:
+    union {
+      Table _table; ///< The table.
+    };
+};
+
+using Table = Persistent<meminspect::ShardedHashMapPtr<void, size_t, meminspect::DefaultAllocator>>;
+using StackTable = Persistent<meminspect::ShardedHashMapPtr<void, meminspect::Block, meminspect::DefaultAllocator>>;
+
+using ExactInspector = meminspect::MemoryInspector<meminspect::DefaultAllocator, Table>;
+using StacksInspector = meminspect::MemoryInspector<meminspect::DefaultAllocator, StackTable>;
+using SampledInspector = meminspect::MemoryInspector<meminspect::DefaultAllocator, meminspect::Sampled<StackTable>>;
+
+/// @brief The modes of the preload library.
+enum class Mode : uint8_t { Unset, Off, Exact, Stacks, Sampled };
+
+/// @brief Passes the calls through to the real allocator, without tracking them.
+struct Untracked {
+  static inline void * alloc (size_t size) { return meminspect::DefaultAllocator::malloc (size); }
+  static inline void * realloc (void *ptr, size_t size) { return meminspect::DefaultAllocator::realloc (ptr, size); }
+  static inline void * calloc (size_t num, size_t size) { return meminspect::DefaultAllocator::calloc (num, size); }
+  static inline void * aligned_alloc (size_t alignment, size_t size) { return meminspect::DefaultAllocator::aligned_alloc (alignment, size); }
+  static inline void dealloc (void *ptr, size_t size = 0, size_t alignment = 0) {
+    if (size == 0)
+      meminspect::DefaultAllocator::free (ptr);
+    else if (alignment == 0)
+      meminspect::DefaultAllocator::free_sized (ptr, size);
+    else
+      meminspect::DefaultAllocator::free_aligned_sized (ptr, alignment, size);
+  }
+
+  static inline size_t usable_size (void *ptr) { return ptr != nullptr ? meminspect::DefaultAllocator::malloc_usable_size (ptr) : 0; }
+
+  using PeakEpoch = meminspect::HighWaterMarks::Epoch;
+
+  static inline meminspect::Snapshot add() { return {}; }
+  static inline meminspect::Snapshot add (PeakEpoch *&epoch) { epoch = nullptr; return {}; }
+  static inline void remove() {}
+  static inline meminspect::Snapshot snapshot() { return {}; }
+  static inline PeakEpoch * addPeak() { return nullptr; }
+  static inline void removePeak (PeakEpoch *) {}
+  static inline size_t peakSince (const meminspect::Snapshot &, const PeakEpoch *) { return 0; }
+  static inline meminspect::SizeHistogram histogram() { return {}; }
+
+  template<typename F>
+  static inline void forEach (F &&) {}
+};
+
+/// @brief The inspector of the preload library, whose storage policy is picked at run time.
+/// The mode is read from the MEMISPECT_MODE environment variable on the first call to the hooks and never changes
+/// afterwards, so every block is freed by the inspector that allocated it:
+/// - `exact` (the default): a table of the live blocks.
+/// - `stacks`: a table of the live blocks with their allocation stacks.
+/// - `sampled`: only sampled blocks, with their allocation stacks; MEMISPECT_SAMPLE_RATE sets the mean number of
+///   bytes between samples (MEMISPECT_SAMPLING_INTERVAL by default).
+/// - `off`: the calls go straight to the real allocator (they can still be traced).
+/// Each call costs one predictable branch on top of the inspector of the mode.
+class PreloadInspector {
+  public:
+    using PeakEpoch = meminspect::HighWaterMarks::Epoch;
+    static constexpr bool CapturesStacks { true }; ///< Whether the call stacks may be captured (by some of the modes).
+
+    static inline void * alloc (size_t size) {
+      return dispatch ([&] (auto t) { return decltype (t)::type::alloc (size); });
+    }
+
+    static inline void * realloc (void *ptr, size_t size) {
+      return dispatch ([&] (auto t) { return decltype (t)::type::realloc (ptr, size); });
+    }
+
+    static inline void * calloc (size_t num, size_t size) {
+      return dispatch ([&] (auto t) { return decltype (t)::type::calloc (num, size); });
+    }
+
+    static inline void * aligned_alloc (size_t alignment, size_t size) {
+      return dispatch ([&] (auto t) { return decltype (t)::type::aligned_alloc (alignment, size); });
+    }
+
+    static inline void dealloc (void *ptr, size_t size = 0, size_t alignment = 0) {
+      dispatch ([&] (auto t) { decltype (t)::type::dealloc (ptr, size, alignment); });
+    }
+
+    static inline size_t usable_size (void *ptr) {
+      return dispatch ([&] (auto t) { return decltype (t)::type::usable_size (ptr); });
+    }
+
+    static inline meminspect::Snapshot add() {
+      return dispatch ([&] (auto t) { return decltype (t)::type::add(); });
+    }
+
+    static inline meminspect::Snapshot add (PeakEpoch *&epoch) {
+      return dispatch ([&] (auto t) { return decltype (t)::type::add (epoch); });
+    }
+
+    static inline void remove() {
+      dispatch ([&] (auto t) { decltype (t)::type::remove(); });
+    }
+
+    static inline meminspect::Snapshot snapshot() {
+      return dispatch ([&] (auto t) { return decltype (t)::type::snapshot(); });
+    }
+
+    static inline PeakEpoch * addPeak() {
+      return dispatch ([&] (auto t) { return decltype (t)::type::addPeak(); });
+    }
+
+    static inline void removePeak (PeakEpoch *epoch) {
+      dispatch ([&] (auto t) { decltype (t)::type::removePeak (epoch); });
+    }
+
+    static inline size_t peakSince (const meminspect::Snapshot &baseline, const PeakEpoch *epoch) {
+      return dispatch ([&] (auto t) { return decltype (t)::type::peakSince (baseline, epoch); });
+    }
+
+    static inline meminspect::SizeHistogram histogram() {
+      return dispatch ([&] (auto t) { return decltype (t)::type::histogram(); });
+    }
+
+    /// @brief Calls a function for every live block of the inspector of the mode (see MemoryInspector::forEach).
+    template<typename F>
+    static void forEach (F &&f) {
+      dispatch ([&] (auto t) { decltype (t)::type::forEach (f); });
+    }
+
+  private:
+    /// @brief Calls a function with the type of the inspector of the mode (as `std::type_identity`).
+    template<typename F>
+    static inline auto dispatch (F &&f) -> decltype (f (std::type_identity<ExactInspector> {})) {
+      auto mode { _mode.load (std::memory_order_relaxed) };
+      if (__builtin_expect (mode == Mode::Unset, 0))
+        mode = configure();
+
+      switch (mode) {
+        case Mode::Stacks: return f (std::type_identity<StacksInspector> {});
+        case Mode::Sampled: return f (std::type_identity<SampledInspector> {});
+        case Mode::Off: return f (std::type_identity<Untracked> {});
+        default: return f (std::type_identity<ExactInspector> {});
+      }
+    }
+
+    /// @brief Reads the mode from the environment.
+    /// It runs in the first call to the hooks, so it must not allocate: `getenv` and `strtoull` do not.
+    static Mode configure() {
+      const auto name { std::getenv ("MEMISPECT_MODE") };
+
+      Mode mode { Mode::Exact };
+      if (name != nullptr) {
+        if (std::strcmp (name, "off") == 0)
+          mode = Mode::Off;
+        else if (std::strcmp (name, "stacks") == 0)
+          mode = Mode::Stacks;
+        else if (std::strcmp (name, "sampled") == 0)
+          mode = Mode::Sampled;
+      }
+
+      // a rate that is not a positive number of bytes keeps MEMISPECT_SAMPLING_INTERVAL.
+      const auto rate { std::getenv ("MEMISPECT_SAMPLE_RATE") };
+      if ((mode == Mode::Sampled) && (rate != nullptr) && (rate[0] >= '0') && (rate[0] <= '9')) {
+        // errno belongs to the caller of the hook.
+        const auto error { errno };
+        char *end { nullptr };
+        errno = 0;
+
+        const auto bytes { std::strtoull (rate, &end, 10) };
+        if ((*end == '\0') && (errno == 0) && (bytes != 0))
+          meminspect::Sampler::setInterval (bytes);
+
+        errno = error;
+      }
+
+      // threads that race here read the same environment, so they agree on the mode.
+      _mode.store (mode, std::memory_order_relaxed);
+
+      return mode;
+    }
+
+    static inline std::atomic<Mode> _mode { Mode::Unset }; ///< The mode.
+};
+
+}
+
+#define MEMISPECT_INSPECTOR PreloadInspector
+#include <meminspect/memory_hook.h>
+#include <meminspect/heap_dump.h>
+#include <meminspect/stats_segment.h>
+
+
+/// @brief Writes a heap dump of the live blocks (see meminspect::HeapDump), e.g. from a debugger attached to the
+/// process: `call meminspect_dump ("app.dump")`.
+/// @param path The file to write.
+/// @return 0, or -1 if the file cannot be written.
+extern "C" MEMISPECT_HOOK int meminspect_dump (const char *path) {
+  return meminspect::HeapDump::write<meminspect::DefaultInspector> (path) ? 0 : -1;
+}
+
+namespace {
+
+/// @brief Writes a heap dump to the file named by the MEMISPECT_DUMP_FILE environment variable when the program exits.
+__attribute__ ((constructor (103))) void dumpOnExit() {
+  if (std::getenv ("MEMISPECT_DUMP_FILE") != nullptr)
+    std::atexit ([] { meminspect_dump (std::getenv ("MEMISPECT_DUMP_FILE")); });
+}
+
+/// @brief Publishes the counters to the stats segment named by the MEMISPECT_STATS_SEGMENT environment variable
+/// (`meminspect.<pid>` when it is empty), to be polled with `meminspect-stat`.
+__attribute__ ((constructor (103))) void publishStats() {
+  const auto name { std::getenv ("MEMISPECT_STATS_SEGMENT") };
+  if (name != nullptr)
+    meminspect::StatsPublisher<meminspect::DefaultInspector>::start (name[0] != '\0' ? name : nullptr);
+}
+
+}
@@ -0,0 +1,86 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <cstdint>
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/default_allocator.h>
+
+
+// ----------------------------------------------------------------------------
+// test_bootstrap_arena
+// ----------------------------------------------------------------------------
+TEST (DefaultAllocator, test_bootstrap_arena) {
+  const auto used { meminspect::BootstrapArena::usedBytes() };
+
+  const auto p0 { static_cast<char *> (meminspect::BootstrapArena::alloc (8, 100)) };
+  const auto p1 { meminspect::BootstrapArena::alloc (256, 10) };
+  ASSERT_NE (p0, nullptr);
+  ASSERT_NE (p1, nullptr);
+  ASSERT_TRUE (meminspect::BootstrapArena::owns (p0));
+  ASSERT_TRUE (meminspect::BootstrapArena::owns (p1));
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (p0) % meminspect::BootstrapArena::HeaderSize, 0);
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (p1) % 256, 0);
+  ASSERT_EQ (meminspect::BootstrapArena::size (p0), 100);
+  ASSERT_EQ (meminspect::BootstrapArena::size (p1), 10);
+  ASSERT_GT (meminspect::BootstrapArena::usedBytes(), used);
+
+  // the arena is never reused, so its blocks are zero-filled.
+  for (size_t i = 0; i < 100; ++i)
+    ASSERT_EQ (p0[i], 0);
+
+  ASSERT_EQ (meminspect::BootstrapArena::alloc (16, MEMISPECT_BOOTSTRAP_SIZE), nullptr);
+
+  int local { 0 };
+  ASSERT_FALSE (meminspect::BootstrapArena::owns (&local));
+}
+
+// ----------------------------------------------------------------------------
+// test_arena_blocks
+// ----------------------------------------------------------------------------
+TEST (DefaultAllocator, test_arena_blocks) {
+  const auto p { static_cast<char *> (meminspect::BootstrapArena::alloc (16, 32)) };
+  std::memset (p, 7, 32);
+
+  // the blocks of the arena are handled by the default allocator: free ignores them and realloc moves them out.
+  ASSERT_EQ (meminspect::DefaultAllocator::malloc_usable_size (p), 32);
+
+  const auto q { static_cast<char *> (meminspect::DefaultAllocator::realloc (p, 64)) };
+  ASSERT_NE (q, nullptr);
+  ASSERT_FALSE (meminspect::BootstrapArena::owns (q));
+  for (size_t i = 0; i < 32; ++i)
+    ASSERT_EQ (q[i], 7);
+
+  meminspect::DefaultAllocator::free (p);
+  meminspect::DefaultAllocator::free (q);
+}
+
+// ----------------------------------------------------------------------------
+// test_real_allocator
+// ----------------------------------------------------------------------------
+TEST (DefaultAllocator, test_real_allocator) {
+  ASSERT_TRUE (meminspect::DefaultAllocator::resolve());
+
+  const auto p { meminspect::DefaultAllocator::malloc (100) };
+  ASSERT_NE (p, nullptr);
+  ASSERT_FALSE (meminspect::BootstrapArena::owns (p));
+  ASSERT_GE (meminspect::DefaultAllocator::malloc_usable_size (p), 100);
+
+  const auto q { meminspect::DefaultAllocator::realloc (p, 1000) };
+  ASSERT_GE (meminspect::DefaultAllocator::malloc_usable_size (q), 1000);
+
+  const auto c { static_cast<char *> (meminspect::DefaultAllocator::calloc (10, 10)) };
+  for (size_t i = 0; i < 100; ++i)
+    ASSERT_EQ (c[i], 0);
+
+  const auto a { meminspect::DefaultAllocator::aligned_alloc (128, 256) };
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (a) % 128, 0);
+
+  meminspect::DefaultAllocator::free (q);
+  meminspect::DefaultAllocator::free (c);
+  meminspect::DefaultAllocator::free (a);
+}
@@ -0,0 +1,152 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/delta_counters.h>
+
+
+// ----------------------------------------------------------------------------
+// test_read
+// ----------------------------------------------------------------------------
+TEST (DeltaCounters, test_read) {
+  using Counters = meminspect::DeltaCounters<struct ReadTag>;
+
+  Counters::allocated (100);
+  Counters::allocated (50);
+  Counters::freed (100);
+
+  // the deltas are still in the buffer of this thread, but the read is exact.
+  const auto s { Counters::read() };
+  ASSERT_EQ (s.allocated, 150);
+  ASSERT_EQ (s.freed, 100);
+  ASSERT_EQ (s.allocations, 2);
+  ASSERT_EQ (s.frees, 1);
+  ASSERT_EQ (s.since (meminspect::Snapshot {}), 50);
+
+  // crossing the threshold flushes the buffer.
+  Counters::allocated (MEMISPECT_DELTA_THRESHOLD);
+  ASSERT_EQ (Counters::read().allocated, 150 + MEMISPECT_DELTA_THRESHOLD);
+}
+
+// ----------------------------------------------------------------------------
+// test_threads
+// ----------------------------------------------------------------------------
+TEST (DeltaCounters, test_threads) {
+  using Counters = meminspect::DeltaCounters<struct ThreadsTag>;
+
+  std::atomic<bool> stop { false };
+
+  // the counters never go backwards, whatever the flushes of the writers.
+  std::thread reader ([ &stop ] () {
+    meminspect::Snapshot last {};
+    while (!stop.load (std::memory_order_acquire)) {
+      const auto s { Counters::read() };
+      ASSERT_GE (s.allocated, last.allocated);
+      ASSERT_GE (s.allocations, last.allocations);
+      last = s;
+    }
+  });
+
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 4; ++t) {
+    writers.emplace_back ([] () {
+      for (int i = 0; i < 100000; ++i) {
+        Counters::allocated (24);
+        Counters::freed (24);
+      }
+
+      Counters::allocated (1);
+    });
+  }
+
+  for (auto &w : writers)
+    w.join();
+
+  stop.store (true, std::memory_order_release);
+  reader.join();
+
+  // the buffers of the writers were flushed when they exited.
+  const auto s { Counters::read() };
+  ASSERT_EQ (s.allocated, 4 * ((100000 * 24) + 1));
+  ASSERT_EQ (s.freed, 4 * 100000 * 24);
+  ASSERT_EQ (s.allocations, 4 * 100001);
+  ASSERT_EQ (s.frees, 4 * 100000);
+}
+
+// ----------------------------------------------------------------------------
+// test_high_water_marks
+// ----------------------------------------------------------------------------
+TEST (DeltaCounters, test_high_water_marks) {
+  meminspect::HighWaterMarks marks;
+
+  // without epochs, nothing is recorded.
+  marks.update (1000);
+
+  const auto e0 { marks.open (100) };
+  marks.update (500);
+  marks.update (200);
+
+  const auto e1 { marks.open (200) };
+  marks.update (300);
+  ASSERT_EQ (marks.peak (*e0), 500);
+  ASSERT_EQ (marks.peak (*e1), 300);
+
+  // the mark of a closed epoch is kept for the older ones.
+  const auto e2 { marks.open (300) };
+  marks.update (800);
+  marks.close (e2);
+  ASSERT_EQ (marks.peak (*e0), 800);
+  ASSERT_EQ (marks.peak (*e1), 800);
+
+  // an older epoch can be closed first.
+  marks.close (e0);
+  marks.update (250);
+  ASSERT_EQ (marks.peak (*e1), 800);
+
+  const auto e3 { marks.open (250) };
+  marks.update (100);
+  ASSERT_EQ (marks.peak (*e3), 250);
+  marks.update (-50);
+  ASSERT_EQ (marks.peak (*e3), 250);
+
+  marks.close (e1);
+  marks.close (e3);
+}
+
+// ----------------------------------------------------------------------------
+// test_peak
+// ----------------------------------------------------------------------------
+TEST (DeltaCounters, test_peak) {
+  using Counters = meminspect::DeltaCounters<struct PeakTag>;
+
+  Counters::allocated (100);
+  const auto epoch { Counters::mark() };
+  ASSERT_NE (epoch, nullptr);
+
+  // large blocks flush the buffer, so they raise the mark even if they are freed before the next read.
+  Counters::allocated (MEMISPECT_DELTA_THRESHOLD * 4);
+  Counters::freed (MEMISPECT_DELTA_THRESHOLD * 4);
+  ASSERT_EQ (Counters::peak (*epoch), 100 + (MEMISPECT_DELTA_THRESHOLD * 4));
+
+  // buffered deltas are caught by the reads.
+  const auto newer { Counters::mark() };
+  Counters::allocated (MEMISPECT_DELTA_THRESHOLD / 2);
+  ASSERT_EQ (Counters::peak (*newer), 100 + (MEMISPECT_DELTA_THRESHOLD / 2));
+  Counters::freed (MEMISPECT_DELTA_THRESHOLD / 2);
+
+  Counters::allocated (10);
+  Counters::reallocated();
+  ASSERT_EQ (Counters::peak (*newer), 100 + (MEMISPECT_DELTA_THRESHOLD / 2));
+  ASSERT_EQ (Counters::peak (*epoch), 100 + (MEMISPECT_DELTA_THRESHOLD * 4));
+  ASSERT_EQ (Counters::read().reallocations, 1);
+
+  Counters::unmark (newer);
+  Counters::unmark (epoch);
+}
@@ -0,0 +1,208 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <malloc.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/memory_inspector.h>
+
+
+namespace {
+
+struct TestAllocator {
+  static meminspect::malloc_t malloc;
+  static meminspect::realloc_t realloc;
+  static meminspect::calloc_t calloc;
+  static meminspect::aligned_alloc_t aligned_alloc;
+  static meminspect::free_t free;
+  static meminspect::malloc_usable_size_t malloc_usable_size;
+};
+meminspect::malloc_t TestAllocator::malloc { ::malloc };
+meminspect::realloc_t TestAllocator::realloc { ::realloc };
+meminspect::calloc_t TestAllocator::calloc { ::calloc };
+meminspect::aligned_alloc_t TestAllocator::aligned_alloc { ::aligned_alloc };
+meminspect::free_t TestAllocator::free { ::free };
+meminspect::malloc_usable_size_t TestAllocator::malloc_usable_size { ::malloc_usable_size };
+
+using DeferredInspector = meminspect::MemoryInspector<TestAllocator, meminspect::Deferred<meminspect::ShardedHashMapPtr<void, size_t, TestAllocator>>>;
+using DeferredStackInspector = meminspect::MemoryInspector<TestAllocator, meminspect::Deferred<meminspect::OpenHashMapPtr<void, meminspect::Block, TestAllocator>>>;
+
+}
+
+
+// ----------------------------------------------------------------------------
+// test_deferred
+// ----------------------------------------------------------------------------
+TEST (EventPipeline, test_deferred) {
+  const auto baseline { DeferredInspector::add() };
+  const auto before { DeferredInspector::stats() };
+
+  void *mem0 { DeferredInspector::alloc (100) };
+  void *mem1 { DeferredInspector::calloc (2, 50) };
+  void *mem2 { DeferredInspector::aligned_alloc (64, 128) };
+
+  // the queries apply the pending events first.
+  ASSERT_EQ (DeferredInspector::bytesSince (baseline), 328);
+  ASSERT_EQ (DeferredInspector::stats().size, before.size + 3);
+  ASSERT_GE (DeferredInspector::usable_size (mem2), 128);
+
+  mem0 = DeferredInspector::realloc (mem0, 300);
+  ASSERT_EQ (DeferredInspector::bytesSince (baseline), 528);
+
+  ASSERT_EQ (DeferredInspector::realloc (mem2, 0), nullptr);
+  DeferredInspector::dealloc (mem0);
+  DeferredInspector::dealloc (mem1);
+  ASSERT_EQ (DeferredInspector::bytesSince (baseline), 0);
+  ASSERT_EQ (DeferredInspector::stats().size, before.size);
+
+  DeferredInspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_ring_overflow
+// ----------------------------------------------------------------------------
+TEST (EventPipeline, test_ring_overflow) {
+  const auto baseline { DeferredInspector::add() };
+
+  // more events than a ring holds: the thread drains the pipeline itself when its ring is full.
+  std::vector<void *> blocks;
+  for (int i = 0; i < 4 * MEMISPECT_RING_SIZE; ++i)
+    blocks.push_back (DeferredInspector::alloc (16));
+
+  ASSERT_EQ (DeferredInspector::bytesSince (baseline), 4 * MEMISPECT_RING_SIZE * 16);
+
+  for (auto p : blocks)
+    DeferredInspector::dealloc (p);
+
+  ASSERT_EQ (DeferredInspector::bytesSince (baseline), 0);
+
+  DeferredInspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_thread_counters
+// ----------------------------------------------------------------------------
+TEST (EventPipeline, test_thread_counters) {
+  const auto baseline { DeferredInspector::addThread() };
+  void *mem { DeferredInspector::alloc (100) };
+
+  // allocations of other threads are not counted, even though the consumer applies them all.
+  std::thread ([] () { DeferredInspector::dealloc (DeferredInspector::alloc (1000)); }).join();
+
+  ASSERT_EQ (DeferredInspector::threadBytesSince (baseline), 100);
+
+  DeferredInspector::dealloc (mem);
+  ASSERT_EQ (DeferredInspector::threadBytesSince (baseline), 0);
+
+  DeferredInspector::removeThread();
+}
+
+// ----------------------------------------------------------------------------
+// test_consumer
+// ----------------------------------------------------------------------------
+TEST (EventPipeline, test_consumer) {
+  const auto baseline { DeferredInspector::add() };
+  const auto before { DeferredInspector::stats() };
+  ASSERT_TRUE (DeferredInspector::startConsumer());
+  ASSERT_FALSE (DeferredInspector::startConsumer());
+
+  constexpr size_t Blocks { 20000 };
+  constexpr size_t Pairs { 4 };
+
+  // each block is freed by another thread than the one that allocated it, so the addresses released by one
+  // thread are reused by others while their events are still in flight.
+  std::vector<std::atomic<void *>> slots (Pairs * Blocks);
+  std::vector<std::thread> workers;
+
+  for (size_t t = 0; t < Pairs; ++t) {
+    workers.emplace_back ([ &slots, t ] () {
+      for (size_t i = 0; i < Blocks; ++i)
+        slots[(t * Blocks) + i].store (DeferredInspector::alloc (8 + (i % 64)), std::memory_order_release);
+    });
+
+    workers.emplace_back ([ &slots, t ] () {
+      for (size_t i = 0; i < Blocks; ++i) {
+        void *p { nullptr };
+        while ((p = slots[(t * Blocks) + i].load (std::memory_order_acquire)) == nullptr) {
+          // empty
+        }
+
+        DeferredInspector::dealloc (p);
+      }
+    });
+  }
+
+  for (auto &w : workers)
+    w.join();
+
+  DeferredInspector::stopConsumer();
+
+  ASSERT_EQ (DeferredInspector::bytesSince (baseline), 0);
+  ASSERT_EQ (DeferredInspector::snapshot().since (baseline), 0);
+  ASSERT_EQ (DeferredInspector::snapshot().allocations - baseline.allocations, Pairs * Blocks);
+  ASSERT_EQ (DeferredInspector::stats().size, before.size);
+
+  DeferredInspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_thread_churn
+// ----------------------------------------------------------------------------
+TEST (EventPipeline, test_thread_churn) {
+  const auto baseline { DeferredInspector::add() };
+  ASSERT_TRUE (DeferredInspector::startConsumer());
+
+  constexpr size_t Spawners { 4 };
+  constexpr size_t Rounds { 200 };
+
+  // short-lived threads register their rings while others release theirs.
+  std::vector<std::thread> spawners;
+  for (size_t t = 0; t < Spawners; ++t) {
+    spawners.emplace_back ([] () {
+      for (size_t i = 0; i < Rounds; ++i) {
+        std::thread ([] () {
+          void *p { DeferredInspector::alloc (32) };
+          DeferredInspector::dealloc (DeferredInspector::alloc (64));
+          DeferredInspector::dealloc (p);
+        }).join();
+      }
+    });
+  }
+
+  for (auto &s : spawners)
+    s.join();
+
+  DeferredInspector::stopConsumer();
+
+  ASSERT_EQ (DeferredInspector::bytesSince (baseline), 0);
+  ASSERT_EQ (DeferredInspector::snapshot().allocations - baseline.allocations, 2 * Spawners * Rounds);
+
+  DeferredInspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_stacks
+// ----------------------------------------------------------------------------
+TEST (EventPipeline, test_stacks) {
+  const auto baseline { DeferredStackInspector::add() };
+
+  // the stack is captured by the allocating thread, not by the one applying the event.
+  void *mem { DeferredStackInspector::alloc (100) };
+  DeferredStackInspector::flush();
+
+  size_t bytes { 0 };
+  meminspect::StackDepot::forEach ([ &bytes ] (const meminspect::StackDepot::Stack &s) { bytes += s.liveBytes(); });
+  ASSERT_GE (bytes, 100);
+
+  DeferredStackInspector::dealloc (mem);
+  ASSERT_EQ (DeferredStackInspector::bytesSince (baseline), 0);
+
+  DeferredStackInspector::remove();
+}
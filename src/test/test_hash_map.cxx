@@ -4,8 +4,10 @@
 // Copyright (c) 2023 Carlos Carrasco
 // ----------------------------------------------------------------------------
 #include <stdlib.h>
+#include <algorithm>
 #include <memory>
 #include <string_view>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -36,7 +38,7 @@ class HashMapPtrTest: public ::testing::Test {
 // test_add
 // ----------------------------------------------------------------------------
 TEST_F (HashMapPtrTest, test_add) {
-  meminspect::HashMapPtr<int, std::string_view, TestAllocator, 10> hashMap;
+  meminspect::HashMapPtr<int, std::string_view, TestAllocator, 10, meminspect::ModuloHash> hashMap;
 
   const auto n0 { hashMap.add (reinterpret_cast<int *> (0), "zero") };
   ASSERT_EQ (n0->next, nullptr);
@@ -52,7 +54,7 @@ TEST_F (HashMapPtrTest, test_add) {
 // test_find
 // ----------------------------------------------------------------------------
 TEST_F (HashMapPtrTest, test_find) {
-  meminspect::HashMapPtr<int, std::string_view, TestAllocator, 10> hashMap;
+  meminspect::HashMapPtr<int, std::string_view, TestAllocator, 10, meminspect::ModuloHash> hashMap;
 
   ASSERT_EQ (hashMap.find (reinterpret_cast<int *> (1)), nullptr);
 
@@ -71,7 +73,7 @@ TEST_F (HashMapPtrTest, test_find) {
 // test_remove
 // ----------------------------------------------------------------------------
 TEST_F (HashMapPtrTest, test_remove) {
-  meminspect::HashMapPtr<int, std::string_view, TestAllocator, 10> hashMap;
+  meminspect::HashMapPtr<int, std::string_view, TestAllocator, 10, meminspect::ModuloHash> hashMap;
 
   const auto n0 { hashMap.add (reinterpret_cast<int *> (0), "zero") };
   ASSERT_NE (n0, nullptr);
@@ -102,4 +104,118 @@ TEST_F (HashMapPtrTest, test_remove) {
 
   for (int i = 0; i < 20; ++i)
     ASSERT_FALSE (hashMap.remove (reinterpret_cast<int *> (i)).has_value());
-}
\ No newline at end of file
+}
+// ----------------------------------------------------------------------------
+// test_sharded
+// ----------------------------------------------------------------------------
+TEST_F (HashMapPtrTest, test_sharded) {
+  meminspect::ShardedHashMapPtr<int, std::string_view, TestAllocator, 4, 10> hashMap;
+
+  ASSERT_FALSE (hashMap.find (reinterpret_cast<int *> (1)).has_value());
+
+  for (uintptr_t i = 0; i < 100; i += 3)
+    hashMap.add (reinterpret_cast<int *> (i), "value");
+
+  for (uintptr_t i = 0; i < 100; ++i)
+    ASSERT_EQ (hashMap.find (reinterpret_cast<int *> (i)).has_value(), (i % 3) == 0);
+
+  for (uintptr_t i = 0; i < 100; ++i)
+    ASSERT_EQ (hashMap.remove (reinterpret_cast<int *> (i)).has_value(), (i % 3) == 0);
+
+  for (uintptr_t i = 0; i < 100; ++i)
+    ASSERT_FALSE (hashMap.find (reinterpret_cast<int *> (i)).has_value());
+}
+
+// ----------------------------------------------------------------------------
+// test_grow_shrink
+// ----------------------------------------------------------------------------
+TEST_F (HashMapPtrTest, test_grow_shrink) {
+  meminspect::HashMapPtr<int, size_t, TestAllocator, 8> hashMap;
+
+  ASSERT_EQ (hashMap.buckets(), 0);
+
+  for (uintptr_t i = 1; i <= 1000; ++i) {
+    ASSERT_NE (hashMap.add (reinterpret_cast<int *> (i * 16), std::move (i)), nullptr);
+    ASSERT_LE (hashMap.size(), hashMap.buckets() * meminspect::DefaultLoadFactor::grow + MEMISPECT_HASHMAP_REHASH_STEP);
+  }
+
+  ASSERT_EQ (hashMap.size(), 1000);
+  ASSERT_GE (hashMap.buckets(), 1000 / meminspect::DefaultLoadFactor::grow);
+
+  for (uintptr_t i = 1; i <= 1000; ++i) {
+    const auto n { hashMap.find (reinterpret_cast<int *> (i * 16)) };
+    ASSERT_NE (n, nullptr);
+    ASSERT_EQ (n->value, i);
+  }
+
+  for (uintptr_t i = 1; i <= 1000; ++i)
+    ASSERT_EQ (*hashMap.remove (reinterpret_cast<int *> (i * 16)), i);
+
+  ASSERT_EQ (hashMap.size(), 0);
+  ASSERT_LT (hashMap.buckets(), 1000 / meminspect::DefaultLoadFactor::grow);
+
+  for (uintptr_t i = 1; i <= 1000; ++i)
+    ASSERT_EQ (hashMap.find (reinterpret_cast<int *> (i * 16)), nullptr);
+}
+
+// ----------------------------------------------------------------------------
+// test_hash_policies
+// ----------------------------------------------------------------------------
+template<typename Hash>
+static size_t usedBuckets (size_t buckets) {
+  std::vector<bool> used (buckets);
+
+  // 16-byte aligned pointers, like the ones returned by glibc.
+  for (uintptr_t i = 1; i <= buckets; ++i) {
+    const auto b { Hash::index (0x7f0000000000 + (i * 16), buckets) };
+    EXPECT_LT (b, buckets);
+    used[b] = true;
+  }
+
+  return std::count (used.begin(), used.end(), true);
+}
+
+TEST_F (HashMapPtrTest, test_hash_policies) {
+  constexpr size_t buckets { 1024 };
+
+  const auto modulo { usedBuckets<meminspect::ModuloHash> (buckets) };
+  ASSERT_EQ (modulo, buckets / 16);
+
+  ASSERT_EQ (usedBuckets<meminspect::AlignedModuloHash<4>> (buckets), buckets);
+  ASSERT_GT (usedBuckets<meminspect::FibonacciHash> (buckets), buckets / 2);
+  ASSERT_GT (usedBuckets<meminspect::XorShiftHash> (buckets), buckets / 2);
+}
+
+// ----------------------------------------------------------------------------
+// test_stats
+// ----------------------------------------------------------------------------
+TEST_F (HashMapPtrTest, test_stats) {
+  meminspect::HashMapPtr<int, size_t, TestAllocator, 10, meminspect::ModuloHash> hashMap;
+
+  auto st { hashMap.stats() };
+  ASSERT_EQ (st.size, 0);
+  ASSERT_EQ (st.usedBuckets, 0);
+  ASSERT_EQ (st.averageProbes, 0);
+
+  // bucket 0 gets a chain of 3, bucket 1 a chain of 1.
+  hashMap.add (reinterpret_cast<int *> (10), 0);
+  hashMap.add (reinterpret_cast<int *> (20), 0);
+  hashMap.add (reinterpret_cast<int *> (30), 0);
+  hashMap.add (reinterpret_cast<int *> (1), 0);
+
+  st = hashMap.stats();
+  ASSERT_EQ (st.size, 4);
+  ASSERT_EQ (st.buckets, 10);
+  ASSERT_EQ (st.usedBuckets, 2);
+  ASSERT_EQ (st.maxChainLength, 3);
+  ASSERT_DOUBLE_EQ (st.averageProbes, (1.0 + 2.0 + 3.0 + 1.0) / 4.0);
+
+  meminspect::ShardedHashMapPtr<int, size_t, TestAllocator, 4, 10> sharded;
+  for (uintptr_t i = 1; i <= 100; ++i)
+    sharded.add (reinterpret_cast<int *> (i * 16), 0);
+
+  st = sharded.stats();
+  ASSERT_EQ (st.size, 100);
+  ASSERT_GE (st.buckets, 40);
+  ASSERT_GE (st.averageProbes, 1.0);
+}
@@ -0,0 +1,142 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <malloc.h>
+#include <stdlib.h>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/heap_dump.h>
+#include <meminspect/in_band_header.h>
+#include <meminspect/memory_inspector.h>
+
+
+namespace {
+
+struct TestAllocator {
+  static meminspect::malloc_t malloc;
+  static meminspect::realloc_t realloc;
+  static meminspect::calloc_t calloc;
+  static meminspect::aligned_alloc_t aligned_alloc;
+  static meminspect::free_t free;
+  static meminspect::malloc_usable_size_t malloc_usable_size;
+};
+meminspect::malloc_t TestAllocator::malloc { ::malloc };
+meminspect::realloc_t TestAllocator::realloc { ::realloc };
+meminspect::calloc_t TestAllocator::calloc { ::calloc };
+meminspect::aligned_alloc_t TestAllocator::aligned_alloc { ::aligned_alloc };
+meminspect::free_t TestAllocator::free { ::free };
+meminspect::malloc_usable_size_t TestAllocator::malloc_usable_size { ::malloc_usable_size };
+
+using StackInspector = meminspect::MemoryInspector<TestAllocator, meminspect::ShardedHashMapPtr<void, meminspect::Block, TestAllocator>>;
+using OpenInspector = meminspect::MemoryInspector<TestAllocator, meminspect::OpenHashMapPtr<void, size_t, TestAllocator>>;
+using HeaderInspector = meminspect::MemoryInspector<TestAllocator, meminspect::InBandHeader>;
+
+}
+
+
+// ----------------------------------------------------------------------------
+// test_write
+// ----------------------------------------------------------------------------
+TEST (HeapDump, test_write) {
+  const auto path { testing::TempDir() + "meminspect_test_write.dump" };
+
+  std::vector<void *> blocks;
+  for (size_t i = 1; i <= 100; ++i)
+    blocks.push_back ((i % 2) == 0 ? StackInspector::calloc (i, 10) : StackInspector::alloc (i * 10));
+
+  // a reallocated block is written with its new size.
+  blocks[0] = StackInspector::realloc (blocks[0], 5);
+  blocks[0] = StackInspector::realloc (blocks[0], 10);
+
+  ASSERT_TRUE (meminspect::HeapDump::write<StackInspector> (path.c_str()));
+
+  meminspect::HeapDumpFile file;
+  ASSERT_TRUE (file.open (path.c_str()));
+
+  const auto &h { file.header() };
+  ASSERT_EQ (h.blocks, 100);
+  ASSERT_EQ (h.liveBytes, 50500);
+  ASSERT_GT (h.time, 0);
+
+  std::unordered_map<uint64_t, uint64_t> sizes;
+  for (size_t i = 0; i < h.blocks; ++i) {
+    const auto &b { file.blocks()[i] };
+    ASSERT_NE (b.stack, meminspect::StackDepot::NoStack);
+    sizes[b.ptr] = b.size;
+  }
+
+  for (size_t i = 0; i < blocks.size(); ++i)
+    ASSERT_EQ (sizes[reinterpret_cast<uintptr_t> (blocks[i])], (i + 1) * 10);
+
+  // the stacks of the blocks, with their frames.
+  const auto stack { file.blocks()[0].stack };
+  bool found { false };
+  uint64_t liveBytes { 0 };
+  file.forEachStack ([&] (const meminspect::HeapDumpStack &s, const uint64_t *frames) {
+    ASSERT_GE (s.depth, 1);
+    ASSERT_NE (frames[0], 0);
+    found |= s.id == stack;
+    liveBytes += s.liveBytes;
+  });
+  ASSERT_TRUE (found);
+  ASSERT_GE (liveBytes, 50500);
+
+  // the memory map, to symbolize the frames.
+  ASSERT_NE (file.maps().find ('/'), std::string_view::npos);
+
+  for (auto p : blocks)
+    StackInspector::dealloc (p);
+
+  std::remove (path.c_str());
+}
+
+// ----------------------------------------------------------------------------
+// test_policies
+// ----------------------------------------------------------------------------
+TEST (HeapDump, test_policies) {
+  const auto path { testing::TempDir() + "meminspect_test_policies.dump" };
+  meminspect::HeapDumpFile file;
+
+  // without stacks.
+  void *mem0 { OpenInspector::alloc (100) };
+  void *mem1 { OpenInspector::aligned_alloc (64, 192) };
+  ASSERT_GE (OpenInspector::usable_size (mem1), 192);
+  OpenInspector::dealloc (mem0);
+
+  ASSERT_TRUE (meminspect::HeapDump::write<OpenInspector> (path.c_str()));
+  ASSERT_TRUE (file.open (path.c_str()));
+  ASSERT_EQ (file.header().blocks, 1);
+  ASSERT_EQ (file.blocks()[0].ptr, reinterpret_cast<uintptr_t> (mem1));
+  ASSERT_EQ (file.blocks()[0].size, 192);
+  ASSERT_EQ (file.blocks()[0].stack, meminspect::StackDepot::NoStack);
+
+  OpenInspector::dealloc (mem1);
+
+  // without a table, nothing to write but the header.
+  void *mem2 { HeaderInspector::alloc (100) };
+
+  ASSERT_TRUE (meminspect::HeapDump::write<HeaderInspector> (path.c_str()));
+  ASSERT_TRUE (file.open (path.c_str()));
+  ASSERT_EQ (file.header().blocks, 0);
+  ASSERT_EQ (file.header().liveBytes, 0);
+
+  HeaderInspector::dealloc (mem2);
+
+  // files that are not heap dumps.
+  ASSERT_FALSE (file.open ("/nonexistent/meminspect.dump"));
+
+  auto *f { std::fopen (path.c_str(), "w") };
+  std::fputs ("MEMHDUMP, but not a heap dump", f);
+  std::fclose (f);
+
+  ASSERT_FALSE (file.open (path.c_str()));
+
+  std::remove (path.c_str());
+}
@@ -3,11 +3,20 @@
 //
 // Copyright (c) 2023 Carlos Carrasco
 // ----------------------------------------------------------------------------
+#include <malloc.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <new>
 #include <memory>
 #include <cstdlib>
+#include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
+#include <meminspect/heap_dump.h>
 #include <meminspect/memory_tracker.h>
 
 
@@ -54,6 +63,7 @@ TEST (MemoryTacker, test_malloc) {
   void *mem { std::malloc (123) };
 
   ASSERT_EQ (mt.getAllocatedBytes(), 123);
+  ASSERT_GE (malloc_usable_size (mem), 123);
 
   std::free (mem);
 
@@ -76,9 +86,76 @@ TEST (MemoryTacker, test_realloc) {
 
   ASSERT_EQ (mt.getAllocatedBytes(), 1024);
 
+  mem0 = std::aligned_alloc (256, 100);
+  mem1 = std::realloc (mem1, 2048);
+  mem0 = std::realloc (mem0, 200);
+
+  ASSERT_EQ (mt.getAllocatedBytes(), 2048 + 200);
+
+  std::free (mem0);
+
+  std::free (mem1);
+
+  ASSERT_EQ (mt.getAllocatedBytes(), 0);
+}
+
+// ----------------------------------------------------------------------------
+// test_peak
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_peak) {
+  meminspect::MemoryTracker mt;
+
+  auto mem0 { static_cast<char *> (std::malloc (1000)) };
+  auto mem1 { static_cast<char *> (std::malloc (1 << 20)) };
+  std::fill_n (mem1, 1 << 20, 1);
   std::free (mem1);
 
+  ASSERT_EQ (mt.getAllocatedBytes(), 1000);
+  ASSERT_EQ (mt.getPeakBytes(), 1000 + (1 << 20));
+
+  // the peak restarts from the current bytes.
+  mt.resetPeak();
+  ASSERT_EQ (mt.getPeakBytes(), 1000);
+
+  mem0 = static_cast<char *> (std::realloc (mem0, 3000));
+  std::fill_n (mem0, 3000, 1);
+
+  const auto stats { mt.getStats() };
+  ASSERT_EQ (stats.liveBytes, 3000);
+  ASSERT_EQ (stats.peakBytes, 3000);
+  ASSERT_EQ (stats.allocatedBytes, 4000 + (1 << 20));
+  ASSERT_EQ (stats.freedBytes, 1000 + (1 << 20));
+  ASSERT_EQ (stats.allocations, 3);
+  ASSERT_EQ (stats.frees, 2);
+  ASSERT_EQ (stats.reallocations, 1);
+
+  std::free (mem0);
   ASSERT_EQ (mt.getAllocatedBytes(), 0);
+  ASSERT_EQ (mt.getPeakBytes(), 3000);
+}
+
+// ----------------------------------------------------------------------------
+// test_histogram
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_histogram) {
+  using meminspect::SizeHistogram;
+
+  meminspect::HistogramTracker mt;
+
+  auto mem0 { static_cast<char *> (std::malloc (200)) };
+  auto mem1 { static_cast<char *> (std::malloc (5000)) };
+  std::fill_n (mem0, 200, 1);
+  std::fill_n (mem1, 5000, 1);
+  std::free (mem1);
+
+  const auto h { mt.getHistogram() };
+  ASSERT_EQ (h.buckets[SizeHistogram::bucket (200)].liveBlocks(), 1);
+  ASSERT_EQ (h.buckets[SizeHistogram::bucket (200)].allocatedBytes, 200);
+  ASSERT_EQ (h.buckets[SizeHistogram::bucket (5000)].allocations, 1);
+  ASSERT_EQ (h.buckets[SizeHistogram::bucket (5000)].frees, 1);
+
+  std::free (mem0);
+  ASSERT_EQ (mt.getHistogram().buckets[SizeHistogram::bucket (200)].liveBlocks(), 0);
 }
 
 // ----------------------------------------------------------------------------
@@ -109,8 +186,297 @@ TEST (MemoryTacker, test_aligned_alloc) {
   void *mem { std::aligned_alloc (1024, 1024) };
 
   ASSERT_EQ (mt.getAllocatedBytes(), 1024);
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (mem) % 1024, 0);
 
   std::free (mem);
 
   ASSERT_EQ (mt.getAllocatedBytes(), 0);
-}
\ No newline at end of file
+}
+
+// ----------------------------------------------------------------------------
+// test_posix_memalign
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_posix_memalign) {
+  meminspect::MemoryTracker mt;
+
+  void *mem { nullptr };
+  ASSERT_EQ (posix_memalign (&mem, 256, 300), 0);
+
+  ASSERT_EQ (mt.getAllocatedBytes(), 300);
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (mem) % 256, 0);
+
+  void *bad { nullptr };
+  ASSERT_EQ (posix_memalign (&bad, 24, 300), EINVAL);
+  ASSERT_EQ (bad, nullptr);
+
+  std::free (mem);
+
+  ASSERT_EQ (mt.getAllocatedBytes(), 0);
+}
+
+// ----------------------------------------------------------------------------
+// test_memalign
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_memalign) {
+  meminspect::MemoryTracker mt;
+
+  const auto page { static_cast<size_t> (sysconf (_SC_PAGESIZE)) };
+
+  void *mem0 { memalign (128, 50) };
+  void *mem1 { valloc (10) };
+  void *mem2 { pvalloc (10) };
+
+  ASSERT_EQ (mt.getAllocatedBytes(), 50 + 10 + page);
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (mem0) % 128, 0);
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (mem1) % page, 0);
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (mem2) % page, 0);
+
+  std::free (mem0);
+  std::free (mem1);
+  std::free (mem2);
+
+  ASSERT_EQ (mt.getAllocatedBytes(), 0);
+}
+
+// ----------------------------------------------------------------------------
+// test_reallocarray
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_reallocarray) {
+  meminspect::MemoryTracker mt;
+
+  void *mem { reallocarray (nullptr, 10, 8) };
+  ASSERT_EQ (mt.getAllocatedBytes(), 80);
+
+  mem = reallocarray (mem, 20, 8);
+  ASSERT_EQ (mt.getAllocatedBytes(), 160);
+
+  // hidden from the compiler, which flags the size as too large and the block as freed.
+  size_t huge { SIZE_MAX / 2 };
+  void *same { mem };
+  asm ("" : "+r" (huge), "+r" (same));
+
+  errno = 0;
+  ASSERT_EQ (reallocarray (same, huge, 4), nullptr);
+  ASSERT_EQ (errno, ENOMEM);
+  ASSERT_EQ (mt.getAllocatedBytes(), 160);
+
+  std::free (mem);
+
+  ASSERT_EQ (mt.getAllocatedBytes(), 0);
+}
+
+// ----------------------------------------------------------------------------
+// test_new_delete
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_new_delete) {
+  struct alignas (128) Aligned {
+    char data[200];
+  };
+
+  meminspect::MemoryTracker mt;
+
+  // aligned new, and the sized and aligned delete.
+  auto *aligned { new Aligned };
+  std::fill_n (aligned->data, sizeof (aligned->data), 1);
+  ASSERT_EQ (mt.getAllocatedBytes(), sizeof (Aligned));
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (aligned) % 128, 0);
+
+  delete aligned;
+  ASSERT_EQ (mt.getAllocatedBytes(), 0);
+
+  auto *array { new Aligned[3] };
+  std::fill_n (array[2].data, sizeof (array[2].data), 2);
+  ASSERT_EQ (mt.getAllocatedBytes(), 3 * sizeof (Aligned));
+  delete[] array;
+
+  // nothrow new, and sized delete.
+  auto *value { new (std::nothrow) int64_t { 7 } };
+  ASSERT_EQ (mt.getAllocatedBytes(), sizeof (int64_t));
+  ASSERT_EQ (*value, 7);
+
+  delete value;
+  ASSERT_EQ (mt.getAllocatedBytes(), 0);
+
+  // the operators called directly.
+  void *mem0 { ::operator new (100, std::align_val_t { 64 }, std::nothrow) };
+  void *mem1 { ::operator new (0) };
+  ASSERT_EQ (mt.getAllocatedBytes(), 101);
+
+  ::operator delete (mem0, 100, std::align_val_t { 64 });
+  ::operator delete (mem1, size_t { 0 });
+  ASSERT_EQ (mt.getAllocatedBytes(), 0);
+
+  // a failed allocation throws, and the nothrow version returns nullptr.
+  size_t huge { SIZE_MAX - 4096 };
+  asm ("" : "+r" (huge));
+
+  ASSERT_THROW ((void) ::operator new (huge), std::bad_alloc);
+  ASSERT_EQ (::operator new[] (huge, std::nothrow), nullptr);
+  ASSERT_EQ (mt.getAllocatedBytes(), 0);
+}
+
+// ----------------------------------------------------------------------------
+// test_free_sized
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_free_sized) {
+  meminspect::MemoryTracker mt;
+
+  void *mem0 { std::malloc (100) };
+  void *mem1 { std::aligned_alloc (512, 1024) };
+  ASSERT_EQ (mt.getAllocatedBytes(), 1124);
+
+  free_sized (mem0, 100);
+  free_aligned_sized (mem1, 512, 1024);
+  ASSERT_EQ (mt.getAllocatedBytes(), 0);
+}
+
+// ----------------------------------------------------------------------------
+// test_thread_tracker
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_thread_tracker) {
+  void *mem { nullptr };
+
+  std::thread ([ &mem ] () {
+    meminspect::ThreadMemoryTracker other;
+
+    void *p { std::malloc (1000) };
+    mem = std::malloc (100);
+    ASSERT_EQ (other.getAllocatedBytes(), 1100);
+
+    std::free (p);
+    ASSERT_EQ (other.getAllocatedBytes(), 100);
+  }).join();
+
+  void *own { nullptr };
+
+  {
+    meminspect::ThreadMemoryTracker local;
+
+    // allocations of other threads are not counted.
+    own = std::malloc (200);
+    ASSERT_EQ (local.getAllocatedBytes(), 200);
+
+    // frees are counted by the thread that makes them.
+    std::free (mem);
+    ASSERT_EQ (local.getAllocatedBytes(), 100);
+  }
+
+  std::free (own);
+}
+
+// ----------------------------------------------------------------------------
+// test_bootstrap
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_bootstrap) {
+  // the real allocator was resolved before main, so the blocks come from it.
+  void *mem { std::malloc (64) };
+  ASSERT_FALSE (meminspect::BootstrapArena::owns (mem));
+  ASSERT_LE (meminspect::BootstrapArena::usedBytes(), MEMISPECT_BOOTSTRAP_SIZE);
+
+  std::free (mem);
+}
+
+#ifdef MEMISPECT_TRACE
+// ----------------------------------------------------------------------------
+// test_trace
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_trace) {
+  // kept in the working directory: the replay test replays it.
+  ASSERT_TRUE (meminspect::TraceRecorder::start ("test_hooks.trace"));
+
+  void *mem { std::malloc (100) };
+  mem = std::realloc (mem, 200);
+  const auto old { reinterpret_cast<uintptr_t> (mem) };
+  std::free (mem);
+
+  std::thread ([] () {
+    std::vector<std::unique_ptr<int []>> blocks;
+    for (size_t i = 0; i < 1000; ++i)
+      blocks.push_back (std::make_unique<int []> (i + 1));
+  }).join();
+
+  meminspect::TraceRecorder::stop();
+
+  std::vector<meminspect::TraceRecord> records;
+  ASSERT_TRUE (meminspect::TraceRecorder::load ("test_hooks.trace", records));
+
+  const auto realloc { std::find_if (records.begin(), records.end(), [] (const auto &r) { return r.op == meminspect::TraceOp::Realloc; }) };
+  ASSERT_NE (realloc, records.end());
+  ASSERT_EQ (realloc->size, 200);
+  ASSERT_EQ (realloc->result, old);
+
+  const auto free { std::find_if (realloc, records.end(), [&] (const auto &r) { return (r.op == meminspect::TraceOp::Free) && (r.ptr == old); }) };
+  ASSERT_NE (free, records.end());
+
+  const auto news { std::count_if (records.begin(), records.end(), [&] (const auto &r) { return (r.thread != realloc->thread) && (r.op == meminspect::TraceOp::Malloc); }) };
+  ASSERT_GE (news, 1000);
+}
+#endif
+
+#ifdef MEMISPECT_CAPTURE_STACKS
+namespace {
+
+// the empty asm after the call keeps it from becoming a tail call, so each function is a distinct frame.
+__attribute__ ((noinline)) void * mallocHere (size_t size) {
+  const auto addr { malloc (size) };
+  asm volatile ("" ::: "memory");
+  return addr;
+}
+
+__attribute__ ((noinline)) void * newHere (size_t size) {
+  const auto addr { new char [size] };
+  asm volatile ("" ::: "memory");
+  return addr;
+}
+
+// whether the stack of a live block starts inside a function, which these small functions keep within 128 bytes.
+bool startsInside (void *addr, void * (*f) (size_t)) {
+  uint32_t id { meminspect::StackDepot::NoStack };
+  meminspect::DefaultInspector::forEach ([ addr, &id ] (void *block, size_t, uint32_t stack) {
+    if (block == addr)
+      id = stack;
+  });
+
+  const auto stack { meminspect::StackDepot::get (id) };
+  if ((stack == nullptr) || (stack->depth() == 0))
+    return false;
+
+  const auto start { reinterpret_cast<uintptr_t> (f) };
+  return (stack->frames()[0] > start) && (stack->frames()[0] < start + 128);
+}
+
+}
+
+// ----------------------------------------------------------------------------
+// test_stack_caller
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_stack_caller) {
+  // the frames of the hooks, of operator new and of the inspector are left out of the stacks.
+  const auto mem0 { mallocHere (123) };
+  const auto mem1 { static_cast<char *> (newHere (321)) };
+
+  ASSERT_TRUE (startsInside (mem0, &mallocHere));
+  ASSERT_TRUE (startsInside (mem1, &newHere));
+
+  free (mem0);
+  delete [] mem1;
+}
+
+// ----------------------------------------------------------------------------
+// test_heap_dump
+// ----------------------------------------------------------------------------
+TEST (MemoryTacker, test_heap_dump) {
+  std::vector<std::unique_ptr<char []>> blocks;
+  for (size_t i = 0; i < 100; ++i)
+    blocks.push_back (std::make_unique<char []> (1000));
+
+  // kept in the working directory: the analyzer test reads it.
+  ASSERT_TRUE (meminspect::HeapDump::write<meminspect::DefaultInspector> ("test_hooks.dump"));
+
+  meminspect::HeapDumpFile file;
+  ASSERT_TRUE (file.open ("test_hooks.dump"));
+  ASSERT_GE (file.header().blocks, 100);
+  ASSERT_GE (file.header().liveBytes, 100000);
+  ASSERT_GT (file.header().stacks, 0);
+}
+#endif
@@ -0,0 +1,588 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <malloc.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/memory_inspector.h>
+
+
+namespace {
+
+struct TestAllocator {
+  static meminspect::malloc_t malloc;
+  static meminspect::realloc_t realloc;
+  static meminspect::calloc_t calloc;
+  static meminspect::aligned_alloc_t aligned_alloc;
+  static meminspect::free_t free;
+  static meminspect::malloc_usable_size_t malloc_usable_size;
+};
+meminspect::malloc_t TestAllocator::malloc { ::malloc };
+meminspect::realloc_t TestAllocator::realloc { ::realloc };
+meminspect::calloc_t TestAllocator::calloc { ::calloc };
+meminspect::aligned_alloc_t TestAllocator::aligned_alloc { ::aligned_alloc };
+meminspect::free_t TestAllocator::free { ::free };
+meminspect::malloc_usable_size_t TestAllocator::malloc_usable_size { ::malloc_usable_size };
+
+using Inspector = meminspect::MemoryInspector<TestAllocator>;
+using OpenInspector = meminspect::MemoryInspector<TestAllocator, meminspect::OpenHashMapPtr<void, size_t, TestAllocator>>;
+using TinyInspector = meminspect::MemoryInspector<TestAllocator, meminspect::OpenHashMapPtr<void, size_t, TestAllocator, 4>>;
+using HeaderInspector = meminspect::MemoryInspector<TestAllocator, meminspect::InBandHeader>;
+using CountersInspector = meminspect::MemoryInspector<TestAllocator, meminspect::CountersOnly>;
+using SampledInspector = meminspect::MemoryInspector<TestAllocator, meminspect::Sampled<meminspect::OpenHashMapPtr<void, size_t, TestAllocator>>>;
+
+// An allocator with the sized entry points, which records the last sized call.
+struct SizedAllocator : TestAllocator {
+  static inline void *lastPtr { nullptr };
+  static inline size_t lastSize { 0 };
+  static inline size_t lastAlignment { 0 };
+
+  static void free_sized (void *ptr, size_t size) {
+    lastPtr = ptr;
+    lastSize = size;
+    lastAlignment = 0;
+    ::free (ptr);
+  }
+
+  static void free_aligned_sized (void *ptr, size_t alignment, size_t size) {
+    lastPtr = ptr;
+    lastSize = size;
+    lastAlignment = alignment;
+    ::free (ptr);
+  }
+};
+
+using SizedInspector = meminspect::MemoryInspector<SizedAllocator>;
+using SizedHeaderInspector = meminspect::MemoryInspector<SizedAllocator, meminspect::InBandHeader>;
+
+}
+
+
+// ----------------------------------------------------------------------------
+// test_counters
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_counters) {
+  const auto baseline { Inspector::add() };
+
+  void *mem0 { Inspector::alloc (100) };
+  void *mem1 { Inspector::calloc (2, 50) };
+  void *mem2 { Inspector::aligned_alloc (64, 128) };
+  ASSERT_EQ (Inspector::bytesSince (baseline), 328);
+
+  mem0 = Inspector::realloc (mem0, 300);
+  ASSERT_EQ (Inspector::bytesSince (baseline), 528);
+
+  Inspector::dealloc (mem0);
+  Inspector::dealloc (mem1);
+  Inspector::dealloc (mem2);
+  ASSERT_EQ (Inspector::bytesSince (baseline), 0);
+
+  Inspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_peak
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_peak) {
+  const auto baseline { Inspector::add() };
+  auto epoch { Inspector::addPeak() };
+
+  // a buffer allocated and freed between two reads still shows in the peak.
+  void *mem0 { Inspector::alloc (100) };
+  void *mem1 { Inspector::alloc (1 << 20) };
+  Inspector::dealloc (mem1);
+  ASSERT_EQ (Inspector::bytesSince (baseline), 100);
+  ASSERT_EQ (Inspector::peakSince (baseline, epoch), 100 + (1 << 20));
+
+  // a reallocation is counted as a free and an allocation as well.
+  mem0 = Inspector::realloc (mem0, 200);
+  const auto s { Inspector::snapshot() };
+  ASSERT_EQ (s.allocations - baseline.allocations, 3);
+  ASSERT_EQ (s.frees - baseline.frees, 2);
+  ASSERT_EQ (s.reallocations - baseline.reallocations, 1);
+  ASSERT_EQ (s.allocated - baseline.allocated, 300 + (1 << 20));
+
+  // the peak restarts from the current bytes, still relative to the baseline.
+  const auto reset { Inspector::addPeak() };
+  Inspector::removePeak (std::exchange (epoch, reset));
+  ASSERT_EQ (Inspector::peakSince (baseline, epoch), 200);
+
+  // blocks freed before a read are caught once they fill the buffer of the thread (see MEMISPECT_DELTA_THRESHOLD).
+  void *mem2 { Inspector::alloc (1 << 20) };
+  Inspector::dealloc (mem2);
+  ASSERT_EQ (Inspector::peakSince (baseline, epoch), 200 + (1 << 20));
+
+  Inspector::dealloc (mem0);
+  ASSERT_EQ (Inspector::peakSince (baseline, epoch), 200 + (1 << 20));
+  ASSERT_EQ (Inspector::peakSince (baseline, nullptr), 0);
+
+  Inspector::removePeak (epoch);
+  Inspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_peak_below_baseline
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_peak_below_baseline) {
+  void *mem { Inspector::alloc (1000) };
+
+  // the baseline and the epoch are taken together.
+  Inspector::PeakEpoch *epoch { nullptr };
+  const auto baseline { Inspector::add (epoch) };
+  ASSERT_NE (epoch, nullptr);
+  ASSERT_EQ (Inspector::peakSince (baseline, epoch), 0);
+
+  // a block allocated before the baseline is freed: the net bytes since the baseline stay below 0.
+  Inspector::dealloc (mem);
+  Inspector::removePeak (std::exchange (epoch, Inspector::addPeak()));
+  ASSERT_EQ (Inspector::peakSince (baseline, epoch), 0);
+
+  Inspector::removePeak (epoch);
+  Inspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_peak_cross_thread
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_peak_cross_thread) {
+  constexpr size_t Threshold { MEMISPECT_DELTA_THRESHOLD };
+
+  // a full buffer is flushed at once, so this thread starts with an empty one.
+  Inspector::dealloc (Inspector::alloc (Threshold));
+
+  Inspector::PeakEpoch *epoch { nullptr };
+  const auto baseline { Inspector::add (epoch) };
+
+  void *mem0 { Inspector::alloc (Threshold / 2) };
+  void *mem1 { Inspector::alloc (Threshold / 2) };
+
+  // another thread frees a block and stays alive, so the free remains in its buffer.
+  std::atomic<int> phase { 0 };
+  std::thread worker { [&] () {
+    Inspector::dealloc (mem0);
+
+    phase.store (1, std::memory_order_release);
+    while (phase.load (std::memory_order_acquire) != 2) {
+      // empty
+    }
+  } };
+
+  while (phase.load (std::memory_order_acquire) != 1) {
+    // empty
+  }
+
+  // the flush of this allocation must not count the block freed by the other thread as still live.
+  void *mem2 { Inspector::alloc (Threshold) };
+  ASSERT_EQ (Inspector::peakSince (baseline, epoch), Threshold + (Threshold / 2));
+
+  phase.store (2, std::memory_order_release);
+  worker.join();
+
+  Inspector::dealloc (mem1);
+  Inspector::dealloc (mem2);
+  Inspector::removePeak (epoch);
+  Inspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_histogram
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_histogram) {
+  using meminspect::SizeHistogram;
+
+  // nothing is counted without trackers.
+  const auto before { Inspector::histogram() };
+  Inspector::dealloc (Inspector::alloc (1000));
+  ASSERT_EQ (Inspector::histogram().buckets[SizeHistogram::bucket (1000)].allocations, before.buckets[SizeHistogram::bucket (1000)].allocations);
+
+  Inspector::add();
+  const auto baseline { Inspector::histogram() };
+
+  void *mem0 { Inspector::alloc (1000) };
+  void *mem1 { Inspector::calloc (10, 100) };
+  void *mem2 { Inspector::alloc (24) };
+  mem2 = Inspector::realloc (mem2, 3000);
+  Inspector::dealloc (mem1);
+
+  const auto h { Inspector::histogram().since (baseline) };
+  const auto &b1000 { h.buckets[SizeHistogram::bucket (1000)] };
+  ASSERT_EQ (b1000.allocations, 2);
+  ASSERT_EQ (b1000.frees, 1);
+  ASSERT_EQ (b1000.liveBytes(), 1000);
+  ASSERT_EQ (h.buckets[SizeHistogram::bucket (24)].liveBlocks(), 0);
+  ASSERT_EQ (h.buckets[SizeHistogram::bucket (3000)].liveBytes(), 3000);
+
+  Inspector::dealloc (mem0);
+  Inspector::dealloc (mem2);
+  Inspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_stats
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_stats) {
+  const auto before { Inspector::stats() };
+
+  void *mem { Inspector::alloc (64) };
+  const auto st { Inspector::stats() };
+  ASSERT_EQ (st.size, before.size + 1);
+  ASSERT_GE (st.maxChainLength, 1);
+  ASSERT_GT (st.locks.acquisitions, before.locks.acquisitions);
+
+  Inspector::dealloc (mem);
+  ASSERT_EQ (Inspector::stats().size, before.size);
+}
+
+// ----------------------------------------------------------------------------
+// test_open_hash_map
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_open_hash_map) {
+  const auto baseline { OpenInspector::add() };
+
+  void *mem0 { OpenInspector::alloc (100) };
+  void *mem1 { OpenInspector::calloc (2, 50) };
+  ASSERT_EQ (OpenInspector::bytesSince (baseline), 200);
+
+  mem0 = OpenInspector::realloc (mem0, 300);
+  ASSERT_EQ (OpenInspector::bytesSince (baseline), 400);
+
+  OpenInspector::dealloc (mem0);
+  OpenInspector::dealloc (mem1);
+  ASSERT_EQ (OpenInspector::bytesSince (baseline), 0);
+
+  OpenInspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_full_table
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_full_table) {
+  const auto baseline { TinyInspector::add() };
+
+  // the blocks that do not fit in the table are not counted, since their frees would not be found.
+  std::vector<void *> blocks;
+  for (int i = 0; i < 6; ++i)
+    blocks.push_back (TinyInspector::alloc (100));
+
+  ASSERT_EQ (TinyInspector::bytesSince (baseline), 400);
+  ASSERT_EQ (TinyInspector::snapshot().allocations - baseline.allocations, 4);
+
+  for (auto p : blocks)
+    TinyInspector::dealloc (p);
+
+  ASSERT_EQ (TinyInspector::bytesSince (baseline), 0);
+  ASSERT_EQ (TinyInspector::snapshot().frees - baseline.frees, 4);
+
+  TinyInspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_in_band_header
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_in_band_header) {
+  const auto baseline { HeaderInspector::add() };
+
+  auto mem0 { static_cast<char *> (HeaderInspector::alloc (100)) };
+  auto mem1 { static_cast<char *> (HeaderInspector::calloc (2, 50)) };
+  auto mem2 { static_cast<char *> (HeaderInspector::aligned_alloc (4096, 10)) };
+  ASSERT_EQ (HeaderInspector::bytesSince (baseline), 210);
+
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (mem0) % 16, 0);
+  ASSERT_EQ (reinterpret_cast<uintptr_t> (mem2) % 4096, 0);
+  ASSERT_TRUE (std::all_of (mem1, mem1 + 100, [] (char c) { return c == 0; }));
+  ASSERT_GE (HeaderInspector::usable_size (mem0), 100);
+  ASSERT_GE (HeaderInspector::usable_size (mem2), 10);
+
+  std::fill_n (mem0, 100, 'a');
+  mem0 = static_cast<char *> (HeaderInspector::realloc (mem0, 300));
+  ASSERT_EQ (HeaderInspector::bytesSince (baseline), 410);
+  ASSERT_TRUE (std::all_of (mem0, mem0 + 100, [] (char c) { return c == 'a'; }));
+
+  std::fill_n (mem2, 10, 'b');
+  mem2 = static_cast<char *> (HeaderInspector::realloc (mem2, 20));
+  ASSERT_EQ (HeaderInspector::bytesSince (baseline), 420);
+  ASSERT_TRUE (std::all_of (mem2, mem2 + 10, [] (char c) { return c == 'b'; }));
+
+  HeaderInspector::dealloc (mem0);
+  HeaderInspector::dealloc (mem1);
+  HeaderInspector::dealloc (mem2);
+  ASSERT_EQ (HeaderInspector::bytesSince (baseline), 0);
+
+  // blocks without a header are passed through.
+  void *foreign { ::malloc (64) };
+  foreign = HeaderInspector::realloc (foreign, 128);
+  HeaderInspector::dealloc (foreign);
+  ASSERT_EQ (HeaderInspector::bytesSince (baseline), 0);
+
+  // ownership is never guessed from the bytes in front of a block, even if they hold a valid header.
+  const auto owned { static_cast<char *> (HeaderInspector::alloc (32)) };
+  const auto forged { static_cast<char *> (::aligned_alloc (16, 64)) };
+  std::copy_n (owned - meminspect::InBandHeader::Size, meminspect::InBandHeader::Size, forged);
+  ASSERT_NE (meminspect::InBandHeader::header (owned), nullptr);
+  ASSERT_EQ (meminspect::InBandHeader::header (forged + meminspect::InBandHeader::Size), nullptr);
+  ASSERT_EQ (meminspect::InBandHeader::header (owned + 1), nullptr);
+
+  HeaderInspector::dealloc (owned);
+  ASSERT_EQ (meminspect::InBandHeader::header (owned), nullptr);
+  ::free (forged);
+
+  HeaderInspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_sized_dealloc
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_sized_dealloc) {
+  const auto baseline { SizedInspector::add() };
+
+  void *mem0 { SizedInspector::alloc (100) };
+  void *mem1 { SizedInspector::aligned_alloc (256, 512) };
+  void *mem2 { SizedInspector::alloc (10) };
+  ASSERT_EQ (SizedInspector::bytesSince (baseline), 622);
+
+  // the size the caller knows is passed on to the allocator.
+  SizedInspector::dealloc (mem0, 100);
+  ASSERT_EQ (SizedAllocator::lastPtr, mem0);
+  ASSERT_EQ (SizedAllocator::lastSize, 100);
+  ASSERT_EQ (SizedAllocator::lastAlignment, 0);
+
+  SizedInspector::dealloc (mem1, 512, 256);
+  ASSERT_EQ (SizedAllocator::lastPtr, mem1);
+  ASSERT_EQ (SizedAllocator::lastSize, 512);
+  ASSERT_EQ (SizedAllocator::lastAlignment, 256);
+
+  // without a size, the block goes to free.
+  SizedInspector::dealloc (mem2);
+  ASSERT_NE (SizedAllocator::lastPtr, mem2);
+  ASSERT_EQ (SizedInspector::bytesSince (baseline), 0);
+
+  SizedInspector::remove();
+
+  // the header knows the size of every block, and of its raw block.
+  auto mem3 { static_cast<char *> (SizedHeaderInspector::alloc (100)) };
+  auto mem4 { static_cast<char *> (SizedHeaderInspector::aligned_alloc (4096, 10)) };
+
+  SizedHeaderInspector::dealloc (mem3);
+  ASSERT_EQ (SizedAllocator::lastPtr, mem3 - meminspect::InBandHeader::Size);
+  ASSERT_EQ (SizedAllocator::lastSize, 100 + meminspect::InBandHeader::Size);
+  ASSERT_EQ (SizedAllocator::lastAlignment, 0);
+
+  SizedHeaderInspector::dealloc (mem4);
+  ASSERT_EQ (SizedAllocator::lastPtr, mem4 - 4096);
+  ASSERT_EQ (SizedAllocator::lastSize, 4096 + 4096);
+  ASSERT_EQ (SizedAllocator::lastAlignment, 4096);
+}
+
+// ----------------------------------------------------------------------------
+// test_counters_only
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_counters_only) {
+  const auto baseline { CountersInspector::add() };
+
+  void *mem0 { CountersInspector::alloc (100) };
+  ASSERT_EQ (CountersInspector::bytesSince (baseline), ::malloc_usable_size (mem0));
+  ASSERT_GE (CountersInspector::bytesSince (baseline), 100);
+
+  void *mem1 { CountersInspector::calloc (2, 50) };
+  void *mem2 { CountersInspector::aligned_alloc (64, 128) };
+  ASSERT_EQ (CountersInspector::bytesSince (baseline), ::malloc_usable_size (mem0) + ::malloc_usable_size (mem1) + ::malloc_usable_size (mem2));
+
+  mem0 = CountersInspector::realloc (mem0, 3000);
+  ASSERT_EQ (CountersInspector::bytesSince (baseline), ::malloc_usable_size (mem0) + ::malloc_usable_size (mem1) + ::malloc_usable_size (mem2));
+  ASSERT_GE (CountersInspector::bytesSince (baseline), 3000 + 100 + 128);
+
+  CountersInspector::dealloc (mem0);
+  CountersInspector::dealloc (mem1);
+  CountersInspector::dealloc (mem2);
+  ASSERT_EQ (CountersInspector::bytesSince (baseline), 0);
+
+  ASSERT_EQ (CountersInspector::stats().size, 0);
+
+  CountersInspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_sampling
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_sampling) {
+  const auto baseline { SampledInspector::add() };
+
+  // every allocation is recorded with its own size.
+  SampledInspector::setSamplingInterval (0);
+
+  void *mem0 { SampledInspector::alloc (100) };
+  void *mem1 { SampledInspector::calloc (2, 50) };
+  ASSERT_EQ (SampledInspector::bytesSince (baseline), 200);
+
+  mem0 = SampledInspector::realloc (mem0, 300);
+  ASSERT_EQ (SampledInspector::bytesSince (baseline), 400);
+
+  SampledInspector::dealloc (mem0);
+  SampledInspector::dealloc (mem1);
+  ASSERT_EQ (SampledInspector::bytesSince (baseline), 0);
+
+  // ~320 samples: the estimate is within a few percent, so 25% is a very loose bound.
+  SampledInspector::setSamplingInterval (64 * 1024);
+
+  std::vector<void *> blocks;
+  for (size_t i = 0; i < 20000; ++i)
+    blocks.push_back (SampledInspector::alloc (1024));
+
+  const auto expected { 20000.0 * 1024 };
+  ASSERT_GT (static_cast<double> (SampledInspector::bytesSince (baseline)), expected * 0.75);
+  ASSERT_LT (static_cast<double> (SampledInspector::bytesSince (baseline)), expected * 1.25);
+  ASSERT_LT (SampledInspector::stats().size, 2000);
+
+  for (auto *p : blocks)
+    SampledInspector::dealloc (p);
+
+  ASSERT_EQ (SampledInspector::bytesSince (baseline), 0);
+  ASSERT_EQ (SampledInspector::stats().size, 0);
+
+  SampledInspector::setSamplingInterval (MEMISPECT_SAMPLING_INTERVAL);
+  SampledInspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_sampling_reseed
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_sampling_reseed) {
+  // the number of 1-byte allocations until the first sample after each reset of the interval.
+  std::vector<size_t> countdowns;
+  for (int i = 0; i < 8; ++i) {
+    meminspect::Sampler::setInterval (1024);
+
+    size_t n { 0 };
+    while (meminspect::Sampler::sample (1) == 0)
+      ++n;
+
+    countdowns.push_back (n);
+  }
+
+  meminspect::Sampler::setInterval (MEMISPECT_SAMPLING_INTERVAL);
+
+  // a reset draws from a new seed instead of repeating the same countdown.
+  ASSERT_NE (static_cast<size_t> (std::count (countdowns.begin(), countdowns.end(), countdowns.front())), countdowns.size());
+}
+
+// ----------------------------------------------------------------------------
+// test_many_trackers
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_many_trackers) {
+  // each tracker only sees the blocks allocated after it was created.
+  std::vector<meminspect::Snapshot> baselines;
+  std::vector<void *> blocks;
+  for (size_t i = 0; i < 1000; ++i) {
+    baselines.push_back (Inspector::add());
+    blocks.push_back (Inspector::alloc (10));
+  }
+
+  for (size_t i = 0; i < baselines.size(); ++i)
+    ASSERT_EQ (Inspector::bytesSince (baselines[i]), (baselines.size() - i) * 10);
+
+  for (auto *p : blocks)
+    Inspector::dealloc (p);
+
+  ASSERT_EQ (Inspector::bytesSince (baselines.front()), 0);
+
+  for (size_t i = 0; i < baselines.size(); ++i)
+    Inspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_thread_counters
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_thread_counters) {
+  const auto outer { Inspector::addThread() };
+  void *mem0 { Inspector::alloc (100) };
+
+  const auto inner { Inspector::addThread() };
+  void *mem1 { Inspector::alloc (50) };
+
+  // allocations of other threads are not counted.
+  std::thread ([] () { Inspector::dealloc (Inspector::alloc (1000)); }).join();
+
+  ASSERT_EQ (Inspector::threadBytesSince (outer), 150);
+  ASSERT_EQ (Inspector::threadBytesSince (inner), 50);
+
+  Inspector::dealloc (mem1);
+  ASSERT_EQ (Inspector::threadBytesSince (inner), 0);
+
+  Inspector::removeThread();
+  Inspector::dealloc (mem0);
+  ASSERT_EQ (Inspector::threadBytesSince (outer), 0);
+
+  Inspector::removeThread();
+}
+
+// ----------------------------------------------------------------------------
+// test_concurrent_counters
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_concurrent_counters) {
+  const auto baseline { Inspector::add() };
+
+  std::vector<std::thread> workers;
+  for (int t = 0; t < 4; ++t) {
+    workers.emplace_back ([] () {
+      for (int i = 0; i < 10000; ++i)
+        Inspector::dealloc (Inspector::alloc (32));
+    });
+  }
+
+  for (auto &w : workers)
+    w.join();
+
+  ASSERT_EQ (Inspector::bytesSince (baseline), 0);
+
+  Inspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_concurrent_tables
+// ----------------------------------------------------------------------------
+TEST (MemoryInspector, test_concurrent_tables) {
+  // threads that allocate, reallocate and free at the same time through both tables leave no entry behind.
+  const auto run { [] <typename I> () {
+    const auto before { I::stats().size };
+    const auto baseline { I::add() };
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < 8; ++t) {
+      workers.emplace_back ([t] () {
+        std::array<void *, 64> blocks {};
+        for (size_t round = 0; round < 200; ++round) {
+          for (size_t j = 0; j < blocks.size(); ++j)
+            blocks[j] = I::alloc (16 + (((t * 64) + j) % 512));
+          for (size_t j = 0; j < blocks.size(); j += 2)
+            blocks[j] = I::realloc (blocks[j], 1024);
+          for (auto *p : blocks)
+            I::dealloc (p);
+        }
+      });
+    }
+
+    for (auto &w : workers)
+      w.join();
+
+    const auto s { I::snapshot() };
+    ASSERT_EQ (I::bytesSince (baseline), 0);
+    ASSERT_EQ (s.allocations - baseline.allocations, 8 * 200 * 96);
+    ASSERT_EQ (s.frees - baseline.frees, 8 * 200 * 96);
+    ASSERT_EQ (I::stats().size, before);
+
+    I::remove();
+  } };
+
+  run.template operator()<Inspector>();
+  run.template operator()<OpenInspector>();
+}
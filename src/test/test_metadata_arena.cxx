@@ -0,0 +1,190 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/metadata_arena.h>
+#include <meminspect/types.h>
+
+
+namespace {
+
+struct CountingAllocator {
+  static void * malloc (size_t size) {
+    ++calls;
+    return ::malloc (size);
+  }
+
+  static void free (void *p) {
+    ++calls;
+    ::free (p);
+  }
+
+  static inline size_t calls { 0 };
+};
+
+}
+
+
+// ----------------------------------------------------------------------------
+// test_alloc
+// ----------------------------------------------------------------------------
+TEST (MetadataArena, test_alloc) {
+  using meminspect::MetadataArena;
+
+  const auto before { MetadataArena::footprint() };
+
+  std::map<char *, size_t> blocks;
+  for (size_t size = 1; size <= MetadataArena::MaxSize; size = (size * 3) + 1) {
+    const auto p { static_cast<char *> (MetadataArena::alloc (size)) };
+    ASSERT_NE (p, nullptr);
+    ASSERT_EQ (reinterpret_cast<uintptr_t> (p) % MetadataArena::MinSize, 0);
+    std::memset (p, 0xa5, size);
+    blocks[p] = size;
+  }
+
+  // blocks do not overlap.
+  for (auto it = blocks.begin(), next = std::next (it); next != blocks.end(); ++it, ++next)
+    ASSERT_GE (next->first - it->first, static_cast<ptrdiff_t> (it->second));
+
+  const auto during { MetadataArena::footprint() };
+  ASSERT_GT (during.usedBytes, before.usedBytes);
+  ASSERT_GE (during.mappedBytes, during.usedBytes + during.freeBytes);
+  ASSERT_GE (during.regions, 1);
+
+  for (const auto &[p, size] : blocks)
+    MetadataArena::free (p, size);
+
+  const auto after { MetadataArena::footprint() };
+  ASSERT_EQ (after.usedBytes, before.usedBytes);
+  ASSERT_EQ (after.mappedBytes, during.mappedBytes);
+
+  MetadataArena::free (nullptr, 100);
+}
+
+// ----------------------------------------------------------------------------
+// test_reuse
+// ----------------------------------------------------------------------------
+TEST (MetadataArena, test_reuse) {
+  using meminspect::MetadataArena;
+
+  // the sizes of a class share their blocks.
+  const auto p { MetadataArena::alloc (100) };
+  MetadataArena::free (p, 100);
+  ASSERT_EQ (MetadataArena::alloc (128), p);
+  MetadataArena::free (p, 128);
+
+  // freed blocks are reused instead of mapping new regions.
+  const auto mapped { MetadataArena::footprint().mappedBytes };
+  for (int round = 0; round < 100; ++round) {
+    std::vector<void *> blocks;
+    for (int i = 0; i < 100; ++i)
+      blocks.push_back (MetadataArena::alloc (4096));
+    for (auto b : blocks)
+      MetadataArena::free (b, 4096);
+  }
+
+  ASSERT_LE (MetadataArena::footprint().mappedBytes, mapped + MetadataArena::RegionSize);
+}
+
+// ----------------------------------------------------------------------------
+// test_large
+// ----------------------------------------------------------------------------
+TEST (MetadataArena, test_large) {
+  using meminspect::MetadataArena;
+
+  const auto before { MetadataArena::footprint() };
+  const size_t size { (MetadataArena::RegionSize * 2) + 1 };
+
+  const auto p { static_cast<char *> (MetadataArena::alloc (size)) };
+  ASSERT_NE (p, nullptr);
+  p[0] = 1;
+  p[size - 1] = 1;
+
+  const auto during { MetadataArena::footprint() };
+  ASSERT_EQ (during.largeBlocks, before.largeBlocks + 1);
+  ASSERT_GE (during.mappedBytes - before.mappedBytes, size);
+  ASSERT_EQ (during.mappedBytes - before.mappedBytes, during.usedBytes - before.usedBytes);
+  if constexpr (MEMISPECT_ARENA_HUGE_PAGES != 0) {
+    ASSERT_GT (during.hugePageBytes, before.hugePageBytes);
+  }
+
+  // large blocks are unmapped when they are freed.
+  MetadataArena::free (p, size);
+
+  const auto after { MetadataArena::footprint() };
+  ASSERT_EQ (after.largeBlocks, before.largeBlocks);
+  ASSERT_EQ (after.mappedBytes, before.mappedBytes);
+  ASSERT_EQ (after.hugePageBytes, before.hugePageBytes);
+}
+
+// ----------------------------------------------------------------------------
+// test_threads
+// ----------------------------------------------------------------------------
+TEST (MetadataArena, test_threads) {
+  using meminspect::MetadataArena;
+
+  const auto before { MetadataArena::footprint() };
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back ([t] () {
+      for (int round = 0; round < 100; ++round) {
+        std::vector<std::pair<unsigned char *, size_t>> blocks;
+        for (size_t i = 0; i < 64; ++i) {
+          const auto size { 16 + (((i * 977) + static_cast<size_t> (t)) % 8192) };
+          const auto p { static_cast<unsigned char *> (MetadataArena::alloc (size)) };
+          ASSERT_NE (p, nullptr);
+          std::memset (p, t, size);
+          blocks.emplace_back (p, size);
+        }
+
+        // no other thread wrote to the blocks.
+        for (const auto &[p, size] : blocks) {
+          ASSERT_EQ (p[0], t);
+          ASSERT_EQ (p[size - 1], t);
+          MetadataArena::free (p, size);
+        }
+      }
+    });
+  }
+
+  for (auto &t : threads)
+    t.join();
+
+  ASSERT_EQ (MetadataArena::footprint().usedBytes, before.usedBytes);
+}
+
+// ----------------------------------------------------------------------------
+// test_tables
+// ----------------------------------------------------------------------------
+TEST (MetadataArena, test_tables) {
+  using meminspect::MetadataArena;
+
+  size_t during { 0 };
+
+  {
+    // the buckets come from the arena, so the table never calls the allocator being tracked.
+    meminspect::HashMapPtr<int, size_t, CountingAllocator, 16> hashMap;
+    for (uintptr_t i = 1; i <= 10000; ++i)
+      hashMap.add (reinterpret_cast<int *> (i * 16), size_t { i });
+
+    during = MetadataArena::footprint().usedBytes;
+
+    for (uintptr_t i = 1; i <= 10000; ++i)
+      ASSERT_EQ (hashMap.remove (reinterpret_cast<int *> (i * 16)), i);
+  }
+
+  ASSERT_EQ (CountingAllocator::calls, 0);
+
+  // the buckets are given back (the slabs of the nodes are kept by the NodePool).
+  ASSERT_LT (MetadataArena::footprint().usedBytes, during);
+}
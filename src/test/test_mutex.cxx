@@ -3,6 +3,9 @@
 //
 // Copyright (c) 2023 Carlos Carrasco
 // ----------------------------------------------------------------------------
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <thread>
 
 #include <gtest/gtest.h>
@@ -56,3 +59,78 @@ TEST (Mutex, test_lock_unlock) {
 
   EXPECT_EQ (22 * 1000 * 2, critical.counter); // 22=string-length, 1000=iteration, 2=threads
 }
+
+// ----------------------------------------------------------------------------
+// test_try_lock
+// ----------------------------------------------------------------------------
+TEST (Mutex, test_try_lock) {
+  meminspect::Mutex mutex;
+
+  mutex.lock();
+  ASSERT_FALSE (mutex.try_lock());
+  mutex.unlock();
+
+  ASSERT_TRUE (mutex.try_lock());
+  mutex.unlock();
+
+  // a failed try_lock is neither an acquisition nor a contention.
+  const auto st { mutex.stats() };
+  ASSERT_EQ (st.acquisitions, 2);
+  ASSERT_EQ (st.contentions, 0);
+  ASSERT_EQ (st.sleeps, 0);
+}
+
+// ----------------------------------------------------------------------------
+// test_sleep
+// ----------------------------------------------------------------------------
+TEST (Mutex, test_sleep) {
+  meminspect::Mutex mutex;
+  std::atomic<bool> locked { false };
+
+  // the owner keeps the mutex much longer than the waiter spins, so the waiter sleeps until it is woken.
+  std::thread owner { [ &mutex, &locked ] () {
+    mutex.lock();
+    locked.store (true, std::memory_order_release);
+    std::this_thread::sleep_for (std::chrono::milliseconds (50));
+    mutex.unlock();
+  } };
+
+  while (!locked.load (std::memory_order_acquire)) {
+    // empty
+  }
+
+  mutex.lock();
+  mutex.unlock();
+  owner.join();
+
+  const auto st { mutex.stats() };
+  ASSERT_EQ (st.acquisitions, 2);
+  ASSERT_EQ (st.contentions, 1);
+  ASSERT_GT (st.spins, 0);
+  ASSERT_GE (st.sleeps, 1);
+}
+
+// ----------------------------------------------------------------------------
+// test_contention
+// ----------------------------------------------------------------------------
+TEST (Mutex, test_contention) {
+  meminspect::Mutex mutex;
+  size_t counter { 0 };
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back ([ &mutex, &counter ] () {
+      for (int i = 0; i < 100000; ++i) {
+        std::lock_guard<meminspect::Mutex> guard { mutex };
+        ++counter;
+      }
+    });
+  }
+
+  for (auto &t : threads)
+    t.join();
+
+  ASSERT_EQ (counter, 8 * 100000);
+  ASSERT_EQ (mutex.stats().acquisitions, 8 * 100000);
+  ASSERT_LE (mutex.stats().contentions, 8 * 100000);
+}
@@ -0,0 +1,89 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <cstdint>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/node_pool.h>
+
+
+// ----------------------------------------------------------------------------
+// test_alloc
+// ----------------------------------------------------------------------------
+TEST (NodePool, test_alloc) {
+  using Pool = meminspect::NodePool<24, 8>;
+
+  std::set<void *> blocks;
+  for (int i = 0; i < 10000; ++i) {
+    const auto p { Pool::alloc() };
+    ASSERT_NE (p, nullptr);
+    ASSERT_EQ (reinterpret_cast<uintptr_t> (p) % 8, 0);
+    ASSERT_TRUE (blocks.insert (p).second);
+  }
+
+  // blocks do not overlap.
+  for (auto it = blocks.begin(), next = std::next (it); next != blocks.end(); ++it, ++next)
+    ASSERT_GE (static_cast<char *> (*next) - static_cast<char *> (*it), 24);
+
+  ASSERT_GE (Pool::mappedBytes(), 10000 * 24);
+
+  for (auto p : blocks)
+    Pool::free (p);
+}
+
+// ----------------------------------------------------------------------------
+// test_reuse
+// ----------------------------------------------------------------------------
+TEST (NodePool, test_reuse) {
+  using Pool = meminspect::NodePool<32>;
+
+  const auto p { Pool::alloc() };
+  Pool::free (p);
+  ASSERT_EQ (Pool::alloc(), p);
+  Pool::free (p);
+
+  // freed blocks are reused instead of mapping new slabs.
+  const auto mapped { Pool::mappedBytes() };
+  for (int round = 0; round < 100; ++round) {
+    std::vector<void *> blocks;
+    for (int i = 0; i < 1000; ++i)
+      blocks.push_back (Pool::alloc());
+    for (auto b : blocks)
+      Pool::free (b);
+  }
+
+  ASSERT_LE (Pool::mappedBytes(), mapped + (2 * MEMISPECT_POOL_SLAB_SIZE));
+}
+
+// ----------------------------------------------------------------------------
+// test_threads
+// ----------------------------------------------------------------------------
+TEST (NodePool, test_threads) {
+  using Pool = meminspect::NodePool<48>;
+
+  // blocks allocated by one thread and freed by another, by threads that exit.
+  for (int round = 0; round < 20; ++round) {
+    std::vector<void *> blocks (2000);
+
+    std::thread producer { [ &blocks ] () {
+      for (auto &b : blocks)
+        b = Pool::alloc();
+    } };
+    producer.join();
+
+    std::thread consumer { [ &blocks ] () {
+      for (auto b : blocks)
+        Pool::free (b);
+    } };
+    consumer.join();
+  }
+
+  // the magazines of the exited threads went back to the shared free list.
+  ASSERT_LE (Pool::mappedBytes(), 2 * MEMISPECT_POOL_SLAB_SIZE + (2000 * 48));
+}
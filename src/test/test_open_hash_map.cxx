@@ -0,0 +1,201 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <stdlib.h>
+#include <atomic>
+#include <random>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/types.h>
+
+
+namespace {
+
+struct TestAllocator {
+  static meminspect::malloc_t malloc;
+  static meminspect::free_t free;
+};
+meminspect::malloc_t  TestAllocator::malloc { nullptr };
+meminspect::free_t  TestAllocator::free { nullptr };
+
+}
+
+class OpenHashMapPtrTest: public ::testing::Test {
+  protected:
+    void SetUp() override {
+      TestAllocator::malloc = malloc;
+      TestAllocator::free = free;
+    }
+};
+
+
+// ----------------------------------------------------------------------------
+// test_add
+// ----------------------------------------------------------------------------
+TEST_F (OpenHashMapPtrTest, test_add) {
+  meminspect::OpenHashMapPtr<int, std::string_view, TestAllocator, 16> hashMap;
+
+  ASSERT_TRUE (hashMap.add (reinterpret_cast<int *> (16), "sixteen"));
+  ASSERT_TRUE (hashMap.add (reinterpret_cast<int *> (32), "thirty-two"));
+
+  // fill the table.
+  for (uintptr_t i = 3; i <= 16; ++i)
+    ASSERT_TRUE (hashMap.add (reinterpret_cast<int *> (i * 16), "value"));
+
+  ASSERT_FALSE (hashMap.add (reinterpret_cast<int *> (17 * 16), "full"));
+}
+
+// ----------------------------------------------------------------------------
+// test_find
+// ----------------------------------------------------------------------------
+TEST_F (OpenHashMapPtrTest, test_find) {
+  meminspect::OpenHashMapPtr<int, std::string_view, TestAllocator, 16> hashMap;
+
+  ASSERT_FALSE (hashMap.find (reinterpret_cast<int *> (16)).has_value());
+
+  hashMap.add (reinterpret_cast<int *> (16), "sixteen");
+  hashMap.add (reinterpret_cast<int *> (32), "thirty-two");
+  hashMap.add (reinterpret_cast<int *> (48), "forty-eight");
+
+  ASSERT_EQ (*hashMap.find (reinterpret_cast<int *> (16)), "sixteen");
+  ASSERT_EQ (*hashMap.find (reinterpret_cast<int *> (32)), "thirty-two");
+  ASSERT_EQ (*hashMap.find (reinterpret_cast<int *> (48)), "forty-eight");
+  ASSERT_FALSE (hashMap.find (reinterpret_cast<int *> (64)).has_value());
+}
+
+// ----------------------------------------------------------------------------
+// test_remove
+// ----------------------------------------------------------------------------
+TEST_F (OpenHashMapPtrTest, test_remove) {
+  meminspect::OpenHashMapPtr<int, std::string_view, TestAllocator, 16> hashMap;
+
+  ASSERT_FALSE (hashMap.remove (reinterpret_cast<int *> (16)).has_value());
+
+  for (uintptr_t i = 1; i <= 16; ++i)
+    hashMap.add (reinterpret_cast<int *> (i * 16), "value");
+
+  const auto v { hashMap.remove (reinterpret_cast<int *> (32)) };
+  ASSERT_TRUE (v.has_value());
+  ASSERT_EQ (*v, "value");
+  ASSERT_FALSE (hashMap.remove (reinterpret_cast<int *> (32)).has_value());
+  ASSERT_FALSE (hashMap.find (reinterpret_cast<int *> (32)).has_value());
+
+  // the tombstone is reused.
+  ASSERT_TRUE (hashMap.add (reinterpret_cast<int *> (17 * 16), "reused"));
+  ASSERT_EQ (*hashMap.find (reinterpret_cast<int *> (17 * 16)), "reused");
+
+  for (uintptr_t i = 1; i <= 17; ++i)
+    ASSERT_EQ (hashMap.remove (reinterpret_cast<int *> (i * 16)).has_value(), i != 2);
+}
+
+// ----------------------------------------------------------------------------
+// test_concurrent
+// ----------------------------------------------------------------------------
+TEST_F (OpenHashMapPtrTest, test_concurrent) {
+  meminspect::OpenHashMapPtr<int, size_t, TestAllocator, 4096> hashMap;
+
+  std::vector<std::thread> workers;
+  for (uintptr_t t = 0; t < 4; ++t) {
+    workers.emplace_back ([ &hashMap, t ] () {
+      for (int round = 0; round < 100; ++round) {
+        for (uintptr_t i = 0; i < 256; ++i)
+          ASSERT_TRUE (hashMap.add (reinterpret_cast<int *> (((t * 256) + i + 1) * 16), (t * 256) + i));
+        for (uintptr_t i = 0; i < 256; ++i)
+          ASSERT_EQ (*hashMap.remove (reinterpret_cast<int *> (((t * 256) + i + 1) * 16)), (t * 256) + i);
+      }
+    });
+  }
+
+  for (auto &w : workers)
+    w.join();
+
+  for (uintptr_t i = 0; i < 1024; ++i)
+    ASSERT_FALSE (hashMap.find (reinterpret_cast<int *> ((i + 1) * 16)).has_value());
+}
+
+// ----------------------------------------------------------------------------
+// test_publish
+// ----------------------------------------------------------------------------
+TEST_F (OpenHashMapPtrTest, test_publish) {
+  meminspect::OpenHashMapPtr<int, size_t, TestAllocator, 4096> hashMap;
+  std::atomic<bool> done { false };
+
+  // a reader that finds a key must see the value written with it.
+  std::thread reader ([ &hashMap, &done ] () {
+    while (!done.load()) {
+      for (uintptr_t i = 1; i <= 1024; ++i) {
+        ASSERT_EQ (hashMap.find (reinterpret_cast<int *> (i * 16)).value_or (i), i);
+      }
+    }
+  });
+
+  for (int round = 0; round < 100; ++round) {
+    for (uintptr_t i = 1; i <= 1024; ++i)
+      ASSERT_TRUE (hashMap.add (reinterpret_cast<int *> (i * 16), size_t { i }));
+    for (uintptr_t i = 1; i <= 1024; ++i)
+      ASSERT_TRUE (hashMap.remove (reinterpret_cast<int *> (i * 16)).has_value());
+  }
+
+  done = true;
+  reader.join();
+}
+
+// ----------------------------------------------------------------------------
+// test_churn
+// ----------------------------------------------------------------------------
+TEST_F (OpenHashMapPtrTest, test_churn) {
+  meminspect::OpenHashMapPtr<int, size_t, TestAllocator, 1024> hashMap;
+  std::vector<uintptr_t> live;
+  std::mt19937 rng { 42 };
+  uintptr_t next { 1 };
+
+  // half of the table stays used while every slot sees many adds and removes.
+  for (; next <= 512; ++next) {
+    ASSERT_TRUE (hashMap.add (reinterpret_cast<int *> (next * 16), size_t { next }));
+    live.push_back (next);
+  }
+
+  for (int i = 0; i < 100000; ++i, ++next) {
+    auto &victim { live[rng() % live.size()] };
+    ASSERT_EQ (*hashMap.remove (reinterpret_cast<int *> (victim * 16)), victim);
+    ASSERT_TRUE (hashMap.add (reinterpret_cast<int *> (next * 16), size_t { next }));
+    victim = next;
+  }
+
+  for (const auto key : live)
+    ASSERT_EQ (*hashMap.find (reinterpret_cast<int *> (key * 16)), key);
+
+  // only the tombstones that some probe path still goes through are left.
+  const auto st { hashMap.stats() };
+  ASSERT_EQ (st.size, 512);
+  ASSERT_LT (st.tombstones, 192);
+  ASSERT_LT (st.maxChainLength, 64);
+  ASSERT_LT (st.averageProbes, 3.0);
+}
+
+// ----------------------------------------------------------------------------
+// test_stats
+// ----------------------------------------------------------------------------
+TEST_F (OpenHashMapPtrTest, test_stats) {
+  meminspect::OpenHashMapPtr<int, size_t, TestAllocator, 16, meminspect::ModuloHash> hashMap;
+
+  // keys 16, 32 and 48 all have slot 0 as home with ModuloHash.
+  hashMap.add (reinterpret_cast<int *> (16), 0);
+  hashMap.add (reinterpret_cast<int *> (32), 0);
+  hashMap.add (reinterpret_cast<int *> (48), 0);
+  hashMap.add (reinterpret_cast<int *> (5), 0);
+  hashMap.remove (reinterpret_cast<int *> (32));
+
+  const auto st { hashMap.stats() };
+  ASSERT_EQ (st.size, 3);
+  ASSERT_EQ (st.buckets, 16);
+  ASSERT_EQ (st.tombstones, 1);
+  ASSERT_EQ (st.maxChainLength, 3);
+  ASSERT_DOUBLE_EQ (st.averageProbes, (1.0 + 3.0 + 1.0) / 3.0);
+}
@@ -0,0 +1,96 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <dlfcn.h>
+#include <malloc.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/heap_dump.h>
+
+
+namespace {
+
+using dump_t = int (*) (const char *);
+
+/// @brief Writes a heap dump with the preloaded library and maps it.
+bool dump (const std::string &path, meminspect::HeapDumpFile &file) {
+  const auto f { reinterpret_cast<dump_t> (dlsym (RTLD_DEFAULT, "meminspect_dump")) };
+
+  return (f != nullptr) && (f (path.c_str()) == 0) && file.open (path.c_str());
+}
+
+/// @brief Gets the sizes of the blocks of a heap dump.
+std::unordered_map<uintptr_t, uint64_t> sizes (const meminspect::HeapDumpFile &file) {
+  std::unordered_map<uintptr_t, uint64_t> s;
+  for (size_t i = 0; i < file.header().blocks; ++i)
+    s[file.blocks()[i].ptr] = file.blocks()[i].size;
+
+  return s;
+}
+
+}
+
+
+// ----------------------------------------------------------------------------
+// test_preloaded
+// ----------------------------------------------------------------------------
+TEST (Preload, test_preloaded) {
+  // the binary is not linked with the hooks: they come from LD_PRELOAD.
+  ASSERT_NE (dlsym (RTLD_DEFAULT, "meminspect_dump"), nullptr);
+}
+
+// ----------------------------------------------------------------------------
+// test_blocks
+// ----------------------------------------------------------------------------
+TEST (Preload, test_blocks) {
+  const auto path { testing::TempDir() + "meminspect_test_preload.dump" };
+
+  std::vector<void *> blocks;
+  for (size_t i = 1; i <= 50; ++i)
+    blocks.push_back (std::malloc (i * 1000 + 1));
+
+  void *zeroed { std::calloc (10, 777) };
+  void *aligned { std::aligned_alloc (256, 2560) };
+  void *moved { std::realloc (std::malloc (10), 12345) };
+  auto *object { new char[4321] };
+  void *freed { std::malloc (54321) };
+  std::free (freed);
+
+  ASSERT_GE (malloc_usable_size (blocks[0]), 1001);
+
+  meminspect::HeapDumpFile file;
+  ASSERT_TRUE (dump (path, file));
+
+  auto s { sizes (file) };
+  for (size_t i = 0; i < blocks.size(); ++i)
+    ASSERT_EQ (s[reinterpret_cast<uintptr_t> (blocks[i])], (i + 1) * 1000 + 1);
+
+  ASSERT_EQ (s[reinterpret_cast<uintptr_t> (zeroed)], 7770);
+  ASSERT_EQ (s[reinterpret_cast<uintptr_t> (aligned)], 2560);
+  ASSERT_EQ (s[reinterpret_cast<uintptr_t> (moved)], 12345);
+  ASSERT_EQ (s[reinterpret_cast<uintptr_t> (object)], 4321);
+
+  // MEMISPECT_MODE=stacks: the blocks carry their allocation stacks.
+  ASSERT_GT (file.header().stacks, 0);
+  for (auto p : blocks)
+    std::free (p);
+
+  std::free (zeroed);
+  std::free (aligned);
+  std::free (moved);
+  delete[] object;
+
+  ASSERT_TRUE (dump (path, file));
+  s = sizes (file);
+  ASSERT_EQ (s.count (reinterpret_cast<uintptr_t> (blocks[0])), 0);
+
+  std::remove (path.c_str());
+}
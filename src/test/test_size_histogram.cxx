@@ -0,0 +1,126 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/size_histogram.h>
+
+
+// ----------------------------------------------------------------------------
+// test_buckets
+// ----------------------------------------------------------------------------
+TEST (SizeHistogram, test_buckets) {
+  using meminspect::SizeHistogram;
+
+  // the small sizes have a class of their own.
+  for (size_t size = 0; size < 2 * SizeHistogram::SubBuckets; ++size) {
+    ASSERT_EQ (SizeHistogram::bucket (size), size);
+    ASSERT_EQ (SizeHistogram::lowerBound (size), size);
+    ASSERT_EQ (SizeHistogram::upperBound (size), size);
+  }
+
+  // the classes cover every size, without gaps nor overlaps.
+  for (size_t i = 1; i < SizeHistogram::Buckets; ++i) {
+    ASSERT_EQ (SizeHistogram::lowerBound (i), SizeHistogram::upperBound (i - 1) + 1);
+    ASSERT_EQ (SizeHistogram::bucket (SizeHistogram::lowerBound (i)), i);
+    ASSERT_EQ (SizeHistogram::bucket (SizeHistogram::upperBound (i)), i);
+  }
+
+  ASSERT_EQ (SizeHistogram::bucket (SIZE_MAX), SizeHistogram::Buckets - 1);
+  ASSERT_EQ (SizeHistogram::upperBound (SizeHistogram::Buckets - 1), SIZE_MAX);
+
+  // each power of two is split into classes of the same width.
+  if constexpr (SizeHistogram::SubBuckets == 4) {
+    ASSERT_EQ (SizeHistogram::lowerBound (SizeHistogram::bucket (100)), 96);
+    ASSERT_EQ (SizeHistogram::upperBound (SizeHistogram::bucket (100)), 111);
+    ASSERT_EQ (SizeHistogram::lowerBound (SizeHistogram::bucket (1500)), 1280);
+    ASSERT_EQ (SizeHistogram::upperBound (SizeHistogram::bucket (1500)), 1535);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// test_counters
+// ----------------------------------------------------------------------------
+TEST (SizeHistogram, test_counters) {
+  using meminspect::SizeHistogram;
+  using Counters = meminspect::HistogramCounters<struct CountersTag>;
+
+  Counters::allocated (100);
+  Counters::allocated (110);
+  Counters::allocated (4096);
+  Counters::freed (100);
+
+  const auto baseline { Counters::read() };
+  const auto &b { baseline.buckets[SizeHistogram::bucket (100)] };
+  ASSERT_EQ (b.allocations, 2);
+  ASSERT_EQ (b.frees, 1);
+  ASSERT_EQ (b.allocatedBytes, 210);
+  ASSERT_EQ (b.freedBytes, 100);
+  ASSERT_EQ (b.liveBlocks(), 1);
+  ASSERT_EQ (b.liveBytes(), 110);
+  ASSERT_EQ (baseline.buckets[SizeHistogram::bucket (4096)].allocations, 1);
+
+  // the difference with a baseline only holds what came after it.
+  Counters::freed (4096);
+  Counters::allocated (7);
+
+  size_t classes { 0 };
+  Counters::read().since (baseline).forEach ([&classes] (size_t lower, size_t upper, const SizeHistogram::Bucket &c) {
+    ++classes;
+    if (lower == 7) {
+      ASSERT_EQ (upper, 7);
+      ASSERT_EQ (c.allocations, 1);
+      ASSERT_EQ (c.frees, 0);
+    }
+    else {
+      ASSERT_LE (lower, 4096);
+      ASSERT_GE (upper, 4096);
+      ASSERT_EQ (c.allocations, 0);
+      ASSERT_EQ (c.frees, 1);
+      ASSERT_EQ (c.liveBytes(), -4096);
+    }
+  });
+
+  ASSERT_EQ (classes, 2);
+}
+
+// ----------------------------------------------------------------------------
+// test_threads
+// ----------------------------------------------------------------------------
+TEST (SizeHistogram, test_threads) {
+  using meminspect::SizeHistogram;
+  using Counters = meminspect::HistogramCounters<struct ThreadsTag>;
+
+  // the shards of the threads that exited are kept.
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 8; ++t) {
+    threads.emplace_back ([t] () {
+      for (size_t i = 0; i < 1000; ++i) {
+        Counters::allocated (64 + t);
+        Counters::freed (64 + t);
+      }
+    });
+  }
+
+  for (auto &t : threads)
+    t.join();
+
+  const auto h { Counters::read() };
+
+  uint64_t allocations { 0 };
+  uint64_t bytes { 0 };
+  h.forEach ([&] (size_t, size_t, const SizeHistogram::Bucket &c) {
+    allocations += c.allocations;
+    bytes += c.freedBytes;
+    ASSERT_EQ (c.liveBlocks(), 0);
+  });
+
+  ASSERT_EQ (allocations, 8000);
+  ASSERT_EQ (bytes, (64 * 8000) + (1000 * 28));
+}
@@ -0,0 +1,159 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <malloc.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/memory_inspector.h>
+#include <meminspect/stack_depot.h>
+
+
+namespace {
+
+struct TestAllocator {
+  static meminspect::malloc_t malloc;
+  static meminspect::realloc_t realloc;
+  static meminspect::calloc_t calloc;
+  static meminspect::aligned_alloc_t aligned_alloc;
+  static meminspect::free_t free;
+  static meminspect::malloc_usable_size_t malloc_usable_size;
+};
+meminspect::malloc_t TestAllocator::malloc { ::malloc };
+meminspect::realloc_t TestAllocator::realloc { ::realloc };
+meminspect::calloc_t TestAllocator::calloc { ::calloc };
+meminspect::aligned_alloc_t TestAllocator::aligned_alloc { ::aligned_alloc };
+meminspect::free_t TestAllocator::free { ::free };
+meminspect::malloc_usable_size_t TestAllocator::malloc_usable_size { ::malloc_usable_size };
+
+using StackInspector = meminspect::MemoryInspector<TestAllocator, meminspect::ShardedHashMapPtr<void, meminspect::Block, TestAllocator>>;
+
+// the empty asm after the call keeps it from becoming a tail call, so each function is a distinct frame.
+__attribute__ ((noinline)) uint32_t captureA (size_t size) {
+  const auto id { meminspect::StackDepot::capture (size) };
+  asm volatile ("" ::: "memory");
+  return id;
+}
+
+__attribute__ ((noinline)) uint32_t captureB (size_t size) {
+  const auto id { meminspect::StackDepot::capture (size) };
+  asm volatile ("" ::: "memory");
+  return id;
+}
+
+// whether an address is inside the code of a function, which these small functions keep within 128 bytes.
+bool inside (uintptr_t addr, uint32_t (*f) (size_t)) {
+  const auto start { reinterpret_cast<uintptr_t> (f) };
+  return (addr > start) && (addr < start + 128);
+}
+
+size_t liveBytes() {
+  size_t bytes { 0 };
+  meminspect::StackDepot::forEach ([ &bytes ] (const meminspect::StackDepot::Stack &s) { bytes += s.liveBytes(); });
+
+  return bytes;
+}
+
+}
+
+
+// ----------------------------------------------------------------------------
+// test_capture
+// ----------------------------------------------------------------------------
+TEST (StackDepot, test_capture) {
+  // the same lambda runs on two threads, so both captures have the same call stack.
+  const auto site { [] (size_t size, uint32_t &id) { id = captureA (size); } };
+
+  uint32_t a0 { 0 };
+  uint32_t a1 { 0 };
+  std::thread (site, 100, std::ref (a0)).join();
+  std::thread (site, 50, std::ref (a1)).join();
+  const auto b { captureB (10) };
+
+  ASSERT_NE (a0, meminspect::StackDepot::NoStack);
+  ASSERT_NE (b, meminspect::StackDepot::NoStack);
+
+  // the same call stack is stored once.
+  ASSERT_EQ (a0, a1);
+  ASSERT_NE (a0, b);
+
+  const auto sa { meminspect::StackDepot::get (a0) };
+  ASSERT_EQ (sa->id(), a0);
+  ASSERT_GE (sa->depth(), 1);
+  ASSERT_LE (sa->depth(), MEMISPECT_STACK_DEPTH);
+  ASSERT_EQ (sa->liveBytes(), 150);
+  ASSERT_EQ (sa->liveBlocks(), 2);
+
+  // the stacks start at the caller of capture, not inside the depot.
+  ASSERT_TRUE (inside (sa->frames()[0], &captureA));
+  ASSERT_TRUE (inside (meminspect::StackDepot::get (b)->frames()[0], &captureB));
+  ASSERT_EQ (meminspect::StackDepot::get (b)->liveBytes(), 10);
+
+  meminspect::StackDepot::release (a0, 100);
+  meminspect::StackDepot::release (a1, 50);
+  meminspect::StackDepot::release (b, 10);
+  ASSERT_EQ (sa->liveBytes(), 0);
+  ASSERT_EQ (sa->liveBlocks(), 0);
+
+  ASSERT_EQ (meminspect::StackDepot::get (meminspect::StackDepot::NoStack), nullptr);
+  ASSERT_GT (meminspect::StackDepot::usedBytes(), 0);
+
+  bool found { false };
+  meminspect::StackDepot::forEach ([ a0, &found ] (const meminspect::StackDepot::Stack &s) { found |= (s.id() == a0); });
+  ASSERT_TRUE (found);
+}
+
+// ----------------------------------------------------------------------------
+// test_inspector
+// ----------------------------------------------------------------------------
+TEST (StackDepot, test_inspector) {
+  const auto baseline { StackInspector::add() };
+
+  const auto before { liveBytes() };
+
+  void *mem0 { StackInspector::alloc (100) };
+  void *mem1 { StackInspector::calloc (2, 50) };
+  void *mem2 { StackInspector::aligned_alloc (64, 128) };
+  ASSERT_EQ (StackInspector::bytesSince (baseline), 328);
+  ASSERT_EQ (liveBytes(), before + 328);
+  ASSERT_GE (StackInspector::usable_size (mem2), 128);
+
+  mem0 = StackInspector::realloc (mem0, 300);
+  ASSERT_EQ (liveBytes(), before + 528);
+
+  StackInspector::dealloc (mem0);
+  StackInspector::dealloc (mem1);
+  StackInspector::dealloc (mem2);
+  ASSERT_EQ (StackInspector::bytesSince (baseline), 0);
+  ASSERT_EQ (liveBytes(), before);
+
+  StackInspector::remove();
+}
+
+// ----------------------------------------------------------------------------
+// test_threads
+// ----------------------------------------------------------------------------
+TEST (StackDepot, test_threads) {
+  const auto before { liveBytes() };
+
+  std::vector<std::thread> workers;
+  for (int t = 0; t < 4; ++t) {
+    workers.emplace_back ([] () {
+      std::vector<void *> blocks;
+      for (int i = 0; i < 1000; ++i)
+        blocks.push_back (StackInspector::alloc (16 + (i % 7)));
+      for (auto p : blocks)
+        StackInspector::dealloc (p);
+    });
+  }
+
+  for (auto &w : workers)
+    w.join();
+
+  ASSERT_EQ (liveBytes(), before);
+}
@@ -0,0 +1,232 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/memory_inspector.h>
+#include <meminspect/stats_segment.h>
+
+
+namespace {
+
+struct TestAllocator {
+  static meminspect::malloc_t malloc;
+  static meminspect::free_t free;
+};
+meminspect::malloc_t TestAllocator::malloc { ::malloc };
+meminspect::free_t TestAllocator::free { ::free };
+
+using Inspector = meminspect::MemoryInspector<TestAllocator, meminspect::ShardedHashMapPtr<void, size_t, TestAllocator>>;
+using Publisher = meminspect::StatsPublisher<Inspector>;
+using HeaderPublisher = meminspect::StatsPublisher<meminspect::MemoryInspector<TestAllocator, meminspect::InBandHeader>>;
+
+/// @brief Gets a segment name of its own for each process running the tests.
+std::string segmentName() {
+  return "meminspect_test_stats." + std::to_string (::getpid());
+}
+
+}
+
+
+// ----------------------------------------------------------------------------
+// test_publish
+// ----------------------------------------------------------------------------
+TEST (StatsSegment, test_publish) {
+  const auto name { segmentName() };
+  meminspect::StatsReader reader;
+  meminspect::StatsSample sample;
+
+  ASSERT_FALSE (reader.open (name.c_str()));
+  ASSERT_TRUE (Publisher::start (name.c_str()));
+  ASSERT_FALSE (Publisher::start (name.c_str()));
+  ASSERT_TRUE (reader.open (name.c_str()));
+
+  // the segment of another live process is never replaced.
+  const auto child { ::fork() };
+  if (child == 0)
+    ::_exit (HeaderPublisher::start (name.c_str()) ? 1 : 0);
+
+  int status { -1 };
+  ASSERT_EQ (::waitpid (child, &status, 0), child);
+  ASSERT_EQ (status, 0);
+
+  void *mem0 { Inspector::alloc (1000) };
+  void *mem1 { Inspector::alloc (3000) };
+  Publisher::publish();
+  Inspector::dealloc (mem1);
+
+  // a named tracker only counts what happens after it is attached.
+  const auto baseline { Inspector::add() };
+  const auto peak { Inspector::addPeak() };
+  const auto slot { Publisher::attach ("stage one", baseline, peak) };
+  ASSERT_GE (slot, 0);
+  void *mem2 { Inspector::alloc (500) };
+  Publisher::publish();
+
+  ASSERT_TRUE (reader.read (sample));
+  ASSERT_EQ (sample.pid, static_cast<uint32_t> (::getpid()));
+  ASSERT_GE (sample.updates, 3);
+  ASSERT_GT (sample.time, 0);
+  ASSERT_EQ (sample.global.allocated, 4500);
+  ASSERT_EQ (sample.global.freed, 3000);
+  ASSERT_EQ (sample.global.allocations, 3);
+  ASSERT_EQ (sample.global.frees, 1);
+  ASSERT_EQ (sample.global.liveBytes, 1500);
+  ASSERT_EQ (sample.global.peakBytes, 4000);
+
+  // the size classes start with the publisher as well.
+  ASSERT_EQ (sample.histogram.size(), 3);
+  for (const auto &b : sample.histogram) {
+    ASSERT_LE (b.lowerBound, b.upperBound);
+    ASSERT_EQ (b.allocations, 1);
+    ASSERT_EQ (b.frees, b.lowerBound <= 3000 && 3000 <= b.upperBound ? 1 : 0);
+  }
+
+  ASSERT_EQ (sample.trackers.size(), 1);
+  ASSERT_EQ (sample.trackers[0].name, "stage one");
+  ASSERT_EQ (sample.trackers[0].counters.allocated, 500);
+  ASSERT_EQ (sample.trackers[0].counters.allocations, 1);
+  ASSERT_EQ (sample.trackers[0].counters.liveBytes, 500);
+  ASSERT_EQ (sample.trackers[0].counters.peakBytes, 500);
+
+  // detached trackers are no longer published.
+  Publisher::detach (slot);
+  Inspector::removePeak (peak);
+  Inspector::remove();
+  Publisher::publish();
+  ASSERT_TRUE (reader.read (sample));
+  ASSERT_TRUE (sample.trackers.empty());
+
+  Inspector::dealloc (mem0);
+  Inspector::dealloc (mem2);
+
+  // the segment is removed when the publisher stops.
+  Publisher::stop();
+  ASSERT_FALSE (meminspect::StatsReader {}.open (name.c_str()));
+}
+
+// ----------------------------------------------------------------------------
+// test_consistency
+// ----------------------------------------------------------------------------
+TEST (StatsSegment, test_consistency) {
+  const auto name { segmentName() };
+  ASSERT_TRUE (Publisher::start (name.c_str()));
+
+  const auto slot { Publisher::attach ("worker", Inspector::add(), nullptr) };
+
+  // the allocations and the updates race with the reader, which must never see a torn update.
+  std::atomic<bool> done { false };
+  std::thread writer { [&done] () {
+    std::vector<void *> blocks;
+    for (int i = 0; i < 20000; ++i) {
+      blocks.push_back (Inspector::alloc (16 + (i % 512)));
+      if ((i % 3) == 0) {
+        Inspector::dealloc (blocks.back());
+        blocks.pop_back();
+      }
+
+      if ((i % 10) == 0)
+        Publisher::publish();
+    }
+
+    for (auto p : blocks)
+      Inspector::dealloc (p);
+
+    done.store (true, std::memory_order_release);
+  } };
+
+  meminspect::StatsReader reader;
+  ASSERT_TRUE (reader.open (name.c_str()));
+
+  meminspect::StatsSample sample;
+  uint64_t updates { 0 };
+  while (!done.load (std::memory_order_acquire)) {
+    ASSERT_TRUE (reader.read (sample));
+    ASSERT_GE (sample.updates, updates);
+    updates = sample.updates;
+
+    const auto &g { sample.global };
+    ASSERT_EQ (g.liveBytes, g.allocated - g.freed);
+    ASSERT_GE (g.allocations, g.frees);
+    ASSERT_GE (g.peakBytes, g.liveBytes);
+
+    for (const auto &t : sample.trackers) {
+      ASSERT_EQ (t.name, "worker");
+      ASSERT_EQ (t.counters.liveBytes, t.counters.allocated - t.counters.freed);
+    }
+  }
+
+  writer.join();
+
+  Publisher::detach (slot);
+  Inspector::remove();
+  Publisher::stop();
+}
+
+// ----------------------------------------------------------------------------
+// test_stale
+// ----------------------------------------------------------------------------
+TEST (StatsSegment, test_stale) {
+  const auto name { segmentName() };
+  ASSERT_TRUE (Publisher::start (name.c_str()));
+
+  // a copy of the segment, left in the middle of an update by a process that exited.
+  std::string segment;
+  {
+    const auto fd { ::open (meminspect::statsSegmentPath (name.c_str()).c_str(), O_RDONLY) };
+    ASSERT_GE (fd, 0);
+
+    struct stat st {};
+    ASSERT_EQ (::fstat (fd, &st), 0);
+    segment.resize (static_cast<size_t> (st.st_size));
+    ASSERT_EQ (::pread (fd, segment.data(), segment.size(), 0), st.st_size);
+    ::close (fd);
+  }
+
+  Publisher::stop();
+
+  const auto child { ::fork() };
+  if (child == 0)
+    ::_exit (0);
+
+  int status { -1 };
+  ASSERT_EQ (::waitpid (child, &status, 0), child);
+
+  meminspect::StatsSegmentHeader h {};
+  std::memcpy (&h, segment.data(), sizeof (h));
+  h.sequence |= 1;
+  h.pid = static_cast<uint32_t> (child);
+  std::memcpy (segment.data(), &h, sizeof (h));
+
+  const auto stale { name + ".stale" };
+  const auto path { meminspect::statsSegmentPath (stale.c_str()) };
+  {
+    const auto fd { ::open (path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) };
+    ASSERT_GE (fd, 0);
+    ASSERT_EQ (::write (fd, segment.data(), segment.size()), static_cast<ssize_t> (segment.size()));
+    ::close (fd);
+  }
+
+  // the reader gives up instead of waiting for an update that never ends.
+  meminspect::StatsReader reader;
+  meminspect::StatsSample sample;
+  ASSERT_TRUE (reader.open (stale.c_str()));
+  ASSERT_FALSE (reader.read (sample));
+  ASSERT_FALSE (reader.alive());
+
+  reader.close();
+  ::unlink (path.c_str());
+}
@@ -0,0 +1,144 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <meminspect/trace.h>
+
+
+// ----------------------------------------------------------------------------
+// test_record
+// ----------------------------------------------------------------------------
+TEST (TraceRecorder, test_record) {
+  const auto path { testing::TempDir() + "meminspect_test_record.trace" };
+  int a { 0 };
+  int b { 0 };
+
+  ASSERT_TRUE (meminspect::TraceRecorder::start (path.c_str()));
+  ASSERT_TRUE (meminspect::TraceRecorder::active());
+  ASSERT_FALSE (meminspect::TraceRecorder::start (path.c_str()));
+
+  const auto t0 { meminspect::TraceRecorder::now() };
+  ASSERT_NE (t0, 0);
+  meminspect::TraceRecorder::record (meminspect::TraceOp::Malloc, t0, nullptr, &a, 10);
+
+  std::thread ([&] () {
+    meminspect::TraceRecorder::record (meminspect::TraceOp::AlignedAlloc, meminspect::TraceRecorder::now(), nullptr, &b, 64, 64);
+  }).join();
+
+  meminspect::TraceRecorder::record (meminspect::TraceOp::Realloc, meminspect::TraceRecorder::now(), &a, &b, 20);
+  meminspect::TraceRecorder::record (meminspect::TraceOp::Free, meminspect::TraceRecorder::now(), &b, nullptr, 0);
+
+  // more than a chunk, so the records of the thread are written in several chunks.
+  for (size_t i = 0; i < MEMISPECT_TRACE_CHUNK + 10; ++i)
+    meminspect::TraceRecorder::record (meminspect::TraceOp::Calloc, meminspect::TraceRecorder::now(), nullptr, &a, i);
+
+  meminspect::TraceRecorder::stop();
+  ASSERT_FALSE (meminspect::TraceRecorder::active());
+  ASSERT_EQ (meminspect::TraceRecorder::now(), 0);
+
+  std::vector<meminspect::TraceRecord> records;
+  ASSERT_TRUE (meminspect::TraceRecorder::load (path.c_str(), records));
+  ASSERT_EQ (records.size(), MEMISPECT_TRACE_CHUNK + 14);
+
+  for (size_t i = 1; i < records.size(); ++i)
+    ASSERT_LE (records[i - 1].time, records[i].time);
+
+  const auto &malloc { records[0] };
+  ASSERT_EQ (malloc.op, meminspect::TraceOp::Malloc);
+  ASSERT_EQ (malloc.ptr, 0);
+  ASSERT_EQ (malloc.result, reinterpret_cast<uintptr_t> (&a));
+  ASSERT_EQ (malloc.size, 10);
+
+  const auto &aligned { records[1] };
+  ASSERT_EQ (aligned.op, meminspect::TraceOp::AlignedAlloc);
+  ASSERT_EQ (aligned.alignment, 6);
+  ASSERT_NE (aligned.thread, malloc.thread);
+
+  const auto &realloc { records[2] };
+  ASSERT_EQ (realloc.op, meminspect::TraceOp::Realloc);
+  ASSERT_EQ (realloc.ptr, reinterpret_cast<uintptr_t> (&a));
+  ASSERT_EQ (realloc.result, reinterpret_cast<uintptr_t> (&b));
+  ASSERT_EQ (realloc.size, 20);
+  ASSERT_EQ (realloc.thread, malloc.thread);
+
+  ASSERT_EQ (records[3].op, meminspect::TraceOp::Free);
+  ASSERT_EQ (records.back().size, MEMISPECT_TRACE_CHUNK + 9);
+
+  std::remove (path.c_str());
+}
+
+// ----------------------------------------------------------------------------
+// test_partial
+// ----------------------------------------------------------------------------
+TEST (TraceRecorder, test_partial) {
+  const auto path { testing::TempDir() + "meminspect_test_partial.trace" };
+  int a { 0 };
+
+  ASSERT_TRUE (meminspect::TraceRecorder::start (path.c_str()));
+  for (size_t i = 0; i < (2 * MEMISPECT_TRACE_CHUNK) + 5; ++i)
+    meminspect::TraceRecorder::record (meminspect::TraceOp::Malloc, meminspect::TraceRecorder::now(), nullptr, &a, i);
+
+  // while recording (or after a crash), the file holds the complete chunks the writer copied.
+  std::vector<meminspect::TraceRecord> records;
+  const auto deadline { std::chrono::steady_clock::now() + std::chrono::seconds (5) };
+  while ((records.size() < 2 * MEMISPECT_TRACE_CHUNK) && (std::chrono::steady_clock::now() < deadline)) {
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    ASSERT_TRUE (meminspect::TraceRecorder::load (path.c_str(), records));
+  }
+
+  ASSERT_EQ (records.size(), 2 * MEMISPECT_TRACE_CHUNK);
+  for (size_t i = 0; i < records.size(); ++i)
+    ASSERT_EQ (records[i].size, i);
+
+  // stop() writes the partial chunk as well.
+  meminspect::TraceRecorder::stop();
+  ASSERT_TRUE (meminspect::TraceRecorder::load (path.c_str(), records));
+  ASSERT_EQ (records.size(), (2 * MEMISPECT_TRACE_CHUNK) + 5);
+
+  std::remove (path.c_str());
+}
+
+// ----------------------------------------------------------------------------
+// test_inactive
+// ----------------------------------------------------------------------------
+TEST (TraceRecorder, test_inactive) {
+  const auto path { testing::TempDir() + "meminspect_test_inactive.trace" };
+  int a { 0 };
+
+  // calls that start before the recording are not recorded.
+  const auto t0 { meminspect::TraceRecorder::now() };
+  ASSERT_EQ (t0, 0);
+
+  ASSERT_TRUE (meminspect::TraceRecorder::start (path.c_str()));
+  meminspect::TraceRecorder::record (meminspect::TraceOp::Malloc, t0, nullptr, &a, 10);
+  meminspect::TraceRecorder::stop();
+
+  meminspect::TraceRecorder::record (meminspect::TraceOp::Malloc, meminspect::TraceRecorder::now(), nullptr, &a, 10);
+
+  std::vector<meminspect::TraceRecord> records;
+  ASSERT_TRUE (meminspect::TraceRecorder::load (path.c_str(), records));
+  ASSERT_TRUE (records.empty());
+
+  std::remove (path.c_str());
+
+  // missing files and files that are not traces.
+  ASSERT_FALSE (meminspect::TraceRecorder::load (path.c_str(), records));
+  ASSERT_FALSE (meminspect::TraceRecorder::start ("/nonexistent/meminspect.trace"));
+
+  auto *f { std::fopen (path.c_str(), "w") };
+  std::fputs ("this is not a trace, but it is long enough", f);
+  std::fclose (f);
+
+  ASSERT_FALSE (meminspect::TraceRecorder::load (path.c_str(), records));
+
+  std::remove (path.c_str());
+}
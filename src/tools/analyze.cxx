@@ -0,0 +1,563 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <meminspect/heap_dump.h>
+#include <meminspect/size_histogram.h>
+#include <meminspect/trace.h>
+
+
+namespace {
+
+/// @brief The options of the analysis.
+struct Options {
+  const char *path { nullptr }; ///< The trace or heap dump.
+  size_t threads { 0 };         ///< The worker threads (0: one per core).
+  size_t top { 10 };            ///< The entries of the top lists.
+  size_t buckets { 20 };        ///< The rows of the live-bytes-over-time table.
+};
+
+// ----------------------------------------------------------------------------
+// helpers
+// ----------------------------------------------------------------------------
+
+/// @brief Formats a number of bytes with a binary unit.
+std::string human (double n) {
+  static constexpr const char *Units[] { "B", "KiB", "MiB", "GiB", "TiB" };
+
+  size_t unit { 0 };
+  while ((n >= 1024) && (unit + 1 < std::size (Units))) {
+    n /= 1024;
+    ++unit;
+  }
+
+  char text[32];
+  std::snprintf (text, sizeof (text), unit == 0 ? "%.0f %s" : "%.1f %s", n, Units[unit]);
+
+  return text;
+}
+
+/// @brief Runs a function on [0, n) split into contiguous ranges, one per thread.
+/// @param threads The threads.
+/// @param n The size of the range.
+/// @param f The function, called with the index of the thread and its range.
+template<typename F>
+void parallel (size_t threads, size_t n, F &&f) {
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < threads; ++w)
+    workers.emplace_back ([&f, w, threads, n] () { f (w, (n * w) / threads, (n * (w + 1)) / threads); });
+
+  for (auto &t : workers)
+    t.join();
+}
+
+/// @brief Blocks and bytes per size class.
+/// The classes are those of meminspect::SizeHistogram, so they match the ones printed by meminspect-stat.
+struct Histogram {
+  using Classes = meminspect::SizeHistogram; ///< The layout of the classes.
+
+  std::array<uint64_t, Classes::Buckets> blocks {}; ///< The blocks of each class.
+  std::array<uint64_t, Classes::Buckets> bytes {};  ///< The bytes of each class.
+
+  /// @brief Counts a block.
+  inline void add (uint64_t size) {
+    const auto c { Classes::bucket (size) };
+    ++blocks[c];
+    bytes[c] += size;
+  }
+
+  /// @brief Merges another histogram.
+  Histogram & operator+= (const Histogram &other) {
+    for (size_t c = 0; c < Classes::Buckets; ++c) {
+      blocks[c] += other.blocks[c];
+      bytes[c] += other.bytes[c];
+    }
+
+    return *this;
+  }
+
+  /// @brief Prints the classes that have blocks.
+  void print() const {
+    uint64_t total { 0 };
+    for (auto b : bytes)
+      total += b;
+
+    std::printf ("  %-24s %12s %12s %7s\n", "size", "blocks", "bytes", "bytes%");
+    for (size_t c = 0; c < Classes::Buckets; ++c) {
+      if (blocks[c] == 0)
+        continue;
+
+      // printed in bytes like meminspect-stat, since the bounds of the classes are not round numbers.
+      const uint64_t low { Classes::lowerBound (c) };
+      const uint64_t high { Classes::upperBound (c) };
+
+      char range[48];
+      if (low == high)
+        std::snprintf (range, sizeof (range), "%" PRIu64, low);
+      else if (high == UINT64_MAX)
+        std::snprintf (range, sizeof (range), "%" PRIu64 "-max", low);
+      else
+        std::snprintf (range, sizeof (range), "%" PRIu64 "-%" PRIu64, low, high);
+
+      std::printf ("  %-24s %12" PRIu64 " %12s %6.1f%%\n", range, blocks[c], human (bytes[c]).c_str(),
+                   total > 0 ? 100.0 * bytes[c] / total : 0.0);
+    }
+  }
+};
+
+// ----------------------------------------------------------------------------
+// traces
+// ----------------------------------------------------------------------------
+
+/// @brief A block live during the trace.
+struct Live {
+  uint64_t size;   ///< The requested size.
+  uint64_t time;   ///< When it was created.
+  uint32_t thread; ///< The thread that created it.
+};
+
+/// @brief A change of the live bytes.
+struct Delta {
+  uint64_t time;  ///< When it happened.
+  int64_t bytes;  ///< The bytes created (positive) or released (negative).
+};
+
+/// @brief A block released or created by a call.
+struct Event {
+  uint64_t time;   ///< When it happened.
+  uint64_t addr;   ///< The block.
+  uint64_t size;   ///< The requested size (created blocks only).
+  uint32_t thread; ///< The calling thread.
+  bool create;     ///< Whether the block was created (or released).
+};
+
+/// @brief The blocks of the addresses that hash to one worker, followed through the trace.
+/// A block passed to a call is released when the call starts, and a block returned by a call exists when it
+/// returns, so an address reused by another thread right after a free is never mistaken for the freed block.
+class Partition {
+  public:
+    /// @brief Takes the events of the addresses of a worker, routed to it by every reader, and sorts them by time.
+    /// @param routed The events routed by each reader to each worker, in the order of the chunks.
+    /// @param worker The worker.
+    Partition (std::vector<std::vector<std::vector<Event>>> &routed, size_t worker) {
+      size_t n { 0 };
+      for (const auto &r : routed)
+        n += r[worker].size();
+
+      _events.reserve (n);
+      for (auto &r : routed) {
+        _events.insert (_events.end(), r[worker].begin(), r[worker].end());
+        std::vector<Event> {}.swap (r[worker]);
+      }
+
+      std::stable_sort (_events.begin(), _events.end(), [] (const Event &a, const Event &b) {
+        return (a.time != b.time) ? (a.time < b.time) : (!a.create && b.create);
+      });
+    }
+
+    /// @brief Follows the blocks up to a time.
+    /// Frees of blocks created before the recording started are ignored.
+    /// @param until The last time.
+    /// @param deltas If not null, receives the changes of the live bytes, in time order.
+    /// @return The blocks live at `until`.
+    std::unordered_map<uint64_t, Live> run (uint64_t until, std::vector<Delta> *deltas) const {
+      std::unordered_map<uint64_t, Live> live;
+
+      for (const auto &e : _events) {
+        if (e.time > until)
+          break;
+
+        const auto it { live.find (e.addr) };
+
+        if (it != live.end()) {
+          if (deltas != nullptr)
+            deltas->push_back ({ e.time, -static_cast<int64_t> (it->second.size) });
+
+          live.erase (it);
+        }
+
+        if (e.create) {
+          live[e.addr] = { e.size, e.time, e.thread };
+          if (deltas != nullptr)
+            deltas->push_back ({ e.time, static_cast<int64_t> (e.size) });
+        }
+      }
+
+      return live;
+    }
+
+    /// @brief Gets the worker of an address.
+    static inline size_t owner (uint64_t addr, size_t workers) {
+      return ((addr * UINT64_C (0x9E3779B97F4A7C15)) >> 32) % workers;
+    }
+
+  private:
+    std::vector<Event> _events; ///< The events of the addresses of the worker, sorted by time.
+};
+
+/// @brief Analyzes a trace.
+int analyzeTrace (const meminspect::TraceFile &file, const Options &options) {
+  const auto threads { options.threads };
+
+  // the chunks are read in place, a range per reader, and each event is routed to the worker of its address.
+  std::vector<std::vector<std::vector<Event>>> routed (threads, std::vector<std::vector<Event>> (threads));
+  std::vector<Histogram> sizes (threads);
+  std::vector<std::array<uint64_t, 5>> calls (threads);
+  std::vector<uint64_t> spans (threads);
+  std::vector<uint32_t> callers (threads);
+
+  parallel (threads, file.chunks(), [&] (size_t w, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const auto records { file.records (i) };
+      for (size_t j = 0; j < file.chunk (i).count; ++j) {
+        const auto r { file.decode (records[j]) };
+        ++calls[w][static_cast<size_t> (r.op) % 5];
+        spans[w] = std::max (spans[w], r.time + r.duration);
+        callers[w] = std::max (callers[w], r.thread + 1);
+
+        if (r.ptr != 0)
+          routed[w][Partition::owner (r.ptr, threads)].push_back ({ r.time, r.ptr, 0, r.thread, false });
+
+        if (r.op != meminspect::TraceOp::Free) {
+          sizes[w].add (r.size);
+          if (r.result != 0)
+            routed[w][Partition::owner (r.result, threads)].push_back ({ r.time + r.duration, r.result, r.size, r.thread, true });
+        }
+      }
+    }
+  });
+
+  for (size_t w = 1; w < threads; ++w) {
+    sizes[0] += sizes[w];
+    for (size_t op = 0; op < 5; ++op)
+      calls[0][op] += calls[w][op];
+  }
+
+  const auto span { *std::max_element (spans.begin(), spans.end()) };
+  const auto traceThreads { *std::max_element (callers.begin(), callers.end()) };
+
+  uint64_t records { 0 };
+  for (auto c : calls[0])
+    records += c;
+
+  std::printf ("trace: %s\n", options.path);
+  std::printf ("  %" PRIu64 " calls from %" PRIu32 " threads over %.3f ms, %zu chunks, %" PRIu64 " records dropped\n",
+               records, traceThreads, span / 1e6, file.chunks(), file.header().dropped);
+  std::printf ("  malloc %" PRIu64 ", calloc %" PRIu64 ", aligned_alloc %" PRIu64 ", realloc %" PRIu64 ", free %" PRIu64 "\n\n",
+               calls[0][0], calls[0][1], calls[0][2], calls[0][3], calls[0][4]);
+
+  // the blocks are followed in parallel, each worker with the addresses that hash to it.
+  std::vector<std::unique_ptr<Partition>> partitions (threads);
+  std::vector<std::vector<Delta>> deltas (threads);
+  std::vector<std::vector<std::pair<uint64_t, Live>>> leaks (threads);
+
+  parallel (threads, threads, [&] (size_t w, size_t, size_t) {
+    partitions[w] = std::make_unique<Partition> (routed, w);
+    const auto live { partitions[w]->run (UINT64_MAX, &deltas[w]) };
+    leaks[w].assign (live.begin(), live.end());
+  });
+
+  // the deltas of each worker are in time order: they are merged as they are read.
+  using Head = std::pair<uint64_t, size_t>; // the time of the next delta of a worker, the worker
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  std::vector<size_t> next (threads, 0);
+  for (size_t w = 0; w < threads; ++w) {
+    if (!deltas[w].empty())
+      heads.push ({ deltas[w].front().time, w });
+  }
+
+  // live bytes over time: the value at the end of each row, and its maximum within the row.
+  const auto rows { std::max<size_t> (options.buckets, 1) };
+  std::vector<std::pair<int64_t, int64_t>> timeline (rows, { 0, 0 });
+  int64_t live { 0 };
+  int64_t peak { 0 };
+  uint64_t peakTime { 0 };
+  size_t row { 0 };
+
+  while (!heads.empty()) {
+    const auto w { heads.top().second };
+    heads.pop();
+
+    const auto &d { deltas[w][next[w]++] };
+    if (next[w] < deltas[w].size())
+      heads.push ({ deltas[w][next[w]].time, w });
+
+    const auto r { span > 0 ? std::min<size_t> ((d.time * rows) / span, rows - 1) : 0 };
+    for (; row < r; ++row) {
+      timeline[row + 1] = { live, live };
+    }
+
+    live += d.bytes;
+    timeline[row].first = live;
+    timeline[row].second = std::max (timeline[row].second, live);
+    if (live > peak) {
+      peak = live;
+      peakTime = d.time;
+    }
+  }
+
+  for (; row + 1 < rows; ++row)
+    timeline[row + 1] = { live, live };
+
+  std::vector<std::vector<Delta>> {}.swap (deltas);
+
+  std::printf ("live bytes over time:\n");
+  std::printf ("  %12s %12s %12s\n", "until (ms)", "live", "max");
+  for (size_t r = 0; r < rows; ++r) {
+    std::printf ("  %12.3f %12s %12s\n", (static_cast<double> (span) * (r + 1)) / rows / 1e6,
+                 human (timeline[r].first).c_str(), human (timeline[r].second).c_str());
+  }
+
+  // the peak composition: the blocks live at the peak, followed again up to it.
+  std::vector<Histogram> peakSizes (threads);
+  std::vector<std::unordered_map<uint32_t, std::pair<uint64_t, uint64_t>>> peakThreads (threads);
+
+  parallel (threads, threads, [&] (size_t w, size_t, size_t) {
+    for (const auto &[addr, block] : partitions[w]->run (peakTime, nullptr)) {
+      peakSizes[w].add (block.size);
+      auto &t { peakThreads[w][block.thread] };
+      ++t.first;
+      t.second += block.size;
+    }
+  });
+
+  for (size_t w = 1; w < threads; ++w) {
+    peakSizes[0] += peakSizes[w];
+    for (const auto &[thread, t] : peakThreads[w]) {
+      peakThreads[0][thread].first += t.first;
+      peakThreads[0][thread].second += t.second;
+    }
+  }
+
+  std::printf ("\npeak: %s at %.3f ms\n", human (peak).c_str(), peakTime / 1e6);
+  peakSizes[0].print();
+
+  std::vector<std::pair<uint32_t, std::pair<uint64_t, uint64_t>>> byThread (peakThreads[0].begin(), peakThreads[0].end());
+  std::sort (byThread.begin(), byThread.end(), [] (const auto &a, const auto &b) { return a.second.second > b.second.second; });
+
+  std::printf ("\n  %-24s %12s %12s\n", "thread", "blocks", "bytes");
+  for (size_t i = 0; i < std::min (byThread.size(), options.top); ++i) {
+    std::printf ("  %-24" PRIu32 " %12" PRIu64 " %12s\n", byThread[i].first, byThread[i].second.first,
+                 human (byThread[i].second.second).c_str());
+  }
+
+  std::printf ("\nallocation sizes:\n");
+  sizes[0].print();
+
+  // the blocks never freed: leaks, or blocks still in use when the recording stopped.
+  std::vector<std::pair<uint64_t, Live>> leaked;
+  for (auto &l : leaks)
+    leaked.insert (leaked.end(), l.begin(), l.end());
+
+  uint64_t leakedBytes { 0 };
+  for (const auto &l : leaked)
+    leakedBytes += l.second.size;
+
+  const auto shown { std::min (leaked.size(), options.top) };
+  std::partial_sort (leaked.begin(), leaked.begin() + shown, leaked.end(), [] (const auto &a, const auto &b) { return a.second.size > b.second.size; });
+
+  std::printf ("\nleaks (live at the end of the trace): %zu blocks, %s\n", leaked.size(), human (leakedBytes).c_str());
+  std::printf ("  %-18s %12s %8s %14s\n", "block", "size", "thread", "created (ms)");
+  for (size_t i = 0; i < shown; ++i) {
+    const auto &[addr, block] { leaked[i] };
+    std::printf ("  0x%016" PRIx64 " %12s %8" PRIu32 " %14.3f\n", addr, human (block.size).c_str(), block.thread, block.time / 1e6);
+  }
+
+  std::printf ("\nallocation sites: traces have no call stacks, analyze a heap dump written with MEMISPECT_CAPTURE_STACKS\n");
+
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// heap dumps
+// ----------------------------------------------------------------------------
+
+/// @brief A mapping of the memory map of the dumped process.
+struct Mapping {
+  uint64_t start;   ///< The first address.
+  uint64_t end;     ///< The address after the last one.
+  uint64_t offset;  ///< The offset of the first address in the file.
+  std::string path; ///< The mapped file.
+};
+
+/// @brief Parses the mappings of files from the text of `/proc/<pid>/maps`.
+std::vector<Mapping> parseMaps (std::string_view text) {
+  std::vector<Mapping> maps;
+
+  while (!text.empty()) {
+    const auto eol { text.find ('\n') };
+    const std::string line { text.substr (0, eol) };
+    text.remove_prefix (eol == std::string_view::npos ? text.size() : eol + 1);
+
+    Mapping m {};
+    char perms[8] {};
+    int pathAt { 0 };
+    if (std::sscanf (line.c_str(), "%" SCNx64 "-%" SCNx64 " %7s %" SCNx64 " %*s %*s %n", &m.start, &m.end, perms, &m.offset, &pathAt) < 4)
+      continue;
+
+    if ((pathAt > 0) && (line[pathAt] == '/')) {
+      m.path = line.substr (pathAt);
+      maps.push_back (std::move (m));
+    }
+  }
+
+  return maps;
+}
+
+/// @brief Formats a frame as the file that contains it and its offset in the file, for `addr2line`.
+std::string symbolize (const std::vector<Mapping> &maps, uint64_t frame) {
+  char text[64];
+  std::snprintf (text, sizeof (text), "0x%016" PRIx64, frame);
+
+  for (const auto &m : maps) {
+    if ((frame >= m.start) && (frame < m.end)) {
+      char offset[32];
+      std::snprintf (offset, sizeof (offset), "+0x%" PRIx64, frame - m.start + m.offset);
+
+      return std::string { text } + " " + m.path + offset;
+    }
+  }
+
+  return text;
+}
+
+/// @brief Analyzes a heap dump.
+int analyzeDump (const meminspect::HeapDumpFile &file, const Options &options) {
+  using Site = std::pair<uint64_t, uint64_t>; // bytes, blocks
+
+  const auto &h { file.header() };
+  const auto blocks { file.blocks() };
+  const auto threads { options.threads };
+
+  // the blocks are split between the workers.
+  std::vector<std::unordered_map<uint32_t, Site>> sites (threads);
+  std::vector<Histogram> sizes (threads);
+  std::vector<std::vector<meminspect::HeapDumpBlock>> largest (threads);
+
+  parallel (threads, h.blocks, [&] (size_t w, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      auto &s { sites[w][blocks[i].stack] };
+      s.first += blocks[i].size;
+      ++s.second;
+      sizes[w].add (blocks[i].size);
+    }
+
+    const auto shown { std::min (end - begin, options.top) };
+    largest[w].assign (blocks + begin, blocks + begin + shown);
+    std::partial_sort_copy (blocks + begin, blocks + end, largest[w].begin(), largest[w].end(), [] (const auto &a, const auto &b) { return a.size > b.size; });
+  });
+
+  for (size_t w = 1; w < threads; ++w) {
+    sizes[0] += sizes[w];
+    for (const auto &[id, s] : sites[w]) {
+      sites[0][id].first += s.first;
+      sites[0][id].second += s.second;
+    }
+
+    largest[0].insert (largest[0].end(), largest[w].begin(), largest[w].end());
+  }
+
+  std::unordered_map<uint32_t, std::pair<const uint64_t *, uint32_t>> stacks;
+  file.forEachStack ([&] (const meminspect::HeapDumpStack &s, const uint64_t *frames) { stacks[s.id] = { frames, s.depth }; });
+
+  const auto maps { parseMaps (file.maps()) };
+
+  std::printf ("heap dump: %s\n", options.path);
+  std::printf ("  %" PRIu64 " live blocks, %s, %" PRIu64 " allocation stacks\n\n", h.blocks, human (h.liveBytes).c_str(), h.stacks);
+
+  std::printf ("block sizes:\n");
+  sizes[0].print();
+
+  std::vector<std::pair<uint32_t, Site>> bySite (sites[0].begin(), sites[0].end());
+  std::sort (bySite.begin(), bySite.end(), [] (const auto &a, const auto &b) { return a.second.first > b.second.first; });
+
+  std::printf ("\ntop allocation sites:\n");
+  for (size_t i = 0; i < std::min (bySite.size(), options.top); ++i) {
+    const auto &[id, s] { bySite[i] };
+    std::printf ("  #%zu: %s in %" PRIu64 " blocks (%.1f%%)%s\n", i + 1, human (s.first).c_str(), s.second,
+                 h.liveBytes > 0 ? 100.0 * s.first / h.liveBytes : 0.0, id == meminspect::StackDepot::NoStack ? ", no stack" : "");
+
+    if (const auto it { stacks.find (id) }; it != stacks.end()) {
+      for (uint32_t f = 0; f < it->second.second; ++f)
+        std::printf ("      %s\n", symbolize (maps, it->second.first[f]).c_str());
+    }
+  }
+
+  // every block of a dump is live: the largest are the first leak candidates.
+  const auto shown { std::min (largest[0].size(), options.top) };
+  std::partial_sort (largest[0].begin(), largest[0].begin() + shown, largest[0].end(), [] (const auto &a, const auto &b) { return a.size > b.size; });
+
+  std::printf ("\nlargest live blocks:\n");
+  std::printf ("  %-18s %12s %10s\n", "block", "size", "stack");
+  for (size_t i = 0; i < shown; ++i) {
+    const auto &b { largest[0][i] };
+    std::printf ("  0x%016" PRIx64 " %12s %10" PRIu32 "\n", b.ptr, human (b.size).c_str(), b.stack);
+  }
+
+  return 0;
+}
+
+/// @brief Parses the command line.
+/// @return false if it is not valid.
+bool parse (int argc, char *argv[], Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    const auto value { [&] () { return (i + 1 < argc) ? std::strtoul (argv[++i], nullptr, 10) : 0; } };
+
+    if (std::strcmp (argv[i], "--threads") == 0)
+      options.threads = value();
+    else if (std::strcmp (argv[i], "--top") == 0)
+      options.top = value();
+    else if (std::strcmp (argv[i], "--buckets") == 0)
+      options.buckets = value();
+    else if ((argv[i][0] != '-') && (options.path == nullptr))
+      options.path = argv[i];
+    else
+      return false;
+  }
+
+  if (options.threads == 0)
+    options.threads = std::max (std::thread::hardware_concurrency(), 1u);
+
+  return options.path != nullptr;
+}
+
+}
+
+
+// ----------------------------------------------------------------------------
+// main
+// ----------------------------------------------------------------------------
+int main (int argc, char* argv[]) {
+  Options options {};
+  if (!parse (argc, argv, options)) {
+    std::fprintf (stderr, "usage: %s <trace or heap dump> [--threads N] [--top N] [--buckets N]\n", argv[0]);
+    return 1;
+  }
+
+  if (meminspect::TraceFile trace; trace.open (options.path))
+    return analyzeTrace (trace, options);
+
+  if (meminspect::HeapDumpFile dump; dump.open (options.path))
+    return analyzeDump (dump, options);
+
+  std::fprintf (stderr, "%s: %s is not a trace or a heap dump\n", argv[0], options.path);
+
+  return 1;
+}
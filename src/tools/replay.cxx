@@ -0,0 +1,260 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <meminspect/memory_tracker.h>
+#include <meminspect/trace.h>
+
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t NoSlot { SIZE_MAX }; ///< An operation that takes or returns no tracked block.
+
+/// @brief The options of the replay.
+struct Options {
+  const char *path { nullptr }; ///< The trace file.
+  size_t threads { 0 };         ///< The replay threads (0: one per thread of the trace).
+  size_t copies { 1 };          ///< The copies of the trace replayed at the same time.
+  size_t repeat { 1 };          ///< The times the trace is replayed.
+  bool timing { false };        ///< Whether the calls wait for their time in the trace.
+};
+
+/// @brief A call to replay.
+/// The blocks are passed between calls through slots: the call that creates a block fills its slot, and the call
+/// that releases it waits for the slot, even when another thread creates it.
+struct Op {
+  const meminspect::TraceRecord *record { nullptr }; ///< The recorded call.
+  size_t in { NoSlot };                              ///< The slot of the block passed to the call.
+  size_t out { NoSlot };                             ///< The slot of the block returned by the call.
+};
+
+/// @brief A block passed between calls.
+struct Slot {
+  std::atomic<bool> ready { false }; ///< Whether the block was created (and not yet released).
+  void *block { nullptr };           ///< The block.
+};
+
+/// @brief The calls of each replay thread.
+struct Plan {
+  std::vector<std::vector<Op>> threads; ///< The calls of each thread, in order.
+  size_t slots { 0 };                   ///< The number of slots.
+  size_t ops { 0 };                     ///< The number of calls.
+};
+
+/// @brief Builds the plan of a trace.
+/// The addresses of the trace are reused by the allocator, so each block gets its own slot: a block passed to a
+/// call is released when the call starts, and a block returned by a call exists when the call returns. Frees of
+/// blocks allocated before the recording started are dropped, and reallocations of those blocks allocate.
+/// @param records The records, sorted by time.
+/// @param threads The replay threads; the calls of trace thread `t` run on thread `t % threads`.
+/// @return The plan.
+Plan plan (const std::vector<meminspect::TraceRecord> &records, size_t threads) {
+  struct Event {
+    uint64_t time;
+    bool create;
+    size_t index;
+  };
+
+  std::vector<Event> events;
+  for (size_t i = 0; i < records.size(); ++i) {
+    const auto &r { records[i] };
+    if (r.ptr != 0)
+      events.push_back ({ r.time, false, i });
+    if (r.result != 0)
+      events.push_back ({ r.time + r.duration, true, i });
+  }
+
+  // releases first: a block freed when another call returns may be that call's result.
+  std::sort (events.begin(), events.end(), [] (const Event &a, const Event &b) {
+    return (a.time != b.time) ? (a.time < b.time) : (a.create != b.create) ? !a.create : (a.index < b.index);
+  });
+
+  std::vector<Op> ops (records.size());
+  std::unordered_map<uint64_t, size_t> live;
+  Plan p {};
+
+  for (const auto &e : events) {
+    const auto &r { records[e.index] };
+    if (e.create) {
+      ops[e.index].out = p.slots;
+      live[r.result] = p.slots++;
+    }
+    else if (const auto it { live.find (r.ptr) }; it != live.end()) {
+      ops[e.index].in = it->second;
+      live.erase (it);
+    }
+  }
+
+  p.threads.resize (threads);
+  for (size_t i = 0; i < records.size(); ++i) {
+    auto &op { ops[i] };
+    if ((records[i].op == meminspect::TraceOp::Free) && (op.in == NoSlot))
+      continue;
+
+    op.record = &records[i];
+    p.threads[records[i].thread % threads].push_back (op);
+    ++p.ops;
+  }
+
+  return p;
+}
+
+/// @brief Replays the calls of a thread.
+/// @param ops The calls.
+/// @param slots The slots of the copy of the trace.
+/// @param begin The time the replay started.
+/// @param timing Whether each call waits for its time in the trace.
+void replay (const std::vector<Op> &ops, Slot *slots, Clock::time_point begin, bool timing) {
+  for (const auto &op : ops) {
+    const auto &r { *op.record };
+    if (timing)
+      std::this_thread::sleep_until (begin + std::chrono::nanoseconds (r.time));
+
+    void *in { nullptr };
+    if (op.in != NoSlot) {
+      auto &s { slots[op.in] };
+      while (!s.ready.load (std::memory_order_acquire))
+        std::this_thread::yield();
+
+      in = s.block;
+      s.ready.store (false, std::memory_order_relaxed);
+    }
+
+    void *out { nullptr };
+    switch (r.op) {
+      case meminspect::TraceOp::Malloc:       out = std::malloc (r.size); break;
+      case meminspect::TraceOp::Calloc:       out = std::calloc (1, r.size); break;
+      case meminspect::TraceOp::AlignedAlloc: out = std::aligned_alloc (size_t { 1 } << r.alignment, r.size); break;
+      case meminspect::TraceOp::Realloc:      out = std::realloc (in, r.size); break;
+      case meminspect::TraceOp::Free:         std::free (in); break;
+    }
+
+    if (op.out != NoSlot) {
+      auto &s { slots[op.out] };
+      s.block = out;
+      s.ready.store (true, std::memory_order_release);
+    }
+  }
+}
+
+/// @brief Parses the command line.
+/// @return false if it is not valid.
+bool parse (int argc, char *argv[], Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    const auto value { [&] () { return (i + 1 < argc) ? std::strtoul (argv[++i], nullptr, 10) : 0; } };
+
+    if (std::strcmp (argv[i], "--threads") == 0)
+      options.threads = value();
+    else if (std::strcmp (argv[i], "--copies") == 0)
+      options.copies = value();
+    else if (std::strcmp (argv[i], "--repeat") == 0)
+      options.repeat = value();
+    else if (std::strcmp (argv[i], "--honor-timing") == 0)
+      options.timing = true;
+    else if ((argv[i][0] != '-') && (options.path == nullptr))
+      options.path = argv[i];
+    else
+      return false;
+  }
+
+  return (options.path != nullptr) && (options.copies > 0) && (options.repeat > 0);
+}
+
+}
+
+
+// ----------------------------------------------------------------------------
+// main
+// ----------------------------------------------------------------------------
+int main (int argc, char* argv[]) {
+  Options options {};
+  if (!parse (argc, argv, options)) {
+    std::fprintf (stderr, "usage: %s <trace> [--threads N] [--copies N] [--repeat N] [--honor-timing]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<meminspect::TraceRecord> records;
+  if (!meminspect::TraceRecorder::load (options.path, records)) {
+    std::fprintf (stderr, "%s: cannot read the trace %s\n", argv[0], options.path);
+    return 1;
+  }
+
+  size_t traceThreads { 1 };
+  for (const auto &r : records) {
+    if (r.thread + size_t { 1 } > traceThreads)
+      traceThreads = r.thread + size_t { 1 };
+  }
+
+  const auto threads { options.threads > 0 ? options.threads : traceThreads };
+  const auto p { plan (records, threads) };
+  const auto slots { std::make_unique<Slot []> (p.slots * options.copies) };
+
+  std::printf ("trace: %zu calls from %zu threads over %.3f ms\n", records.size(), traceThreads,
+               records.empty() ? 0.0 : (records.back().time + records.back().duration) / 1e6);
+  std::printf ("replay: %zu calls on %zu threads x %zu copies, %zu times%s\n", p.ops, threads, options.copies,
+               options.repeat, options.timing ? ", honoring the timing" : "");
+
+  meminspect::MemoryTracker tracker;
+  Clock::duration elapsed {};
+  size_t liveBytes { 0 };
+
+  for (size_t n = 0; n < options.repeat; ++n) {
+    std::atomic<bool> go { false };
+    Clock::time_point begin {};
+    std::vector<std::thread> workers;
+
+    for (size_t c = 0; c < options.copies; ++c) {
+      for (const auto &ops : p.threads) {
+        workers.emplace_back ([&, copy = &slots[c * p.slots]] () {
+          while (!go.load (std::memory_order_acquire))
+            std::this_thread::yield();
+
+          replay (ops, copy, begin, options.timing);
+        });
+      }
+    }
+
+    begin = Clock::now();
+    go.store (true, std::memory_order_release);
+    for (auto &w : workers)
+      w.join();
+
+    elapsed += Clock::now() - begin;
+    liveBytes = tracker.getAllocatedBytes();
+
+    // the blocks the trace never freed, so each repetition starts from the same heap.
+    for (size_t i = 0; i < p.slots * options.copies; ++i) {
+      if (slots[i].ready.exchange (false, std::memory_order_relaxed))
+        std::free (slots[i].block);
+    }
+  }
+
+  const auto seconds { std::chrono::duration<double> (elapsed).count() };
+  const auto calls { static_cast<double> (p.ops * options.copies * options.repeat) };
+  const auto stats { meminspect::DefaultInspector::stats() };
+
+  std::printf ("elapsed: %.3f ms, %.0f calls/s, %.1f ns/call\n", seconds * 1e3, seconds > 0 ? calls / seconds : 0.0,
+               calls > 0 ? seconds * 1e9 / calls : 0.0);
+  std::printf ("live at the end: %zu bytes\n", liveBytes);
+  std::printf ("table: %zu elements, %zu buckets, longest chain %zu, %.2f probes\n", stats.size, stats.buckets,
+               stats.maxChainLength, stats.averageProbes);
+  std::printf ("locks: %zu acquisitions, %zu contentions, %zu spins, %zu sleeps\n", stats.locks.acquisitions,
+               stats.locks.contentions, stats.locks.spins, stats.locks.sleeps);
+
+  return 0;
+}
@@ -0,0 +1,153 @@
+// ----------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2023 Carlos Carrasco
+// ----------------------------------------------------------------------------
+#include <time.h>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <meminspect/stats_segment.h>
+
+
+namespace {
+
+/// @brief The options of the monitor.
+struct Options {
+  std::string name;         ///< The name of the segment.
+  size_t interval { 1000 }; ///< The milliseconds between two polls.
+  size_t count { 0 };       ///< The number of polls (0: until interrupted).
+  bool histogram { false }; ///< Whether the size classes of the process are printed.
+};
+
+/// @brief Formats a number of bytes with a binary unit.
+std::string human (double n) {
+  static constexpr const char *Units[] { "B", "KiB", "MiB", "GiB", "TiB" };
+
+  size_t unit { 0 };
+  while ((n >= 1024) && (unit + 1 < std::size (Units))) {
+    n /= 1024;
+    ++unit;
+  }
+
+  char text[32];
+  std::snprintf (text, sizeof (text), unit == 0 ? "%.0f %s" : "%.1f %s", n, Units[unit]);
+
+  return text;
+}
+
+/// @brief Prints the counters of the process or of a tracker.
+void print (const char *name, const meminspect::StatsCounters &c) {
+  // the net bytes are negative when a tracker frees more than it allocates.
+  const auto live { static_cast<int64_t> (c.liveBytes) };
+  std::string text { live < 0 ? "-" : "" };
+  text += human (static_cast<double> (live < 0 ? -live : live));
+
+  std::printf ("  %-24s %12s %12s %12s %12s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n", name, text.c_str(), human (static_cast<double> (c.peakBytes)).c_str(),
+    human (static_cast<double> (c.allocated)).c_str(), human (static_cast<double> (c.freed)).c_str(), c.allocations, c.frees, c.reallocations);
+}
+
+/// @brief Prints the size classes of the process that have allocations or frees.
+void print (const std::vector<meminspect::StatsHistogramBucket> &histogram) {
+  std::printf ("  %-24s %12s %12s %12s %12s %12s\n", "size", "allocations", "frees", "live blocks", "live", "allocated");
+  for (const auto &b : histogram) {
+    char range[48];
+    if (b.lowerBound == b.upperBound)
+      std::snprintf (range, sizeof (range), "%" PRIu64, b.lowerBound);
+    else if (b.upperBound == UINT64_MAX)
+      std::snprintf (range, sizeof (range), "%" PRIu64 "-max", b.lowerBound);
+    else
+      std::snprintf (range, sizeof (range), "%" PRIu64 "-%" PRIu64, b.lowerBound, b.upperBound);
+
+    const auto live { static_cast<int64_t> (b.allocatedBytes - b.freedBytes) };
+    std::string text { live < 0 ? "-" : "" };
+    text += human (static_cast<double> (live < 0 ? -live : live));
+
+    std::printf ("  %-24s %12" PRIu64 " %12" PRIu64 " %12" PRId64 " %12s %12s\n", range, b.allocations, b.frees,
+      static_cast<int64_t> (b.allocations - b.frees), text.c_str(), human (static_cast<double> (b.allocatedBytes)).c_str());
+  }
+}
+
+/// @brief Parses the command line.
+/// @return false if it is not valid.
+bool parse (int argc, char *argv[], Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    const auto value { [&] () { return (i + 1 < argc) ? std::strtoul (argv[++i], nullptr, 10) : 0; } };
+
+    if (std::strcmp (argv[i], "--interval") == 0)
+      options.interval = value();
+    else if (std::strcmp (argv[i], "--count") == 0)
+      options.count = value();
+    else if (std::strcmp (argv[i], "--histogram") == 0)
+      options.histogram = true;
+    else if ((argv[i][0] != '-') && options.name.empty())
+      // a process id names its default segment.
+      options.name = std::strspn (argv[i], "0123456789") == std::strlen (argv[i]) ? std::string { "meminspect." } + argv[i] : argv[i];
+    else
+      return false;
+  }
+
+  return !options.name.empty();
+}
+
+}
+
+
+// ----------------------------------------------------------------------------
+// main
+// ----------------------------------------------------------------------------
+int main (int argc, char* argv[]) {
+  Options options {};
+  if (!parse (argc, argv, options)) {
+    std::fprintf (stderr, "usage: %s <segment or pid> [--interval MS] [--count N] [--histogram]\n", argv[0]);
+    return 1;
+  }
+
+  meminspect::StatsReader reader;
+  if (!reader.open (options.name.c_str())) {
+    std::fprintf (stderr, "%s: cannot read the stats segment %s\n", argv[0], meminspect::statsSegmentPath (options.name.c_str()).c_str());
+    return 1;
+  }
+
+  const timespec interval { static_cast<time_t> (options.interval / 1000), static_cast<long> ((options.interval % 1000) * 1000000) };
+
+  meminspect::StatsSample sample;
+  for (size_t i = 0; (options.count == 0) || (i < options.count); ++i) {
+    if (i > 0)
+      nanosleep (&interval, nullptr);
+
+    if (!reader.read (sample)) {
+      if (!reader.alive()) {
+        std::fprintf (stderr, "%s: the stats segment %s is stale (its process exited during an update)\n", argv[0],
+          meminspect::statsSegmentPath (options.name.c_str()).c_str());
+        return 1;
+      }
+
+      continue;
+    }
+
+    const auto seconds { static_cast<time_t> (sample.time / 1000000000) };
+    tm local {};
+    localtime_r (&seconds, &local);
+
+    std::printf ("%02d:%02d:%02d.%03" PRIu64 " pid %" PRIu32 ", update %" PRIu64 "\n", local.tm_hour, local.tm_min, local.tm_sec,
+      (sample.time / 1000000) % 1000, sample.pid, sample.updates);
+    std::printf ("  %-24s %12s %12s %12s %12s %12s %12s %12s\n", "tracker", "live", "peak", "allocated", "freed", "allocations", "frees", "reallocs");
+    print ("(process)", sample.global);
+    for (const auto &t : sample.trackers)
+      print (t.name.c_str(), t.counters);
+
+    if (options.histogram)
+      print (sample.histogram);
+
+    std::fflush (stdout);
+  }
+
+  return 0;
+}